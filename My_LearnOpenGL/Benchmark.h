@@ -0,0 +1,393 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+// headless, deterministic benchmark mode for main.cpp:
+//
+//	My_LearnOpenGL --bench [frames=300] [width=1024] [height=768] [api=osmesa|egl|native]
+//	                       [out=bench.json] [baseline=baseline.json] [threshold=0.10]
+//	                       [filter=pcf|hwpcf|poisson|evsm] [screenshot=frame.ppm]
+//	                       [lights=N|sweep] [path=forward|deferred] [occlusion=1|0] [queries=1|0]
+//	                       [bvh=N] [transforms=N] [matrices=cpu|vertex] [nanosuit=N]
+//	                       [instancing=1|0] [batch=1|0] [workers=N]
+//
+// renders the scene offscreen along a scripted FpsCamera path with a fixed time
+// step, then reports mean/median/p99 frame time, CPU submit time and draw calls
+// as JSON. With a baseline (a previous report) the run fails with exit code
+// BENCHMARK_EXIT_REGRESSION when the median frame time got worse than threshold.
+// Mean GPU times of the profiler zones handed to AddGpuZone() are reported too,
+// and the last frame can be saved to compare the image quality of settings.
+// A run can be split into labelled segments (BeginSegment()), e.g. one per
+// clustered light count of lights=sweep, each reported with its own statistics.
+// bvh=N adds N moving boxes to the scene's spatial index to time it at scale.
+// transforms=N times the batch matrix kernels on N objects once, before the run.
+// nanosuit=N draws N nanosuits in the lit pass, a vertex-bound load to compare
+// the per object matrices from the CPU with the old per vertex ones (matrices=vertex).
+// workers=N runs the job system with N worker threads (default: one per hardware
+// thread besides the main thread), to measure how the parallel parts scale.
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "FpsCamera.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+
+const int BENCHMARK_EXIT_REGRESSION = 2;
+// frames rendered before measuring starts (shader compilation, first uploads)
+const unsigned int BENCHMARK_WARMUP_FRAMES = 10;
+// clustered light counts of lights=sweep
+const unsigned int BENCHMARK_SWEEP_LIGHTS[] = { 8, 16, 32, 64, 128, 256, 512, 1024 };
+const unsigned int BENCHMARK_SWEEP_STEPS = sizeof(BENCHMARK_SWEEP_LIGHTS) / sizeof(BENCHMARK_SWEEP_LIGHTS[0]);
+
+// what context the benchmark runs on
+enum BenchmarkApi
+{
+	BENCH_API_NATIVE,	// hidden window of the regular platform
+	BENCH_API_EGL,		// EGL context, no visible window
+	BENCH_API_OSMESA	// OSMesa software context (Mesa llvmpipe), no display at all
+};
+
+struct BenchmarkOptions
+{
+	bool enabled = false;
+	unsigned int frames = 300;
+	unsigned int width = 1024;
+	unsigned int height = 768;
+	BenchmarkApi api = BENCH_API_OSMESA;
+	std::string outPath;
+	std::string baselinePath;
+	float threshold = 0.10f;
+	std::string shadowFilter = "pcf";
+	std::string screenshotPath;
+	// clustered lights: a count, or "sweep" for one segment per BENCHMARK_SWEEP_LIGHTS entry
+	std::string lights = "64";
+	std::string renderPath = "forward";
+	bool occlusion = true;
+	bool queries = true;
+	// moving boxes added to the spatial index, not rendered
+	unsigned int bvhObjects = 0;
+	// objects of the matrix kernel microbenchmark, 0 skips it
+	unsigned int transformObjects = 0;
+	// lit pass matrices: "cpu" (precomputed per object) or "vertex" (derived in the vertex shader)
+	std::string matrices = "cpu";
+	// nanosuit instances added to the lit pass
+	unsigned int nanosuitInstances = 0;
+	bool instancing = true;
+	bool staticBatching = true;
+	// worker threads of the job system, 0 = the hardware's
+	unsigned int workers = 0;
+
+	bool LightSweep() const { return lights == "sweep"; }
+	unsigned int LightCount(unsigned int segment) const
+	{
+		if (LightSweep())
+			return BENCHMARK_SWEEP_LIGHTS[std::min(segment, BENCHMARK_SWEEP_STEPS - 1)];
+		return (unsigned int)std::max(0, std::atoi(lights.c_str()));
+	}
+	unsigned int SegmentCount() const { return LightSweep() ? BENCHMARK_SWEEP_STEPS : 1; }
+
+	// parses "--bench key=value ...", returns false on unknown arguments
+	bool Parse(int argc, char** argv)
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg == "--bench")
+			{
+				enabled = true;
+				continue;
+			}
+			size_t eq = arg.find('=');
+			std::string key = arg.substr(0, eq);
+			std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+			if (key == "frames")
+				frames = std::max(1, std::atoi(value.c_str()));
+			else if (key == "width")
+				width = std::max(1, std::atoi(value.c_str()));
+			else if (key == "height")
+				height = std::max(1, std::atoi(value.c_str()));
+			else if (key == "out")
+				outPath = value;
+			else if (key == "baseline")
+				baselinePath = value;
+			else if (key == "threshold")
+				threshold = (float)std::atof(value.c_str());
+			else if (key == "filter")
+				shadowFilter = value;
+			else if (key == "screenshot")
+				screenshotPath = value;
+			else if (key == "lights")
+				lights = value;
+			else if (key == "path")
+				renderPath = value;
+			else if (key == "occlusion")
+				occlusion = std::atoi(value.c_str()) != 0;
+			else if (key == "queries")
+				queries = std::atoi(value.c_str()) != 0;
+			else if (key == "bvh")
+				bvhObjects = (unsigned int)std::max(0, std::atoi(value.c_str()));
+			else if (key == "transforms")
+				transformObjects = (unsigned int)std::max(0, std::atoi(value.c_str()));
+			else if (key == "matrices")
+				matrices = value;
+			else if (key == "nanosuit")
+				nanosuitInstances = (unsigned int)std::max(0, std::atoi(value.c_str()));
+			else if (key == "instancing")
+				instancing = std::atoi(value.c_str()) != 0;
+			else if (key == "batch")
+				staticBatching = std::atoi(value.c_str()) != 0;
+			else if (key == "workers")
+				workers = (unsigned int)std::max(0, std::atoi(value.c_str()));
+			else if (key == "api" && value == "native")
+				api = BENCH_API_NATIVE;
+			else if (key == "api" && value == "egl")
+				api = BENCH_API_EGL;
+			else if (key == "api" && value == "osmesa")
+				api = BENCH_API_OSMESA;
+			else
+			{
+				std::cout << "ERROR::BENCHMARK::UNKNOWN_ARGUMENT: " << arg << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+class Benchmark
+{
+public:
+	// fixed time step of the scripted run
+	static float DeltaTime() { return 1.0f / 60.0f; }
+
+	// puts the camera at its scripted pose for a frame: one slow orbit around the
+	// scene at varying height, always looking at the origin
+	static void ScriptCamera(FpsCamera& camera, unsigned int frame, unsigned int frameCount)
+	{
+		float t = frameCount > 1 ? (float)frame / (float)(frameCount - 1) : 0.0f;
+		float angle = t * glm::two_pi<float>();
+		float radius = 6.0f;
+		glm::vec3 position(radius * cos(angle), 2.0f + 1.5f * sin(2.0f * angle), radius * sin(angle));
+		glm::vec3 dir = glm::normalize(-position);
+		float yaw = glm::degrees(atan2(dir.z, dir.x));
+		float pitch = glm::degrees(asin(dir.y));
+		camera.SetPose(position, yaw, pitch);
+	}
+
+	void AddFrame(double frameMs, double submitMs, unsigned int drawCalls)
+	{
+		m_frameMs.push_back(frameMs);
+		m_submitMs.push_back(submitMs);
+		m_drawCalls.push_back(drawCalls);
+	}
+
+	void AddGpuZone(const std::string& zone, double ms)
+	{
+		m_perFrame["gpu_" + zone + "_ms"].push_back(ms);
+	}
+
+	void AddCpuZone(const std::string& zone, double ms)
+	{
+		m_perFrame["cpu_" + zone + "_ms"].push_back(ms);
+	}
+
+	// any other per-frame value (counts, ratios), reported as its mean under name
+	void AddValue(const std::string& name, double value)
+	{
+		m_perFrame[name].push_back(value);
+	}
+
+	// frames and zones added from now on belong to a new segment
+	void BeginSegment(const std::string& label)
+	{
+		Segment segment;
+		segment.label = label;
+		segment.firstFrame = m_frameMs.size();
+		for (std::map<std::string, std::vector<double> >::const_iterator it = m_perFrame.begin(); it != m_perFrame.end(); ++it)
+			segment.firstZoneValue[it->first] = it->second.size();
+		m_segments.push_back(segment);
+	}
+
+	// saves the current read framebuffer as a binary PPM
+	static bool WriteScreenshot(const std::string& path, unsigned int width, unsigned int height)
+	{
+		std::vector<unsigned char> pixels(width * height * 3);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+		std::ofstream out(path.c_str(), std::ios::binary);
+		if (!out)
+		{
+			std::cout << "ERROR::BENCHMARK::CANNOT_WRITE: " << path << std::endl;
+			return false;
+		}
+		out << "P6\n" << width << " " << height << "\n255\n";
+		// GL rows start at the bottom
+		for (unsigned int y = height; y > 0; y--)
+			out.write((const char*)&pixels[(y - 1) * width * 3], width * 3);
+		return true;
+	}
+
+	// writes the report (stdout, and out path if given) and compares against the
+	// baseline. Returns the process exit code.
+	int Finish(const BenchmarkOptions& options) const
+	{
+		std::string report = Report(options);
+		std::cout << report;
+		if (!options.outPath.empty())
+		{
+			std::ofstream out(options.outPath.c_str());
+			if (out)
+				out << report;
+			else
+				std::cout << "ERROR::BENCHMARK::CANNOT_WRITE: " << options.outPath << std::endl;
+		}
+		if (options.baselinePath.empty())
+			return 0;
+
+		double baseline = 0.0;
+		if (!ReadValue(options.baselinePath, "median_frame_ms", baseline) || baseline <= 0.0)
+		{
+			std::cout << "ERROR::BENCHMARK::BAD_BASELINE: " << options.baselinePath << std::endl;
+			return 1;
+		}
+		double current = Percentile(m_frameMs, 0.5);
+		double limit = baseline * (1.0 + options.threshold);
+		if (current > limit)
+		{
+			std::cout << "Benchmark REGRESSION: median " << current << " ms > baseline " << baseline << " ms (+" << options.threshold * 100.0f << "%)" << std::endl;
+			return BENCHMARK_EXIT_REGRESSION;
+		}
+		std::cout << "Benchmark OK: median " << current << " ms, baseline " << baseline << " ms" << std::endl;
+		return 0;
+	}
+
+private:
+	std::vector<double> m_frameMs;
+	std::vector<double> m_submitMs;
+	std::vector<unsigned int> m_drawCalls;
+	// zones and values by report name, one entry per measured frame
+	std::map<std::string, std::vector<double> > m_perFrame;
+
+	struct Segment
+	{
+		std::string label;
+		size_t firstFrame;
+		std::map<std::string, size_t> firstZoneValue;	// zones missing here started inside the segment
+	};
+	std::vector<Segment> m_segments;
+
+	std::string Report(const BenchmarkOptions& options) const
+	{
+		double draws = 0.0;
+		for (unsigned int i = 0; i < m_drawCalls.size(); i++)
+			draws += m_drawCalls[i];
+		if (!m_drawCalls.empty())
+			draws /= m_drawCalls.size();
+
+		std::ostringstream out;
+		out << "{\n"
+			<< "  \"frames\": " << m_frameMs.size() << ",\n"
+			<< "  \"width\": " << options.width << ",\n"
+			<< "  \"height\": " << options.height << ",\n"
+			<< "  \"shadow_filter\": \"" << options.shadowFilter << "\",\n"
+			<< "  \"lights\": \"" << options.lights << "\",\n"
+			<< "  \"render_path\": \"" << options.renderPath << "\",\n"
+			<< "  \"occlusion\": " << (options.occlusion ? 1 : 0) << ",\n"
+			<< "  \"queries\": " << (options.queries ? 1 : 0) << ",\n"
+			<< "  \"bvh_objects\": " << options.bvhObjects << ",\n"
+			<< "  \"mean_frame_ms\": " << Mean(m_frameMs) << ",\n"
+			<< "  \"median_frame_ms\": " << Percentile(m_frameMs, 0.5) << ",\n"
+			<< "  \"p99_frame_ms\": " << Percentile(m_frameMs, 0.99) << ",\n"
+			<< "  \"mean_submit_ms\": " << Mean(m_submitMs) << ",\n"
+			<< "  \"median_submit_ms\": " << Percentile(m_submitMs, 0.5) << ",\n"
+			<< "  \"p99_submit_ms\": " << Percentile(m_submitMs, 0.99) << ",\n";
+		for (std::map<std::string, std::vector<double> >::const_iterator it = m_perFrame.begin(); it != m_perFrame.end(); ++it)
+			out << "  \"" << it->first << "\": " << Mean(it->second) << ",\n";
+		if (!m_segments.empty())
+		{
+			out << "  \"segments\": [\n";
+			for (unsigned int i = 0; i < m_segments.size(); i++)
+				out << SegmentReport(i) << (i + 1 < m_segments.size() ? ",\n" : "\n");
+			out << "  ],\n";
+		}
+		out
+			<< "  \"draw_calls_per_frame\": " << draws << "\n"
+			<< "}\n";
+		return out.str();
+	}
+
+	std::string SegmentReport(unsigned int index) const
+	{
+		const Segment& segment = m_segments[index];
+		size_t end = index + 1 < m_segments.size() ? m_segments[index + 1].firstFrame : m_frameMs.size();
+		std::vector<double> frames(m_frameMs.begin() + segment.firstFrame, m_frameMs.begin() + end);
+		std::ostringstream out;
+		out << "    { \"label\": \"" << segment.label << "\", \"frames\": " << frames.size()
+			<< ", \"mean_frame_ms\": " << Mean(frames)
+			<< ", \"median_frame_ms\": " << Percentile(frames, 0.5)
+			<< ", \"p99_frame_ms\": " << Percentile(frames, 0.99);
+		for (std::map<std::string, std::vector<double> >::const_iterator it = m_perFrame.begin(); it != m_perFrame.end(); ++it)
+		{
+			std::map<std::string, size_t>::const_iterator first = segment.firstZoneValue.find(it->first);
+			size_t begin = first != segment.firstZoneValue.end() ? first->second : 0;
+			size_t last = it->second.size();
+			if (index + 1 < m_segments.size())
+			{
+				std::map<std::string, size_t>::const_iterator next = m_segments[index + 1].firstZoneValue.find(it->first);
+				last = next != m_segments[index + 1].firstZoneValue.end() ? next->second : begin;
+			}
+			std::vector<double> values(it->second.begin() + begin, it->second.begin() + last);
+			out << ", \"" << it->first << "\": " << Mean(values);
+		}
+		out << " }";
+		return out.str();
+	}
+
+	static double Mean(const std::vector<double>& values)
+	{
+		if (values.empty())
+			return 0.0;
+		double sum = 0.0;
+		for (unsigned int i = 0; i < values.size(); i++)
+			sum += values[i];
+		return sum / values.size();
+	}
+
+	// nearest-rank percentile
+	static double Percentile(std::vector<double> values, double p)
+	{
+		if (values.empty())
+			return 0.0;
+		std::sort(values.begin(), values.end());
+		size_t rank = (size_t)(p * (values.size() - 1) + 0.5);
+		return values[std::min(rank, values.size() - 1)];
+	}
+
+	// reads "key": number out of a previous report
+	static bool ReadValue(const std::string& path, const std::string& key, double& value)
+	{
+		std::ifstream in(path.c_str());
+		if (!in)
+			return false;
+		std::stringstream buffer;
+		buffer << in.rdbuf();
+		std::string text = buffer.str();
+		size_t pos = text.find("\"" + key + "\"");
+		if (pos == std::string::npos)
+			return false;
+		pos = text.find(':', pos);
+		if (pos == std::string::npos)
+			return false;
+		value = std::atof(text.c_str() + pos + 1);
+		return true;
+	}
+};
+
+#endif // !BENCHMARK_H
@@ -0,0 +1,359 @@
+#ifndef CASCADEDSHADOWMAP_H
+#define CASCADEDSHADOWMAP_H
+
+// cascaded shadow maps for a directional light. The camera frustum is split
+// logarithmically (blended with a uniform split), every cascade gets a light
+// projection fitted tightly around its slice's bounding sphere and snapped to
+// whole shadow map texels so the shadows don't shimmer when the camera moves.
+// All cascades live in one depth texture array that is rendered in a single
+// layered pass (the geometry shader emits each triangle into every layer).
+//
+// static casters are cached: they're rendered into a separate static array, per
+// cascade, only when that cascade's light matrix or the static caster set changed.
+// Because cascades move in whole texel steps their matrices stay bit-identical
+// for as long as the camera stays within a texel. Dynamic casters are drawn every
+// frame on top of a copy of the static depth.
+//
+// casters are culled per cascade with CasterMask(). The near plane is ignored
+// there and depth clamping is on while rendering, so casters between the light
+// and a cascade (outside the camera's view) are flattened onto the near plane
+// instead of being clipped away.
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "shader.h"
+#include "GLStateCache.h"
+#include "RenderQueue.h"
+#include "Frustum.h"
+
+#include <vector>
+#include <string>
+#include <cmath>
+
+// must match MAX_CASCADES in the 5.3.3.csm_* shaders
+const unsigned int CSM_MAX_CASCADES = 4;
+
+class CascadedShadowMap
+{
+public:
+	unsigned int m_cascadeCount;
+	unsigned int m_resolution;
+	// 0 = uniform splits, 1 = purely logarithmic splits
+	float m_splitLambda;
+	// how far shadows reach from the camera, the last cascade ends here
+	float m_shadowDistance;
+	// extra room towards the light so casters outside the camera frustum still cast into it
+	float m_casterMargin;
+
+	GLuint m_fbo;
+	GLuint m_depthArray;	// static depth + dynamic casters
+	GLuint m_staticArray;	// cached static casters only
+
+	// per cascade: far distance in view space and the light's view-projection
+	float m_splitFar[CSM_MAX_CASCADES];
+	glm::mat4 m_lightSpace[CSM_MAX_CASCADES];
+
+	// shadow caching statistics of the last RenderShadows()
+	struct CacheStats
+	{
+		unsigned int cascadesRendered;	// cascades whose static depth was re-rendered
+		unsigned int drawsIssued;		// static caster draws issued
+		unsigned int drawsSkipped;		// static caster draws saved by the cache
+		unsigned int dynamicDraws;		// dynamic caster draws issued
+	};
+	CacheStats m_cacheStats;
+
+	CascadedShadowMap(unsigned int cascadeCount = CSM_MAX_CASCADES, unsigned int resolution = 1024)
+		: m_cascadeCount(cascadeCount < CSM_MAX_CASCADES ? cascadeCount : CSM_MAX_CASCADES),
+		m_resolution(resolution),
+		m_splitLambda(0.75f),
+		m_shadowDistance(50.0f),
+		m_casterMargin(20.0f),
+		m_fbo(0),
+		m_depthArray(0),
+		m_staticArray(0),
+		m_sampledArray(0),
+		m_staticHash(0)
+	{
+		for (unsigned int i = 0; i < CSM_MAX_CASCADES; i++)
+		{
+			m_splitFar[i] = 0.0f;
+			m_lightSpace[i] = glm::mat4(1.0f);
+			m_cachedLightSpace[i] = glm::mat4(1.0f);
+			m_staticValid[i] = false;
+		}
+		m_copyFbo[0] = m_copyFbo[1] = 0;
+		m_cacheStats.cascadesRendered = m_cacheStats.drawsIssued = m_cacheStats.drawsSkipped = m_cacheStats.dynamicDraws = 0;
+	}
+
+	// creates the depth texture array and its framebuffer, needs a current GL context
+	bool Init()
+	{
+		GLStateCache& state = GLStateCache::Get();
+		m_depthArray = CreateDepthArray();
+		m_staticArray = CreateDepthArray();
+		m_sampledArray = m_staticArray;
+		// per-layer framebuffers for the static cache and the static -> dynamic copy
+		glGenFramebuffers(2, m_copyFbo);
+
+		glGenFramebuffers(1, &m_fbo);
+		state.BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		// attaching the whole array makes the framebuffer layered
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_depthArray, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		if (!complete)
+			std::cout << "ERROR::FRAMEBUFFER:: Cascaded shadow map framebuffer is not complete!" << std::endl;
+		state.BindFramebuffer(GL_FRAMEBUFFER, 0);
+		return complete;
+	}
+
+	void Destroy()
+	{
+		GLStateCache::Get().ForgetTexture(m_depthArray);
+		GLStateCache::Get().ForgetTexture(m_staticArray);
+		glDeleteTextures(1, &m_depthArray);
+		glDeleteTextures(1, &m_staticArray);
+		glDeleteFramebuffers(1, &m_fbo);
+		glDeleteFramebuffers(2, m_copyFbo);
+		m_depthArray = m_staticArray = m_sampledArray = m_fbo = 0;
+		m_copyFbo[0] = m_copyFbo[1] = 0;
+	}
+
+	// forces the static casters to be re-rendered into every cascade
+	void InvalidateStatic()
+	{
+		for (unsigned int i = 0; i < CSM_MAX_CASCADES; i++)
+			m_staticValid[i] = false;
+	}
+
+	// renders the queue's depth-only passes: PASS_SHADOW_STATIC into the cache
+	// (single-layer shader with a "lightSpaceMatrix" uniform, only for stale
+	// cascades) and PASS_SHADOW layered on top of it (layered shader)
+	void RenderShadows(RenderQueue& queue, Shader& staticDepthShader, Shader& layeredDepthShader)
+	{
+		GLStateCache& state = GLStateCache::Get();
+		m_cacheStats.cascadesRendered = m_cacheStats.drawsIssued = m_cacheStats.drawsSkipped = m_cacheStats.dynamicDraws = 0;
+
+		// any change of the static casters (added, removed, moved) invalidates every cascade
+		uint64_t staticHash = queue.PassHash(PASS_SHADOW_STATIC);
+		if (staticHash != m_staticHash)
+		{
+			InvalidateStatic();
+			m_staticHash = staticHash;
+		}
+
+		state.Viewport(0, 0, m_resolution, m_resolution);
+		state.Enable(GL_DEPTH_CLAMP);
+		for (unsigned int i = 0; i < m_cascadeCount; i++)
+		{
+			// the light matrix also changes when the light moves
+			if (m_staticValid[i] && m_cachedLightSpace[i] == m_lightSpace[i])
+			{
+				m_cacheStats.drawsSkipped += static_cast<unsigned int>(queue.Count(PASS_SHADOW_STATIC, 1u << i));
+				continue;
+			}
+			state.BindFramebuffer(GL_FRAMEBUFFER, m_copyFbo[0]);
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_staticArray, 0, i);
+			glDrawBuffer(GL_NONE);
+			glReadBuffer(GL_NONE);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			staticDepthShader.use();
+			staticDepthShader.setMat4("lightSpaceMatrix", m_lightSpace[i]);
+			m_cacheStats.drawsIssued += queue.ExecuteDepth(PASS_SHADOW_STATIC, 1u << i);
+
+			m_cachedLightSpace[i] = m_lightSpace[i];
+			m_staticValid[i] = true;
+			m_cacheStats.cascadesRendered++;
+		}
+
+		// without (visible) dynamic casters the cache is the shadow map
+		if (queue.Count(PASS_SHADOW) == 0)
+		{
+			state.Disable(GL_DEPTH_CLAMP);
+			m_sampledArray = m_staticArray;
+			return;
+		}
+
+		// copy the static depth of every cascade, then draw the dynamic casters on top
+		for (unsigned int i = 0; i < m_cascadeCount; i++)
+		{
+			state.BindFramebuffer(GL_READ_FRAMEBUFFER, m_copyFbo[0]);
+			glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_staticArray, 0, i);
+			state.BindFramebuffer(GL_DRAW_FRAMEBUFFER, m_copyFbo[1]);
+			glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_depthArray, 0, i);
+			glDrawBuffer(GL_NONE);
+			glBlitFramebuffer(0, 0, m_resolution, m_resolution, 0, 0, m_resolution, m_resolution, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+		}
+		BeginDepthPass(layeredDepthShader, false);
+		m_cacheStats.dynamicDraws = queue.ExecuteDepth(PASS_SHADOW);
+		state.Disable(GL_DEPTH_CLAMP);
+		m_sampledArray = m_depthArray;
+	}
+
+	// splits the camera frustum and fits a light projection to each cascade.
+	// lightDir points towards the light.
+	void Update(const glm::mat4& view, float fovY, float aspect, float nearPlane, float farPlane, const glm::vec3& lightDir)
+	{
+		float farShadow = farPlane < m_shadowDistance ? farPlane : m_shadowDistance;
+		ComputeSplits(nearPlane, farShadow);
+
+		float splitNear = nearPlane;
+		for (unsigned int i = 0; i < m_cascadeCount; i++)
+		{
+			m_lightSpace[i] = FitCascade(view, fovY, aspect, splitNear, m_splitFar[i], glm::normalize(lightDir));
+			m_casterVolume[i] = Frustum(m_lightSpace[i]);
+			splitNear = m_splitFar[i];
+		}
+	}
+
+	// the cascades a caster with the given world space bounds can cast into (bit i
+	// = cascade i), 0 if it can't shadow anything the camera sees
+	unsigned int CasterMask(const glm::vec3& worldMin, const glm::vec3& worldMax) const
+	{
+		unsigned int mask = 0;
+		for (unsigned int i = 0; i < m_cascadeCount; i++)
+			if (m_casterVolume[i].IntersectsAabb(worldMin, worldMax, true))
+				mask |= 1u << i;
+		return mask;
+	}
+
+	// binds the framebuffer for the layered depth pass and uploads the cascade matrices
+	void BeginDepthPass(Shader& depthShader, bool clear = true)
+	{
+		GLStateCache& state = GLStateCache::Get();
+		depthShader.use();
+		SetCascadeUniforms(depthShader);
+		state.Viewport(0, 0, m_resolution, m_resolution);
+		state.BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		if (clear)
+			glClear(GL_DEPTH_BUFFER_BIT);
+	}
+
+	// binds the depth array to a texture unit and uploads what the lit shader needs to select a cascade
+	void BindForLighting(Shader& shader, unsigned int unit)
+	{
+		SetCascadeUniforms(shader);
+		const CascadeLocations& locations = GetCascadeLocations(shader);
+		for (unsigned int i = 0; i < m_cascadeCount; i++)
+			glUniform1f(locations.planeDistances[i], m_splitFar[i]);
+		GLStateCache::Get().BindTexture(unit, GL_TEXTURE_2D_ARRAY, m_sampledArray);
+	}
+
+	// the array the lighting pass samples (the static cache when there are no dynamic casters)
+	GLuint SampledArray() const { return m_sampledArray; }
+
+private:
+	GLuint m_copyFbo[2];
+	GLuint m_sampledArray;
+	uint64_t m_staticHash;
+	glm::mat4 m_cachedLightSpace[CSM_MAX_CASCADES];
+	bool m_staticValid[CSM_MAX_CASCADES];
+	Frustum m_casterVolume[CSM_MAX_CASCADES];
+
+	// uniform locations of the cascade arrays, looked up once per program
+	struct CascadeLocations
+	{
+		GLuint program;
+		GLint cascadeCount;
+		GLint lightSpaceMatrices[CSM_MAX_CASCADES];
+		GLint planeDistances[CSM_MAX_CASCADES];
+	};
+	std::vector<CascadeLocations> m_locations;
+
+	const CascadeLocations& GetCascadeLocations(const Shader& shader)
+	{
+		for (unsigned int i = 0; i < m_locations.size(); i++)
+			if (m_locations[i].program == shader.ID)
+				return m_locations[i];
+		CascadeLocations locations;
+		locations.program = shader.ID;
+		locations.cascadeCount = glGetUniformLocation(shader.ID, "cascadeCount");
+		for (unsigned int i = 0; i < CSM_MAX_CASCADES; i++)
+		{
+			std::string index = "[" + std::to_string(i) + "]";
+			locations.lightSpaceMatrices[i] = glGetUniformLocation(shader.ID, ("lightSpaceMatrices" + index).c_str());
+			locations.planeDistances[i] = glGetUniformLocation(shader.ID, ("cascadePlaneDistances" + index).c_str());
+		}
+		m_locations.push_back(locations);
+		return m_locations.back();
+	}
+
+	GLuint CreateDepthArray()
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		GLStateCache::Get().BindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, m_resolution, m_resolution, m_cascadeCount, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		GLfloat borderColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+		glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, borderColor);
+		return texture;
+	}
+
+	// practical split scheme: blend of logarithmic and uniform distribution
+	void ComputeSplits(float nearPlane, float farPlane)
+	{
+		for (unsigned int i = 0; i < m_cascadeCount; i++)
+		{
+			float p = (float)(i + 1) / (float)m_cascadeCount;
+			float logSplit = nearPlane * std::pow(farPlane / nearPlane, p);
+			float uniformSplit = nearPlane + (farPlane - nearPlane) * p;
+			m_splitFar[i] = m_splitLambda * logSplit + (1.0f - m_splitLambda) * uniformSplit;
+		}
+	}
+
+	glm::mat4 FitCascade(const glm::mat4& view, float fovY, float aspect, float splitNear, float splitFar, const glm::vec3& lightDir) const
+	{
+		// world space corners of the frustum slice
+		glm::mat4 invViewProj = glm::inverse(glm::perspective(fovY, aspect, splitNear, splitFar) * view);
+		glm::vec3 corners[8];
+		glm::vec3 center(0.0f);
+		unsigned int n = 0;
+		for (int x = 0; x < 2; x++)
+			for (int y = 0; y < 2; y++)
+				for (int z = 0; z < 2; z++)
+				{
+					glm::vec4 corner = invViewProj * glm::vec4(2.0f * x - 1.0f, 2.0f * y - 1.0f, 2.0f * z - 1.0f, 1.0f);
+					corners[n] = glm::vec3(corner) / corner.w;
+					center += corners[n];
+					n++;
+				}
+		center /= 8.0f;
+
+		// a bounding sphere keeps the projection size constant while the camera rotates
+		float radius = 0.0f;
+		for (unsigned int i = 0; i < 8; i++)
+			radius = glm::max(radius, glm::length(corners[i] - center));
+		radius = std::ceil(radius * 16.0f) / 16.0f;
+
+		// the light view only depends on the light direction, the cascade center is
+		// snapped to whole texels in light space. Both keep the matrix bit-identical
+		// while the camera moves less than a texel (no shimmering, and cacheable).
+		glm::vec3 up = std::fabs(lightDir.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+		glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), -lightDir, up);
+		float texelSize = 2.0f * radius / m_resolution;
+		glm::vec3 centerLS = glm::vec3(lightView * glm::vec4(center, 1.0f));
+		centerLS = glm::floor(centerLS / texelSize) * texelSize;
+		// the view looks down -z, pull the near plane back towards the light for outside casters
+		glm::mat4 lightProj = glm::ortho(centerLS.x - radius, centerLS.x + radius, centerLS.y - radius, centerLS.y + radius,
+			-(centerLS.z + radius + m_casterMargin), -(centerLS.z - radius));
+
+		return lightProj * lightView;
+	}
+
+	void SetCascadeUniforms(Shader& shader)
+	{
+		const CascadeLocations& locations = GetCascadeLocations(shader);
+		glUniform1i(locations.cascadeCount, (int)m_cascadeCount);
+		for (unsigned int i = 0; i < m_cascadeCount; i++)
+			glUniformMatrix4fv(locations.lightSpaceMatrices[i], 1, GL_FALSE, &m_lightSpace[i][0][0]);
+	}
+};
+
+#endif // !CASCADEDSHADOWMAP_H
@@ -0,0 +1,365 @@
+#ifndef CLUSTEREDLIGHTS_H
+#define CLUSTEREDLIGHTS_H
+
+// clustered forward lighting for many (unshadowed) point lights. The view
+// frustum is cut into a 3D grid of froxels: CLUSTER_X x CLUSTER_Y screen tiles
+// times CLUSTER_Z exponential depth slices. Every frame the lights are assigned
+// to the clusters their sphere overlaps on the CPU, and the lit shader only loops
+// over the lights of its fragment's cluster.
+//
+// assignment: lights are first binned by depth slice, then each slice's clusters
+// test the slice's lights four at a time (SSE, scalar fallback) against their
+// view space bounds. The slices are spread over the job system's threads.
+//
+// upload (buffer textures, GL 3.1 core):
+//	clusterLightData	RGBA32F, two texels per light: world position + radius, color
+//	clusterRanges		RG32UI, per cluster: offset into the index list, light count
+//	clusterIndices		R16UI, light indices grouped by cluster
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "GLStateCache.h"
+#include "Profiler.h"
+#include "JobSystem.h"
+
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CLUSTER_USE_SSE 1
+#endif
+
+// must match the CLUSTER_* defines in 5.3.3.csm_shadow.fs
+const unsigned int CLUSTER_X = 16;
+const unsigned int CLUSTER_Y = 9;
+const unsigned int CLUSTER_Z = 24;
+const unsigned int CLUSTER_COUNT = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+// light indices are 16 bit
+const unsigned int CLUSTER_MAX_LIGHTS = 65535;
+
+struct ClusterLight
+{
+	glm::vec3 position;
+	float radius;
+	glm::vec3 color;
+};
+
+class ClusteredLights
+{
+public:
+	std::vector<ClusterLight> m_lights;
+
+	// statistics of the last Build()
+	struct Stats
+	{
+		unsigned int lights;
+		unsigned int indices;		// light references over all clusters
+		unsigned int maxPerCluster;
+		double buildMs;				// CPU assignment time
+	};
+	Stats m_stats;
+
+	ClusteredLights()
+		: m_nearPlane(0.1f),
+		m_farPlane(100.0f),
+		m_width(0),
+		m_height(0),
+		m_lightBuffer(0), m_lightTexture(0),
+		m_rangeBuffer(0), m_rangeTexture(0),
+		m_indexBuffer(0), m_indexTexture(0)
+	{
+		m_stats.lights = m_stats.indices = m_stats.maxPerCluster = 0;
+		m_stats.buildMs = 0.0;
+		m_ranges.resize(CLUSTER_COUNT * 2);
+		m_sliceIndices.resize(CLUSTER_Z);
+	}
+
+	// creates the buffer textures
+	void Init()
+	{
+		CreateBufferTexture(m_lightBuffer, m_lightTexture, GL_RGBA32F);
+		CreateBufferTexture(m_rangeBuffer, m_rangeTexture, GL_RG32UI);
+		CreateBufferTexture(m_indexBuffer, m_indexTexture, GL_R16UI);
+	}
+
+	void Destroy()
+	{
+		GLStateCache& state = GLStateCache::Get();
+		state.ForgetTexture(m_lightTexture);
+		state.ForgetTexture(m_rangeTexture);
+		state.ForgetTexture(m_indexTexture);
+		GLuint textures[3] = { m_lightTexture, m_rangeTexture, m_indexTexture };
+		GLuint buffers[3] = { m_lightBuffer, m_rangeBuffer, m_indexBuffer };
+		glDeleteTextures(3, textures);
+		glDeleteBuffers(3, buffers);
+		m_lightTexture = m_rangeTexture = m_indexTexture = 0;
+		m_lightBuffer = m_rangeBuffer = m_indexBuffer = 0;
+	}
+
+	// fills m_lights with count deterministic pseudo-random lights inside the given box
+	void GenerateLights(unsigned int count, const glm::vec3& boxMin, const glm::vec3& boxMax, unsigned int seed = 1)
+	{
+		if (count > CLUSTER_MAX_LIGHTS)
+			count = CLUSTER_MAX_LIGHTS;
+		m_lights.resize(count);
+		uint32_t state = seed;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			ClusterLight& light = m_lights[i];
+			light.position = glm::mix(boxMin, boxMax, glm::vec3(Random(state), Random(state), Random(state)));
+			light.radius = 1.5f + 2.0f * Random(state);
+			light.color = glm::vec3(Random(state), Random(state), Random(state)) * 0.5f + 0.1f;
+		}
+	}
+
+	// froxel bounds follow the projection, call when it or the render size changes
+	void SetProjection(const glm::mat4& projection, float nearPlane, float farPlane, unsigned int width, unsigned int height)
+	{
+		if (projection == m_projection && width == m_width && height == m_height)
+			return;
+		m_projection = projection;
+		m_nearPlane = nearPlane;
+		m_farPlane = farPlane;
+		m_width = width;
+		m_height = height;
+
+		glm::mat4 inverseProjection = glm::inverse(projection);
+		m_clusterMin.resize(CLUSTER_COUNT);
+		m_clusterMax.resize(CLUSTER_COUNT);
+		for (unsigned int z = 0; z < CLUSTER_Z; z++)
+		{
+			float sliceNear = SliceDepth(z);
+			float sliceFar = SliceDepth(z + 1);
+			for (unsigned int y = 0; y < CLUSTER_Y; y++)
+				for (unsigned int x = 0; x < CLUSTER_X; x++)
+				{
+					// the tile's corner rays, cut at both slice depths
+					glm::vec3 boxMin(1e30f), boxMax(-1e30f);
+					for (unsigned int corner = 0; corner < 4; corner++)
+					{
+						float ndcX = 2.0f * (float)(x + (corner & 1)) / CLUSTER_X - 1.0f;
+						float ndcY = 2.0f * (float)(y + (corner >> 1)) / CLUSTER_Y - 1.0f;
+						glm::vec4 onFar = inverseProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+						glm::vec3 ray = glm::vec3(onFar) / onFar.w;
+						ray /= -ray.z;
+						boxMin = glm::min(boxMin, glm::min(ray * sliceNear, ray * sliceFar));
+						boxMax = glm::max(boxMax, glm::max(ray * sliceNear, ray * sliceFar));
+					}
+					unsigned int index = ClusterIndex(x, y, z);
+					m_clusterMin[index] = boxMin;
+					m_clusterMax[index] = boxMax;
+				}
+		}
+	}
+
+	// assigns the lights to the clusters and uploads the lists
+	void Build(const glm::mat4& view)
+	{
+		PROFILE_SCOPE("ClusterBuild");
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		// view space lights as SoA, padded to a multiple of 4
+		unsigned int count = (unsigned int)m_lights.size();
+		unsigned int padded = (count + 3) & ~3u;
+		m_viewX.assign(padded, 0.0f);
+		m_viewY.assign(padded, 0.0f);
+		m_viewZ.assign(padded, 1e30f);
+		m_radius.assign(padded, -1.0f);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			glm::vec3 p = glm::vec3(view * glm::vec4(m_lights[i].position, 1.0f));
+			m_viewX[i] = p.x;
+			m_viewY[i] = p.y;
+			m_viewZ[i] = p.z;
+			m_radius[i] = m_lights[i].radius;
+		}
+		// lights per depth slice (view space looks down -z)
+		for (unsigned int z = 0; z < CLUSTER_Z; z++)
+			m_sliceLights[z].clear();
+		for (unsigned int i = 0; i < count; i++)
+		{
+			float lightNear = -m_viewZ[i] - m_radius[i];
+			float lightFar = -m_viewZ[i] + m_radius[i];
+			if (lightFar < m_nearPlane || lightNear > m_farPlane)
+				continue;
+			unsigned int first = Slice(lightNear), last = Slice(lightFar);
+			for (unsigned int z = first; z <= last; z++)
+				m_sliceLights[z].push_back(i);
+		}
+
+		// the slices are independent, one job per slice
+		JobSystem::Get().ParallelFor(CLUSTER_Z, 1, [this](unsigned int begin, unsigned int end)
+		{
+			for (unsigned int z = begin; z < end; z++)
+				AssignSlice(z);
+		}, "ClusterAssign");
+
+		// concatenate the slices' index lists
+		m_indices.clear();
+		m_stats.maxPerCluster = 0;
+		for (unsigned int z = 0; z < CLUSTER_Z; z++)
+		{
+			uint32_t base = (uint32_t)m_indices.size();
+			for (unsigned int c = z * CLUSTER_X * CLUSTER_Y; c < (z + 1) * CLUSTER_X * CLUSTER_Y; c++)
+			{
+				m_ranges[c * 2] += base;
+				if (m_ranges[c * 2 + 1] > m_stats.maxPerCluster)
+					m_stats.maxPerCluster = m_ranges[c * 2 + 1];
+			}
+			m_indices.insert(m_indices.end(), m_sliceIndices[z].begin(), m_sliceIndices[z].end());
+		}
+		m_stats.lights = count;
+		m_stats.indices = (unsigned int)m_indices.size();
+		m_stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		Upload();
+	}
+
+	// binds the three buffer textures to firstUnit.. firstUnit + 2 and sets the grid uniforms
+	void BindForLighting(Shader& shader, unsigned int firstUnit)
+	{
+		GLStateCache& state = GLStateCache::Get();
+		shader.setInt("clusterLightData", (int)firstUnit);
+		shader.setInt("clusterRanges", (int)firstUnit + 1);
+		shader.setInt("clusterIndices", (int)firstUnit + 2);
+		state.BindTexture(firstUnit, GL_TEXTURE_BUFFER, m_lightTexture);
+		state.BindTexture(firstUnit + 1, GL_TEXTURE_BUFFER, m_rangeTexture);
+		state.BindTexture(firstUnit + 2, GL_TEXTURE_BUFFER, m_indexTexture);
+		// slice = log(depth) * scale + bias
+		float scale = CLUSTER_Z / std::log(m_farPlane / m_nearPlane);
+		shader.setVec2("clusterSliceParams", glm::vec2(scale, -std::log(m_nearPlane) * scale));
+		shader.setVec2("clusterTileSize", glm::vec2((float)m_width / CLUSTER_X, (float)m_height / CLUSTER_Y));
+	}
+
+private:
+	glm::mat4 m_projection;
+	float m_nearPlane, m_farPlane;
+	unsigned int m_width, m_height;
+	std::vector<glm::vec3> m_clusterMin, m_clusterMax;	// view space froxel bounds
+
+	// per frame
+	std::vector<float> m_viewX, m_viewY, m_viewZ, m_radius;
+	std::vector<unsigned int> m_sliceLights[CLUSTER_Z];
+	std::vector<std::vector<uint16_t> > m_sliceIndices;
+	std::vector<uint32_t> m_ranges;	// offset, count per cluster
+	std::vector<uint16_t> m_indices;
+
+	GLuint m_lightBuffer, m_lightTexture;
+	GLuint m_rangeBuffer, m_rangeTexture;
+	GLuint m_indexBuffer, m_indexTexture;
+
+	static float Random(uint32_t& state)
+	{
+		state = state * 1664525u + 1013904223u;
+		return (float)(state >> 8) / 16777216.0f;
+	}
+
+	static unsigned int ClusterIndex(unsigned int x, unsigned int y, unsigned int z)
+	{
+		return x + CLUSTER_X * (y + CLUSTER_Y * z);
+	}
+
+	float SliceDepth(unsigned int slice) const
+	{
+		return m_nearPlane * std::pow(m_farPlane / m_nearPlane, (float)slice / CLUSTER_Z);
+	}
+
+	unsigned int Slice(float depth) const
+	{
+		if (depth <= m_nearPlane)
+			return 0;
+		int slice = (int)(std::log(depth / m_nearPlane) / std::log(m_farPlane / m_nearPlane) * CLUSTER_Z);
+		return slice < (int)CLUSTER_Z ? (unsigned int)slice : CLUSTER_Z - 1;
+	}
+
+	// sphere vs. box for every cluster of the slice and every light binned into it
+	void AssignSlice(unsigned int z)
+	{
+		std::vector<uint16_t>& out = m_sliceIndices[z];
+		out.clear();
+		const std::vector<unsigned int>& lights = m_sliceLights[z];
+		for (unsigned int c = z * CLUSTER_X * CLUSTER_Y; c < (z + 1) * CLUSTER_X * CLUSTER_Y; c++)
+		{
+			uint32_t offset = (uint32_t)out.size();
+			const glm::vec3& boxMin = m_clusterMin[c];
+			const glm::vec3& boxMax = m_clusterMax[c];
+			unsigned int n = 0;
+#ifdef CLUSTER_USE_SSE
+			__m128 minX = _mm_set1_ps(boxMin.x), minY = _mm_set1_ps(boxMin.y), minZ = _mm_set1_ps(boxMin.z);
+			__m128 maxX = _mm_set1_ps(boxMax.x), maxY = _mm_set1_ps(boxMax.y), maxZ = _mm_set1_ps(boxMax.z);
+			__m128 zero = _mm_setzero_ps();
+			for (; n + 4 <= lights.size(); n += 4)
+			{
+				unsigned int i0 = lights[n], i1 = lights[n + 1], i2 = lights[n + 2], i3 = lights[n + 3];
+				__m128 px = _mm_setr_ps(m_viewX[i0], m_viewX[i1], m_viewX[i2], m_viewX[i3]);
+				__m128 py = _mm_setr_ps(m_viewY[i0], m_viewY[i1], m_viewY[i2], m_viewY[i3]);
+				__m128 pz = _mm_setr_ps(m_viewZ[i0], m_viewZ[i1], m_viewZ[i2], m_viewZ[i3]);
+				__m128 r = _mm_setr_ps(m_radius[i0], m_radius[i1], m_radius[i2], m_radius[i3]);
+				// distance from the sphere center to the box, per axis
+				__m128 dx = _mm_add_ps(_mm_max_ps(_mm_sub_ps(minX, px), zero), _mm_max_ps(_mm_sub_ps(px, maxX), zero));
+				__m128 dy = _mm_add_ps(_mm_max_ps(_mm_sub_ps(minY, py), zero), _mm_max_ps(_mm_sub_ps(py, maxY), zero));
+				__m128 dz = _mm_add_ps(_mm_max_ps(_mm_sub_ps(minZ, pz), zero), _mm_max_ps(_mm_sub_ps(pz, maxZ), zero));
+				__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+				int hits = _mm_movemask_ps(_mm_cmple_ps(d2, _mm_mul_ps(r, r)));
+				for (unsigned int k = 0; hits != 0; k++, hits >>= 1)
+					if (hits & 1)
+						out.push_back((uint16_t)lights[n + k]);
+			}
+#endif
+			for (; n < lights.size(); n++)
+			{
+				unsigned int i = lights[n];
+				glm::vec3 p(m_viewX[i], m_viewY[i], m_viewZ[i]);
+				glm::vec3 d = glm::max(boxMin - p, glm::vec3(0.0f)) + glm::max(p - boxMax, glm::vec3(0.0f));
+				if (glm::dot(d, d) <= m_radius[i] * m_radius[i])
+					out.push_back((uint16_t)i);
+			}
+			// offsets are relative to the slice until Build() concatenates the slices
+			m_ranges[c * 2] = offset;
+			m_ranges[c * 2 + 1] = (uint32_t)out.size() - offset;
+		}
+	}
+
+	static void CreateBufferTexture(GLuint& buffer, GLuint& texture, GLenum format)
+	{
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+		glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+		glGenTextures(1, &texture);
+		GLStateCache::Get().BindTexture(GL_TEXTURE_BUFFER, texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+	}
+
+	// orphans and refills the buffers, an empty list still gets one element
+	static void UploadBuffer(GLuint buffer, const void* data, size_t size)
+	{
+		static const uint32_t empty[4] = { 0, 0, 0, 0 };
+		glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+		glBufferData(GL_TEXTURE_BUFFER, size > 0 ? size : sizeof(empty), NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, size > 0 ? size : sizeof(empty), size > 0 ? data : empty);
+	}
+
+	void Upload()
+	{
+		m_lightData.resize(m_lights.size() * 8);
+		for (unsigned int i = 0; i < m_lights.size(); i++)
+		{
+			const ClusterLight& light = m_lights[i];
+			float* texel = &m_lightData[i * 8];
+			texel[0] = light.position.x; texel[1] = light.position.y; texel[2] = light.position.z; texel[3] = light.radius;
+			texel[4] = light.color.r; texel[5] = light.color.g; texel[6] = light.color.b; texel[7] = 0.0f;
+		}
+		UploadBuffer(m_lightBuffer, m_lightData.data(), m_lightData.size() * sizeof(float));
+		UploadBuffer(m_rangeBuffer, m_ranges.data(), m_ranges.size() * sizeof(uint32_t));
+		UploadBuffer(m_indexBuffer, m_indices.data(), m_indices.size() * sizeof(uint16_t));
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+
+	std::vector<float> m_lightData;
+};
+
+#endif // !CLUSTEREDLIGHTS_H
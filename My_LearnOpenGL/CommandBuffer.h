@@ -0,0 +1,170 @@
+#ifndef COMMANDBUFFER_H
+#define COMMANDBUFFER_H
+
+// a recorded list of render commands, to build on any thread and replay later on
+// the thread owning the GL context (GLCommandReplay). Commands are small fixed-size
+// PODs; handles and enums are kept as plain 32-bit values and nothing here calls
+// into GL, so recording needs no context. Larger arguments (matrices, bounds) go
+// to a payload array of 32-bit words next to the commands.
+//
+// a buffer doesn't know what was bound before it: every draw records all the state
+// it needs, and the replay drops what is already current. That keeps buffers
+// recorded in parallel for disjoint draw ranges independent of each other.
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+enum CommandType
+{
+	CMD_USE_PROGRAM,
+	CMD_BIND_VERTEX_ARRAY,
+	CMD_BIND_TEXTURE,
+	CMD_BIND_BUFFER_RANGE,
+	CMD_UNIFORM_INT,
+	CMD_UNIFORM_MAT4,
+	CMD_DRAW,
+	CMD_DRAW_INDEXED,
+	// the next commands draw one occlusion tested object, see BeginOcclusionTest()
+	CMD_OCCLUSION_TEST
+};
+
+struct Command
+{
+	CommandType type;
+	union
+	{
+		struct { uint32_t program; } useProgram;
+		struct { uint32_t vertexArray; } bindVertexArray;
+		struct { uint32_t unit, target, texture; } bindTexture;
+		struct { uint32_t target, index, buffer, offset, size; } bindBufferRange;
+		struct { int32_t location; int32_t value; } uniformInt;
+		struct { int32_t location; uint32_t payload; } uniformMat4;
+		// indexed draws read 32-bit indices from the start of the element buffer
+		struct { uint32_t primitive, first, count, instances; } draw;
+		// bounds: min and max as 6 floats in the payload
+		struct { uint32_t id, payload, commands; } occlusionTest;
+	};
+};
+
+class CommandBuffer
+{
+public:
+	void Clear()
+	{
+		m_commands.clear();
+		m_payload.clear();
+	}
+
+	size_t Size() const { return m_commands.size(); }
+	const Command& operator[](size_t i) const { return m_commands[i]; }
+	const uint32_t* Payload(uint32_t offset) const { return &m_payload[offset]; }
+
+	void UseProgram(uint32_t program)
+	{
+		Command& command = Add(CMD_USE_PROGRAM);
+		command.useProgram.program = program;
+	}
+
+	void BindVertexArray(uint32_t vertexArray)
+	{
+		Command& command = Add(CMD_BIND_VERTEX_ARRAY);
+		command.bindVertexArray.vertexArray = vertexArray;
+	}
+
+	void BindTexture(uint32_t unit, uint32_t target, uint32_t texture)
+	{
+		Command& command = Add(CMD_BIND_TEXTURE);
+		command.bindTexture.unit = unit;
+		command.bindTexture.target = target;
+		command.bindTexture.texture = texture;
+	}
+
+	void BindBufferRange(uint32_t target, uint32_t index, uint32_t buffer, uint32_t offset, uint32_t size)
+	{
+		Command& command = Add(CMD_BIND_BUFFER_RANGE);
+		command.bindBufferRange.target = target;
+		command.bindBufferRange.index = index;
+		command.bindBufferRange.buffer = buffer;
+		command.bindBufferRange.offset = offset;
+		command.bindBufferRange.size = size;
+	}
+
+	// uniforms of the program in use, the location has to be looked up beforehand
+	void UniformInt(int32_t location, int32_t value)
+	{
+		Command& command = Add(CMD_UNIFORM_INT);
+		command.uniformInt.location = location;
+		command.uniformInt.value = value;
+	}
+
+	void UniformMat4(int32_t location, const glm::mat4& matrix)
+	{
+		uint32_t payload = Store(&matrix[0][0], sizeof(glm::mat4));
+		Command& command = Add(CMD_UNIFORM_MAT4);
+		command.uniformMat4.location = location;
+		command.uniformMat4.payload = payload;
+	}
+
+	void Draw(uint32_t primitive, uint32_t first, uint32_t count, uint32_t instances = 1)
+	{
+		AddDraw(CMD_DRAW, primitive, first, count, instances);
+	}
+
+	void DrawIndexed(uint32_t primitive, uint32_t count, uint32_t instances = 1)
+	{
+		AddDraw(CMD_DRAW_INDEXED, primitive, 0, count, instances);
+	}
+
+	// the commands up to EndOcclusionTest() draw one object that the replay may
+	// occlusion test (with query object id) and skip or defer. Returns what
+	// EndOcclusionTest() needs.
+	size_t BeginOcclusionTest(uint32_t id, const glm::vec3& worldMin, const glm::vec3& worldMax)
+	{
+		float bounds[6] = { worldMin.x, worldMin.y, worldMin.z, worldMax.x, worldMax.y, worldMax.z };
+		uint32_t payload = Store(bounds, sizeof(bounds));
+		Command& command = Add(CMD_OCCLUSION_TEST);
+		command.occlusionTest.id = id;
+		command.occlusionTest.payload = payload;
+		command.occlusionTest.commands = 0;
+		return m_commands.size() - 1;
+	}
+
+	void EndOcclusionTest(size_t begin)
+	{
+		m_commands[begin].occlusionTest.commands = (uint32_t)(m_commands.size() - begin - 1);
+	}
+
+private:
+	std::vector<Command> m_commands;
+	std::vector<uint32_t> m_payload;
+
+	Command& Add(CommandType type)
+	{
+		m_commands.push_back(Command());
+		Command& command = m_commands.back();
+		command.type = type;
+		return command;
+	}
+
+	void AddDraw(CommandType type, uint32_t primitive, uint32_t first, uint32_t count, uint32_t instances)
+	{
+		Command& command = Add(type);
+		command.draw.primitive = primitive;
+		command.draw.first = first;
+		command.draw.count = count;
+		command.draw.instances = instances;
+	}
+
+	// appends size bytes (padded to whole words) to the payload, returns their offset in words
+	uint32_t Store(const void* data, uint32_t size)
+	{
+		uint32_t offset = (uint32_t)m_payload.size();
+		m_payload.resize(offset + (size + 3) / 4);
+		std::memcpy(&m_payload[offset], data, size);
+		return offset;
+	}
+};
+
+#endif // !COMMANDBUFFER_H
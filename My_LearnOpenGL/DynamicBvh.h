@@ -0,0 +1,444 @@
+#ifndef DYNAMICBVH_H
+#define DYNAMICBVH_H
+
+// dynamic bounding volume hierarchy over world space boxes (after Box2D's
+// b2DynamicTree), the scene level index for frustum, light (sphere/box) and ray
+// queries instead of linear scans over every object.
+//
+// every object is a proxy: a leaf holding its box grown by m_margin (a "fat" box)
+// and a user value. Moving an object only touches the tree when its new box leaves
+// the fat one; then the leaf is removed and reinserted, O(log n) since insertions
+// pick the cheapest sibling by surface area and rotations keep the tree balanced.
+// Fat boxes are also stretched along the displacement, so steadily moving objects
+// reinsert rarely.
+//
+// queries are const and keep their traversal stack locally, any number of threads
+// may query while nobody modifies the tree.
+#include <glm/glm.hpp>
+
+#include "Frustum.h"
+
+#include <vector>
+#include <algorithm>
+
+const int DYNAMICBVH_NULL = -1;
+// traversal stack of the queries, a balanced tree stays far below this
+const unsigned int DYNAMICBVH_STACK_SIZE = 256;
+
+class DynamicBvh
+{
+public:
+	// the fat boxes are this much bigger than the objects on every side
+	float m_margin;
+	// fat boxes stretch this many displacements ahead of a moving object
+	float m_displacementFactor;
+
+	DynamicBvh()
+		: m_margin(0.1f),
+		m_displacementFactor(2.0f),
+		m_root(DYNAMICBVH_NULL),
+		m_freeList(DYNAMICBVH_NULL),
+		m_proxyCount(0),
+		m_reinsertions(0)
+	{
+	}
+
+	unsigned int ProxyCount() const { return m_proxyCount; }
+	int Height() const { return m_root == DYNAMICBVH_NULL ? 0 : m_nodes[m_root].height; }
+	unsigned int UserData(int proxy) const { return m_nodes[proxy].userData; }
+	const glm::vec3& FatMin(int proxy) const { return m_nodes[proxy].boxMin; }
+	const glm::vec3& FatMax(int proxy) const { return m_nodes[proxy].boxMax; }
+
+	// reinsertions done by MoveProxy() since the last call
+	unsigned int TakeReinsertions()
+	{
+		unsigned int count = m_reinsertions;
+		m_reinsertions = 0;
+		return count;
+	}
+
+	void Clear()
+	{
+		m_nodes.clear();
+		m_root = m_freeList = DYNAMICBVH_NULL;
+		m_proxyCount = 0;
+	}
+
+	// adds an object with the given world bounds, returns its proxy id
+	int CreateProxy(const glm::vec3& boxMin, const glm::vec3& boxMax, unsigned int userData)
+	{
+		int proxy = AllocateNode();
+		Node& node = m_nodes[proxy];
+		node.boxMin = boxMin - glm::vec3(m_margin);
+		node.boxMax = boxMax + glm::vec3(m_margin);
+		node.userData = userData;
+		node.height = 0;
+		InsertLeaf(proxy);
+		m_proxyCount++;
+		return proxy;
+	}
+
+	void DestroyProxy(int proxy)
+	{
+		RemoveLeaf(proxy);
+		FreeNode(proxy);
+		m_proxyCount--;
+	}
+
+	// updates an object's bounds, displacement is how far it moved since the last
+	// call. Returns true when the proxy had to be reinserted.
+	bool MoveProxy(int proxy, const glm::vec3& boxMin, const glm::vec3& boxMax, const glm::vec3& displacement)
+	{
+		Node& node = m_nodes[proxy];
+		if (glm::all(glm::lessThanEqual(node.boxMin, boxMin)) && glm::all(glm::greaterThanEqual(node.boxMax, boxMax)))
+			return false;
+		RemoveLeaf(proxy);
+		glm::vec3 fatMin = boxMin - glm::vec3(m_margin);
+		glm::vec3 fatMax = boxMax + glm::vec3(m_margin);
+		glm::vec3 ahead = displacement * m_displacementFactor;
+		fatMin += glm::min(ahead, glm::vec3(0.0f));
+		fatMax += glm::max(ahead, glm::vec3(0.0f));
+		m_nodes[proxy].boxMin = fatMin;
+		m_nodes[proxy].boxMax = fatMax;
+		InsertLeaf(proxy);
+		m_reinsertions++;
+		return true;
+	}
+
+	// calls callback(proxy) for every fat box overlapping the box, stops when it returns false
+	template <typename Callback>
+	void QueryAabb(const glm::vec3& boxMin, const glm::vec3& boxMax, Callback callback) const
+	{
+		int stack[DYNAMICBVH_STACK_SIZE];
+		unsigned int count = 0;
+		if (m_root != DYNAMICBVH_NULL)
+			stack[count++] = m_root;
+		while (count > 0)
+		{
+			const Node& node = m_nodes[stack[--count]];
+			if (glm::any(glm::lessThan(node.boxMax, boxMin)) || glm::any(glm::greaterThan(node.boxMin, boxMax)))
+				continue;
+			if (node.IsLeaf())
+			{
+				if (!callback(stack[count]))
+					return;
+				continue;
+			}
+			stack[count++] = node.child1;
+			stack[count++] = node.child2;
+		}
+	}
+
+	// calls callback(proxy) for every fat box touching the sphere (e.g. a light's range)
+	template <typename Callback>
+	void QuerySphere(const glm::vec3& center, float radius, Callback callback) const
+	{
+		float radiusSquared = radius * radius;
+		int stack[DYNAMICBVH_STACK_SIZE];
+		unsigned int count = 0;
+		if (m_root != DYNAMICBVH_NULL)
+			stack[count++] = m_root;
+		while (count > 0)
+		{
+			const Node& node = m_nodes[stack[--count]];
+			glm::vec3 closest = glm::clamp(center, node.boxMin, node.boxMax) - center;
+			if (glm::dot(closest, closest) > radiusSquared)
+				continue;
+			if (node.IsLeaf())
+			{
+				if (!callback(stack[count]))
+					return;
+				continue;
+			}
+			stack[count++] = node.child1;
+			stack[count++] = node.child2;
+		}
+	}
+
+	// calls callback(proxy) for every fat box in the frustum. Subtrees entirely
+	// inside are reported without testing the planes again.
+	template <typename Callback>
+	void QueryFrustum(const Frustum& frustum, Callback callback) const
+	{
+		int stack[DYNAMICBVH_STACK_SIZE];
+		bool inside[DYNAMICBVH_STACK_SIZE];
+		unsigned int count = 0;
+		if (m_root != DYNAMICBVH_NULL)
+		{
+			stack[count] = m_root;
+			inside[count++] = false;
+		}
+		while (count > 0)
+		{
+			count--;
+			int index = stack[count];
+			bool nodeInside = inside[count];
+			const Node& node = m_nodes[index];
+			if (!nodeInside)
+			{
+				if (!frustum.IntersectsAabb(node.boxMin, node.boxMax))
+					continue;
+				nodeInside = frustum.ContainsAabb(node.boxMin, node.boxMax);
+			}
+			if (node.IsLeaf())
+			{
+				if (!callback(index))
+					return;
+				continue;
+			}
+			stack[count] = node.child1;
+			inside[count++] = nodeInside;
+			stack[count] = node.child2;
+			inside[count++] = nodeInside;
+		}
+	}
+
+	// walks the fat boxes hit by the ray origin + t * direction, t in [0, maxDistance],
+	// calling callback(proxy, tEnter). The callback returns the new maxDistance: tEnter
+	// (or its own exact hit distance) clips the ray to find the closest object, 0 stops.
+	template <typename Callback>
+	void RayCast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, Callback callback) const
+	{
+		glm::vec3 inverse(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+		int stack[DYNAMICBVH_STACK_SIZE];
+		unsigned int count = 0;
+		if (m_root != DYNAMICBVH_NULL)
+			stack[count++] = m_root;
+		while (count > 0)
+		{
+			int index = stack[--count];
+			const Node& node = m_nodes[index];
+			float tEnter;
+			if (!RayHitsBox(origin, inverse, maxDistance, node.boxMin, node.boxMax, tEnter))
+				continue;
+			if (node.IsLeaf())
+			{
+				maxDistance = callback(index, tEnter);
+				if (maxDistance <= 0.0f)
+					return;
+				continue;
+			}
+			stack[count++] = node.child1;
+			stack[count++] = node.child2;
+		}
+	}
+
+private:
+	struct Node
+	{
+		glm::vec3 boxMin, boxMax;
+		int parent;			// next free node while on the free list
+		int child1, child2;	// DYNAMICBVH_NULL for leaves
+		int height;			// leaves are 0, free nodes -1
+		unsigned int userData;
+
+		bool IsLeaf() const { return child1 == DYNAMICBVH_NULL; }
+	};
+
+	std::vector<Node> m_nodes;
+	int m_root;
+	int m_freeList;
+	unsigned int m_proxyCount;
+	unsigned int m_reinsertions;
+
+	static float Area(const glm::vec3& boxMin, const glm::vec3& boxMax)
+	{
+		glm::vec3 size = boxMax - boxMin;
+		return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	}
+
+	static float UnionArea(const Node& a, const Node& b)
+	{
+		return Area(glm::min(a.boxMin, b.boxMin), glm::max(a.boxMax, b.boxMax));
+	}
+
+	// slab test, tEnter is where the ray enters the box (0 if it starts inside)
+	static bool RayHitsBox(const glm::vec3& origin, const glm::vec3& inverse, float maxDistance, const glm::vec3& boxMin, const glm::vec3& boxMax,
+		float& tEnter)
+	{
+		glm::vec3 t1 = (boxMin - origin) * inverse;
+		glm::vec3 t2 = (boxMax - origin) * inverse;
+		glm::vec3 tNear = glm::min(t1, t2);
+		glm::vec3 tFar = glm::max(t1, t2);
+		tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+		float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDistance));
+		return tEnter <= tExit;
+	}
+
+	int AllocateNode()
+	{
+		int index;
+		if (m_freeList != DYNAMICBVH_NULL)
+		{
+			index = m_freeList;
+			m_freeList = m_nodes[index].parent;
+		}
+		else
+		{
+			index = (int)m_nodes.size();
+			m_nodes.push_back(Node());
+		}
+		Node& node = m_nodes[index];
+		node.parent = node.child1 = node.child2 = DYNAMICBVH_NULL;
+		node.height = 0;
+		node.userData = 0;
+		return index;
+	}
+
+	void FreeNode(int index)
+	{
+		m_nodes[index].parent = m_freeList;
+		m_nodes[index].height = -1;
+		m_freeList = index;
+	}
+
+	void FitNode(int index)
+	{
+		Node& node = m_nodes[index];
+		const Node& child1 = m_nodes[node.child1];
+		const Node& child2 = m_nodes[node.child2];
+		node.boxMin = glm::min(child1.boxMin, child2.boxMin);
+		node.boxMax = glm::max(child1.boxMax, child2.boxMax);
+		node.height = 1 + std::max(child1.height, child2.height);
+	}
+
+	void InsertLeaf(int leaf)
+	{
+		if (m_root == DYNAMICBVH_NULL)
+		{
+			m_root = leaf;
+			m_nodes[leaf].parent = DYNAMICBVH_NULL;
+			return;
+		}
+
+		// descend to the sibling that grows the total surface area least
+		const Node& leafNode = m_nodes[leaf];
+		int index = m_root;
+		while (!m_nodes[index].IsLeaf())
+		{
+			const Node& node = m_nodes[index];
+			float area = Area(node.boxMin, node.boxMax);
+			float combinedArea = UnionArea(node, leafNode);
+			// a new parent here costs the combined box, pushing down costs the growth of this one
+			float cost = 2.0f * combinedArea;
+			float inheritedCost = 2.0f * (combinedArea - area);
+			float cost1 = ChildCost(m_nodes[node.child1], leafNode) + inheritedCost;
+			float cost2 = ChildCost(m_nodes[node.child2], leafNode) + inheritedCost;
+			if (cost < cost1 && cost < cost2)
+				break;
+			index = cost1 < cost2 ? node.child1 : node.child2;
+		}
+
+		int sibling = index;
+		int oldParent = m_nodes[sibling].parent;
+		int newParent = AllocateNode();
+		m_nodes[newParent].parent = oldParent;
+		m_nodes[newParent].child1 = sibling;
+		m_nodes[newParent].child2 = leaf;
+		m_nodes[sibling].parent = newParent;
+		m_nodes[leaf].parent = newParent;
+		FitNode(newParent);
+		if (oldParent == DYNAMICBVH_NULL)
+			m_root = newParent;
+		else if (m_nodes[oldParent].child1 == sibling)
+			m_nodes[oldParent].child1 = newParent;
+		else
+			m_nodes[oldParent].child2 = newParent;
+
+		RefitAncestors(m_nodes[leaf].parent);
+	}
+
+	// cost of going down into child: a leaf gets a new parent, an inner node only grows
+	float ChildCost(const Node& child, const Node& leafNode) const
+	{
+		if (child.IsLeaf())
+			return UnionArea(child, leafNode);
+		return UnionArea(child, leafNode) - Area(child.boxMin, child.boxMax);
+	}
+
+	void RemoveLeaf(int leaf)
+	{
+		if (leaf == m_root)
+		{
+			m_root = DYNAMICBVH_NULL;
+			return;
+		}
+		int parent = m_nodes[leaf].parent;
+		int grandParent = m_nodes[parent].parent;
+		int sibling = m_nodes[parent].child1 == leaf ? m_nodes[parent].child2 : m_nodes[parent].child1;
+		FreeNode(parent);
+		m_nodes[sibling].parent = grandParent;
+		if (grandParent == DYNAMICBVH_NULL)
+		{
+			m_root = sibling;
+			return;
+		}
+		if (m_nodes[grandParent].child1 == parent)
+			m_nodes[grandParent].child1 = sibling;
+		else
+			m_nodes[grandParent].child2 = sibling;
+		RefitAncestors(grandParent);
+	}
+
+	// walks up from index, rebalancing and refitting every node on the way
+	void RefitAncestors(int index)
+	{
+		while (index != DYNAMICBVH_NULL)
+		{
+			index = Balance(index);
+			FitNode(index);
+			index = m_nodes[index].parent;
+		}
+	}
+
+	// rotates a grandchild up when the subtrees of a differ in height by more than
+	// one, returns the index now at a's place
+	int Balance(int a)
+	{
+		Node& nodeA = m_nodes[a];
+		if (nodeA.IsLeaf() || nodeA.height < 2)
+			return a;
+		int b = nodeA.child1;
+		int c = nodeA.child2;
+		int balance = m_nodes[c].height - m_nodes[b].height;
+		if (balance > 1)
+			return Rotate(a, c, false);
+		if (balance < -1)
+			return Rotate(a, b, true);
+		return a;
+	}
+
+	// promotes the higher child up over a, keeps its higher grandchild and hands
+	// its lower grandchild to a. upIsChild1 tells which child of a up was.
+	int Rotate(int a, int up, bool upIsChild1)
+	{
+		Node& nodeA = m_nodes[a];
+		Node& nodeUp = m_nodes[up];
+		int f = nodeUp.child1;
+		int g = nodeUp.child2;
+
+		nodeUp.child1 = a;
+		nodeUp.parent = nodeA.parent;
+		nodeA.parent = up;
+		if (nodeUp.parent == DYNAMICBVH_NULL)
+			m_root = up;
+		else if (m_nodes[nodeUp.parent].child1 == a)
+			m_nodes[nodeUp.parent].child1 = up;
+		else
+			m_nodes[nodeUp.parent].child2 = up;
+
+		int keep = m_nodes[f].height > m_nodes[g].height ? f : g;
+		int give = keep == f ? g : f;
+		nodeUp.child2 = keep;
+		if (upIsChild1)
+			nodeA.child1 = give;
+		else
+			nodeA.child2 = give;
+		m_nodes[give].parent = a;
+		FitNode(a);
+		FitNode(up);
+		return up;
+	}
+};
+
+#endif // !DYNAMICBVH_H
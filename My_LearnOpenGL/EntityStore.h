@@ -0,0 +1,411 @@
+#ifndef ENTITYSTORE_H
+#define ENTITYSTORE_H
+
+// entity-component store with archetype storage. All entities with the same set
+// of component types (an archetype) live together in fixed size chunks, each
+// component type in its own tightly packed array (structure of arrays), so a
+// system asking for some components walks straight through memory:
+//
+//	chunk:	[ entity ids ][ Transform x capacity ][ Bounds x capacity ][ ... ]
+//
+// components are plain data (trivially copyable), they are moved with memcpy.
+// Destroying an entity moves the archetype's last one into its row, adding or
+// removing a component moves it to another archetype. Entity ids stay valid
+// through all of that: they index a table of (archetype, chunk, row) records and
+// carry a generation, so ids of destroyed entities are recognized.
+//
+// structural changes (create, destroy, add, remove) made while a ForEach is
+// running are queued and applied when the outermost ForEach returns, so
+// iteration never sees rows move under it.
+#include <vector>
+#include <functional>
+#include <type_traits>
+#include <cstring>
+
+// generation in the high bits, table index in the low ones
+typedef unsigned int Entity;
+const Entity ENTITY_NULL = 0xFFFFFFFFu;
+const unsigned int ENTITY_INDEX_BITS = 22;
+const unsigned int ENTITY_INDEX_MASK = (1u << ENTITY_INDEX_BITS) - 1;
+
+const unsigned int ENTITYSTORE_CHUNK_BYTES = 16 * 1024;
+// component types per program, one bit each in an archetype's mask
+const unsigned int ENTITYSTORE_MAX_COMPONENTS = 32;
+// columns start on this boundary
+const unsigned int ENTITYSTORE_COLUMN_ALIGN = 16;
+
+class EntityStore
+{
+public:
+	EntityStore()
+		: m_iterating(0),
+		m_freeList(ENTITY_NULL),
+		m_count(0)
+	{
+	}
+
+	// id of a component type, assigned on first use
+	template <typename T>
+	static unsigned int ComponentId()
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "components must be plain data");
+		static const unsigned int id = RegisterComponent(sizeof(T));
+		return id;
+	}
+
+	static unsigned int EntityIndex(Entity entity) { return entity & ENTITY_INDEX_MASK; }
+
+	unsigned int Count() const { return m_count; }
+	// every live entity's EntityIndex() is below this
+	unsigned int IndexLimit() const { return (unsigned int)m_records.size(); }
+	unsigned int ArchetypeCount() const { return (unsigned int)m_archetypes.size(); }
+
+	unsigned int ChunkCount() const
+	{
+		unsigned int chunks = 0;
+		for (unsigned int i = 0; i < m_archetypes.size(); i++)
+			chunks += (unsigned int)m_archetypes[i].chunks.size();
+		return chunks;
+	}
+
+	bool Alive(Entity entity) const
+	{
+		unsigned int index = EntityIndex(entity);
+		return entity != ENTITY_NULL && index < m_records.size() && m_records[index].generation == Generation(entity)
+			&& m_records[index].archetype != NO_ARCHETYPE;
+	}
+
+	// creates an entity with the given components. Inside a ForEach the id is valid
+	// right away, the entity shows up once the iteration is over.
+	template <typename... Ts>
+	Entity Create(const Ts&... components)
+	{
+		Entity entity = AllocateEntity();
+		if (m_iterating > 0)
+		{
+			m_pending.push_back([=]() { Insert(entity, components...); });
+			return entity;
+		}
+		Insert(entity, components...);
+		return entity;
+	}
+
+	void Destroy(Entity entity)
+	{
+		if (m_iterating > 0)
+		{
+			m_pending.push_back([=]() { Destroy(entity); });
+			return;
+		}
+		if (!Alive(entity))
+			return;
+		Record& record = m_records[EntityIndex(entity)];
+		RemoveRow(record.archetype, record.chunk, record.row);
+		record.archetype = NO_ARCHETYPE;
+		record.generation = (record.generation + 1) & (0xFFFFFFFFu >> ENTITY_INDEX_BITS);
+		record.chunk = m_freeList;
+		m_freeList = EntityIndex(entity);
+		m_count--;
+	}
+
+	// the entity's component, NULL if it has none (or is gone)
+	template <typename T>
+	T* Get(Entity entity)
+	{
+		if (!Alive(entity))
+			return NULL;
+		const Record& record = m_records[EntityIndex(entity)];
+		Archetype& archetype = m_archetypes[record.archetype];
+		unsigned int id = ComponentId<T>();
+		if (!(archetype.mask & (1u << id)))
+			return NULL;
+		return Column<T>(archetype, archetype.chunks[record.chunk]) + record.row;
+	}
+
+	// adds (or overwrites) a component, moving the entity to the matching archetype
+	template <typename T>
+	void Add(Entity entity, const T& component)
+	{
+		if (m_iterating > 0)
+		{
+			m_pending.push_back([=]() { Add(entity, component); });
+			return;
+		}
+		if (!Alive(entity))
+			return;
+		unsigned int id = ComponentId<T>();
+		const Record& record = m_records[EntityIndex(entity)];
+		unsigned int mask = m_archetypes[record.archetype].mask | (1u << id);
+		if (mask != m_archetypes[record.archetype].mask)
+			MoveEntity(entity, mask);
+		*Get<T>(entity) = component;
+	}
+
+	template <typename T>
+	void Remove(Entity entity)
+	{
+		if (m_iterating > 0)
+		{
+			m_pending.push_back([=]() { Remove<T>(entity); });
+			return;
+		}
+		if (!Alive(entity))
+			return;
+		unsigned int id = ComponentId<T>();
+		const Record& record = m_records[EntityIndex(entity)];
+		unsigned int mask = m_archetypes[record.archetype].mask & ~(1u << id);
+		if (mask != m_archetypes[record.archetype].mask)
+			MoveEntity(entity, mask);
+	}
+
+	// calls f(count, entities, Ts* columns...) for every chunk of every archetype that
+	// has all of Ts. The columns are arrays of count components, row i belongs to entities[i].
+	template <typename... Ts, typename F>
+	void ForEachChunk(F f)
+	{
+		unsigned int mask = MaskOf<Ts...>();
+		m_iterating++;
+		// archetypes and chunks created meanwhile are queued, the sizes can't change
+		for (unsigned int a = 0; a < m_archetypes.size(); a++)
+		{
+			Archetype& archetype = m_archetypes[a];
+			if ((archetype.mask & mask) != mask)
+				continue;
+			for (unsigned int c = 0; c < archetype.chunks.size(); c++)
+			{
+				Chunk& chunk = archetype.chunks[c];
+				if (chunk.count > 0)
+					f(chunk.count, Entities(chunk), Column<Ts>(archetype, chunk)...);
+			}
+		}
+		if (--m_iterating == 0)
+			FlushPending();
+	}
+
+	// calls f(entity, Ts&...) for every entity that has all of Ts
+	template <typename... Ts, typename F>
+	void ForEach(F f)
+	{
+		ForEachChunk<Ts...>([&f](unsigned int count, const Entity* entities, Ts*... columns)
+		{
+			for (unsigned int i = 0; i < count; i++)
+				f(entities[i], columns[i]...);
+		});
+	}
+
+private:
+	static const unsigned int NO_ARCHETYPE = 0xFFFFFFFFu;
+
+	struct Chunk
+	{
+		std::vector<unsigned char> data;	// ENTITYSTORE_CHUNK_BYTES, the entity ids first
+		unsigned int count;
+	};
+
+	struct Archetype
+	{
+		unsigned int mask;
+		unsigned int capacity;	// rows per chunk
+		unsigned int offsets[ENTITYSTORE_MAX_COMPONENTS];	// column offsets in a chunk by component id
+		std::vector<Chunk> chunks;	// all full but the last
+	};
+
+	// where an entity lives; free records chain through chunk
+	struct Record
+	{
+		unsigned int archetype;
+		unsigned int chunk;
+		unsigned int row;
+		unsigned int generation;
+	};
+
+	std::vector<Archetype> m_archetypes;
+	std::vector<Record> m_records;
+	std::vector<std::function<void()> > m_pending;
+	unsigned int m_iterating;
+	unsigned int m_freeList;
+	unsigned int m_count;
+
+	static std::vector<unsigned int>& ComponentSizes()
+	{
+		static std::vector<unsigned int> sizes;
+		return sizes;
+	}
+
+	static unsigned int RegisterComponent(unsigned int size)
+	{
+		ComponentSizes().push_back(size);
+		return (unsigned int)ComponentSizes().size() - 1;
+	}
+
+	static unsigned int Generation(Entity entity) { return entity >> ENTITY_INDEX_BITS; }
+
+	template <typename... Ts>
+	static unsigned int MaskOf()
+	{
+		unsigned int mask = 0;
+		int expand[] = { 0, (mask |= 1u << ComponentId<Ts>(), 0)... };
+		(void)expand;
+		return mask;
+	}
+
+	static unsigned int AlignUp(unsigned int value)
+	{
+		return (value + ENTITYSTORE_COLUMN_ALIGN - 1) & ~(ENTITYSTORE_COLUMN_ALIGN - 1);
+	}
+
+	static Entity* Entities(Chunk& chunk) { return reinterpret_cast<Entity*>(chunk.data.data()); }
+
+	template <typename T>
+	static T* Column(Archetype& archetype, Chunk& chunk)
+	{
+		return reinterpret_cast<T*>(chunk.data.data() + archetype.offsets[ComponentId<T>()]);
+	}
+
+	// lays out the columns for capacity rows, returns the bytes needed
+	static unsigned int Layout(Archetype& archetype, unsigned int capacity)
+	{
+		const std::vector<unsigned int>& sizes = ComponentSizes();
+		unsigned int offset = AlignUp(capacity * sizeof(Entity));
+		for (unsigned int id = 0; id < sizes.size(); id++)
+		{
+			if (!(archetype.mask & (1u << id)))
+				continue;
+			archetype.offsets[id] = offset;
+			offset = AlignUp(offset + capacity * sizes[id]);
+		}
+		return offset;
+	}
+
+	unsigned int FindArchetype(unsigned int mask)
+	{
+		for (unsigned int i = 0; i < m_archetypes.size(); i++)
+			if (m_archetypes[i].mask == mask)
+				return i;
+		Archetype archetype;
+		archetype.mask = mask;
+		const std::vector<unsigned int>& sizes = ComponentSizes();
+		unsigned int rowBytes = sizeof(Entity);
+		for (unsigned int id = 0; id < sizes.size(); id++)
+			if (mask & (1u << id))
+				rowBytes += sizes[id];
+		// as many rows as fit once the columns are aligned
+		archetype.capacity = ENTITYSTORE_CHUNK_BYTES / rowBytes;
+		while (archetype.capacity > 1 && Layout(archetype, archetype.capacity) > ENTITYSTORE_CHUNK_BYTES)
+			archetype.capacity--;
+		Layout(archetype, archetype.capacity);
+		m_archetypes.push_back(archetype);
+		return (unsigned int)m_archetypes.size() - 1;
+	}
+
+	Entity AllocateEntity()
+	{
+		unsigned int index;
+		if (m_freeList != ENTITY_NULL)
+		{
+			index = m_freeList;
+			m_freeList = m_records[index].chunk;
+		}
+		else
+		{
+			index = (unsigned int)m_records.size();
+			Record record = { NO_ARCHETYPE, 0, 0, 0 };
+			m_records.push_back(record);
+		}
+		// not alive until it has a row
+		m_records[index].archetype = NO_ARCHETYPE;
+		m_records[index].chunk = 0;
+		return (m_records[index].generation << ENTITY_INDEX_BITS) | index;
+	}
+
+	// appends a row for the entity to the archetype, returns the record
+	Record& AddRow(Entity entity, unsigned int archetypeIndex)
+	{
+		Archetype& archetype = m_archetypes[archetypeIndex];
+		if (archetype.chunks.empty() || archetype.chunks.back().count == archetype.capacity)
+		{
+			Chunk chunk;
+			chunk.data.resize(ENTITYSTORE_CHUNK_BYTES);
+			chunk.count = 0;
+			archetype.chunks.push_back(chunk);
+		}
+		Chunk& chunk = archetype.chunks.back();
+		Entities(chunk)[chunk.count] = entity;
+		Record& record = m_records[EntityIndex(entity)];
+		record.archetype = archetypeIndex;
+		record.chunk = (unsigned int)archetype.chunks.size() - 1;
+		record.row = chunk.count++;
+		return record;
+	}
+
+	// fills the hole with the archetype's last row, keeping the chunks packed
+	void RemoveRow(unsigned int archetypeIndex, unsigned int chunkIndex, unsigned int row)
+	{
+		Archetype& archetype = m_archetypes[archetypeIndex];
+		Chunk& chunk = archetype.chunks[chunkIndex];
+		Chunk& last = archetype.chunks.back();
+		unsigned int lastRow = last.count - 1;
+		if (&chunk != &last || row != lastRow)
+		{
+			const std::vector<unsigned int>& sizes = ComponentSizes();
+			Entity moved = Entities(last)[lastRow];
+			Entities(chunk)[row] = moved;
+			for (unsigned int id = 0; id < sizes.size(); id++)
+				if (archetype.mask & (1u << id))
+					memcpy(chunk.data.data() + archetype.offsets[id] + row * sizes[id],
+						last.data.data() + archetype.offsets[id] + lastRow * sizes[id], sizes[id]);
+			Record& record = m_records[EntityIndex(moved)];
+			record.chunk = chunkIndex;
+			record.row = row;
+		}
+		if (--last.count == 0)
+			archetype.chunks.pop_back();
+	}
+
+	template <typename... Ts>
+	void Insert(Entity entity, const Ts&... components)
+	{
+		const Record& record = AddRow(entity, FindArchetype(MaskOf<Ts...>()));
+		Archetype& archetype = m_archetypes[record.archetype];
+		Chunk& chunk = archetype.chunks[record.chunk];
+		unsigned int row = record.row;
+		int expand[] = { 0, (Column<Ts>(archetype, chunk)[row] = components, 0)... };
+		(void)expand;
+		m_count++;
+	}
+
+	// copies the components both archetypes share, new ones are zeroed
+	void MoveEntity(Entity entity, unsigned int mask)
+	{
+		Record old = m_records[EntityIndex(entity)];
+		unsigned int target = FindArchetype(mask);
+		const Record& record = AddRow(entity, target);
+		Archetype& from = m_archetypes[old.archetype];
+		Archetype& to = m_archetypes[target];
+		Chunk& source = from.chunks[old.chunk];
+		Chunk& destination = to.chunks[record.chunk];
+		const std::vector<unsigned int>& sizes = ComponentSizes();
+		for (unsigned int id = 0; id < sizes.size(); id++)
+		{
+			if (!(mask & (1u << id)))
+				continue;
+			unsigned char* dst = destination.data.data() + to.offsets[id] + record.row * sizes[id];
+			if (from.mask & (1u << id))
+				memcpy(dst, source.data.data() + from.offsets[id] + old.row * sizes[id], sizes[id]);
+			else
+				memset(dst, 0, sizes[id]);
+		}
+		RemoveRow(old.archetype, old.chunk, old.row);
+	}
+
+	void FlushPending()
+	{
+		// the queued changes may queue nothing new, m_iterating is 0
+		std::vector<std::function<void()> > pending;
+		pending.swap(m_pending);
+		for (unsigned int i = 0; i < pending.size(); i++)
+			pending[i]();
+	}
+};
+
+#endif // !ENTITYSTORE_H
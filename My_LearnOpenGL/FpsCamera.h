@@ -138,6 +138,15 @@ public:
 		if(m_zoom > 45.0f)
 			m_zoom = 45.0f;
 	}
+
+	// places the camera directly, used by scripted (non-interactive) camera paths
+	void SetPose(vec3 position, float yaw, float pitch)
+	{
+		m_position = position;
+		m_yaw = yaw;
+		m_pitch = pitch;
+		UpdateCameraVectors();
+	}
 	
 
 private:
@@ -0,0 +1,103 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+// view volume of any view-projection matrix (perspective or orthographic) as six
+// planes, for culling world space bounding boxes against it. The planes are
+// extracted straight from the matrix rows (Gribb/Hartmann) and point inwards.
+#include <glm/glm.hpp>
+
+#include <cmath>
+
+enum FrustumPlane
+{
+	FRUSTUM_LEFT,
+	FRUSTUM_RIGHT,
+	FRUSTUM_BOTTOM,
+	FRUSTUM_TOP,
+	FRUSTUM_NEAR,
+	FRUSTUM_FAR,
+	FRUSTUM_PLANE_COUNT
+};
+
+class Frustum
+{
+public:
+	// xyz = inward normal, w = distance: a point p is inside when dot(xyz, p) + w >= 0
+	glm::vec4 m_planes[FRUSTUM_PLANE_COUNT];
+
+	Frustum()
+	{
+		for (unsigned int i = 0; i < FRUSTUM_PLANE_COUNT; i++)
+			m_planes[i] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	}
+
+	explicit Frustum(const glm::mat4& viewProj)
+	{
+		// glm is column major: row i of the matrix is (m[0][i], m[1][i], m[2][i], m[3][i])
+		glm::vec4 row0(viewProj[0][0], viewProj[1][0], viewProj[2][0], viewProj[3][0]);
+		glm::vec4 row1(viewProj[0][1], viewProj[1][1], viewProj[2][1], viewProj[3][1]);
+		glm::vec4 row2(viewProj[0][2], viewProj[1][2], viewProj[2][2], viewProj[3][2]);
+		glm::vec4 row3(viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]);
+		m_planes[FRUSTUM_LEFT] = row3 + row0;
+		m_planes[FRUSTUM_RIGHT] = row3 - row0;
+		m_planes[FRUSTUM_BOTTOM] = row3 + row1;
+		m_planes[FRUSTUM_TOP] = row3 - row1;
+		m_planes[FRUSTUM_NEAR] = row3 + row2;
+		m_planes[FRUSTUM_FAR] = row3 - row2;
+		for (unsigned int i = 0; i < FRUSTUM_PLANE_COUNT; i++)
+			m_planes[i] /= glm::length(glm::vec3(m_planes[i]));
+	}
+
+	// conservative box test: false only if the box is fully outside one plane.
+	// skipNear ignores the near plane, for shadow casters between the light and the volume.
+	bool IntersectsAabb(const glm::vec3& boxMin, const glm::vec3& boxMax, bool skipNear = false) const
+	{
+		for (unsigned int i = 0; i < FRUSTUM_PLANE_COUNT; i++)
+		{
+			if (skipNear && i == FRUSTUM_NEAR)
+				continue;
+			// the box corner furthest along the plane normal
+			const glm::vec4& plane = m_planes[i];
+			glm::vec3 positive(plane.x >= 0.0f ? boxMax.x : boxMin.x,
+				plane.y >= 0.0f ? boxMax.y : boxMin.y,
+				plane.z >= 0.0f ? boxMax.z : boxMin.z);
+			if (glm::dot(glm::vec3(plane), positive) + plane.w < 0.0f)
+				return false;
+		}
+		return true;
+	}
+
+	// true if the box is entirely inside all six planes
+	bool ContainsAabb(const glm::vec3& boxMin, const glm::vec3& boxMax) const
+	{
+		for (unsigned int i = 0; i < FRUSTUM_PLANE_COUNT; i++)
+		{
+			// the box corner furthest against the plane normal
+			const glm::vec4& plane = m_planes[i];
+			glm::vec3 negative(plane.x >= 0.0f ? boxMin.x : boxMax.x,
+				plane.y >= 0.0f ? boxMin.y : boxMax.y,
+				plane.z >= 0.0f ? boxMin.z : boxMax.z);
+			if (glm::dot(glm::vec3(plane), negative) + plane.w < 0.0f)
+				return false;
+		}
+		return true;
+	}
+
+	// world space bounds of a transformed local space box (Arvo's method)
+	static void TransformAabb(const glm::mat4& model, const glm::vec3& localMin, const glm::vec3& localMax, glm::vec3& worldMin, glm::vec3& worldMax)
+	{
+		glm::vec3 translation(model[3]);
+		worldMin = translation;
+		worldMax = translation;
+		for (int column = 0; column < 3; column++)
+			for (int row = 0; row < 3; row++)
+			{
+				float a = model[column][row] * localMin[column];
+				float b = model[column][row] * localMax[column];
+				worldMin[row] += a < b ? a : b;
+				worldMax[row] += a < b ? b : a;
+			}
+	}
+};
+
+#endif // !FRUSTUM_H
@@ -0,0 +1,150 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+// compact G-buffer of the deferred path, 12 bytes per pixel:
+//
+//	albedoSpec	RGBA8			albedo, specular strength
+//	normal		RG16			octahedral world space normal
+//	depth		DEPTH24_STENCIL8	world positions are rebuilt from it
+//
+// the geometry pass (5.3.5.gbuffer.fs) fills it, then one fullscreen triangle runs
+// the lit shader compiled with DEFERRED_LIGHTING. That pass samples the same
+// shadow maps and walks the same clustered light lists as the forward path, so
+// the lights are effectively applied per screen tile and depth slice.
+#include <glad/glad.h>
+
+#include "shader.h"
+#include "GLStateCache.h"
+
+#include <iostream>
+
+enum RenderPath
+{
+	RENDER_PATH_FORWARD,
+	RENDER_PATH_DEFERRED
+};
+
+class GBuffer
+{
+public:
+	GBuffer()
+		: m_width(0),
+		m_height(0),
+		m_fbo(0),
+		m_albedoSpec(0),
+		m_normal(0),
+		m_depth(0),
+		m_emptyVAO(0)
+	{
+	}
+
+	static const char* PathName(RenderPath path)
+	{
+		return path == RENDER_PATH_DEFERRED ? "deferred" : "forward";
+	}
+
+	static unsigned int BytesPerPixel() { return 4 + 4 + 4; }
+
+	// (re)creates the targets when the size changed, the textures are only allocated
+	// once the deferred path is used
+	void Resize(unsigned int width, unsigned int height)
+	{
+		if (width == m_width && height == m_height)
+			return;
+		m_width = width;
+		m_height = height;
+		if (m_fbo == 0)
+		{
+			glGenFramebuffers(1, &m_fbo);
+			glGenVertexArrays(1, &m_emptyVAO);
+		}
+		DeleteTextures();
+		m_albedoSpec = CreateTarget(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+		m_normal = CreateTarget(GL_RG16, GL_RG, GL_UNSIGNED_SHORT);
+		m_depth = CreateTarget(GL_DEPTH24_STENCIL8, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8);
+
+		GLStateCache::Get().BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_albedoSpec, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, m_normal, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, m_depth, 0);
+		GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		glDrawBuffers(2, drawBuffers);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			std::cout << "ERROR::FRAMEBUFFER:: G-buffer framebuffer is not complete!" << std::endl;
+	}
+
+	void Destroy()
+	{
+		DeleteTextures();
+		glDeleteFramebuffers(1, &m_fbo);
+		glDeleteVertexArrays(1, &m_emptyVAO);
+		m_fbo = m_emptyVAO = 0;
+		m_width = m_height = 0;
+	}
+
+	// binds and clears the G-buffer for the geometry pass
+	void BeginGeometryPass()
+	{
+		GLStateCache& state = GLStateCache::Get();
+		state.BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		state.Viewport(0, 0, m_width, m_height);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	}
+
+	// binds the G-buffer textures to firstUnit.. firstUnit + 2 for the lighting pass
+	void BindForLighting(Shader& shader, unsigned int firstUnit)
+	{
+		GLStateCache& state = GLStateCache::Get();
+		shader.setInt("gAlbedoSpec", (int)firstUnit);
+		shader.setInt("gNormal", (int)firstUnit + 1);
+		shader.setInt("gDepth", (int)firstUnit + 2);
+		state.BindTexture(firstUnit, GL_TEXTURE_2D, m_albedoSpec);
+		state.BindTexture(firstUnit + 1, GL_TEXTURE_2D, m_normal);
+		state.BindTexture(firstUnit + 2, GL_TEXTURE_2D, m_depth);
+	}
+
+	// the fullscreen lighting triangle, into whatever framebuffer is bound
+	void DrawLightingPass()
+	{
+		GLStateCache& state = GLStateCache::Get();
+		state.Disable(GL_DEPTH_TEST);
+		state.BindVertexArray(m_emptyVAO);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		state.CountDrawCall();
+		state.Enable(GL_DEPTH_TEST);
+	}
+
+private:
+	unsigned int m_width, m_height;
+	GLuint m_fbo;
+	GLuint m_albedoSpec;
+	GLuint m_normal;
+	GLuint m_depth;
+	GLuint m_emptyVAO;	// the fullscreen triangle is generated from gl_VertexID
+
+	GLuint CreateTarget(GLenum internalFormat, GLenum format, GLenum type)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		GLStateCache::Get().BindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, m_width, m_height, 0, format, type, NULL);
+		// the lighting pass reads exactly one texel per pixel
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		return texture;
+	}
+
+	void DeleteTextures()
+	{
+		GLStateCache& state = GLStateCache::Get();
+		GLuint textures[3] = { m_albedoSpec, m_normal, m_depth };
+		for (unsigned int i = 0; i < 3; i++)
+			state.ForgetTexture(textures[i]);
+		glDeleteTextures(3, textures);
+		m_albedoSpec = m_normal = m_depth = 0;
+	}
+};
+
+#endif // !GBUFFER_H
@@ -0,0 +1,134 @@
+#ifndef GLCOMMANDREPLAY_H
+#define GLCOMMANDREPLAY_H
+
+// replays recorded CommandBuffers on the GL thread, in order. Program, vertex
+// array and texture binds go through GLStateCache, which drops the redundant ones;
+// buffer range bindings are tracked here, per binding point, between Reset()s.
+// CMD_OCCLUSION_TEST groups are handed to OcclusionQueries when one is given
+// (their replay may then happen in its Flush()), and drawn directly otherwise.
+#include <glad/glad.h>
+
+#include "CommandBuffer.h"
+#include "GLStateCache.h"
+#include "OcclusionQueries.h"
+
+// uniform buffer binding points whose bound range is tracked
+const unsigned int GLCOMMANDREPLAY_RANGE_BINDINGS = 8;
+
+class GLCommandReplay
+{
+public:
+	// counters since the last Reset()
+	struct Stats
+	{
+		unsigned int commands;			// replayed
+		unsigned int rangesFiltered;	// buffer range binds that were already current
+	};
+	Stats m_stats;
+
+	GLCommandReplay()
+	{
+		Reset();
+	}
+
+	// forgets the tracked buffer ranges, call when anything else may have bound some
+	void Reset()
+	{
+		for (unsigned int i = 0; i < GLCOMMANDREPLAY_RANGE_BINDINGS; i++)
+			m_ranges[i].buffer = 0;
+		m_stats.commands = 0;
+		m_stats.rangesFiltered = 0;
+	}
+
+	// the buffer must stay unchanged until occlusion->Flush() if occlusion is given
+	void Replay(const CommandBuffer& buffer, OcclusionQueries* occlusion = NULL)
+	{
+		Replay(buffer, 0, buffer.Size(), occlusion);
+	}
+
+private:
+	struct Range
+	{
+		GLuint buffer;
+		uint32_t offset, size;
+	};
+	Range m_ranges[GLCOMMANDREPLAY_RANGE_BINDINGS];
+
+	void Replay(const CommandBuffer& buffer, size_t begin, size_t end, OcclusionQueries* occlusion)
+	{
+		GLStateCache& state = GLStateCache::Get();
+		for (size_t i = begin; i < end; i++)
+		{
+			const Command& command = buffer[i];
+			m_stats.commands++;
+			switch (command.type)
+			{
+			case CMD_USE_PROGRAM:
+				state.UseProgram(command.useProgram.program);
+				break;
+			case CMD_BIND_VERTEX_ARRAY:
+				state.BindVertexArray(command.bindVertexArray.vertexArray);
+				break;
+			case CMD_BIND_TEXTURE:
+				state.BindTexture(command.bindTexture.unit, command.bindTexture.target, command.bindTexture.texture);
+				break;
+			case CMD_BIND_BUFFER_RANGE:
+				BindBufferRange(command);
+				break;
+			case CMD_UNIFORM_INT:
+				glUniform1i(command.uniformInt.location, command.uniformInt.value);
+				break;
+			case CMD_UNIFORM_MAT4:
+				glUniformMatrix4fv(command.uniformMat4.location, 1, GL_FALSE, reinterpret_cast<const float*>(buffer.Payload(command.uniformMat4.payload)));
+				break;
+			case CMD_DRAW:
+				if (command.draw.instances > 1)
+					glDrawArraysInstanced(command.draw.primitive, command.draw.first, command.draw.count, command.draw.instances);
+				else
+					glDrawArrays(command.draw.primitive, command.draw.first, command.draw.count);
+				state.CountDrawCall();
+				break;
+			case CMD_DRAW_INDEXED:
+				if (command.draw.instances > 1)
+					glDrawElementsInstanced(command.draw.primitive, command.draw.count, GL_UNSIGNED_INT, 0, command.draw.instances);
+				else
+					glDrawElements(command.draw.primitive, command.draw.count, GL_UNSIGNED_INT, 0);
+				state.CountDrawCall();
+				break;
+			case CMD_OCCLUSION_TEST:
+			{
+				size_t first = i + 1, last = first + command.occlusionTest.commands;
+				if (occlusion)
+				{
+					const float* bounds = reinterpret_cast<const float*>(buffer.Payload(command.occlusionTest.payload));
+					const CommandBuffer* source = &buffer;
+					occlusion->Draw(command.occlusionTest.id, glm::vec3(bounds[0], bounds[1], bounds[2]), glm::vec3(bounds[3], bounds[4], bounds[5]),
+						[this, source, first, last] { Replay(*source, first, last, NULL); });
+					i = last - 1;
+				}
+				break;
+			}
+			}
+		}
+	}
+
+	void BindBufferRange(const Command& command)
+	{
+		uint32_t index = command.bindBufferRange.index;
+		if (command.bindBufferRange.target == GL_UNIFORM_BUFFER && index < GLCOMMANDREPLAY_RANGE_BINDINGS)
+		{
+			Range& range = m_ranges[index];
+			if (range.buffer == command.bindBufferRange.buffer && range.offset == command.bindBufferRange.offset && range.size == command.bindBufferRange.size)
+			{
+				m_stats.rangesFiltered++;
+				return;
+			}
+			range.buffer = command.bindBufferRange.buffer;
+			range.offset = command.bindBufferRange.offset;
+			range.size = command.bindBufferRange.size;
+		}
+		glBindBufferRange(command.bindBufferRange.target, index, command.bindBufferRange.buffer, command.bindBufferRange.offset, command.bindBufferRange.size);
+	}
+};
+
+#endif // !GLCOMMANDREPLAY_H
@@ -0,0 +1,312 @@
+#ifndef GLSTATECACHE_H
+#define GLSTATECACHE_H
+
+// thin shadow copy of the GL state we touch every frame. Every bind/set goes
+// through here first and is only forwarded to the driver when it would actually
+// change something. Anything that changes GL state behind the cache's back must
+// call Invalidate() afterwards.
+#include <glad/glad.h>
+
+// texture units tracked by the cache (GL 3.3 guarantees at least 16 per stage)
+const unsigned int STATECACHE_MAX_TEXTURE_UNITS = 32;
+
+class GLStateCache
+{
+public:
+	// per-frame call counters
+	struct FrameStats
+	{
+		unsigned int issued;	// calls forwarded to GL
+		unsigned int filtered;	// redundant calls dropped by the cache
+		unsigned int drawCalls;	// draw calls reported through CountDrawCall()
+	};
+
+	// the one cache for the (single) GL context
+	static GLStateCache& Get()
+	{
+		static GLStateCache instance;
+		return instance;
+	}
+
+	// forget everything we know, the next call of each kind always reaches GL
+	void Invalidate()
+	{
+		m_program = UNKNOWN;
+		m_vertexArray = UNKNOWN;
+		m_activeUnit = UNKNOWN;
+		for (unsigned int unit = 0; unit < STATECACHE_MAX_TEXTURE_UNITS; unit++)
+			for (unsigned int slot = 0; slot < TARGET_COUNT; slot++)
+				m_textures[unit][slot] = UNKNOWN;
+		m_drawFramebuffer = UNKNOWN;
+		m_readFramebuffer = UNKNOWN;
+		m_viewportValid = false;
+		for (unsigned int i = 0; i < CAP_COUNT; i++)
+			m_caps[i] = CAP_UNKNOWN;
+		m_depthFunc = UNKNOWN;
+		m_depthMask = CAP_UNKNOWN;
+		m_blendSrc = UNKNOWN;
+		m_blendDst = UNKNOWN;
+	}
+
+	// call once at the top of every frame: the counters of the frame that just
+	// finished are kept in LastFrame()
+	void NewFrame()
+	{
+		m_lastFrame = m_frame;
+		m_frame.issued = 0;
+		m_frame.filtered = 0;
+		m_frame.drawCalls = 0;
+	}
+
+	// draws aren't state, but the cache is where the per-frame GL numbers live
+	void CountDrawCall() { m_frame.drawCalls++; }
+
+	const FrameStats& LastFrame() const { return m_lastFrame; }
+	const FrameStats& CurrentFrame() const { return m_frame; }
+
+	// program
+	// ------------------------------------------------------------------------
+	void UseProgram(GLuint program)
+	{
+		if (!Changed(m_program, program))
+			return;
+		glUseProgram(program);
+	}
+	GLuint CurrentProgram() const { return m_program; }
+
+	// vertex array
+	// ------------------------------------------------------------------------
+	void BindVertexArray(GLuint vao)
+	{
+		if (!Changed(m_vertexArray, vao))
+			return;
+		glBindVertexArray(vao);
+	}
+
+	// textures: binding to a unit only switches the active unit when needed
+	// ------------------------------------------------------------------------
+	void ActiveTexture(unsigned int unit)
+	{
+		if (!Changed(m_activeUnit, unit))
+			return;
+		glActiveTexture(GL_TEXTURE0 + unit);
+	}
+
+	void BindTexture(unsigned int unit, GLenum target, GLuint texture)
+	{
+		int slot = TargetSlot(target);
+		if (unit >= STATECACHE_MAX_TEXTURE_UNITS || slot < 0)
+		{
+			// not tracked, pass straight through and forget the active unit
+			glActiveTexture(GL_TEXTURE0 + unit);
+			glBindTexture(target, texture);
+			m_activeUnit = unit;
+			m_frame.issued += 2;
+			return;
+		}
+		if (m_textures[unit][slot] == texture)
+		{
+			m_frame.filtered++;
+			return;
+		}
+		ActiveTexture(unit);
+		glBindTexture(target, texture);
+		m_textures[unit][slot] = texture;
+		m_frame.issued++;
+	}
+
+	// bind a texture for editing (upload, parameters) on the currently active unit
+	void BindTexture(GLenum target, GLuint texture)
+	{
+		BindTexture(m_activeUnit == UNKNOWN ? 0 : m_activeUnit, target, texture);
+	}
+
+	// a deleted texture is silently unbound by GL, keep the cache in sync
+	void ForgetTexture(GLuint texture)
+	{
+		for (unsigned int unit = 0; unit < STATECACHE_MAX_TEXTURE_UNITS; unit++)
+			for (unsigned int slot = 0; slot < TARGET_COUNT; slot++)
+				if (m_textures[unit][slot] == texture)
+					m_textures[unit][slot] = 0;
+	}
+
+	// framebuffer
+	// ------------------------------------------------------------------------
+	void BindFramebuffer(GLenum target, GLuint fbo)
+	{
+		if (target == GL_FRAMEBUFFER)
+		{
+			if (m_drawFramebuffer == fbo && m_readFramebuffer == fbo)
+			{
+				m_frame.filtered++;
+				return;
+			}
+			m_drawFramebuffer = fbo;
+			m_readFramebuffer = fbo;
+		}
+		else if (target == GL_DRAW_FRAMEBUFFER)
+		{
+			if (!Changed(m_drawFramebuffer, fbo))
+				return;
+			glBindFramebuffer(target, fbo);
+			return;
+		}
+		else
+		{
+			if (!Changed(m_readFramebuffer, fbo))
+				return;
+			glBindFramebuffer(target, fbo);
+			return;
+		}
+		glBindFramebuffer(target, fbo);
+		m_frame.issued++;
+	}
+
+	// viewport
+	// ------------------------------------------------------------------------
+	void Viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+	{
+		if (m_viewportValid && m_viewport[0] == x && m_viewport[1] == y && m_viewport[2] == width && m_viewport[3] == height)
+		{
+			m_frame.filtered++;
+			return;
+		}
+		m_viewport[0] = x;
+		m_viewport[1] = y;
+		m_viewport[2] = width;
+		m_viewport[3] = height;
+		m_viewportValid = true;
+		glViewport(x, y, width, height);
+		m_frame.issued++;
+	}
+
+	// blend/depth state
+	// ------------------------------------------------------------------------
+	void Enable(GLenum cap) { SetCapability(cap, true); }
+	void Disable(GLenum cap) { SetCapability(cap, false); }
+
+	void SetCapability(GLenum cap, bool enabled)
+	{
+		int slot = CapabilitySlot(cap);
+		int wanted = enabled ? CAP_ON : CAP_OFF;
+		if (slot >= 0)
+		{
+			if (m_caps[slot] == wanted)
+			{
+				m_frame.filtered++;
+				return;
+			}
+			m_caps[slot] = wanted;
+		}
+		if (enabled)
+			glEnable(cap);
+		else
+			glDisable(cap);
+		m_frame.issued++;
+	}
+
+	void DepthFunc(GLenum func)
+	{
+		if (!Changed(m_depthFunc, func))
+			return;
+		glDepthFunc(func);
+	}
+
+	void DepthMask(bool write)
+	{
+		int wanted = write ? CAP_ON : CAP_OFF;
+		if (m_depthMask == wanted)
+		{
+			m_frame.filtered++;
+			return;
+		}
+		m_depthMask = wanted;
+		glDepthMask(write ? GL_TRUE : GL_FALSE);
+		m_frame.issued++;
+	}
+
+	void BlendFunc(GLenum src, GLenum dst)
+	{
+		if (m_blendSrc == src && m_blendDst == dst)
+		{
+			m_frame.filtered++;
+			return;
+		}
+		m_blendSrc = src;
+		m_blendDst = dst;
+		glBlendFunc(src, dst);
+		m_frame.issued++;
+	}
+
+private:
+	static const GLuint UNKNOWN = 0xFFFFFFFFu;
+	enum { CAP_UNKNOWN = -1, CAP_OFF = 0, CAP_ON = 1 };
+	enum { TARGET_2D, TARGET_2D_ARRAY, TARGET_CUBE_MAP, TARGET_BUFFER, TARGET_COUNT };
+	enum { CAP_DEPTH_TEST, CAP_BLEND, CAP_CULL_FACE, CAP_DEPTH_CLAMP, CAP_SCISSOR_TEST, CAP_COUNT };
+
+	GLuint m_program;
+	GLuint m_vertexArray;
+	GLuint m_activeUnit;
+	GLuint m_textures[STATECACHE_MAX_TEXTURE_UNITS][TARGET_COUNT];
+	GLuint m_drawFramebuffer;
+	GLuint m_readFramebuffer;
+	GLint m_viewport[4];
+	bool m_viewportValid;
+	int m_caps[CAP_COUNT];
+	GLenum m_depthFunc;
+	int m_depthMask;
+	GLenum m_blendSrc;
+	GLenum m_blendDst;
+
+	FrameStats m_frame;
+	FrameStats m_lastFrame;
+
+	GLStateCache()
+	{
+		Invalidate();
+		m_frame.issued = m_frame.filtered = m_frame.drawCalls = 0;
+		m_lastFrame = m_frame;
+	}
+	GLStateCache(const GLStateCache&) = delete;
+	GLStateCache& operator=(const GLStateCache&) = delete;
+
+	// updates the cached value and counts the call, returns whether GL needs it
+	bool Changed(GLuint& cached, GLuint wanted)
+	{
+		if (cached == wanted)
+		{
+			m_frame.filtered++;
+			return false;
+		}
+		cached = wanted;
+		m_frame.issued++;
+		return true;
+	}
+
+	static int TargetSlot(GLenum target)
+	{
+		switch (target)
+		{
+		case GL_TEXTURE_2D: return TARGET_2D;
+		case GL_TEXTURE_2D_ARRAY: return TARGET_2D_ARRAY;
+		case GL_TEXTURE_CUBE_MAP: return TARGET_CUBE_MAP;
+		case GL_TEXTURE_BUFFER: return TARGET_BUFFER;
+		default: return -1;
+		}
+	}
+
+	static int CapabilitySlot(GLenum cap)
+	{
+		switch (cap)
+		{
+		case GL_DEPTH_TEST: return CAP_DEPTH_TEST;
+		case GL_BLEND: return CAP_BLEND;
+		case GL_CULL_FACE: return CAP_CULL_FACE;
+		case GL_DEPTH_CLAMP: return CAP_DEPTH_CLAMP;
+		case GL_SCISSOR_TEST: return CAP_SCISSOR_TEST;
+		default: return -1;
+		}
+	}
+};
+
+#endif // !GLSTATECACHE_H
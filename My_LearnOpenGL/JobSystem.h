@@ -0,0 +1,518 @@
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+// work-stealing job scheduler shared by everything that runs on more than one
+// thread (light binning, occlusion rasterization, transform updates, ...). There is
+// one worker per hardware thread besides the main thread, and every thread (the
+// main thread included) owns a Chase-Lev deque: it pushes and pops its own jobs at
+// the bottom, idle threads steal the oldest ones from the top of someone else's.
+//
+// a job is a function pointer, a data pointer and an index range. JobCounter counts
+// a batch of jobs down to zero; Wait() on it runs other jobs in the meantime instead
+// of blocking, and a job may be given a counter to depend on, it is only queued once
+// that counter reached zero. ParallelFor() cuts a range into jobs of grain indices.
+//
+// GL calls must stay on the thread owning the context: RunOnMainThread() queues a
+// job that only the main thread runs, in RunMainThreadJobs() or while it Wait()s.
+//
+// with no worker threads (one core) everything runs inline on the calling thread.
+#include "Profiler.h"
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <cstdint>
+#include <algorithm>
+
+// jobs per deque, a full deque runs new jobs inline
+const unsigned int JOBSYSTEM_DEQUE_SIZE = 4096;
+// upper bound for the worker threads
+const unsigned int JOBSYSTEM_MAX_WORKERS = 15;
+// failed attempts to find a job before a worker goes to sleep
+const unsigned int JOBSYSTEM_SPINS = 64;
+
+// runs indices [begin, end) of whatever data points to
+typedef void (*JobFunction)(void* data, unsigned int begin, unsigned int end);
+
+struct Job
+{
+	JobFunction function;
+	void* data;
+	unsigned int begin, end;
+	class JobCounter* counter;	// decremented when the job is done, may be NULL
+	const char* name;			// profiler zone, may be NULL
+};
+
+// number of unfinished jobs of a batch. It must outlive the jobs counting on it and
+// the jobs depending on it.
+class JobCounter
+{
+public:
+	JobCounter() : m_pending(0) {}
+
+	bool Done() const { return m_pending.load(std::memory_order_acquire) == 0; }
+
+private:
+	friend class JobSystem;
+	std::atomic<unsigned int> m_pending;
+
+	JobCounter(const JobCounter&);
+	JobCounter& operator=(const JobCounter&);
+};
+
+class JobSystem
+{
+public:
+	// per thread, index 0 is the main thread
+	struct ThreadStats
+	{
+		unsigned int jobs;			// executed
+		unsigned int steals;		// of those, taken from another thread
+		double busyMs;				// spent running jobs
+	};
+	// statistics of the last frame (between the last two NewFrame()s)
+	struct Stats
+	{
+		unsigned int jobs;
+		unsigned int steals;
+		unsigned int mainThreadJobs;	// RunOnMainThread() jobs
+		double frameMs;
+		double utilization;			// worker busy time / (workers * frame time), 0 without workers
+	};
+	Stats m_stats;
+	std::vector<ThreadStats> m_threadStats;
+
+	static JobSystem& Get()
+	{
+		static JobSystem instance;
+		return instance;
+	}
+
+	// starts the workers (0 = one less than the hardware threads). The calling thread
+	// becomes the main thread.
+	void Init(unsigned int workerCount = 0)
+	{
+		if (!m_threads.empty())
+			return;
+		if (workerCount == 0)
+		{
+			unsigned int hardware = std::thread::hardware_concurrency();
+			workerCount = hardware > 1 ? hardware - 1 : 0;
+		}
+		workerCount = std::min(workerCount, JOBSYSTEM_MAX_WORKERS);
+		m_stop = false;
+		m_threads.resize(workerCount + 1);
+		for (unsigned int i = 0; i <= workerCount; i++)
+			m_threads[i] = new ThreadData();
+		m_threadStats.assign(workerCount + 1, ThreadStats());
+		CurrentIndex() = 0;
+		m_frameStart = std::chrono::steady_clock::now();
+		for (unsigned int i = 1; i <= workerCount; i++)
+			m_workers.push_back(std::thread(&JobSystem::WorkerLoop, this, i));
+	}
+
+	// stops the workers, queued jobs are run first
+	void Shutdown()
+	{
+		if (m_threads.empty())
+			return;
+		RunMainThreadJobs();
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (unsigned int i = 0; i < m_workers.size(); i++)
+			m_workers[i].join();
+		m_workers.clear();
+		// jobs the workers left behind
+		while (RunOne(0))
+			;
+		for (unsigned int i = 0; i < m_threads.size(); i++)
+			delete m_threads[i];
+		m_threads.clear();
+	}
+
+	unsigned int WorkerCount() const { return (unsigned int)m_workers.size(); }
+
+	// queues a job over [begin, end). counter (if any) counts it until it is done,
+	// dependency (if any) has to reach zero before it may start.
+	void Run(JobFunction function, void* data, unsigned int begin, unsigned int end, JobCounter* counter = NULL,
+		const JobCounter* dependency = NULL, const char* name = NULL)
+	{
+		Job job = { function, data, begin, end, counter, name };
+		if (counter)
+			counter->m_pending.fetch_add(1, std::memory_order_relaxed);
+		if (dependency && Defer(job, dependency))
+			return;
+		Schedule(job);
+	}
+
+	// a job only the main thread runs (GL uploads and the like)
+	void RunOnMainThread(JobFunction function, void* data, unsigned int begin, unsigned int end, JobCounter* counter = NULL,
+		const char* name = NULL)
+	{
+		Job job = { function, data, begin, end, counter, name };
+		if (counter)
+			counter->m_pending.fetch_add(1, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(m_mainMutex);
+		m_mainJobs.push_back(job);
+	}
+
+	// queues [0, count) in jobs of grain indices (0 = about four jobs per thread)
+	void ParallelFor(unsigned int count, unsigned int grain, JobFunction function, void* data, JobCounter& counter,
+		const JobCounter* dependency = NULL, const char* name = NULL)
+	{
+		grain = Grain(count, grain);
+		for (unsigned int begin = 0; begin < count; begin += grain)
+			Run(function, data, begin, std::min(count, begin + grain), &counter, dependency, name);
+	}
+
+	// function(begin, end) over [0, count) in jobs of grain indices, returns when all ran
+	template <typename Function>
+	void ParallelFor(unsigned int count, unsigned int grain, const Function& function, const char* name = NULL)
+	{
+		if (count == 0)
+			return;
+		if (m_workers.empty() || count <= Grain(count, grain))
+		{
+			function(0u, count);
+			return;
+		}
+		JobCounter counter;
+		ParallelFor(count, grain, &CallRange<Function>, const_cast<Function*>(&function), counter, NULL, name);
+		Wait(counter);
+	}
+
+	// runs jobs until counter is done; on the main thread (or before Init()) that
+	// includes the main thread jobs
+	void Wait(const JobCounter& counter)
+	{
+		int index = CurrentIndex();
+		bool mainThread = index == 0 || m_threads.empty();
+		unsigned int idle = 0;
+		while (!counter.Done())
+		{
+			if ((mainThread && RunMainThreadJob()) || (index >= 0 && RunOne((unsigned int)index)))
+				idle = 0;
+			else if (++idle > JOBSYSTEM_SPINS)
+				std::this_thread::yield();
+		}
+	}
+
+	// main thread, once per frame: runs the queued main thread jobs
+	void RunMainThreadJobs()
+	{
+		while (RunMainThreadJob())
+			;
+	}
+
+	// main thread, once per frame: moves the counters of the frame into m_stats
+	void NewFrame()
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		m_stats.frameMs = std::chrono::duration<double, std::milli>(now - m_frameStart).count();
+		m_frameStart = now;
+		m_stats.jobs = m_stats.steals = 0;
+		m_stats.mainThreadJobs = m_mainThreadJobs.exchange(0);
+		double workerBusyMs = 0.0;
+		for (unsigned int i = 0; i < m_threads.size(); i++)
+		{
+			ThreadData& thread = *m_threads[i];
+			ThreadStats& stats = m_threadStats[i];
+			stats.jobs = thread.jobs.exchange(0);
+			stats.steals = thread.steals.exchange(0);
+			stats.busyMs = thread.busyMicros.exchange(0) / 1000.0;
+			m_stats.jobs += stats.jobs;
+			m_stats.steals += stats.steals;
+			if (i > 0)
+				workerBusyMs += stats.busyMs;
+		}
+		m_stats.utilization = m_workers.empty() || m_stats.frameMs <= 0.0 ? 0.0 : workerBusyMs / (m_workers.size() * m_stats.frameMs);
+	}
+
+private:
+	// Chase-Lev deque with a fixed ring of jobs. The owner pushes and pops at the
+	// bottom, thieves take from the top; the last job is raced for with a CAS on top.
+	// A thief may copy a slot the owner is refilling, its CAS fails then and the copy
+	// is dropped.
+	class Deque
+	{
+	public:
+		Deque() : m_top(0), m_bottom(0) {}
+
+		// owner only, false if full
+		bool Push(const Job& job)
+		{
+			int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+			int64_t top = m_top.load(std::memory_order_acquire);
+			if (bottom - top >= (int64_t)JOBSYSTEM_DEQUE_SIZE)
+				return false;
+			m_jobs[bottom & (JOBSYSTEM_DEQUE_SIZE - 1)] = job;
+			std::atomic_thread_fence(std::memory_order_release);
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+		// owner only, newest job first
+		bool Pop(Job& job)
+		{
+			int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+			m_bottom.store(bottom, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t top = m_top.load(std::memory_order_relaxed);
+			if (top > bottom)
+			{
+				m_bottom.store(bottom + 1, std::memory_order_relaxed);
+				return false;
+			}
+			job = m_jobs[bottom & (JOBSYSTEM_DEQUE_SIZE - 1)];
+			if (top < bottom)
+				return true;
+			// the last job, a thief may be after it too
+			bool won = m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
+			return won;
+		}
+
+		// any thread, oldest job first
+		bool Steal(Job& job)
+		{
+			int64_t top = m_top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t bottom = m_bottom.load(std::memory_order_acquire);
+			if (top >= bottom)
+				return false;
+			job = m_jobs[top & (JOBSYSTEM_DEQUE_SIZE - 1)];
+			return m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<int64_t> m_top;
+		std::atomic<int64_t> m_bottom;
+		Job m_jobs[JOBSYSTEM_DEQUE_SIZE];
+	};
+
+	struct ThreadData
+	{
+		Deque deque;
+		std::atomic<unsigned int> jobs;
+		std::atomic<unsigned int> steals;
+		std::atomic<uint64_t> busyMicros;
+		unsigned int victim;		// where the last steal attempt started
+
+		ThreadData() : jobs(0), steals(0), busyMicros(0), victim(0) {}
+	};
+
+	std::vector<ThreadData*> m_threads;
+	std::vector<std::thread> m_workers;
+	std::chrono::steady_clock::time_point m_frameStart;
+
+	// jobs sitting in the deques, sleeping workers wait for this to become non zero
+	std::atomic<int> m_queued;
+	std::atomic<unsigned int> m_sleeping;
+	std::mutex m_sleepMutex;
+	std::condition_variable m_wake;
+	bool m_stop;
+
+	std::mutex m_mainMutex;
+	std::vector<Job> m_mainJobs;
+	std::atomic<unsigned int> m_mainThreadJobs;
+
+	// jobs waiting for their dependency
+	struct DeferredJob
+	{
+		Job job;
+		const JobCounter* dependency;
+	};
+	std::mutex m_deferredMutex;
+	std::vector<DeferredJob> m_deferred;
+	std::atomic<unsigned int> m_deferredCount;
+
+	JobSystem() : m_queued(0), m_sleeping(0), m_stop(false), m_mainThreadJobs(0), m_deferredCount(0)
+	{
+		m_stats.jobs = m_stats.steals = m_stats.mainThreadJobs = 0;
+		m_stats.frameMs = m_stats.utilization = 0.0;
+	}
+
+	~JobSystem()
+	{
+		Shutdown();
+	}
+
+	// index of the calling thread, -1 for threads the job system doesn't know
+	static int& CurrentIndex()
+	{
+		static thread_local int index = -1;
+		return index;
+	}
+
+	template <typename Function>
+	static void CallRange(void* data, unsigned int begin, unsigned int end)
+	{
+		(*static_cast<const Function*>(data))(begin, end);
+	}
+
+	unsigned int Grain(unsigned int count, unsigned int grain) const
+	{
+		// before Init() there are no threads yet, the calling one runs everything
+		unsigned int threads = std::max(1u, (unsigned int)m_threads.size());
+		if (grain == 0)
+			grain = count / (threads * 4) + 1;
+		// keep the jobs of one call well inside a deque
+		return std::max(grain, count / (JOBSYSTEM_DEQUE_SIZE / 4) + 1);
+	}
+
+	// pushes the job to the calling thread's deque and wakes a worker
+	void Schedule(const Job& job)
+	{
+		int index = CurrentIndex();
+		if (index < 0 || m_threads.empty() || m_workers.empty() || !m_threads[index]->deque.Push(job))
+		{
+			if (index < 0 && !m_threads.empty())
+				std::cout << "ERROR::JOBSYSTEM::UNKNOWN_THREAD, running the job inline" << std::endl;
+			Execute(job, index < 0 || m_threads.empty() ? NULL : m_threads[index]);
+			return;
+		}
+		m_queued.fetch_add(1);
+		if (m_sleeping.load() > 0)
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			m_wake.notify_one();
+		}
+	}
+
+	// true if the job was parked until dependency is done
+	bool Defer(const Job& job, const JobCounter* dependency)
+	{
+		// count first, so a job finishing the dependency right now either sees the
+		// count or is seen here as done
+		std::lock_guard<std::mutex> lock(m_deferredMutex);
+		m_deferredCount++;
+		if (dependency->m_pending.load() == 0)
+		{
+			m_deferredCount--;
+			return false;
+		}
+		DeferredJob deferred = { job, dependency };
+		m_deferred.push_back(deferred);
+		return true;
+	}
+
+	// schedules the parked jobs whose dependency is done (a counter just reached zero)
+	void ReleaseDeferred()
+	{
+		std::vector<Job> ready;
+		{
+			std::lock_guard<std::mutex> lock(m_deferredMutex);
+			for (unsigned int i = 0; i < m_deferred.size();)
+			{
+				if (!m_deferred[i].dependency->Done())
+				{
+					i++;
+					continue;
+				}
+				ready.push_back(m_deferred[i].job);
+				m_deferred[i] = m_deferred.back();
+				m_deferred.pop_back();
+				m_deferredCount--;
+			}
+		}
+		for (unsigned int i = 0; i < ready.size(); i++)
+			Schedule(ready[i]);
+	}
+
+	void Execute(const Job& job, ThreadData* thread)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (job.name)
+			Profiler::Get().BeginZone(job.name);
+		job.function(job.data, job.begin, job.end);
+		if (job.name)
+			Profiler::Get().EndZone();
+		if (thread)
+		{
+			thread->jobs.fetch_add(1, std::memory_order_relaxed);
+			thread->busyMicros.fetch_add((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count(),
+				std::memory_order_relaxed);
+		}
+		// the job must not touch its counter once it was counted down
+		if (job.counter && job.counter->m_pending.fetch_sub(1) == 1 && m_deferredCount.load() > 0)
+			ReleaseDeferred();
+	}
+
+	// one job of the own deque, else one stolen from another thread
+	bool RunOne(unsigned int index)
+	{
+		if (index >= m_threads.size())
+			return false;
+		ThreadData& thread = *m_threads[index];
+		Job job;
+		if (thread.deque.Pop(job))
+		{
+			m_queued.fetch_sub(1);
+			Execute(job, &thread);
+			return true;
+		}
+		unsigned int count = (unsigned int)m_threads.size();
+		for (unsigned int i = 0; i < count; i++)
+		{
+			unsigned int victim = (thread.victim + i) % count;
+			if (victim == index || !m_threads[victim]->deque.Steal(job))
+				continue;
+			thread.victim = victim;
+			m_queued.fetch_sub(1);
+			thread.steals.fetch_add(1, std::memory_order_relaxed);
+			Execute(job, &thread);
+			return true;
+		}
+		return false;
+	}
+
+	bool RunMainThreadJob()
+	{
+		Job job;
+		{
+			std::lock_guard<std::mutex> lock(m_mainMutex);
+			if (m_mainJobs.empty())
+				return false;
+			job = m_mainJobs.front();
+			m_mainJobs.erase(m_mainJobs.begin());
+		}
+		m_mainThreadJobs++;
+		Execute(job, m_threads.empty() ? NULL : m_threads[0]);
+		return true;
+	}
+
+	void WorkerLoop(unsigned int index)
+	{
+		CurrentIndex() = (int)index;
+		unsigned int idle = 0;
+		for (;;)
+		{
+			if (RunOne(index))
+			{
+				idle = 0;
+				continue;
+			}
+			if (++idle < JOBSYSTEM_SPINS)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(m_sleepMutex);
+			if (m_stop)
+				return;
+			m_sleeping++;
+			m_wake.wait(lock, [this] { return m_stop || m_queued.load() > 0; });
+			m_sleeping--;
+			idle = 0;
+		}
+	}
+};
+
+#endif // !JOBSYSTEM_H
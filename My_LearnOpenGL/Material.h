@@ -0,0 +1,141 @@
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+// a material is resolved once when a mesh is imported: every texture gets a
+// type enum and a fixed texture unit, so drawing only binds texture ids to
+// units. The sampler names of the shaders (texture_diffuseN, texture_specularN,
+// ...) always map to the same units, which is set up once per program.
+#include <glad/glad.h>
+
+#include "shader.h"
+#include "GLStateCache.h"
+
+#include <string>
+#include <vector>
+
+enum TextureType
+{
+	TEXTURE_DIFFUSE,
+	TEXTURE_SPECULAR,
+	TEXTURE_NORMAL,
+	TEXTURE_HEIGHT,
+	TEXTURE_TYPE_COUNT
+};
+
+// samplers of each type a material can use (texture_diffuse1..N),
+// the units are laid out as type * MATERIAL_SAMPLERS_PER_TYPE + (N - 1)
+const unsigned int MATERIAL_SAMPLERS_PER_TYPE = 4;
+const unsigned int MATERIAL_TEXTURE_UNITS = TEXTURE_TYPE_COUNT * MATERIAL_SAMPLERS_PER_TYPE;
+
+// sampler name prefixes, in TextureType order
+static const char* const MATERIAL_SAMPLER_NAMES[TEXTURE_TYPE_COUNT] =
+{
+	"texture_diffuse",
+	"texture_specular",
+	"texture_normal",
+	"texture_height"
+};
+
+class Material
+{
+public:
+	// a resolved texture binding
+	struct Binding
+	{
+		TextureType type;
+		unsigned int unit;
+		unsigned int texture;
+	};
+
+	// unique id, used as the material part of render queue sort keys
+	unsigned int id;
+	std::vector<Binding> bindings;
+
+	Material() : id(NextId()) {}
+
+	// appends a texture of the given type, returns false when all samplers of that type are taken
+	bool AddTexture(TextureType type, unsigned int texture)
+	{
+		unsigned int count = 0;
+		for (unsigned int i = 0; i < bindings.size(); i++)
+			if (bindings[i].type == type)
+				count++;
+		if (count >= MATERIAL_SAMPLERS_PER_TYPE)
+			return false;
+
+		Binding binding;
+		binding.type = type;
+		binding.unit = type * MATERIAL_SAMPLERS_PER_TYPE + count;
+		binding.texture = texture;
+		bindings.push_back(binding);
+		return true;
+	}
+
+	// binds all textures to their units
+	void Bind() const
+	{
+		GLStateCache& state = GLStateCache::Get();
+		for (unsigned int i = 0; i < bindings.size(); i++)
+			state.BindTexture(bindings[i].unit, GL_TEXTURE_2D, bindings[i].texture);
+	}
+
+	// first texture of the given type, 0 if there is none
+	unsigned int FindTexture(TextureType type) const
+	{
+		for (unsigned int i = 0; i < bindings.size(); i++)
+			if (bindings[i].type == type)
+				return bindings[i].texture;
+		return 0;
+	}
+
+	// maps the texture type strings used by the model loader to the enum
+	static bool TypeFromName(const std::string& name, TextureType& type)
+	{
+		for (unsigned int i = 0; i < TEXTURE_TYPE_COUNT; i++)
+		{
+			if (name == MATERIAL_SAMPLER_NAMES[i])
+			{
+				type = (TextureType)i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// points the material samplers of the shader (which must be in use) at their fixed units.
+	// only the first call per program does any work, later calls are a short integer search.
+	static void PrepareProgram(const Shader& shader)
+	{
+		std::vector<unsigned int>& prepared = PreparedPrograms();
+		for (unsigned int i = 0; i < prepared.size(); i++)
+			if (prepared[i] == shader.ID)
+				return;
+		prepared.push_back(shader.ID);
+
+		for (unsigned int type = 0; type < TEXTURE_TYPE_COUNT; type++)
+		{
+			for (unsigned int n = 0; n < MATERIAL_SAMPLERS_PER_TYPE; n++)
+			{
+				std::string name = MATERIAL_SAMPLER_NAMES[type] + std::to_string(n + 1);
+				int location = glGetUniformLocation(shader.ID, name.c_str());
+				if (location >= 0)
+					glUniform1i(location, type * MATERIAL_SAMPLERS_PER_TYPE + n);
+			}
+		}
+	}
+
+private:
+	static unsigned int NextId()
+	{
+		static unsigned int next = 1;	// 0 means "no material" in sort keys
+		return next++;
+	}
+
+	static std::vector<unsigned int>& PreparedPrograms()
+	{
+		static std::vector<unsigned int> programs;
+		return programs;
+	}
+};
+
+#endif // !MATERIAL_H
@@ -0,0 +1,276 @@
+#ifndef OCCLUSIONQUERIES_H
+#define OCCLUSIONQUERIES_H
+
+// hardware occlusion culling with temporal coherence (after CHC++). Every object
+// (caller-chosen id) remembers whether it was visible when its last query came back:
+//
+//	visible		drawn right away. Every m_visibleInterval frames (staggered by id)
+//				the draw itself is wrapped in a query to find out if it got hidden.
+//	occluded	not drawn in order. Flush(), after the visible objects filled the
+//				depth buffer, renders its bounding box into a query with color and
+//				depth writes off, then the object itself under conditional
+//				rendering, so the GPU drops the draw if the box wasn't visible.
+//				Without conditional rendering the object is simply skipped until a
+//				query says otherwise.
+//
+// results are only read once GL_QUERY_RESULT_AVAILABLE says so (a frame or more
+// later), the CPU never waits for the GPU.
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "shader.h"
+#include "GLStateCache.h"
+
+#include <vector>
+#include <functional>
+
+class OcclusionQueries
+{
+public:
+	// frames between the queries of a visible object
+	unsigned int m_visibleInterval;
+	// draw occluded objects under conditional rendering (needs glBeginConditionalRender)
+	bool m_conditionalRender;
+
+	// statistics of the last frame
+	struct Stats
+	{
+		unsigned int objects;			// Draw() calls
+		unsigned int drawn;				// drawn unconditionally
+		unsigned int conditional;		// drawn under conditional rendering
+		unsigned int skipped;			// not submitted at all
+		unsigned int boxQueries;		// bounding box queries issued
+		unsigned int drawQueries;		// queries around the draws of visible objects
+		unsigned int resultsRead;		// query results that came back this frame
+		unsigned int occludedResults;	// of those, the object was hidden
+		unsigned int conditionalDropped;	// of those, box queries: the conditional draw was dropped by the GPU
+	};
+	Stats m_stats;
+
+	unsigned int QueryCount() const { return m_stats.boxQueries + m_stats.drawQueries; }
+
+	// draws that never reached the rasterizer: skipped ones plus conditional ones
+	// the GPU dropped (known a frame later, counted when the result comes back)
+	float AvoidedFraction() const
+	{
+		if (m_stats.objects == 0)
+			return 0.0f;
+		return (float)(m_stats.skipped + m_stats.conditionalDropped) / (float)m_stats.objects;
+	}
+
+	OcclusionQueries()
+		: m_visibleInterval(8),
+		m_conditionalRender(true),
+		m_frame(0),
+		m_boxVAO(0),
+		m_boxVBO(0),
+		m_boxEBO(0)
+	{
+		ResetStats();
+	}
+
+	// creates the unit box the bounding box queries draw, needs a current GL context
+	void Init()
+	{
+		float corners[8 * 3];
+		for (unsigned int i = 0; i < 8; i++)
+		{
+			corners[i * 3] = (i & 1) ? 1.0f : -1.0f;
+			corners[i * 3 + 1] = (i & 2) ? 1.0f : -1.0f;
+			corners[i * 3 + 2] = (i & 4) ? 1.0f : -1.0f;
+		}
+		// no face culling anywhere, the winding doesn't matter
+		unsigned int indices[36] = {
+			0, 2, 6, 0, 6, 4,	1, 5, 7, 1, 7, 3,
+			0, 4, 5, 0, 5, 1,	2, 3, 7, 2, 7, 6,
+			0, 1, 3, 0, 3, 2,	4, 6, 7, 4, 7, 5 };
+		glGenVertexArrays(1, &m_boxVAO);
+		glGenBuffers(1, &m_boxVBO);
+		glGenBuffers(1, &m_boxEBO);
+		GLStateCache::Get().BindVertexArray(m_boxVAO);
+		glBindBuffer(GL_ARRAY_BUFFER, m_boxVBO);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_boxEBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+		GLStateCache::Get().BindVertexArray(0);
+		// core since GL 3.0, but the loader may still have come up without it
+		if (glBeginConditionalRender == NULL)
+			m_conditionalRender = false;
+	}
+
+	void Destroy()
+	{
+		for (unsigned int i = 0; i < m_objects.size(); i++)
+			if (m_objects[i].query != 0)
+				glDeleteQueries(1, &m_objects[i].query);
+		m_objects.clear();
+		glDeleteVertexArrays(1, &m_boxVAO);
+		glDeleteBuffers(1, &m_boxVBO);
+		glDeleteBuffers(1, &m_boxEBO);
+		m_boxVAO = m_boxVBO = m_boxEBO = 0;
+	}
+
+	// collects the results that are ready, call before the first Draw() of the frame
+	void BeginFrame(Shader& boxShader, const glm::mat4& viewProjection, const glm::vec3& cameraPosition)
+	{
+		m_frame++;
+		m_boxShader = &boxShader;
+		m_viewProjection = viewProjection;
+		m_cameraPosition = cameraPosition;
+		ResetStats();
+		for (unsigned int i = 0; i < m_objects.size(); i++)
+		{
+			Object& object = m_objects[i];
+			if (!object.pending)
+				continue;
+			GLuint available = 0;
+			glGetQueryObjectuiv(object.query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				continue;
+			GLuint anySamples = 0;
+			glGetQueryObjectuiv(object.query, GL_QUERY_RESULT, &anySamples);
+			object.visible = anySamples != 0;
+			object.pending = false;
+			m_stats.resultsRead++;
+			if (!object.visible)
+			{
+				m_stats.occludedResults++;
+				if (object.boxQuery && m_conditionalRender)
+					m_stats.conditionalDropped++;
+			}
+		}
+	}
+
+	// draws (or schedules) one object with the given world space bounds. draw() must
+	// set up everything it needs (program, uniforms, textures), it may run later in Flush().
+	void Draw(unsigned int id, const glm::vec3& worldMin, const glm::vec3& worldMax, const std::function<void()>& draw)
+	{
+		m_stats.objects++;
+		Object& object = GetObject(id);
+		// a box around the camera can't be tested, its front faces are clipped away
+		glm::vec3 margin(0.2f);
+		bool cameraInside = glm::all(glm::greaterThanEqual(m_cameraPosition, worldMin - margin))
+			&& glm::all(glm::lessThanEqual(m_cameraPosition, worldMax + margin));
+		if (cameraInside)
+			object.visible = true;
+		if (!object.visible)
+		{
+			Deferred deferred = { id, worldMin, worldMax, draw };
+			m_deferred.push_back(deferred);
+			return;
+		}
+		bool query = !object.pending && !cameraInside && (m_frame + id) % m_visibleInterval == 0;
+		if (query)
+			glBeginQuery(GL_ANY_SAMPLES_PASSED, object.query);
+		draw();
+		if (query)
+		{
+			glEndQuery(GL_ANY_SAMPLES_PASSED);
+			object.pending = true;
+			object.boxQuery = false;
+			m_stats.drawQueries++;
+		}
+		m_stats.drawn++;
+	}
+
+	// queries the bounding boxes of the objects that were occluded, then draws them
+	// conditionally. Call once all visible objects of the pass are drawn.
+	void Flush()
+	{
+		if (m_deferred.empty())
+			return;
+		GLStateCache& state = GLStateCache::Get();
+		std::vector<bool> queried(m_deferred.size(), false);
+		state.DepthMask(false);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		m_boxShader->use();
+		m_boxShader->setMat4("viewProjection", m_viewProjection);
+		state.BindVertexArray(m_boxVAO);
+		for (unsigned int i = 0; i < m_deferred.size(); i++)
+		{
+			const Deferred& deferred = m_deferred[i];
+			Object& object = m_objects[deferred.id];
+			// the previous box query is still in flight
+			if (object.pending)
+				continue;
+			glm::vec3 center = (deferred.worldMin + deferred.worldMax) * 0.5f;
+			glm::vec3 halfSize = (deferred.worldMax - deferred.worldMin) * 0.5f;
+			m_boxShader->setMat4("model", glm::scale(glm::translate(glm::mat4(1.0f), center), halfSize));
+			glBeginQuery(GL_ANY_SAMPLES_PASSED, object.query);
+			glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
+			glEndQuery(GL_ANY_SAMPLES_PASSED);
+			state.CountDrawCall();
+			object.pending = true;
+			object.boxQuery = true;
+			queried[i] = true;
+			m_stats.boxQueries++;
+		}
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		state.DepthMask(true);
+
+		for (unsigned int i = 0; i < m_deferred.size(); i++)
+		{
+			if (!m_conditionalRender || !queried[i])
+			{
+				m_stats.skipped++;
+				continue;
+			}
+			// no wait: if the result isn't there yet when the GPU gets here, it draws
+			glBeginConditionalRender(m_objects[m_deferred[i].id].query, GL_QUERY_NO_WAIT);
+			m_deferred[i].draw();
+			glEndConditionalRender();
+			m_stats.conditional++;
+		}
+		m_deferred.clear();
+	}
+
+private:
+	struct Object
+	{
+		GLuint query;
+		bool pending;	// a query was issued and its result not read yet
+		bool visible;	// as of the last result
+		bool boxQuery;	// the pending query is a bounding box query
+	};
+
+	struct Deferred
+	{
+		unsigned int id;
+		glm::vec3 worldMin, worldMax;
+		std::function<void()> draw;
+	};
+
+	std::vector<Object> m_objects;
+	std::vector<Deferred> m_deferred;
+	unsigned int m_frame;
+	Shader* m_boxShader;
+	glm::mat4 m_viewProjection;
+	glm::vec3 m_cameraPosition;
+	GLuint m_boxVAO, m_boxVBO, m_boxEBO;
+
+	void ResetStats()
+	{
+		m_stats.objects = m_stats.drawn = m_stats.conditional = m_stats.skipped = 0;
+		m_stats.boxQueries = m_stats.drawQueries = m_stats.resultsRead = m_stats.occludedResults = m_stats.conditionalDropped = 0;
+	}
+
+	// new objects start out visible, their first draw tells
+	Object& GetObject(unsigned int id)
+	{
+		while (m_objects.size() <= id)
+		{
+			Object object;
+			glGenQueries(1, &object.query);
+			object.pending = false;
+			object.visible = true;
+			object.boxQuery = false;
+			m_objects.push_back(object);
+		}
+		return m_objects[id];
+	}
+};
+
+#endif // !OCCLUSIONQUERIES_H
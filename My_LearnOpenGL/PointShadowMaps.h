@@ -0,0 +1,299 @@
+#ifndef POINTSHADOWMAPS_H
+#define POINTSHADOWMAPS_H
+
+// omnidirectional shadows for point lights. Every light owns a depth cube map
+// that is rendered in a single layered pass: the whole cube is attached to the
+// framebuffer and the geometry shader (5.4.1.point_shadows_depth.gs) sends each
+// triangle to the faces (gl_Layer) its caster can reach. Casters are culled per
+// face on the CPU, see CasterMask(). The cube maps store the linear distance to
+// the light divided by m_farPlane.
+//
+// a light's cube map is only re-rendered when the light moved or the point
+// shadow casters changed (same pass hash test as the cascaded shadow map cache).
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "shader.h"
+#include "GLStateCache.h"
+#include "RenderQueue.h"
+#include "Frustum.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+
+// must match MAX_POINT_LIGHTS in 5.3.3.csm_shadow.fs, 6 mask bits per light must fit in 32
+const unsigned int POINT_SHADOW_MAX_LIGHTS = 4;
+const unsigned int POINT_SHADOW_FACES = 6;
+
+class PointShadowMaps
+{
+public:
+	unsigned int m_resolution;
+	float m_nearPlane;
+	// the light's range, nothing further away is lit or shadowed
+	float m_farPlane;
+
+	// statistics of the last Render()
+	struct Stats
+	{
+		unsigned int lightsRendered;	// cube maps re-rendered
+		unsigned int casterDraws;		// draws issued (one per caster and light)
+		unsigned int facesRendered;		// caster faces emitted by the geometry shader
+		unsigned int facesCulled;		// faces of drawn casters skipped by the per-face culling
+	};
+	Stats m_stats;
+
+	PointShadowMaps(unsigned int resolution = 512, float nearPlane = 0.1f, float farPlane = 25.0f)
+		: m_resolution(resolution),
+		m_nearPlane(nearPlane),
+		m_farPlane(farPlane),
+		m_lightCount(0),
+		m_fbo(0),
+		m_emptyCube(0),
+		m_casterHash(0)
+	{
+		for (unsigned int i = 0; i < POINT_SHADOW_MAX_LIGHTS; i++)
+		{
+			m_lights[i].cubeMap = 0;
+			m_lights[i].valid = false;
+		}
+		m_stats.lightsRendered = m_stats.casterDraws = m_stats.facesRendered = m_stats.facesCulled = 0;
+	}
+
+	// creates the layered framebuffer, needs a current GL context
+	void Init()
+	{
+		glGenFramebuffers(1, &m_fbo);
+		// unused samplerCube uniforms of the lit shader still need a cube map behind them
+		m_emptyCube = CreateCubeMap(1);
+	}
+
+	void Destroy()
+	{
+		GLStateCache& state = GLStateCache::Get();
+		for (unsigned int i = 0; i < m_lightCount; i++)
+		{
+			state.ForgetTexture(m_lights[i].cubeMap);
+			glDeleteTextures(1, &m_lights[i].cubeMap);
+			m_lights[i].cubeMap = 0;
+		}
+		state.ForgetTexture(m_emptyCube);
+		glDeleteTextures(1, &m_emptyCube);
+		glDeleteFramebuffers(1, &m_fbo);
+		m_lightCount = 0;
+		m_fbo = m_emptyCube = 0;
+	}
+
+	// adds a shadowed point light, returns its index or -1 when full
+	int AddLight(const glm::vec3& position, const glm::vec3& color)
+	{
+		if (m_lightCount >= POINT_SHADOW_MAX_LIGHTS)
+			return -1;
+		Light& light = m_lights[m_lightCount];
+		light.cubeMap = CreateCubeMap(m_resolution);
+		light.color = color;
+		light.valid = false;
+		SetLightPosition(m_lightCount, position);
+		return (int)m_lightCount++;
+	}
+
+	void SetLightPosition(unsigned int index, const glm::vec3& position)
+	{
+		Light& light = m_lights[index];
+		if (light.valid && light.position == position)
+			return;
+		light.position = position;
+		light.valid = false;
+		// face order of GL_TEXTURE_CUBE_MAP_POSITIVE_X + face
+		static const glm::vec3 directions[POINT_SHADOW_FACES] = {
+			glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f),
+			glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+			glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f) };
+		static const glm::vec3 ups[POINT_SHADOW_FACES] = {
+			glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+			glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+			glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f) };
+		glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, m_nearPlane, m_farPlane);
+		for (unsigned int face = 0; face < POINT_SHADOW_FACES; face++)
+		{
+			light.faceMatrices[face] = projection * glm::lookAt(position, position + directions[face], ups[face]);
+			light.faceVolumes[face] = Frustum(light.faceMatrices[face]);
+		}
+	}
+
+	unsigned int LightCount() const { return m_lightCount; }
+	const glm::vec3& LightPosition(unsigned int index) const { return m_lights[index].position; }
+
+	// the cube faces a caster with the given world space bounds can touch, bit
+	// light * 6 + face. The range sphere rejects most casters before the faces are tested.
+	unsigned int CasterMask(const glm::vec3& worldMin, const glm::vec3& worldMax) const
+	{
+		unsigned int mask = 0;
+		for (unsigned int i = 0; i < m_lightCount; i++)
+		{
+			const Light& light = m_lights[i];
+			glm::vec3 closest = glm::clamp(light.position, worldMin, worldMax);
+			glm::vec3 offset = closest - light.position;
+			if (glm::dot(offset, offset) > m_farPlane * m_farPlane)
+				continue;
+			for (unsigned int face = 0; face < POINT_SHADOW_FACES; face++)
+				if (light.faceVolumes[face].IntersectsAabb(worldMin, worldMax))
+					mask |= 1u << (i * POINT_SHADOW_FACES + face);
+		}
+		return mask;
+	}
+
+	// renders PASS_SHADOW_POINT into the cube maps of the lights that need it,
+	// one layered pass per light
+	void Render(RenderQueue& queue, Shader& depthShader)
+	{
+		GLStateCache& state = GLStateCache::Get();
+		m_stats.lightsRendered = m_stats.casterDraws = m_stats.facesRendered = m_stats.facesCulled = 0;
+
+		uint64_t casterHash = queue.PassHash(PASS_SHADOW_POINT);
+		if (casterHash != m_casterHash)
+		{
+			for (unsigned int i = 0; i < m_lightCount; i++)
+				m_lights[i].valid = false;
+			m_casterHash = casterHash;
+		}
+
+		state.Viewport(0, 0, m_resolution, m_resolution);
+		state.BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		depthShader.use();
+		const DepthLocations& locations = GetDepthLocations(depthShader);
+		glUniform1f(locations.farPlane, m_farPlane);
+		for (unsigned int i = 0; i < m_lightCount; i++)
+		{
+			Light& light = m_lights[i];
+			if (light.valid)
+				continue;
+			// attaching the whole cube map makes the framebuffer layered (6 faces)
+			glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, light.cubeMap, 0);
+			glDrawBuffer(GL_NONE);
+			glReadBuffer(GL_NONE);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			glUniform3fv(locations.lightPos, 1, &light.position[0]);
+			for (unsigned int face = 0; face < POINT_SHADOW_FACES; face++)
+				glUniformMatrix4fv(locations.shadowMatrices[face], 1, GL_FALSE, &light.faceMatrices[face][0][0]);
+
+			unsigned int lightMask = ((1u << POINT_SHADOW_FACES) - 1) << (i * POINT_SHADOW_FACES);
+			unsigned int draws = queue.ExecuteDepth(PASS_SHADOW_POINT, lightMask, i * POINT_SHADOW_FACES);
+			unsigned int faces = queue.CountLayers(PASS_SHADOW_POINT, lightMask);
+			m_stats.casterDraws += draws;
+			m_stats.facesRendered += faces;
+			m_stats.facesCulled += draws * POINT_SHADOW_FACES - faces;
+			m_stats.lightsRendered++;
+			light.valid = true;
+		}
+	}
+
+	// uploads the lights and binds their cube maps to firstUnit.. firstUnit + POINT_SHADOW_MAX_LIGHTS - 1
+	// (the shader must be in use)
+	void BindForLighting(Shader& shader, unsigned int firstUnit)
+	{
+		GLStateCache& state = GLStateCache::Get();
+		const LightingLocations& locations = GetLightingLocations(shader);
+		glUniform1i(locations.count, (int)m_lightCount);
+		glUniform1f(locations.farPlane, m_farPlane);
+		for (unsigned int i = 0; i < POINT_SHADOW_MAX_LIGHTS; i++)
+		{
+			glUniform1i(locations.shadowMaps[i], (int)(firstUnit + i));
+			if (i < m_lightCount)
+			{
+				glUniform3fv(locations.positions[i], 1, &m_lights[i].position[0]);
+				glUniform3fv(locations.colors[i], 1, &m_lights[i].color[0]);
+				state.BindTexture(firstUnit + i, GL_TEXTURE_CUBE_MAP, m_lights[i].cubeMap);
+			}
+			else
+				state.BindTexture(firstUnit + i, GL_TEXTURE_CUBE_MAP, m_emptyCube);
+		}
+	}
+
+private:
+	struct Light
+	{
+		glm::vec3 position;
+		glm::vec3 color;
+		GLuint cubeMap;
+		bool valid;		// cube map is up to date
+		glm::mat4 faceMatrices[POINT_SHADOW_FACES];
+		Frustum faceVolumes[POINT_SHADOW_FACES];
+	};
+
+	Light m_lights[POINT_SHADOW_MAX_LIGHTS];
+	unsigned int m_lightCount;
+	GLuint m_fbo;
+	GLuint m_emptyCube;
+	uint64_t m_casterHash;
+
+	// uniform locations of Render() and BindForLighting(), looked up once per program
+	struct DepthLocations
+	{
+		GLuint program;
+		GLint farPlane, lightPos;
+		GLint shadowMatrices[POINT_SHADOW_FACES];
+	};
+	struct LightingLocations
+	{
+		GLuint program;
+		GLint count, farPlane;
+		GLint shadowMaps[POINT_SHADOW_MAX_LIGHTS], positions[POINT_SHADOW_MAX_LIGHTS], colors[POINT_SHADOW_MAX_LIGHTS];
+	};
+	std::vector<DepthLocations> m_depthLocations;
+	std::vector<LightingLocations> m_lightingLocations;
+
+	const DepthLocations& GetDepthLocations(const Shader& shader)
+	{
+		for (unsigned int i = 0; i < m_depthLocations.size(); i++)
+			if (m_depthLocations[i].program == shader.ID)
+				return m_depthLocations[i];
+		DepthLocations locations;
+		locations.program = shader.ID;
+		locations.farPlane = glGetUniformLocation(shader.ID, "farPlane");
+		locations.lightPos = glGetUniformLocation(shader.ID, "lightPos");
+		for (unsigned int face = 0; face < POINT_SHADOW_FACES; face++)
+			locations.shadowMatrices[face] = glGetUniformLocation(shader.ID, ("shadowMatrices[" + std::to_string(face) + "]").c_str());
+		m_depthLocations.push_back(locations);
+		return m_depthLocations.back();
+	}
+
+	const LightingLocations& GetLightingLocations(const Shader& shader)
+	{
+		for (unsigned int i = 0; i < m_lightingLocations.size(); i++)
+			if (m_lightingLocations[i].program == shader.ID)
+				return m_lightingLocations[i];
+		LightingLocations locations;
+		locations.program = shader.ID;
+		locations.count = glGetUniformLocation(shader.ID, "pointLightCount");
+		locations.farPlane = glGetUniformLocation(shader.ID, "pointFarPlane");
+		for (unsigned int i = 0; i < POINT_SHADOW_MAX_LIGHTS; i++)
+		{
+			std::string index = "[" + std::to_string(i) + "]";
+			locations.shadowMaps[i] = glGetUniformLocation(shader.ID, ("pointShadowMaps" + index).c_str());
+			locations.positions[i] = glGetUniformLocation(shader.ID, ("pointLightPositions" + index).c_str());
+			locations.colors[i] = glGetUniformLocation(shader.ID, ("pointLightColors" + index).c_str());
+		}
+		m_lightingLocations.push_back(locations);
+		return m_lightingLocations.back();
+	}
+
+	GLuint CreateCubeMap(unsigned int resolution)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		GLStateCache::Get().BindTexture(GL_TEXTURE_CUBE_MAP, texture);
+		for (unsigned int face = 0; face < POINT_SHADOW_FACES; face++)
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT32F, resolution, resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		return texture;
+	}
+};
+
+#endif // !POINTSHADOWMAPS_H
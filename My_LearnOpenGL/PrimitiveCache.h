@@ -0,0 +1,154 @@
+#ifndef PRIMITIVECACHE_H
+#define PRIMITIVECACHE_H
+
+// shared, indexed primitive geometry (the cube, the floor, ...). Every primitive
+// is uploaded once with an index buffer and gets two vertex arrays on it: the full
+// layout (position, normal, texcoords) for the lit pass and a position-only one
+// for the depth passes. The vertices and indices also stay on the CPU, for
+// StaticBatch to pre-transform into merged buffers.
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "GLStateCache.h"
+
+#include <vector>
+
+// floats per vertex: position (3), normal (3), texcoords (2)
+const unsigned int PRIMITIVE_VERTEX_FLOATS = 8;
+
+struct Primitive
+{
+	GLuint vao;					// full vertex layout
+	GLuint shadowVAO;			// positions only
+	GLsizei indexCount;
+	glm::vec3 boundsMin, boundsMax;
+	std::vector<float> vertices;
+	std::vector<unsigned int> indices;
+};
+
+class PrimitiveCache
+{
+public:
+	PrimitiveCache() : m_cube(-1) {}
+
+	// uploads a primitive of interleaved PRIMITIVE_VERTEX_FLOATS vertices, returns its id.
+	// Needs a current GL context.
+	unsigned int Add(const float* vertices, unsigned int vertexCount, const unsigned int* indices, unsigned int indexCount)
+	{
+		Primitive primitive;
+		primitive.vertices.assign(vertices, vertices + vertexCount * PRIMITIVE_VERTEX_FLOATS);
+		primitive.indices.assign(indices, indices + indexCount);
+		primitive.indexCount = (GLsizei)indexCount;
+		primitive.boundsMin = primitive.boundsMax = glm::vec3(vertices[0], vertices[1], vertices[2]);
+		std::vector<float> positions(vertexCount * 3);
+		for (unsigned int i = 0; i < vertexCount; i++)
+		{
+			glm::vec3 position(vertices[i * PRIMITIVE_VERTEX_FLOATS], vertices[i * PRIMITIVE_VERTEX_FLOATS + 1], vertices[i * PRIMITIVE_VERTEX_FLOATS + 2]);
+			primitive.boundsMin = glm::min(primitive.boundsMin, position);
+			primitive.boundsMax = glm::max(primitive.boundsMax, position);
+			positions[i * 3] = position.x;
+			positions[i * 3 + 1] = position.y;
+			positions[i * 3 + 2] = position.z;
+		}
+
+		GLuint buffers[3];
+		glGenBuffers(3, buffers);
+		m_buffers.insert(m_buffers.end(), buffers, buffers + 3);
+		GLStateCache& state = GLStateCache::Get();
+		glGenVertexArrays(1, &primitive.vao);
+		state.BindVertexArray(primitive.vao);
+		glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+		glBufferData(GL_ARRAY_BUFFER, primitive.vertices.size() * sizeof(float), primitive.vertices.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[2]);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(unsigned int), indices, GL_STATIC_DRAW);
+		GLsizei stride = PRIMITIVE_VERTEX_FLOATS * sizeof(float);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(6 * sizeof(float)));
+
+		glGenVertexArrays(1, &primitive.shadowVAO);
+		state.BindVertexArray(primitive.shadowVAO);
+		glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+		glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(float), positions.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[2]);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+		state.BindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		m_primitives.push_back(primitive);
+		return (unsigned int)m_primitives.size() - 1;
+	}
+
+	// the [-1,1] cube: 24 vertices (4 per face, for the face normals) and 36 indices,
+	// added on first use
+	unsigned int Cube()
+	{
+		if (m_cube >= 0)
+			return (unsigned int)m_cube;
+		// per face: normal, then the face's u and v axes (u x v = normal, so the
+		// corners below run counter-clockwise seen from outside)
+		static const float faces[6][9] = {
+			{  1.0f,  0.0f,  0.0f,   0.0f, 0.0f, -1.0f,   0.0f, 1.0f,  0.0f },
+			{ -1.0f,  0.0f,  0.0f,   0.0f, 0.0f,  1.0f,   0.0f, 1.0f,  0.0f },
+			{  0.0f,  1.0f,  0.0f,   1.0f, 0.0f,  0.0f,   0.0f, 0.0f, -1.0f },
+			{  0.0f, -1.0f,  0.0f,   1.0f, 0.0f,  0.0f,   0.0f, 0.0f,  1.0f },
+			{  0.0f,  0.0f,  1.0f,   1.0f, 0.0f,  0.0f,   0.0f, 1.0f,  0.0f },
+			{  0.0f,  0.0f, -1.0f,  -1.0f, 0.0f,  0.0f,   0.0f, 1.0f,  0.0f }
+		};
+		static const float corners[4][2] = { { 0.0f, 0.0f }, { 1.0f, 0.0f }, { 1.0f, 1.0f }, { 0.0f, 1.0f } };
+		float vertices[24 * PRIMITIVE_VERTEX_FLOATS];
+		unsigned int indices[36];
+		for (unsigned int face = 0; face < 6; face++)
+		{
+			glm::vec3 normal(faces[face][0], faces[face][1], faces[face][2]);
+			glm::vec3 u(faces[face][3], faces[face][4], faces[face][5]);
+			glm::vec3 v(faces[face][6], faces[face][7], faces[face][8]);
+			for (unsigned int c = 0; c < 4; c++)
+			{
+				glm::vec3 position = normal + u * (corners[c][0] * 2.0f - 1.0f) + v * (corners[c][1] * 2.0f - 1.0f);
+				float* vertex = &vertices[(face * 4 + c) * PRIMITIVE_VERTEX_FLOATS];
+				vertex[0] = position.x;
+				vertex[1] = position.y;
+				vertex[2] = position.z;
+				vertex[3] = normal.x;
+				vertex[4] = normal.y;
+				vertex[5] = normal.z;
+				vertex[6] = corners[c][0];
+				vertex[7] = corners[c][1];
+			}
+			static const unsigned int quad[6] = { 0, 1, 2, 0, 2, 3 };
+			for (unsigned int i = 0; i < 6; i++)
+				indices[face * 6 + i] = face * 4 + quad[i];
+		}
+		m_cube = (int)Add(vertices, 24, indices, 36);
+		return (unsigned int)m_cube;
+	}
+
+	const Primitive& Get(unsigned int id) const { return m_primitives[id]; }
+	unsigned int Count() const { return (unsigned int)m_primitives.size(); }
+
+	void Destroy()
+	{
+		for (unsigned int i = 0; i < m_primitives.size(); i++)
+		{
+			glDeleteVertexArrays(1, &m_primitives[i].vao);
+			glDeleteVertexArrays(1, &m_primitives[i].shadowVAO);
+		}
+		if (!m_buffers.empty())
+			glDeleteBuffers((GLsizei)m_buffers.size(), m_buffers.data());
+		m_primitives.clear();
+		m_buffers.clear();
+		m_cube = -1;
+	}
+
+private:
+	std::vector<Primitive> m_primitives;
+	std::vector<GLuint> m_buffers;
+	int m_cube;
+};
+
+#endif // !PRIMITIVECACHE_H
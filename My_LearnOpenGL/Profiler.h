@@ -0,0 +1,392 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// frame profiler: scoped CPU zones (nestable, per thread, timestamped with the
+// TSC where available) and GPU zones made of GL_TIMESTAMP query pairs. GPU queries
+// live in a ring of PROFILER_GPU_FRAMES frames and are only read back once that
+// many frames later, and only if available, so reading results never stalls.
+// A capture of N frames can be written as Chrome trace-event JSON
+// (chrome://tracing, ui.perfetto.dev) for offline inspection.
+//
+//	PROFILE_SCOPE("ShadowPass");		// cpu zone until end of scope
+//	PROFILE_GPU_SCOPE("ShadowPass");	// gpu zone until end of scope (GL thread only)
+#include <glad/glad.h>
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define PROFILER_HAS_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILER_HAS_TSC 1
+#endif
+
+// frames the GPU queries of a frame are kept before they're read back
+const unsigned int PROFILER_GPU_FRAMES = 4;
+// GPU zones per frame
+const unsigned int PROFILER_GPU_ZONES = 32;
+// maximum nesting depth of CPU zones per thread
+const unsigned int PROFILER_MAX_DEPTH = 64;
+
+class Profiler
+{
+public:
+	static Profiler& Get()
+	{
+		static Profiler instance;
+		return instance;
+	}
+
+	// raw timestamp in ticks, TSC if the platform has one
+	static uint64_t Now()
+	{
+#ifdef PROFILER_HAS_TSC
+		return __rdtsc();
+#else
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	// creates the GPU query ring, needs a current GL context
+	void InitGpu()
+	{
+		for (unsigned int f = 0; f < PROFILER_GPU_FRAMES; f++)
+		{
+			glGenQueries(PROFILER_GPU_ZONES * 2, m_gpuFrames[f].queries);
+			m_gpuFrames[f].count = 0;
+		}
+		// anchor the GPU clock to ours
+		GLint64 gpuNow = 0;
+		glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+		m_gpuOrigin = gpuNow;
+		m_gpuOriginTicks = Now();
+		m_gpuReady = true;
+	}
+
+	// records the next frames, the trace is written to path afterwards
+	void BeginCapture(unsigned int frames, const std::string& path)
+	{
+		std::lock_guard<std::mutex> lock(m_threadsMutex);
+		for (unsigned int i = 0; i < m_threads.size(); i++)
+		{
+			std::lock_guard<std::mutex> threadLock(m_threads[i]->mutex);
+			m_threads[i]->events.clear();
+		}
+		m_gpuEvents.clear();
+		m_capturePath = path;
+		m_captureFrames = frames;
+		m_capturing = true;
+	}
+
+	bool IsCapturing() const { return m_capturing; }
+
+	// call once per frame on the GL thread, before any zone of the frame
+	void NewFrame()
+	{
+		if (m_gpuReady)
+		{
+			m_gpuFrame = (m_gpuFrame + 1) % PROFILER_GPU_FRAMES;
+			// this slot was last used PROFILER_GPU_FRAMES frames ago
+			CollectGpuFrame(m_gpuFrames[m_gpuFrame]);
+			m_gpuFrames[m_gpuFrame].count = 0;
+		}
+		m_frameIndex++;
+
+		if (m_capturing && m_captureFrames-- == 0)
+		{
+			m_capturing = false;
+			WriteChromeTrace(m_capturePath);
+		}
+	}
+
+	// cpu zones
+	// ------------------------------------------------------------------------
+	void BeginZone(const char* name)
+	{
+		ThreadData& thread = CurrentThread();
+		if (thread.depth < PROFILER_MAX_DEPTH)
+		{
+			thread.stack[thread.depth].name = name;
+			thread.stack[thread.depth].start = Now();
+		}
+		thread.depth++;
+	}
+
+	void EndZone()
+	{
+		uint64_t end = Now();
+		ThreadData& thread = CurrentThread();
+		if (thread.depth == 0)
+			return;
+		thread.depth--;
+		if (!m_capturing || thread.depth >= PROFILER_MAX_DEPTH)
+			return;
+		Event event;
+		event.name = thread.stack[thread.depth].name;
+		event.start = thread.stack[thread.depth].start;
+		event.end = end;
+		std::lock_guard<std::mutex> lock(thread.mutex);
+		thread.events.push_back(event);
+	}
+
+	// gpu zones, GL thread only. Zones may nest since each end is its own timestamp.
+	// ------------------------------------------------------------------------
+	void BeginGpuZone(const char* name)
+	{
+		if (!m_gpuReady)
+			return;
+		GpuFrame& frame = m_gpuFrames[m_gpuFrame];
+		// past the zone budget (or too deep) the zone still takes a stack entry, with
+		// no query behind it, so every EndGpuZone() pops the zone it belongs to
+		unsigned int zone = NO_GPU_ZONE;
+		if (frame.count < PROFILER_GPU_ZONES && m_gpuDepth < PROFILER_MAX_DEPTH)
+		{
+			zone = frame.count++;
+			frame.names[zone] = name;
+			glQueryCounter(frame.queries[zone * 2], GL_TIMESTAMP);
+			frame.open[zone] = true;
+		}
+		else
+			m_gpuOverflow++;
+		if (m_gpuDepth < PROFILER_MAX_DEPTH)
+			m_gpuStack[m_gpuDepth] = zone;
+		m_gpuDepth++;
+	}
+
+	void EndGpuZone()
+	{
+		if (!m_gpuReady || m_gpuDepth == 0)
+			return;
+		m_gpuDepth--;
+		if (m_gpuDepth >= PROFILER_MAX_DEPTH)
+			return;
+		GpuFrame& frame = m_gpuFrames[m_gpuFrame];
+		unsigned int zone = m_gpuStack[m_gpuDepth];
+		if (zone >= frame.count || !frame.open[zone])
+			return;
+		glQueryCounter(frame.queries[zone * 2 + 1], GL_TIMESTAMP);
+		frame.open[zone] = false;
+	}
+
+	// last read back duration of a GPU zone in milliseconds (from PROFILER_GPU_FRAMES frames ago)
+	double GpuZoneMs(const char* name) const
+	{
+		for (unsigned int i = 0; i < m_gpuLast.size(); i++)
+			if (std::strcmp(m_gpuLast[i].name, name) == 0)
+				return (m_gpuLast[i].end - m_gpuLast[i].start) / 1.0e6;
+		return 0.0;
+	}
+
+	// writes everything captured so far as Chrome trace-event JSON
+	bool WriteChromeTrace(const std::string& path)
+	{
+		std::ofstream out(path.c_str());
+		if (!out)
+		{
+			std::cout << "ERROR::PROFILER::CANNOT_WRITE_TRACE: " << path << std::endl;
+			return false;
+		}
+		double ticksPerUs = TicksPerMicrosecond();
+		bool first = true;
+		out << "{\"traceEvents\":[\n";
+		std::lock_guard<std::mutex> lock(m_threadsMutex);
+		for (unsigned int t = 0; t < m_threads.size(); t++)
+		{
+			ThreadData& thread = *m_threads[t];
+			std::lock_guard<std::mutex> threadLock(thread.mutex);
+			WriteThreadName(out, first, thread.id, t == 0 ? "Main thread" : "Worker " + std::to_string(thread.id));
+			for (unsigned int i = 0; i < thread.events.size(); i++)
+			{
+				const Event& e = thread.events[i];
+				double ts = (double)(int64_t)(e.start - m_originTicks) / ticksPerUs;
+				double dur = (double)(e.end - e.start) / ticksPerUs;
+				WriteEvent(out, first, e.name, thread.id, ts, dur);
+			}
+		}
+		// gpu timestamps are in ns on the GPU clock, anchored to our origin in InitGpu
+		WriteThreadName(out, first, GPU_TRACE_TID, "GPU");
+		double gpuOffsetUs = (double)(int64_t)(m_gpuOriginTicks - m_originTicks) / ticksPerUs;
+		for (unsigned int i = 0; i < m_gpuEvents.size(); i++)
+		{
+			const GpuEvent& e = m_gpuEvents[i];
+			double ts = gpuOffsetUs + (double)(e.start - m_gpuOrigin) / 1000.0;
+			double dur = (double)(e.end - e.start) / 1000.0;
+			WriteEvent(out, first, e.name, GPU_TRACE_TID, ts, dur);
+		}
+		out << "\n]}\n";
+		std::cout << "Profiler: wrote trace to " << path << std::endl;
+		return true;
+	}
+
+private:
+	static const unsigned int GPU_TRACE_TID = 1000;
+	// stack entry of a GPU zone that got no queries
+	static const unsigned int NO_GPU_ZONE = PROFILER_GPU_ZONES;
+
+	struct Event
+	{
+		const char* name;
+		uint64_t start;
+		uint64_t end;
+	};
+
+	struct OpenZone
+	{
+		const char* name;
+		uint64_t start;
+	};
+
+	struct ThreadData
+	{
+		unsigned int id;
+		unsigned int depth;
+		OpenZone stack[PROFILER_MAX_DEPTH];
+		std::mutex mutex;	// only contended while a trace is written
+		std::vector<Event> events;
+	};
+
+	struct GpuFrame
+	{
+		GLuint queries[PROFILER_GPU_ZONES * 2];
+		const char* names[PROFILER_GPU_ZONES];
+		bool open[PROFILER_GPU_ZONES];
+		unsigned int count;
+	};
+
+	struct GpuEvent
+	{
+		const char* name;
+		GLuint64 start;
+		GLuint64 end;
+	};
+
+	std::mutex m_threadsMutex;
+	std::vector<ThreadData*> m_threads;
+	std::atomic<bool> m_capturing;
+	unsigned int m_captureFrames;
+	std::string m_capturePath;
+	uint64_t m_frameIndex;
+
+	uint64_t m_originTicks;
+	std::chrono::steady_clock::time_point m_originTime;
+
+	bool m_gpuReady;
+	GpuFrame m_gpuFrames[PROFILER_GPU_FRAMES];
+	unsigned int m_gpuFrame;
+	unsigned int m_gpuStack[PROFILER_MAX_DEPTH];
+	unsigned int m_gpuDepth;
+	unsigned int m_gpuOverflow;
+	GLint64 m_gpuOrigin;
+	uint64_t m_gpuOriginTicks;
+	std::vector<GpuEvent> m_gpuEvents;	// captured
+	std::vector<GpuEvent> m_gpuLast;	// most recent frame read back
+
+	Profiler()
+		: m_capturing(false), m_captureFrames(0), m_frameIndex(0),
+		m_gpuReady(false), m_gpuFrame(0), m_gpuDepth(0), m_gpuOverflow(0), m_gpuOrigin(0), m_gpuOriginTicks(0)
+	{
+		m_originTicks = Now();
+		m_originTime = std::chrono::steady_clock::now();
+	}
+	~Profiler()
+	{
+		for (unsigned int i = 0; i < m_threads.size(); i++)
+			delete m_threads[i];
+	}
+	Profiler(const Profiler&) = delete;
+	Profiler& operator=(const Profiler&) = delete;
+
+	ThreadData& CurrentThread()
+	{
+		static thread_local ThreadData* thread = NULL;
+		if (!thread)
+		{
+			thread = new ThreadData();
+			thread->depth = 0;
+			std::lock_guard<std::mutex> lock(m_threadsMutex);
+			thread->id = static_cast<unsigned int>(m_threads.size()) + 1;
+			m_threads.push_back(thread);
+		}
+		return *thread;
+	}
+
+	// reads back a ring slot if its results are there, drops it otherwise
+	void CollectGpuFrame(const GpuFrame& frame)
+	{
+		// timestamps complete in order, so the last closed zone tells us about the whole frame
+		int last = static_cast<int>(frame.count) - 1;
+		while (last >= 0 && frame.open[last])
+			last--;
+		if (last < 0)
+			return;
+		GLint available = 0;
+		glGetQueryObjectiv(frame.queries[last * 2 + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			return;
+		m_gpuLast.clear();
+		for (unsigned int i = 0; i < frame.count; i++)
+		{
+			if (frame.open[i])
+				continue;
+			GpuEvent event;
+			event.name = frame.names[i];
+			glGetQueryObjectui64v(frame.queries[i * 2], GL_QUERY_RESULT, &event.start);
+			glGetQueryObjectui64v(frame.queries[i * 2 + 1], GL_QUERY_RESULT, &event.end);
+			m_gpuLast.push_back(event);
+			if (m_capturing)
+				m_gpuEvents.push_back(event);
+		}
+	}
+
+	// calibrates the tick rate over the whole lifetime of the profiler
+	double TicksPerMicrosecond() const
+	{
+		double elapsedUs = (double)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_originTime).count();
+		if (elapsedUs <= 0.0)
+			return 1.0;
+		return (double)(Now() - m_originTicks) / elapsedUs;
+	}
+
+	static void WriteThreadName(std::ofstream& out, bool& first, unsigned int tid, const std::string& name)
+	{
+		out << (first ? "" : ",\n");
+		first = false;
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"name\":\"" << name << "\"}}";
+	}
+
+	static void WriteEvent(std::ofstream& out, bool& first, const char* name, unsigned int tid, double ts, double dur)
+	{
+		out << (first ? "" : ",\n");
+		first = false;
+		out << "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid << ",\"ts\":" << std::fixed << ts << ",\"dur\":" << dur << "}";
+	}
+};
+
+// RAII helpers for the macros below
+struct ProfileScope
+{
+	ProfileScope(const char* name) { Profiler::Get().BeginZone(name); }
+	~ProfileScope() { Profiler::Get().EndZone(); }
+};
+
+struct GpuProfileScope
+{
+	GpuProfileScope(const char* name) { Profiler::Get().BeginGpuZone(name); }
+	~GpuProfileScope() { Profiler::Get().EndGpuZone(); }
+};
+
+#define PROFILER_CONCAT_INNER(a, b) a##b
+#define PROFILER_CONCAT(a, b) PROFILER_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILER_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) GpuProfileScope PROFILER_CONCAT(gpuProfileScope, __LINE__)(name)
+
+#endif // !PROFILER_H
@@ -0,0 +1,708 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+// draws are not issued right away but submitted as a packed 64-bit sort key plus
+// a payload. Once per frame the keys are radix sorted and executed in order, so
+// program, material and VAO switches are grouped together and opaque geometry
+// is drawn front-to-back for early-Z.
+//
+// lit pass key:     | pass:4 | program:12 | material:16 | depth:16 | vao:16 |
+// shadow pass keys: | pass:4 | program:12 | vao:16      | depth:16 | 0:16   |
+// (the depth-only pass has no material, so it groups by vertex array instead)
+//
+// depth-only draws are submitted with SubmitDepth() and issued with ExecuteDepth():
+// a position-only vertex array, no textures or materials, and a layer mask that
+// says which shadow map layers (cascades) the caster can reach at all.
+//
+// lit draws given an occlusion id (SetOcclusion()) go through OcclusionQueries
+// when Execute() is handed one.
+//
+// the lit shaders get their per object matrices ready-made: Execute() derives
+// the model-view-projection and normal matrix of all draws of the pass from the
+// SetViewProjection() matrix in batches (TransformBatch), so the vertex shader
+// no longer inverts or multiplies matrices per vertex. They are written to the
+// StreamBuffer (SetStreamBuffer()) as one PerDrawBlock per draw and bound to the
+// "PerDraw" uniform block with glBindBufferRange(), no glUniform calls per draw.
+//
+// SubmitInstanced() queues the same vertex array with several transforms as one
+// draw: the block becomes an array with one element per instance, picked by
+// gl_InstanceID, and the draw is issued with glDraw*Instanced().
+// Execute() also instances on its own: separately submitted draws of the same
+// program, material, geometry and textures (e.g. Model::Submit() of one model at
+// many places) are merged, the merge ratio is kept in m_stats.
+//
+// the lit draws are not issued one by one either: Execute() cuts the pass into
+// ranges of RENDERQUEUE_RECORD_DRAWS draws and records each range into its own
+// CommandBuffer on the job system (matrices, blocks, binds and draw calls). This
+// thread then replays the buffers in order with GLCommandReplay, which drops the
+// binds that are already current.
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "mesh.h"
+#include "GLStateCache.h"
+#include "OcclusionQueries.h"
+#include "TransformBatch.h"
+#include "StreamBuffer.h"
+#include "CommandBuffer.h"
+#include "GLCommandReplay.h"
+#include "JobSystem.h"
+
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+
+// passes, in execution order
+enum RenderPass
+{
+	PASS_SHADOW_STATIC = 0,	// depth-only, casters that never move (cached between frames)
+	PASS_SHADOW = 1,		// depth-only, dynamic casters
+	PASS_SHADOW_POINT = 2,	// depth-only, point light cube maps (mask bits: light * 6 + face)
+	PASS_SHADOW_SPOT = 3,	// depth-only, spot lights in the shadow atlas (mask bit: light)
+	PASS_OPAQUE = 4
+};
+
+// true for the depth-only passes
+inline bool IsShadowPass(RenderPass pass)
+{
+	return pass == PASS_SHADOW_STATIC || pass == PASS_SHADOW || pass == PASS_SHADOW_POINT || pass == PASS_SHADOW_SPOT;
+}
+
+// textures a raw (non-Mesh) draw can bind, on units 0..N-1
+const unsigned int RENDERQUEUE_MAX_TEXTURES = 4;
+// occlusion id of draws that are never occlusion tested
+const unsigned int RENDERQUEUE_NO_OCCLUSION = 0xFFFFFFFFu;
+// end of a chain of merged draws
+const uint32_t RENDERQUEUE_NO_ITEM = 0xFFFFFFFFu;
+// uniform buffer binding of the lit shaders' "PerDraw" block
+const GLuint RENDERQUEUE_PER_DRAW_BINDING = 0;
+
+// one element of the lit shaders' "PerDraw" uniform block array (std140)
+struct PerDrawBlock
+{
+	glm::mat4 model;
+	glm::mat4 modelViewProjection;
+	glm::mat4 normalMatrix;		// inverse transpose of the model's upper 3x3, identity elsewhere
+};
+// instances of one draw, must match MAX_INSTANCES in 5.3.3.csm_shadow.vs
+const unsigned int RENDERQUEUE_MAX_INSTANCES = 64;
+// bytes bound for the "PerDraw" block: its declared size, whatever the instance count
+const GLsizeiptr RENDERQUEUE_PER_DRAW_RANGE = RENDERQUEUE_MAX_INSTANCES * sizeof(PerDrawBlock);
+// lit draws recorded per command buffer (one job each)
+const unsigned int RENDERQUEUE_RECORD_DRAWS = 64;
+
+// payload of a queued draw
+struct RenderItem
+{
+	Shader* shader;
+	glm::mat4 model;
+	// either a Mesh (which binds its own textures) ...
+	Mesh* mesh;
+	// ... or a raw vertex array
+	GLuint vao;
+	GLenum primitive;
+	GLsizei count;
+	bool indexed;
+	unsigned int textureCount;
+	GLuint textures[RENDERQUEUE_MAX_TEXTURES];
+	// depth-only draws: bit i set = the caster reaches shadow map layer i
+	unsigned int layerMask;
+	// instanced draws: instanceCount transforms from m_instanceModels[firstInstance],
+	// model is the first one
+	unsigned int instanceCount;
+	uint32_t firstInstance;
+	// lit draws: hardware occlusion query object and its world space bounds
+	unsigned int occlusionId;
+	glm::vec3 boundsMin, boundsMax;
+};
+
+class RenderQueue
+{
+public:
+	typedef uint64_t Key;
+
+	// builds the key of a lit (opaque) draw, depth in [0,1] is sorted front-to-back
+	static Key MakeOpaqueKey(GLuint program, unsigned int material, float depth, GLuint vao)
+	{
+		return ((Key)PASS_OPAQUE << 60)
+			| ((Key)(program & 0xFFF) << 48)
+			| ((Key)(material & 0xFFFF) << 32)
+			| ((Key)QuantizeDepth(depth) << 16)
+			| (Key)(vao & 0xFFFF);
+	}
+
+	// builds the key of a depth-only draw
+	static Key MakeShadowKey(GLuint program, GLuint vao, float depth, RenderPass pass = PASS_SHADOW)
+	{
+		return ((Key)pass << 60)
+			| ((Key)(program & 0xFFF) << 48)
+			| ((Key)(vao & 0xFFFF) << 32)
+			| ((Key)QuantizeDepth(depth) << 16);
+	}
+
+	// normalized view depth of a world space point, used for the depth bucket
+	static float ViewDepth(const glm::mat4& view, const glm::vec3& worldPos, float farPlane)
+	{
+		float z = -(view * glm::vec4(worldPos, 1.0f)).z;
+		return z / farPlane;
+	}
+
+	// clears all submitted draws, keeps the allocations
+	void Clear()
+	{
+		m_items.clear();
+		m_keys.clear();
+		m_instanceModels.clear();
+		m_sorted = false;
+	}
+
+	// statistics of the last Execute()
+	struct Stats
+	{
+		unsigned int submitted;		// queued draws of the pass
+		unsigned int draws;			// draws issued for them
+		unsigned int merged;		// submissions folded into another's instanced draw
+		unsigned int commandBuffers;
+		unsigned int commands;		// replayed
+		double recordMs;			// until the last buffer was recorded
+		double replayMs;
+	};
+	Stats m_stats = { 0, 0, 0, 0, 0, 0.0, 0.0 };
+
+	// submissions per issued draw in the last Execute()
+	float MergeRatio() const
+	{
+		return m_stats.draws == 0 ? 1.0f : (float)m_stats.submitted / (float)m_stats.draws;
+	}
+
+	// merging of identical draws into instanced ones in Execute(), on by default
+	void SetAutoInstancing(bool enabled)
+	{
+		m_autoInstancing = enabled;
+	}
+
+	// view-projection of the lit pass, set before Execute()
+	void SetViewProjection(const glm::mat4& viewProjection)
+	{
+		m_viewProjection = viewProjection;
+	}
+
+	// where the per draw blocks of Execute() are written, must be set before it
+	void SetStreamBuffer(StreamBuffer* stream)
+	{
+		m_stream = stream;
+	}
+
+	// points a program's "PerDraw" block (if it has one) at RENDERQUEUE_PER_DRAW_BINDING
+	static void BindPerDrawBlock(GLuint program)
+	{
+		GLuint block = glGetUniformBlockIndex(program, "PerDraw");
+		if (block != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, block, RENDERQUEUE_PER_DRAW_BINDING);
+	}
+
+	// queues a mesh
+	void Submit(Key key, Shader& shader, Mesh& mesh, const glm::mat4& model)
+	{
+		RenderItem item;
+		item.shader = &shader;
+		item.model = model;
+		item.mesh = &mesh;
+		item.vao = mesh.VAO;
+		item.primitive = GL_TRIANGLES;
+		item.count = static_cast<GLsizei>(mesh.indices.size());
+		item.indexed = true;
+		item.textureCount = 0;
+		item.layerMask = ~0u;
+		item.occlusionId = RENDERQUEUE_NO_OCCLUSION;
+		item.instanceCount = 1;
+		item.firstInstance = 0;
+		Push(key, item);
+	}
+
+	// queues a raw vertex array, with up to RENDERQUEUE_MAX_TEXTURES textures
+	void Submit(Key key, Shader& shader, GLuint vao, GLenum primitive, GLsizei count, bool indexed, const glm::mat4& model,
+		const GLuint* textures = NULL, unsigned int textureCount = 0)
+	{
+		RenderItem item;
+		item.shader = &shader;
+		item.model = model;
+		item.mesh = NULL;
+		item.vao = vao;
+		item.primitive = primitive;
+		item.count = count;
+		item.indexed = indexed;
+		item.textureCount = textureCount < RENDERQUEUE_MAX_TEXTURES ? textureCount : RENDERQUEUE_MAX_TEXTURES;
+		for (unsigned int i = 0; i < item.textureCount; i++)
+			item.textures[i] = textures[i];
+		item.layerMask = ~0u;
+		item.occlusionId = RENDERQUEUE_NO_OCCLUSION;
+		item.instanceCount = 1;
+		item.firstInstance = 0;
+		Push(key, item);
+	}
+
+	// queues a raw vertex array drawn once per transform in models, as instanced draws
+	// of up to RENDERQUEUE_MAX_INSTANCES each (lit pass only)
+	void SubmitInstanced(Key key, Shader& shader, GLuint vao, GLenum primitive, GLsizei count, bool indexed, const glm::mat4* models,
+		unsigned int instanceCount, const GLuint* textures = NULL, unsigned int textureCount = 0)
+	{
+		for (unsigned int first = 0; first < instanceCount; first += RENDERQUEUE_MAX_INSTANCES)
+		{
+			unsigned int instances = instanceCount - first < RENDERQUEUE_MAX_INSTANCES ? instanceCount - first : RENDERQUEUE_MAX_INSTANCES;
+			Submit(key, shader, vao, primitive, count, indexed, models[first], textures, textureCount);
+			RenderItem& item = m_items.back();
+			item.instanceCount = instances;
+			item.firstInstance = static_cast<uint32_t>(m_instanceModels.size());
+			m_instanceModels.insert(m_instanceModels.end(), models + first, models + first + instances);
+		}
+	}
+
+	// queues a depth-only draw of a position-only vertex array. A caster with an
+	// empty layerMask is still queued (it keeps the pass hash independent of
+	// culling) but never drawn.
+	void SubmitDepth(Key key, Shader& shader, GLuint vao, GLsizei count, bool indexed, const glm::mat4& model, unsigned int layerMask)
+	{
+		RenderItem item;
+		item.shader = &shader;
+		item.model = model;
+		item.mesh = NULL;
+		item.vao = vao;
+		item.primitive = GL_TRIANGLES;
+		item.count = count;
+		item.indexed = indexed;
+		item.textureCount = 0;
+		item.layerMask = layerMask;
+		item.occlusionId = RENDERQUEUE_NO_OCCLUSION;
+		item.instanceCount = 1;
+		item.firstInstance = 0;
+		Push(key, item);
+	}
+
+	// makes the draw submitted last occlusion tested, id is its OcclusionQueries object
+	void SetOcclusion(unsigned int id, const glm::vec3& worldMin, const glm::vec3& worldMax)
+	{
+		RenderItem& item = m_items.back();
+		item.occlusionId = id;
+		item.boundsMin = worldMin;
+		item.boundsMax = worldMax;
+	}
+
+	// radix sorts the submitted keys (LSD, 8 bits per pass)
+	void Sort()
+	{
+		size_t n = m_keys.size();
+		m_scratch.resize(n);
+		SortEntry* src = m_keys.data();
+		SortEntry* dst = m_scratch.data();
+		for (unsigned int shift = 0; shift < 64; shift += 8)
+		{
+			size_t counts[256] = { 0 };
+			for (size_t i = 0; i < n; i++)
+				counts[(src[i].key >> shift) & 0xFF]++;
+			// skip the byte if every key shares it (most of the pass/program bits)
+			if (n == 0 || counts[(src[0].key >> shift) & 0xFF] == n)
+				continue;
+			size_t offset = 0;
+			for (unsigned int b = 0; b < 256; b++)
+			{
+				size_t c = counts[b];
+				counts[b] = offset;
+				offset += c;
+			}
+			for (size_t i = 0; i < n; i++)
+				dst[counts[(src[i].key >> shift) & 0xFF]++] = src[i];
+			SortEntry* tmp = src;
+			src = dst;
+			dst = tmp;
+		}
+		if (src != m_keys.data())
+			m_keys.swap(m_scratch);
+		m_sorted = true;
+	}
+
+	// issues the draws of one pass in key order, the caller sets up the pass
+	// (framebuffer, viewport, shared uniforms) beforehand. With occlusion queries
+	// (BeginFrame() already called) the draws that have an occlusion id go through
+	// them, and the ones they deferred are flushed at the end.
+	void Execute(RenderPass pass, OcclusionQueries* occlusion = NULL)
+	{
+		if (!m_sorted)
+			Sort();
+
+		// the pass's draws in key order. Within a run of keys with the same program
+		// and material, submissions of the same geometry and textures are merged
+		// into one instanced draw (unless they are occlusion tested), placed where
+		// the first (nearest) of them sorted
+		m_passItems.clear();
+		m_passInstances.clear();
+		m_nextMerged.resize(m_items.size());
+		m_stats.submitted = 0;
+		m_stats.merged = 0;
+		size_t end = 0;
+		for (size_t begin = 0; begin < m_keys.size(); begin = end)
+		{
+			Key run = m_keys[begin].key >> 32;
+			for (end = begin + 1; end < m_keys.size() && (m_keys[end].key >> 32) == run; end++)
+				;
+			if ((RenderPass)(run >> 28) != pass)
+				continue;
+			m_openDraws.clear();
+			for (size_t i = begin; i < end; i++)
+			{
+				uint32_t index = m_keys[i].index;
+				const RenderItem& item = m_items[index];
+				m_nextMerged[index] = RENDERQUEUE_NO_ITEM;
+				m_stats.submitted++;
+				bool mergeable = m_autoInstancing && (!occlusion || item.occlusionId == RENDERQUEUE_NO_OCCLUSION);
+				unsigned int open = 0;
+				while (mergeable && open < m_openDraws.size() && !CanMerge(m_openDraws[open], item))
+					open++;
+				if (mergeable && open < m_openDraws.size())
+				{
+					OpenDraw& draw = m_openDraws[open];
+					m_nextMerged[draw.last] = index;
+					draw.last = index;
+					m_passInstances[draw.draw] += item.instanceCount;
+					m_stats.merged++;
+					continue;
+				}
+				if (mergeable)
+				{
+					OpenDraw draw = { static_cast<uint32_t>(m_passItems.size()), index };
+					m_openDraws.push_back(draw);
+				}
+				m_passItems.push_back(index);
+				m_passInstances.push_back(item.instanceCount);
+			}
+		}
+
+		// the transforms of every draw's instances, contiguous per draw (plus the end)
+		m_passFirstModel.clear();
+		m_passModels.clear();
+		for (size_t draw = 0; draw <= m_passItems.size(); draw++)
+		{
+			m_passFirstModel.push_back(static_cast<uint32_t>(m_passModels.size()));
+			if (draw == m_passItems.size())
+				break;
+			for (uint32_t index = m_passItems[draw]; index != RENDERQUEUE_NO_ITEM; index = m_nextMerged[index])
+			{
+				const RenderItem& item = m_items[index];
+				if (item.instanceCount > 1)
+					m_passModels.insert(m_passModels.end(), m_instanceModels.begin() + item.firstInstance,
+						m_instanceModels.begin() + item.firstInstance + item.instanceCount);
+				else
+					m_passModels.push_back(item.model);
+			}
+		}
+		m_stats.draws = static_cast<unsigned int>(m_passItems.size());
+
+		unsigned int count = static_cast<unsigned int>(m_passItems.size());
+		if (count > 0 && !AllocateBlocks(count))
+		{
+			std::cout << "ERROR::RENDERQUEUE::STREAM_BUFFER_FULL: " << count << " draws skipped" << std::endl;
+			count = 0;
+		}
+		PreparePrograms(count);
+
+		// record the ranges in parallel, then make the blocks visible to the GPU
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		unsigned int ranges = (count + RENDERQUEUE_RECORD_DRAWS - 1) / RENDERQUEUE_RECORD_DRAWS;
+		if (m_commandBuffers.size() < ranges)
+			m_commandBuffers.resize(ranges);
+		m_recordOcclusion = occlusion != NULL;
+		JobSystem::Get().ParallelFor(ranges, 1, [this, count](unsigned int begin, unsigned int end)
+		{
+			for (unsigned int range = begin; range < end; range++)
+				RecordRange(m_commandBuffers[range], range * RENDERQUEUE_RECORD_DRAWS, std::min(count, (range + 1) * RENDERQUEUE_RECORD_DRAWS));
+		}, "RecordCommands");
+		if (count > 0)
+			m_stream->Flush();
+		std::chrono::steady_clock::time_point recorded = std::chrono::steady_clock::now();
+
+		// replay them in order on this (the GL) thread
+		m_replay.Reset();
+		for (unsigned int range = 0; range < ranges; range++)
+			m_replay.Replay(m_commandBuffers[range], occlusion);
+		if (occlusion)
+			occlusion->Flush();
+		m_stats.commandBuffers = ranges;
+		m_stats.commands = m_replay.m_stats.commands;
+		m_stats.recordMs = std::chrono::duration<double, std::milli>(recorded - start).count();
+		m_stats.replayMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - recorded).count();
+	}
+
+	// issues the depth-only draws of a pass that reach any layer in layerMask and
+	// returns how many were drawn. Only "model" (and "layerMask" if the program
+	// has it, for layered rendering) is uploaded, the locations are looked up once
+	// per program run since the keys group draws by program. The uploaded mask is
+	// shifted right by maskShift, so a range of bits can address layers 0..n.
+	unsigned int ExecuteDepth(RenderPass pass, unsigned int layerMask = ~0u, unsigned int maskShift = 0)
+	{
+		if (!m_sorted)
+			Sort();
+
+		GLStateCache& state = GLStateCache::Get();
+		unsigned int drawn = 0;
+		GLuint program = 0;
+		GLint modelLocation = -1, maskLocation = -1;
+		for (size_t i = 0; i < m_keys.size(); i++)
+		{
+			if ((RenderPass)(m_keys[i].key >> 60) != pass)
+				continue;
+			RenderItem& item = m_items[m_keys[i].index];
+			if ((item.layerMask & layerMask) == 0)
+				continue;
+			if (item.shader->ID != program)
+			{
+				program = item.shader->ID;
+				modelLocation = glGetUniformLocation(program, "model");
+				maskLocation = glGetUniformLocation(program, "layerMask");
+			}
+			state.UseProgram(program);
+			glUniformMatrix4fv(modelLocation, 1, GL_FALSE, &item.model[0][0]);
+			if (maskLocation >= 0)
+				glUniform1i(maskLocation, (GLint)((item.layerMask & layerMask) >> maskShift));
+			state.BindVertexArray(item.vao);
+			if (item.indexed)
+				glDrawElements(item.primitive, item.count, GL_UNSIGNED_INT, 0);
+			else
+				glDrawArrays(item.primitive, 0, item.count);
+			state.CountDrawCall();
+			drawn++;
+		}
+		return drawn;
+	}
+
+	size_t Size() const { return m_items.size(); }
+
+	// number of draws queued for a pass (that reach any layer in layerMask)
+	size_t Count(RenderPass pass, unsigned int layerMask = ~0u) const
+	{
+		size_t count = 0;
+		for (size_t i = 0; i < m_keys.size(); i++)
+			if ((RenderPass)(m_keys[i].key >> 60) == pass && (m_items[m_keys[i].index].layerMask & layerMask) != 0)
+				count++;
+		return count;
+	}
+
+	// number of (draw, layer) pairs of a pass within layerMask, i.e. how many
+	// times a layered pass emits its geometry
+	unsigned int CountLayers(RenderPass pass, unsigned int layerMask = ~0u) const
+	{
+		unsigned int count = 0;
+		for (size_t i = 0; i < m_keys.size(); i++)
+		{
+			if ((RenderPass)(m_keys[i].key >> 60) != pass)
+				continue;
+			for (unsigned int bits = m_items[m_keys[i].index].layerMask & layerMask; bits != 0; bits &= bits - 1)
+				count++;
+		}
+		return count;
+	}
+
+	// FNV-1a hash over the keys and transforms of a pass, tells whether a pass
+	// submitted exactly the same draws as in an earlier frame. By default every
+	// draw counts, culled ones included, so culling alone never changes the hash;
+	// any other layerMask only hashes the draws that reach those layers.
+	uint64_t PassHash(RenderPass pass, unsigned int layerMask = ~0u)
+	{
+		if (!m_sorted)
+			Sort();
+		uint64_t hash = 14695981039346656037ull;
+		for (size_t i = 0; i < m_keys.size(); i++)
+		{
+			if ((RenderPass)(m_keys[i].key >> 60) != pass)
+				continue;
+			const RenderItem& item = m_items[m_keys[i].index];
+			if (layerMask != ~0u && (item.layerMask & layerMask) == 0)
+				continue;
+			hash = HashBytes(hash, &m_keys[i].key, sizeof(Key));
+			hash = HashBytes(hash, &item.model[0][0], sizeof(glm::mat4));
+			if (item.instanceCount > 1)
+				hash = HashBytes(hash, &m_instanceModels[item.firstInstance][0][0], item.instanceCount * sizeof(glm::mat4));
+			hash = HashBytes(hash, &item.count, sizeof(item.count));
+		}
+		return hash;
+	}
+
+private:
+	struct SortEntry
+	{
+		Key key;
+		uint32_t index;
+	};
+
+	std::vector<RenderItem> m_items;
+	std::vector<SortEntry> m_keys;
+	std::vector<SortEntry> m_scratch;
+	std::vector<glm::mat4> m_instanceModels;
+	bool m_sorted = false;
+
+	// the pass being executed: its items in key order and their matrices
+	glm::mat4 m_viewProjection = glm::mat4(1.0f);
+	// per draw: its first item (the rest chained by m_nextMerged), instances, first transform
+	std::vector<uint32_t> m_passItems;
+	std::vector<unsigned int> m_passInstances;
+	std::vector<uint32_t> m_passFirstModel;
+	std::vector<uint32_t> m_nextMerged;
+	// draws of the current program/material run that can still take instances
+	struct OpenDraw
+	{
+		uint32_t draw;
+		uint32_t last;
+	};
+	std::vector<OpenDraw> m_openDraws;
+	bool m_autoInstancing = true;
+	std::vector<glm::mat4> m_passModels;
+	std::vector<glm::mat4> m_passModelViewProjection;
+	std::vector<glm::mat4> m_passNormal;
+	// the pass's per draw block arrays in the stream buffer
+	StreamBuffer* m_stream = NULL;
+	std::vector<GLintptr> m_passOffsets;
+	std::vector<PerDrawBlock*> m_passBlocks;
+	// programs of the pass set up for it, on this thread before recording
+	std::vector<GLuint> m_preparedPrograms;
+	// one per range of the pass, reused between frames
+	std::vector<CommandBuffer> m_commandBuffers;
+	bool m_recordOcclusion = false;
+	GLCommandReplay m_replay;
+
+	// reserves the per draw block arrays of the executing pass in the stream buffer,
+	// one (aligned for binding) per draw. The recording jobs fill them.
+	bool AllocateBlocks(unsigned int count)
+	{
+		m_passOffsets.resize(count);
+		m_passBlocks.resize(count);
+		for (unsigned int slot = 0; slot < count; slot++)
+		{
+			m_passBlocks[slot] = static_cast<PerDrawBlock*>(m_stream->Allocate(m_passInstances[slot] * sizeof(PerDrawBlock), m_passOffsets[slot]));
+			if (!m_passBlocks[slot])
+				return false;
+		}
+		unsigned int models = static_cast<unsigned int>(m_passModels.size());
+		m_passModelViewProjection.resize(models);
+		m_passNormal.resize(models);
+		return true;
+	}
+
+	// what recording can't do off the GL thread: the "PerDraw" block binding of every
+	// program of the pass, and the material samplers of programs drawing meshes
+	void PreparePrograms(unsigned int count)
+	{
+		m_preparedPrograms.clear();
+		for (unsigned int slot = 0; slot < count; slot++)
+		{
+			const RenderItem& item = m_items[m_passItems[slot]];
+			if (std::find(m_preparedPrograms.begin(), m_preparedPrograms.end(), item.shader->ID) != m_preparedPrograms.end())
+				continue;
+			m_preparedPrograms.push_back(item.shader->ID);
+			BindPerDrawBlock(item.shader->ID);
+			if (item.mesh)
+			{
+				item.shader->use();
+				Material::PrepareProgram(*item.shader);
+			}
+		}
+	}
+
+	// job: derives the matrices of draws [begin, end) of the executing pass, writes
+	// their blocks and records them
+	void RecordRange(CommandBuffer& commands, unsigned int begin, unsigned int end)
+	{
+		uint32_t firstModel = m_passFirstModel[begin];
+		unsigned int models = m_passFirstModel[end] - firstModel;
+		TransformBatch::Multiply(m_viewProjection, &m_passModels[firstModel], models, &m_passModelViewProjection[firstModel]);
+		TransformBatch::NormalMatrices(&m_passModels[firstModel], models, &m_passNormal[firstModel]);
+
+		commands.Clear();
+		for (unsigned int slot = begin; slot < end; slot++)
+		{
+			PerDrawBlock* blocks = m_passBlocks[slot];
+			for (uint32_t i = 0, model = m_passFirstModel[slot]; model < m_passFirstModel[slot + 1]; i++, model++)
+			{
+				blocks[i].model = m_passModels[model];
+				blocks[i].modelViewProjection = m_passModelViewProjection[model];
+				blocks[i].normalMatrix = m_passNormal[model];
+			}
+			const RenderItem& item = m_items[m_passItems[slot]];
+			bool tested = m_recordOcclusion && item.occlusionId != RENDERQUEUE_NO_OCCLUSION;
+			size_t test = tested ? commands.BeginOcclusionTest(item.occlusionId, item.boundsMin, item.boundsMax) : 0;
+			RecordDraw(commands, slot);
+			if (tested)
+				commands.EndOcclusionTest(test);
+		}
+	}
+
+	// everything draw m_passItems[slot] needs, whatever was bound before it
+	void RecordDraw(CommandBuffer& commands, unsigned int slot) const
+	{
+		const RenderItem& item = m_items[m_passItems[slot]];
+		commands.UseProgram(item.shader->ID);
+		commands.BindBufferRange(GL_UNIFORM_BUFFER, RENDERQUEUE_PER_DRAW_BINDING, m_stream->Buffer(), (uint32_t)m_passOffsets[slot],
+			(uint32_t)RENDERQUEUE_PER_DRAW_RANGE);
+		if (item.mesh)
+		{
+			const std::vector<Material::Binding>& bindings = item.mesh->material.bindings;
+			for (unsigned int t = 0; t < bindings.size(); t++)
+				commands.BindTexture(bindings[t].unit, GL_TEXTURE_2D, bindings[t].texture);
+		}
+		for (unsigned int t = 0; t < item.textureCount; t++)
+			commands.BindTexture(t, GL_TEXTURE_2D, item.textures[t]);
+		commands.BindVertexArray(item.vao);
+		if (item.indexed)
+			commands.DrawIndexed(item.primitive, item.count, m_passInstances[slot]);
+		else
+			commands.Draw(item.primitive, 0, item.count, m_passInstances[slot]);
+	}
+
+	// true if item draws the same thing as the open draw and still fits into it
+	bool CanMerge(const OpenDraw& draw, const RenderItem& item) const
+	{
+		const RenderItem& first = m_items[m_passItems[draw.draw]];
+		if (m_passInstances[draw.draw] + item.instanceCount > RENDERQUEUE_MAX_INSTANCES)
+			return false;
+		if (first.shader != item.shader || first.mesh != item.mesh || first.vao != item.vao || first.primitive != item.primitive
+			|| first.count != item.count || first.indexed != item.indexed || first.textureCount != item.textureCount)
+			return false;
+		for (unsigned int t = 0; t < item.textureCount; t++)
+			if (first.textures[t] != item.textures[t])
+				return false;
+		return true;
+	}
+
+	void Push(Key key, const RenderItem& item)
+	{
+		SortEntry entry;
+		entry.key = key;
+		entry.index = static_cast<uint32_t>(m_items.size());
+		m_items.push_back(item);
+		m_keys.push_back(entry);
+		m_sorted = false;
+	}
+
+	static uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	static unsigned int QuantizeDepth(float depth)
+	{
+		if (depth < 0.0f)
+			depth = 0.0f;
+		if (depth > 1.0f)
+			depth = 1.0f;
+		return static_cast<unsigned int>(depth * 65535.0f);
+	}
+};
+
+#endif // !RENDERQUEUE_H
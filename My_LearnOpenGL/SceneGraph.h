@@ -0,0 +1,170 @@
+#ifndef SCENEGRAPH_H
+#define SCENEGRAPH_H
+
+// transform hierarchy as flat arrays (structure of arrays), nodes stored depth-first
+// so every parent comes before its children and a node's subtree is the contiguous
+// range [node, SubtreeEnd(node)).
+//
+// setting a local transform only marks the node dirty. Update() walks the array
+// once and recomputes the world matrices of the dirty subtrees only (world =
+// parent world * local TRS); clean subtrees are skipped as a whole. Large dirty
+// subtrees are split into their child subtrees and spread over the job system. The local
+// matrices of a range are built in batches by the SIMD kernels of TransformBatch.
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "TransformBatch.h"
+#include "JobSystem.h"
+
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include <algorithm>
+
+// dirty nodes per Update() below which everything stays on the calling thread
+const unsigned int SCENEGRAPH_PARALLEL_NODES = 4096;
+// local matrices composed per batch
+const unsigned int SCENEGRAPH_BATCH_NODES = 64;
+
+class SceneGraph
+{
+public:
+	static const int NO_PARENT = -1;
+
+	unsigned int NodeCount() const { return (unsigned int)m_parent.size(); }
+	int Parent(unsigned int node) const { return m_parent[node]; }
+	unsigned int SubtreeEnd(unsigned int node) const { return m_subtreeEnd[node]; }
+	const glm::mat4& World(unsigned int node) const { return m_world[node]; }
+	const glm::vec3& Position(unsigned int node) const { return m_position[node]; }
+	const glm::quat& Rotation(unsigned int node) const { return m_rotation[node]; }
+	const glm::vec3& Scale(unsigned int node) const { return m_scale[node]; }
+
+	// appends a node, depth-first: the parent must be the last node added or one of
+	// its ancestors (or NO_PARENT). Returns the node index, -1 if the order is broken.
+	int AddNode(int parent, const glm::vec3& position = glm::vec3(0.0f), const glm::quat& rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f),
+		const glm::vec3& scale = glm::vec3(1.0f))
+	{
+		unsigned int node = NodeCount();
+		if (parent != NO_PARENT && m_subtreeEnd[parent] != node)
+		{
+			std::cout << "ERROR::SCENEGRAPH::NODE_NOT_DEPTH_FIRST: parent " << parent << std::endl;
+			return -1;
+		}
+		m_parent.push_back(parent);
+		m_position.push_back(position);
+		m_rotation.push_back(rotation);
+		m_scale.push_back(scale);
+		m_world.push_back(glm::mat4(1.0f));
+		m_dirty.push_back(1);
+		m_subtreeEnd.push_back(node + 1);
+		for (int ancestor = parent; ancestor != NO_PARENT; ancestor = m_parent[ancestor])
+			m_subtreeEnd[ancestor] = node + 1;
+		return (int)node;
+	}
+
+	void SetLocal(unsigned int node, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+	{
+		m_position[node] = position;
+		m_rotation[node] = rotation;
+		m_scale[node] = scale;
+		m_dirty[node] = 1;
+	}
+
+	void SetPosition(unsigned int node, const glm::vec3& position)
+	{
+		m_position[node] = position;
+		m_dirty[node] = 1;
+	}
+
+	void SetRotation(unsigned int node, const glm::quat& rotation)
+	{
+		m_rotation[node] = rotation;
+		m_dirty[node] = 1;
+	}
+
+	// brings the world matrices up to date, returns the number of nodes recomputed
+	unsigned int Update()
+	{
+		// the dirty subtrees, outermost only (a dirty node's descendants are redone anyway)
+		m_ranges.clear();
+		unsigned int dirtyNodes = 0;
+		unsigned int count = NodeCount();
+		for (unsigned int node = 0; node < count;)
+		{
+			if (!m_dirty[node])
+			{
+				node++;
+				continue;
+			}
+			m_ranges.push_back(Range(node, m_subtreeEnd[node]));
+			dirtyNodes += m_subtreeEnd[node] - node;
+			node = m_subtreeEnd[node];
+		}
+		JobSystem& jobs = JobSystem::Get();
+		if (dirtyNodes < SCENEGRAPH_PARALLEL_NODES || jobs.WorkerCount() == 0)
+		{
+			for (unsigned int i = 0; i < m_ranges.size(); i++)
+				UpdateRange(m_ranges[i].first, m_ranges[i].second);
+			return dirtyNodes;
+		}
+
+		// split big subtrees: their root is done here, the child subtrees become work items
+		unsigned int grain = dirtyNodes / ((jobs.WorkerCount() + 1) * 4) + 1;
+		m_work.clear();
+		for (unsigned int i = 0; i < m_ranges.size(); i++)
+			SplitRange(m_ranges[i].first, m_ranges[i].second, grain);
+		// splitting leaves many small subtrees, they are batched into about four jobs per thread
+		jobs.ParallelFor((unsigned int)m_work.size(), 0, [this](unsigned int begin, unsigned int end)
+		{
+			for (unsigned int i = begin; i < end; i++)
+				UpdateRange(m_work[i].first, m_work[i].second);
+		}, "SceneGraphUpdate");
+		return dirtyNodes;
+	}
+
+private:
+	typedef std::pair<unsigned int, unsigned int> Range;
+
+	std::vector<int> m_parent;
+	std::vector<glm::vec3> m_position;
+	std::vector<glm::quat> m_rotation;
+	std::vector<glm::vec3> m_scale;
+	std::vector<glm::mat4> m_world;
+	std::vector<uint8_t> m_dirty;
+	std::vector<unsigned int> m_subtreeEnd;
+
+	std::vector<Range> m_ranges;
+	std::vector<Range> m_work;
+
+	// parents come first, so one pass in order sees every parent already updated
+	void UpdateRange(unsigned int begin, unsigned int end)
+	{
+		glm::mat4 local[SCENEGRAPH_BATCH_NODES];
+		for (unsigned int batch = begin; batch < end; batch += SCENEGRAPH_BATCH_NODES)
+		{
+			unsigned int count = std::min(end - batch, SCENEGRAPH_BATCH_NODES);
+			TransformBatch::ComposeTrs(&m_position[batch], &m_rotation[batch], &m_scale[batch], count, local);
+			for (unsigned int i = 0; i < count; i++)
+			{
+				unsigned int node = batch + i;
+				int parent = m_parent[node];
+				m_world[node] = parent == NO_PARENT ? local[i] : m_world[parent] * local[i];
+				m_dirty[node] = 0;
+			}
+		}
+	}
+
+	void SplitRange(unsigned int begin, unsigned int end, unsigned int grain)
+	{
+		if (end - begin <= grain)
+		{
+			m_work.push_back(Range(begin, end));
+			return;
+		}
+		UpdateRange(begin, begin + 1);
+		for (unsigned int child = begin + 1; child < end; child = m_subtreeEnd[child])
+			SplitRange(child, m_subtreeEnd[child], grain);
+	}
+};
+
+#endif // !SCENEGRAPH_H
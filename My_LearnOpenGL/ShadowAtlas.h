@@ -0,0 +1,506 @@
+#ifndef SHADOWATLAS_H
+#define SHADOWATLAS_H
+
+// shadows for many spot lights in one depth texture. Instead of a framebuffer and
+// a depth map per light, every light gets a square tile of the atlas:
+//
+// - ShadowAtlasAllocator hands out power of two tiles (buddy/quadtree scheme:
+//   a free tile is split into four on demand, four free siblings merge back).
+// - the tile size follows the light's screen coverage, lights outside the
+//   camera frustum give their tile back. When the atlas is full a light keeps
+//   the smaller tile it got and only tries to grow again once a tile was freed.
+// - only m_updatesPerFrame tiles are re-rendered per frame. A tile needs an update
+//   when it was (re)allocated, its light moved, or the casters reaching it changed;
+//   the waiting tiles are ordered by importance * coverage * frames waited.
+//
+// tiles are rendered with viewport + scissor into the one framebuffer, so there's
+// no framebuffer switch per light. A light whose tile was never rendered is lit
+// without shadows until its turn comes.
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "shader.h"
+#include "GLStateCache.h"
+#include "RenderQueue.h"
+#include "Frustum.h"
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <iostream>
+
+// must match MAX_SPOT_LIGHTS in 5.3.3.csm_shadow.fs (one layer mask bit per light)
+const unsigned int SHADOW_ATLAS_MAX_LIGHTS = 16;
+
+// a square region of the atlas in texels, size 0 = no tile
+struct ShadowTile
+{
+	unsigned int x, y, size;
+};
+
+class ShadowAtlasAllocator
+{
+public:
+	void Reset(unsigned int atlasSize, unsigned int minTileSize)
+	{
+		m_atlasSize = atlasSize;
+		m_minTileSize = minTileSize;
+		unsigned int levels = 1;
+		for (unsigned int size = atlasSize; size > minTileSize; size /= 2)
+			levels++;
+		m_free.assign(levels, std::vector<glm::uvec2>());
+		m_free[0].push_back(glm::uvec2(0, 0));
+	}
+
+	// size is rounded up to a power of two tile (at least the minimum tile size)
+	bool Allocate(unsigned int size, ShadowTile& tile)
+	{
+		unsigned int level = Level(size);
+		// the smallest free tile that's big enough
+		int from = (int)level;
+		while (from >= 0 && m_free[from].empty())
+			from--;
+		if (from < 0)
+			return false;
+		glm::uvec2 position = m_free[from].back();
+		m_free[from].pop_back();
+		// split down, keeping the first quadrant and freeing the other three
+		for (unsigned int l = from + 1; l <= level; l++)
+		{
+			unsigned int half = TileSize(l);
+			m_free[l].push_back(position + glm::uvec2(half, 0));
+			m_free[l].push_back(position + glm::uvec2(0, half));
+			m_free[l].push_back(position + glm::uvec2(half, half));
+		}
+		tile.x = position.x;
+		tile.y = position.y;
+		tile.size = TileSize(level);
+		return true;
+	}
+
+	void Free(const ShadowTile& tile)
+	{
+		if (tile.size == 0)
+			return;
+		unsigned int level = Level(tile.size);
+		glm::uvec2 position(tile.x, tile.y);
+		// merge with the three siblings for as long as they're free as well
+		while (level > 0)
+		{
+			unsigned int parentSize = TileSize(level - 1);
+			glm::uvec2 parent(position.x - position.x % parentSize, position.y - position.y % parentSize);
+			unsigned int half = parentSize / 2;
+			glm::uvec2 siblings[4] = { parent, parent + glm::uvec2(half, 0), parent + glm::uvec2(0, half), parent + glm::uvec2(half, half) };
+			unsigned int freeSiblings = 0;
+			for (unsigned int i = 0; i < 4; i++)
+				if (siblings[i] != position && Contains(level, siblings[i]))
+					freeSiblings++;
+			if (freeSiblings != 3)
+				break;
+			for (unsigned int i = 0; i < 4; i++)
+				if (siblings[i] != position)
+					Remove(level, siblings[i]);
+			position = parent;
+			level--;
+		}
+		m_free[level].push_back(position);
+	}
+
+	// free texels, for statistics
+	unsigned int FreeArea() const
+	{
+		unsigned int area = 0;
+		for (unsigned int l = 0; l < m_free.size(); l++)
+			area += (unsigned int)m_free[l].size() * TileSize(l) * TileSize(l);
+		return area;
+	}
+
+	unsigned int TileSize(unsigned int level) const { return m_atlasSize >> level; }
+
+private:
+	unsigned int m_atlasSize = 0;
+	unsigned int m_minTileSize = 0;
+	// free tiles per level, level 0 is the whole atlas
+	std::vector<std::vector<glm::uvec2> > m_free;
+
+	unsigned int Level(unsigned int size) const
+	{
+		unsigned int level = 0;
+		while (level + 1 < m_free.size() && TileSize(level + 1) >= size)
+			level++;
+		return level;
+	}
+
+	bool Contains(unsigned int level, const glm::uvec2& position) const
+	{
+		for (unsigned int i = 0; i < m_free[level].size(); i++)
+			if (m_free[level][i] == position)
+				return true;
+		return false;
+	}
+
+	void Remove(unsigned int level, const glm::uvec2& position)
+	{
+		for (unsigned int i = 0; i < m_free[level].size(); i++)
+		{
+			if (m_free[level][i] == position)
+			{
+				m_free[level][i] = m_free[level].back();
+				m_free[level].pop_back();
+				return;
+			}
+		}
+	}
+};
+
+class ShadowAtlas
+{
+public:
+	unsigned int m_atlasSize;
+	unsigned int m_minTileSize;
+	unsigned int m_maxTileSize;
+	// tile refreshes per frame (the K of the scheduler)
+	unsigned int m_updatesPerFrame;
+
+	// statistics of the last Update()/Render()
+	struct Stats
+	{
+		unsigned int tilesAllocated;	// lights holding a tile
+		unsigned int tilesRendered;		// tiles refreshed this frame
+		unsigned int tilesPending;		// tiles still waiting for a refresh
+		unsigned int freeArea;			// free texels of the atlas
+	};
+	Stats m_stats;
+
+	ShadowAtlas(unsigned int atlasSize = 2048, unsigned int minTileSize = 64, unsigned int maxTileSize = 1024, unsigned int updatesPerFrame = 2)
+		: m_atlasSize(atlasSize),
+		m_minTileSize(minTileSize),
+		m_maxTileSize(maxTileSize),
+		m_updatesPerFrame(updatesPerFrame),
+		m_depthMap(0),
+		m_fbo(0),
+		m_freeCount(0)
+	{
+		m_stats.tilesAllocated = m_stats.tilesRendered = m_stats.tilesPending = 0;
+		m_stats.freeArea = atlasSize * atlasSize;
+	}
+
+	// creates the atlas depth texture and its framebuffer, needs a current GL context
+	bool Init()
+	{
+		GLStateCache& state = GLStateCache::Get();
+		m_allocator.Reset(m_atlasSize, m_minTileSize);
+
+		glGenTextures(1, &m_depthMap);
+		state.BindTexture(GL_TEXTURE_2D, m_depthMap);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, m_atlasSize, m_atlasSize, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		glGenFramebuffers(1, &m_fbo);
+		state.BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_depthMap, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		if (!complete)
+			std::cout << "ERROR::FRAMEBUFFER:: Shadow atlas framebuffer is not complete!" << std::endl;
+		state.BindFramebuffer(GL_FRAMEBUFFER, 0);
+		return complete;
+	}
+
+	void Destroy()
+	{
+		GLStateCache::Get().ForgetTexture(m_depthMap);
+		glDeleteTextures(1, &m_depthMap);
+		glDeleteFramebuffers(1, &m_fbo);
+		m_depthMap = m_fbo = 0;
+	}
+
+	// adds a shadowed spot light, angles in degrees. Returns its index or -1 when full.
+	int AddLight(const glm::vec3& position, const glm::vec3& direction, const glm::vec3& color,
+		float innerAngle, float outerAngle, float range, float importance = 1.0f)
+	{
+		if (m_lights.size() >= SHADOW_ATLAS_MAX_LIGHTS)
+			return -1;
+		SpotLight light;
+		light.color = color;
+		light.innerAngle = innerAngle;
+		light.outerAngle = outerAngle;
+		light.range = range;
+		light.importance = importance;
+		light.tile.x = light.tile.y = light.tile.size = 0;
+		light.coverage = 0.0f;
+		light.rendered = false;
+		light.undersized = false;
+		light.failedAtFreeCount = 0;
+		light.dirty = true;
+		light.framesWaiting = 0;
+		light.casterHash = 0;
+		m_lights.push_back(light);
+		SetLight((unsigned int)m_lights.size() - 1, position, direction);
+		return (int)m_lights.size() - 1;
+	}
+
+	// moves a light, its tile is re-rendered when its turn comes
+	void SetLight(unsigned int index, const glm::vec3& position, const glm::vec3& direction)
+	{
+		SpotLight& light = m_lights[index];
+		glm::vec3 dir = glm::normalize(direction);
+		if (light.rendered && light.position == position && light.direction == dir)
+			return;
+		light.position = position;
+		light.direction = dir;
+		light.dirty = true;
+		glm::vec3 up = std::fabs(dir.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+		glm::mat4 projection = glm::perspective(glm::radians(2.0f * light.outerAngle), 1.0f, 0.1f, light.range);
+		light.lightSpace = projection * glm::lookAt(position, position + dir, up);
+		light.volume = Frustum(light.lightSpace);
+	}
+
+	unsigned int LightCount() const { return (unsigned int)m_lights.size(); }
+
+	// the spot lights a caster with the given world space bounds can shadow (bit per light)
+	unsigned int CasterMask(const glm::vec3& worldMin, const glm::vec3& worldMax) const
+	{
+		unsigned int mask = 0;
+		for (unsigned int i = 0; i < m_lights.size(); i++)
+			if (m_lights[i].tile.size != 0 && m_lights[i].volume.IntersectsAabb(worldMin, worldMax))
+				mask |= 1u << i;
+		return mask;
+	}
+
+	// resizes the tiles to the lights' screen coverage, call before the casters are submitted
+	void Update(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& cameraPos)
+	{
+		Frustum camera(projection * view);
+		// projection[1][1] = 1 / tan(fovY / 2)
+		float cotHalfFov = projection[1][1];
+		for (unsigned int i = 0; i < m_lights.size(); i++)
+		{
+			SpotLight& light = m_lights[i];
+			// bounding sphere of the cone
+			float radius = 0.5f * light.range;
+			float coneRadius = light.range * std::tan(glm::radians(light.outerAngle));
+			radius = radius > coneRadius ? radius : coneRadius;
+			glm::vec3 center = light.position + light.direction * (0.5f * light.range);
+			float distance = glm::length(center - cameraPos);
+
+			unsigned int wanted = 0;
+			if (camera.IntersectsAabb(center - glm::vec3(radius), center + glm::vec3(radius)))
+			{
+				light.coverage = distance <= radius ? 1.0f : glm::min(1.0f, radius * cotHalfFov / distance);
+				wanted = m_minTileSize;
+				while (wanted * 2 <= m_maxTileSize && wanted * 2 <= light.coverage * m_maxTileSize)
+					wanted *= 2;
+			}
+			else
+				light.coverage = 0.0f;
+
+			if (wanted == 0)
+			{
+				if (light.tile.size != 0)
+					ReleaseTile(light);
+				continue;
+			}
+			// shrink only when two sizes too big (no flip-flopping at a border)
+			if (wanted * 4 <= light.tile.size)
+				ReleaseTile(light);
+			if (wanted <= light.tile.size)
+			{
+				light.undersized = false;
+				continue;
+			}
+			// grow right away. A full atlas falls back to smaller tiles; a light that got
+			// less than it wants keeps that and retries only once some tile was freed
+			if (light.undersized && light.failedAtFreeCount == m_freeCount)
+				continue;
+			ShadowTile tile;
+			unsigned int size = wanted;
+			while (size > light.tile.size && size >= m_minTileSize && !m_allocator.Allocate(size, tile))
+				size /= 2;
+			if (size > light.tile.size && size >= m_minTileSize)
+			{
+				if (light.tile.size != 0)
+					ReleaseTile(light);
+				light.tile = tile;
+			}
+			light.undersized = light.tile.size < wanted;
+			light.failedAtFreeCount = m_freeCount;
+		}
+	}
+
+	// refreshes up to m_updatesPerFrame tiles of PASS_SHADOW_SPOT. depthShader
+	// takes "lightSpaceMatrix" and "model" (5.3.1.2.shadow_mapping_depth).
+	void Render(RenderQueue& queue, Shader& depthShader)
+	{
+		GLStateCache& state = GLStateCache::Get();
+		m_stats.tilesAllocated = m_stats.tilesRendered = m_stats.tilesPending = 0;
+
+		// collect the tiles that need an update
+		std::vector<unsigned int> waiting;
+		for (unsigned int i = 0; i < m_lights.size(); i++)
+		{
+			SpotLight& light = m_lights[i];
+			if (light.tile.size == 0)
+				continue;
+			m_stats.tilesAllocated++;
+			uint64_t casterHash = queue.PassHash(PASS_SHADOW_SPOT, 1u << i);
+			if (casterHash != light.casterHash)
+			{
+				light.casterHash = casterHash;
+				light.dirty = true;
+			}
+			if (light.dirty || !light.rendered)
+				waiting.push_back(i);
+		}
+
+		// most important first: tiles without any content, then importance * coverage * frames waited
+		for (unsigned int n = 0; n < waiting.size() && n < m_updatesPerFrame; n++)
+		{
+			unsigned int best = n;
+			for (unsigned int j = n + 1; j < waiting.size(); j++)
+				if (Priority(m_lights[waiting[j]]) > Priority(m_lights[waiting[best]]))
+					best = j;
+			unsigned int tmp = waiting[n];
+			waiting[n] = waiting[best];
+			waiting[best] = tmp;
+		}
+
+		if (!waiting.empty())
+		{
+			state.BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+			state.Enable(GL_SCISSOR_TEST);
+			depthShader.use();
+		}
+		for (unsigned int n = 0; n < waiting.size(); n++)
+		{
+			SpotLight& light = m_lights[waiting[n]];
+			if (n >= m_updatesPerFrame)
+			{
+				light.framesWaiting++;
+				m_stats.tilesPending++;
+				continue;
+			}
+			state.Viewport(light.tile.x, light.tile.y, light.tile.size, light.tile.size);
+			glScissor(light.tile.x, light.tile.y, light.tile.size, light.tile.size);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			depthShader.setMat4("lightSpaceMatrix", light.lightSpace);
+			queue.ExecuteDepth(PASS_SHADOW_SPOT, 1u << waiting[n]);
+			light.rendered = true;
+			light.dirty = false;
+			light.framesWaiting = 0;
+			m_stats.tilesRendered++;
+		}
+		if (!waiting.empty())
+			state.Disable(GL_SCISSOR_TEST);
+		m_stats.freeArea = m_allocator.FreeArea();
+	}
+
+	// uploads the lights and binds the atlas to a texture unit (the shader must be in use)
+	void BindForLighting(Shader& shader, unsigned int unit)
+	{
+		const LightingLocations& locations = Locations(shader);
+		glUniform1i(locations.count, (int)m_lights.size());
+		glUniform1i(locations.atlas, (int)unit);
+		for (unsigned int i = 0; i < m_lights.size(); i++)
+		{
+			const SpotLight& light = m_lights[i];
+			glm::vec3 params(std::cos(glm::radians(light.innerAngle)), std::cos(glm::radians(light.outerAngle)), light.range);
+			glUniform3fv(locations.positions[i], 1, &light.position[0]);
+			glUniform3fv(locations.directions[i], 1, &light.direction[0]);
+			glUniform3fv(locations.colors[i], 1, &light.color[0]);
+			glUniform3fv(locations.params[i], 1, &params[0]);
+			glUniformMatrix4fv(locations.lightSpaceMatrices[i], 1, GL_FALSE, &light.lightSpace[0][0]);
+			// tile in atlas uv, w = 0 when there's no shadow to sample yet
+			glm::vec4 rect(0.0f);
+			if (light.rendered && light.tile.size != 0)
+				rect = glm::vec4(light.tile.x, light.tile.y, light.tile.size, light.tile.size) / (float)m_atlasSize;
+			glUniform4fv(locations.rects[i], 1, &rect[0]);
+		}
+		GLStateCache::Get().BindTexture(unit, GL_TEXTURE_2D, m_depthMap);
+	}
+
+	GLuint DepthMap() const { return m_depthMap; }
+
+private:
+	struct SpotLight
+	{
+		glm::vec3 position;
+		glm::vec3 direction;
+		glm::vec3 color;
+		float innerAngle, outerAngle;	// degrees
+		float range;
+		float importance;
+		glm::mat4 lightSpace;
+		Frustum volume;
+		ShadowTile tile;
+		float coverage;					// rough fraction of the screen height the light covers
+		bool rendered;					// the tile holds this light's depth
+		bool undersized;				// the tile is smaller than the light wants (full atlas)
+		unsigned int failedAtFreeCount;	// m_freeCount when it last failed to grow
+		bool dirty;						// the depth is out of date
+		unsigned int framesWaiting;
+		uint64_t casterHash;
+	};
+
+	std::vector<SpotLight> m_lights;
+	ShadowAtlasAllocator m_allocator;
+	GLuint m_depthMap;
+	GLuint m_fbo;
+	// tiles given back so far, undersized lights retry when it changes
+	unsigned int m_freeCount;
+
+	// uniform locations of BindForLighting(), looked up once per program
+	struct LightingLocations
+	{
+		GLuint program;
+		GLint count, atlas;
+		GLint positions[SHADOW_ATLAS_MAX_LIGHTS], directions[SHADOW_ATLAS_MAX_LIGHTS], colors[SHADOW_ATLAS_MAX_LIGHTS];
+		GLint params[SHADOW_ATLAS_MAX_LIGHTS], lightSpaceMatrices[SHADOW_ATLAS_MAX_LIGHTS], rects[SHADOW_ATLAS_MAX_LIGHTS];
+	};
+	std::vector<LightingLocations> m_locations;
+
+	const LightingLocations& Locations(const Shader& shader)
+	{
+		for (unsigned int i = 0; i < m_locations.size(); i++)
+			if (m_locations[i].program == shader.ID)
+				return m_locations[i];
+		LightingLocations locations;
+		locations.program = shader.ID;
+		locations.count = glGetUniformLocation(shader.ID, "spotLightCount");
+		locations.atlas = glGetUniformLocation(shader.ID, "spotShadowAtlas");
+		for (unsigned int i = 0; i < SHADOW_ATLAS_MAX_LIGHTS; i++)
+		{
+			std::string index = "[" + std::to_string(i) + "]";
+			locations.positions[i] = glGetUniformLocation(shader.ID, ("spotLightPositions" + index).c_str());
+			locations.directions[i] = glGetUniformLocation(shader.ID, ("spotLightDirections" + index).c_str());
+			locations.colors[i] = glGetUniformLocation(shader.ID, ("spotLightColors" + index).c_str());
+			locations.params[i] = glGetUniformLocation(shader.ID, ("spotLightParams" + index).c_str());
+			locations.lightSpaceMatrices[i] = glGetUniformLocation(shader.ID, ("spotLightSpaceMatrices" + index).c_str());
+			locations.rects[i] = glGetUniformLocation(shader.ID, ("spotShadowRects" + index).c_str());
+		}
+		m_locations.push_back(locations);
+		return m_locations.back();
+	}
+
+	void ReleaseTile(SpotLight& light)
+	{
+		m_allocator.Free(light.tile);
+		light.tile.size = 0;
+		light.rendered = false;
+		m_freeCount++;
+	}
+
+	static float Priority(const SpotLight& light)
+	{
+		if (!light.rendered)
+			return 1e30f * light.importance;
+		return light.importance * light.coverage * (float)(light.framesWaiting + 1);
+	}
+};
+
+#endif // !SHADOWATLAS_H
@@ -0,0 +1,215 @@
+#ifndef SHADOWFILTER_H
+#define SHADOWFILTER_H
+
+// selectable filtering of the cascaded shadow map in the lit shader (5.3.3.csm_shadow.fs):
+//
+//	SHADOW_FILTER_PCF			3x3 manual depth compares (nine fetches)
+//	SHADOW_FILTER_HARDWARE_PCF	four bilinear compare taps through a GL_COMPARE_REF_TO_TEXTURE sampler
+//	SHADOW_FILTER_POISSON		rotated 16-tap Poisson disk with an early-out after 4 taps
+//	SHADOW_FILTER_EVSM			exponential variance shadow map, depth converted to moments
+//								and box blurred (separable) at shadow map resolution
+//
+// the comparison mode lives in a sampler object, so the depth array itself stays a
+// regular texture for the manual modes. The EVSM moments are only allocated once
+// that mode is used.
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "GLStateCache.h"
+#include "Material.h"
+
+#include <string>
+
+// must match the FILTER_* defines in 5.3.3.csm_shadow.fs
+enum ShadowFilterMode
+{
+	SHADOW_FILTER_PCF = 0,
+	SHADOW_FILTER_HARDWARE_PCF = 1,
+	SHADOW_FILTER_POISSON = 2,
+	SHADOW_FILTER_EVSM = 3,
+	SHADOW_FILTER_COUNT
+};
+
+// texture units the lit shader reads the shadow map through, besides "shadowMap".
+// Past the material units, so no mesh texture lands on them
+const unsigned int SHADOW_COMPARE_UNIT = MATERIAL_TEXTURE_UNITS;
+const unsigned int SHADOW_MOMENTS_UNIT = MATERIAL_TEXTURE_UNITS + 1;
+
+class ShadowFilter
+{
+public:
+	ShadowFilterMode m_mode;
+	// EVSM warp exponents (positive, negative), 40 is about the limit of 32-bit floats
+	glm::vec2 m_evsmExponents;
+	// EVSM blur taps to each side (up to MAX_BLUR_RADIUS in the blur shader)
+	int m_blurRadius;
+
+	ShadowFilter()
+		: m_mode(SHADOW_FILTER_PCF),
+		m_evsmExponents(40.0f, 5.0f),
+		m_blurRadius(2),
+		m_resolution(0),
+		m_layers(0),
+		m_compareSampler(0),
+		m_moments(0),
+		m_blurTemp(0),
+		m_fbo(0),
+		m_emptyVAO(0)
+	{
+	}
+
+	static const char* ModeName(ShadowFilterMode mode)
+	{
+		switch (mode)
+		{
+		case SHADOW_FILTER_PCF: return "pcf";
+		case SHADOW_FILTER_HARDWARE_PCF: return "hwpcf";
+		case SHADOW_FILTER_POISSON: return "poisson";
+		case SHADOW_FILTER_EVSM: return "evsm";
+		default: return "unknown";
+		}
+	}
+
+	static bool ModeFromName(const std::string& name, ShadowFilterMode& mode)
+	{
+		for (int i = 0; i < SHADOW_FILTER_COUNT; i++)
+		{
+			if (name == ModeName((ShadowFilterMode)i))
+			{
+				mode = (ShadowFilterMode)i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// creates the comparison sampler, resolution/layers describe the shadow depth array
+	void Init(unsigned int resolution, unsigned int layers)
+	{
+		m_resolution = resolution;
+		m_layers = layers;
+		glGenSamplers(1, &m_compareSampler);
+		glSamplerParameteri(m_compareSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glSamplerParameteri(m_compareSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glSamplerParameteri(m_compareSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glSamplerParameteri(m_compareSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		GLfloat borderColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+		glSamplerParameterfv(m_compareSampler, GL_TEXTURE_BORDER_COLOR, borderColor);
+		glSamplerParameteri(m_compareSampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glSamplerParameteri(m_compareSampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	}
+
+	void Destroy()
+	{
+		GLStateCache& state = GLStateCache::Get();
+		state.ForgetTexture(m_moments);
+		state.ForgetTexture(m_blurTemp);
+		glDeleteSamplers(1, &m_compareSampler);
+		glDeleteTextures(1, &m_moments);
+		glDeleteTextures(1, &m_blurTemp);
+		glDeleteFramebuffers(1, &m_fbo);
+		glDeleteVertexArrays(1, &m_emptyVAO);
+		m_compareSampler = m_moments = m_blurTemp = m_fbo = m_emptyVAO = 0;
+	}
+
+	// only EVSM needs work between the shadow pass and the lit pass: converts every
+	// layer of the depth array to moments and blurs them (horizontal pass into a
+	// scratch layer, vertical pass into the moments array)
+	void Prefilter(Shader& blurShader, GLuint depthArray)
+	{
+		if (m_mode != SHADOW_FILTER_EVSM)
+			return;
+		if (m_moments == 0)
+			CreateMoments();
+
+		GLStateCache& state = GLStateCache::Get();
+		state.Disable(GL_DEPTH_TEST);
+		state.Viewport(0, 0, m_resolution, m_resolution);
+		state.BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		state.BindVertexArray(m_emptyVAO);
+		blurShader.use();
+		blurShader.setInt("source", 0);
+		blurShader.setInt("blurRadius", m_blurRadius);
+		blurShader.setVec2("exponents", m_evsmExponents);
+		float texel = 1.0f / m_resolution;
+		for (unsigned int layer = 0; layer < m_layers; layer++)
+		{
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_blurTemp, 0, 0);
+			state.BindTexture(0, GL_TEXTURE_2D_ARRAY, depthArray);
+			blurShader.setInt("layer", (int)layer);
+			blurShader.setBool("toMoments", true);
+			blurShader.setVec2("direction", glm::vec2(texel, 0.0f));
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			state.CountDrawCall();
+
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_moments, 0, layer);
+			state.BindTexture(0, GL_TEXTURE_2D_ARRAY, m_blurTemp);
+			blurShader.setInt("layer", 0);
+			blurShader.setBool("toMoments", false);
+			blurShader.setVec2("direction", glm::vec2(0.0f, texel));
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			state.CountDrawCall();
+		}
+		state.Enable(GL_DEPTH_TEST);
+	}
+
+	// selects the mode in the lit shader and binds the depth array (compare sampler)
+	// and the moments to their units
+	void BindForLighting(Shader& shader, GLuint depthArray)
+	{
+		GLStateCache& state = GLStateCache::Get();
+		shader.setInt("shadowFilter", (int)m_mode);
+		shader.setInt("shadowMapCompare", (int)SHADOW_COMPARE_UNIT);
+		shader.setInt("shadowMoments", (int)SHADOW_MOMENTS_UNIT);
+		shader.setVec2("evsmExponents", m_evsmExponents);
+		// sampler objects aren't tracked by the state cache, nothing else binds one
+		glBindSampler(SHADOW_COMPARE_UNIT, m_compareSampler);
+		state.BindTexture(SHADOW_COMPARE_UNIT, GL_TEXTURE_2D_ARRAY, depthArray);
+		// without moments the unit still needs a 2D array behind it
+		state.BindTexture(SHADOW_MOMENTS_UNIT, GL_TEXTURE_2D_ARRAY, m_moments != 0 ? m_moments : depthArray);
+	}
+
+	// takes the compare sampler off its unit again, call after the lit pass so it
+	// doesn't apply to whatever texture is bound there next
+	void EndLighting()
+	{
+		glBindSampler(SHADOW_COMPARE_UNIT, 0);
+	}
+
+private:
+	unsigned int m_resolution;
+	unsigned int m_layers;
+	GLuint m_compareSampler;
+	GLuint m_moments;	// RGBA32F array: exp(c+ d), its square, -exp(-c- d), its square
+	GLuint m_blurTemp;	// one RGBA32F layer between the two blur passes
+	GLuint m_fbo;
+	GLuint m_emptyVAO;	// the fullscreen triangle is generated from gl_VertexID
+
+	GLuint CreateMomentArray(unsigned int layers)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		GLStateCache::Get().BindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA32F, m_resolution, m_resolution, layers, 0, GL_RGBA, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		return texture;
+	}
+
+	void CreateMoments()
+	{
+		m_moments = CreateMomentArray(m_layers);
+		m_blurTemp = CreateMomentArray(1);
+		glGenFramebuffers(1, &m_fbo);
+		GLStateCache::Get().BindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_moments, 0, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			std::cout << "ERROR::FRAMEBUFFER:: EVSM framebuffer is not complete!" << std::endl;
+		glGenVertexArrays(1, &m_emptyVAO);
+	}
+};
+
+#endif // !SHADOWFILTER_H
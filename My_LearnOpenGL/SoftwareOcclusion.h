@@ -0,0 +1,317 @@
+#ifndef SOFTWAREOCCLUSION_H
+#define SOFTWAREOCCLUSION_H
+
+// CPU occlusion culling: a few low-poly occluders (solid boxes) are rasterized
+// into a small depth buffer, then the bounding box of every draw is tested
+// against it before the draw reaches the render queue. No GL involved, so it
+// can be used (and tested) without a context.
+//
+// layout: row-major NDC depth (z / w, nearer is smaller) in 8x8 pixel tiles, with
+// the farthest depth of every tile kept as a one level hierarchy. Most occluded
+// boxes are rejected by the tile depths alone. Rows are rasterized 4 pixels at a
+// time (SSE, scalar fallback).
+//
+// threading: Kick() queues one job per row of tiles on the job system (no locking,
+// every tile row belongs to one job). The caller keeps going (e.g. submitting the
+// shadow passes) and calls Wait() before the first IsVisible().
+#include <glm/glm.hpp>
+
+#include "JobSystem.h"
+
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCCLUSION_USE_SSE 1
+#endif
+
+const unsigned int OCCLUSION_TILE_SIZE = 8;
+
+class SoftwareOcclusion
+{
+public:
+	// statistics of the last frame
+	struct Stats
+	{
+		unsigned int occluderTriangles;	// after near plane clipping
+		unsigned int tested;
+		unsigned int occluded;
+		double rasterMs;				// Kick() until the last tile row is done
+	};
+	Stats m_stats;
+
+	// width and height are rounded up to whole tiles
+	SoftwareOcclusion(unsigned int width = 256, unsigned int height = 144)
+		: m_width((width + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE * OCCLUSION_TILE_SIZE),
+		m_height((height + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE * OCCLUSION_TILE_SIZE)
+	{
+		m_tilesX = m_width / OCCLUSION_TILE_SIZE;
+		m_tilesY = m_height / OCCLUSION_TILE_SIZE;
+		m_depth.assign(m_width * m_height, 1.0f);
+		m_tileMax.assign(m_tilesX * m_tilesY, 1.0f);
+		m_stats.occluderTriangles = m_stats.tested = m_stats.occluded = 0;
+		m_stats.rasterMs = 0.0;
+	}
+
+	unsigned int Width() const { return m_width; }
+	unsigned int Height() const { return m_height; }
+	float Depth(unsigned int x, unsigned int y) const { return m_depth[y * m_width + x]; }
+
+	// starts collecting this frame's occluders
+	void BeginFrame(const glm::mat4& viewProj)
+	{
+		m_viewProj = viewProj;
+		m_triangles.clear();
+		m_stats.occluderTriangles = m_stats.tested = m_stats.occluded = 0;
+	}
+
+	// a solid box (local bounds, transformed by model), flat boxes work too
+	void AddBoxOccluder(const glm::mat4& model, const glm::vec3& boxMin, const glm::vec3& boxMax)
+	{
+		glm::vec4 corners[8];
+		ClipCorners(m_viewProj * model, boxMin, boxMax, corners);
+		// two triangles per face, corner index bits are x, y, z
+		static const unsigned int faces[6][4] = {
+			{ 0, 2, 6, 4 }, { 1, 5, 7, 3 },	// -x, +x
+			{ 0, 4, 5, 1 }, { 2, 3, 7, 6 },	// -y, +y
+			{ 0, 1, 3, 2 }, { 4, 6, 7, 5 } };	// -z, +z
+		for (unsigned int f = 0; f < 6; f++)
+		{
+			AddClipTriangle(corners[faces[f][0]], corners[faces[f][1]], corners[faces[f][2]]);
+			AddClipTriangle(corners[faces[f][0]], corners[faces[f][2]], corners[faces[f][3]]);
+		}
+	}
+
+	// clears the buffer and rasterizes the occluders on the job system (inline
+	// without worker threads)
+	void Kick()
+	{
+		m_kickTime = std::chrono::steady_clock::now();
+		m_rowsDone = 0;
+		JobSystem::Get().ParallelFor(m_tilesY, 1, &SoftwareOcclusion::RasterizeTileRows, this, m_counter, NULL, "OcclusionRaster");
+	}
+
+	// helps with the rows until all are done
+	void Wait()
+	{
+		JobSystem::Get().Wait(m_counter);
+	}
+
+	// false only if the world space box is hidden behind the occluders or off screen
+	bool IsVisible(const glm::vec3& worldMin, const glm::vec3& worldMax)
+	{
+		m_stats.tested++;
+		glm::vec4 corners[8];
+		ClipCorners(m_viewProj, worldMin, worldMax, corners);
+		glm::vec2 screenMin(1e30f), screenMax(-1e30f);
+		float nearest = 1e30f;
+		for (unsigned int i = 0; i < 8; i++)
+		{
+			// crosses the near plane, can't be projected
+			if (corners[i].z < -corners[i].w)
+				return true;
+			glm::vec3 screen = ToScreen(corners[i]);
+			screenMin = glm::min(screenMin, glm::vec2(screen));
+			screenMax = glm::max(screenMax, glm::vec2(screen));
+			nearest = std::min(nearest, screen.z);
+		}
+		int x0 = std::max(0, (int)std::floor(screenMin.x)), x1 = std::min((int)m_width - 1, (int)std::floor(screenMax.x));
+		int y0 = std::max(0, (int)std::floor(screenMin.y)), y1 = std::min((int)m_height - 1, (int)std::floor(screenMax.y));
+		if (x0 > x1 || y0 > y1 || nearest > 1.0f)
+		{
+			m_stats.occluded++;
+			return false;
+		}
+		// interpolated occluder depth may land a hair in front of a coplanar box face
+		nearest -= 1e-5f;
+		for (int ty = y0 / (int)OCCLUSION_TILE_SIZE; ty <= y1 / (int)OCCLUSION_TILE_SIZE; ty++)
+			for (int tx = x0 / (int)OCCLUSION_TILE_SIZE; tx <= x1 / (int)OCCLUSION_TILE_SIZE; tx++)
+			{
+				// everything in the tile is nearer than the box
+				if (m_tileMax[ty * m_tilesX + tx] < nearest)
+					continue;
+				int px0 = std::max(x0, tx * (int)OCCLUSION_TILE_SIZE), px1 = std::min(x1, (tx + 1) * (int)OCCLUSION_TILE_SIZE - 1);
+				int py0 = std::max(y0, ty * (int)OCCLUSION_TILE_SIZE), py1 = std::min(y1, (ty + 1) * (int)OCCLUSION_TILE_SIZE - 1);
+				for (int y = py0; y <= py1; y++)
+					for (int x = px0; x <= px1; x++)
+						if (m_depth[y * m_width + x] >= nearest)
+							return true;
+			}
+		m_stats.occluded++;
+		return false;
+	}
+
+private:
+	// screen space triangle, counter-clockwise, with its edge and depth plane equations
+	struct Triangle
+	{
+		float edgeA[3], edgeB[3], edgeC[3];	// inside where A * x + B * y + C >= 0 for all edges
+		float depthA, depthB, depthC;		// z = A * x + B * y + C
+		int minX, maxX, minY, maxY;			// pixel bounds, clamped to the buffer
+	};
+
+	unsigned int m_width, m_height;
+	unsigned int m_tilesX, m_tilesY;
+	std::vector<float> m_depth;
+	std::vector<float> m_tileMax;
+	glm::mat4 m_viewProj;
+	std::vector<Triangle> m_triangles;
+	JobCounter m_counter;
+	std::atomic<unsigned int> m_rowsDone;
+	std::chrono::steady_clock::time_point m_kickTime;
+
+	static void ClipCorners(const glm::mat4& matrix, const glm::vec3& boxMin, const glm::vec3& boxMax, glm::vec4* corners)
+	{
+		for (unsigned int i = 0; i < 8; i++)
+		{
+			glm::vec3 corner((i & 1) ? boxMax.x : boxMin.x, (i & 2) ? boxMax.y : boxMin.y, (i & 4) ? boxMax.z : boxMin.z);
+			corners[i] = matrix * glm::vec4(corner, 1.0f);
+		}
+	}
+
+	// clip space to pixels, z stays NDC
+	glm::vec3 ToScreen(const glm::vec4& clip) const
+	{
+		glm::vec3 ndc = glm::vec3(clip) / clip.w;
+		return glm::vec3((ndc.x * 0.5f + 0.5f) * m_width, (ndc.y * 0.5f + 0.5f) * m_height, ndc.z);
+	}
+
+	// clips against the near plane (z >= -w), the rest is handled by the pixel bounds
+	void AddClipTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c)
+	{
+		const glm::vec4* in[3] = { &a, &b, &c };
+		glm::vec4 polygon[4];
+		unsigned int count = 0;
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			const glm::vec4& from = *in[i];
+			const glm::vec4& to = *in[(i + 1) % 3];
+			float fromDistance = from.z + from.w, toDistance = to.z + to.w;
+			if (fromDistance >= 0.0f)
+				polygon[count++] = from;
+			if ((fromDistance >= 0.0f) != (toDistance >= 0.0f))
+				polygon[count++] = glm::mix(from, to, fromDistance / (fromDistance - toDistance));
+		}
+		for (unsigned int i = 2; i < count; i++)
+			AddScreenTriangle(ToScreen(polygon[0]), ToScreen(polygon[i - 1]), ToScreen(polygon[i]));
+	}
+
+	void AddScreenTriangle(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2)
+	{
+		float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+		if (std::fabs(area) < 1e-8f)
+			return;
+		// occluders are solid, either winding is rasterized
+		if (area < 0.0f)
+		{
+			std::swap(v1, v2);
+			area = -area;
+		}
+		Triangle triangle;
+		triangle.minX = std::max(0, (int)std::floor(std::min(v0.x, std::min(v1.x, v2.x))));
+		triangle.maxX = std::min((int)m_width - 1, (int)std::ceil(std::max(v0.x, std::max(v1.x, v2.x))));
+		triangle.minY = std::max(0, (int)std::floor(std::min(v0.y, std::min(v1.y, v2.y))));
+		triangle.maxY = std::min((int)m_height - 1, (int)std::ceil(std::max(v0.y, std::max(v1.y, v2.y))));
+		if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+			return;
+		const glm::vec3* v[3] = { &v0, &v1, &v2 };
+		for (unsigned int e = 0; e < 3; e++)
+		{
+			const glm::vec3& from = *v[e];
+			const glm::vec3& to = *v[(e + 1) % 3];
+			triangle.edgeA[e] = from.y - to.y;
+			triangle.edgeB[e] = to.x - from.x;
+			triangle.edgeC[e] = -(triangle.edgeA[e] * from.x + triangle.edgeB[e] * from.y);
+		}
+		triangle.depthA = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+		triangle.depthB = ((v1.x - v0.x) * (v2.z - v0.z) - (v2.x - v0.x) * (v1.z - v0.z)) / area;
+		triangle.depthC = v0.z - triangle.depthA * v0.x - triangle.depthB * v0.y;
+		m_triangles.push_back(triangle);
+		m_stats.occluderTriangles++;
+	}
+
+	// job over a range of tile rows, the one finishing the last row stops the clock
+	static void RasterizeTileRows(void* data, unsigned int begin, unsigned int end)
+	{
+		SoftwareOcclusion& self = *static_cast<SoftwareOcclusion*>(data);
+		for (unsigned int row = begin; row < end; row++)
+			self.RasterizeTileRow(row);
+		if (self.m_rowsDone.fetch_add(end - begin) + (end - begin) == self.m_tilesY)
+			self.m_stats.rasterMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - self.m_kickTime).count();
+	}
+
+	// clears the pixel rows of one tile row, draws every triangle touching it, then
+	// updates the tiles' farthest depth
+	void RasterizeTileRow(unsigned int row)
+	{
+		int rowMin = (int)(row * OCCLUSION_TILE_SIZE), rowMax = rowMin + (int)OCCLUSION_TILE_SIZE - 1;
+		std::fill(m_depth.begin() + rowMin * m_width, m_depth.begin() + (rowMax + 1) * m_width, 1.0f);
+		for (size_t t = 0; t < m_triangles.size(); t++)
+		{
+			const Triangle& triangle = m_triangles[t];
+			int y0 = std::max(rowMin, triangle.minY), y1 = std::min(rowMax, triangle.maxY);
+			for (int y = y0; y <= y1; y++)
+				RasterizeSpan(triangle, y);
+		}
+		for (unsigned int tx = 0; tx < m_tilesX; tx++)
+		{
+			float farthest = 0.0f;
+			for (int y = rowMin; y <= rowMax; y++)
+				for (unsigned int x = tx * OCCLUSION_TILE_SIZE; x < (tx + 1) * OCCLUSION_TILE_SIZE; x++)
+					farthest = std::max(farthest, m_depth[y * m_width + x]);
+			m_tileMax[row * m_tilesX + tx] = farthest;
+		}
+	}
+
+	// one pixel row of a triangle, a pixel is covered when its center is inside
+	void RasterizeSpan(const Triangle& triangle, int y)
+	{
+		float* depthRow = &m_depth[y * m_width];
+		float py = y + 0.5f;
+		int x = triangle.minX & ~3;
+#ifdef OCCLUSION_USE_SSE
+		__m128 zero = _mm_setzero_ps();
+		__m128 rowEdge[3], edgeA[3];
+		for (unsigned int e = 0; e < 3; e++)
+		{
+			rowEdge[e] = _mm_set1_ps(triangle.edgeB[e] * py + triangle.edgeC[e]);
+			edgeA[e] = _mm_set1_ps(triangle.edgeA[e]);
+		}
+		__m128 rowDepth = _mm_set1_ps(triangle.depthB * py + triangle.depthC);
+		__m128 depthA = _mm_set1_ps(triangle.depthA);
+		__m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+		// the buffer width is a multiple of 4, so the last group stays inside the row
+		for (; x <= triangle.maxX; x += 4)
+		{
+			__m128 px = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+			__m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeA[0], px), rowEdge[0]), zero);
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeA[1], px), rowEdge[1]), zero));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeA[2], px), rowEdge[2]), zero));
+			if (_mm_movemask_ps(inside) == 0)
+				continue;
+			__m128 depth = _mm_add_ps(_mm_mul_ps(depthA, px), rowDepth);
+			__m128 old = _mm_loadu_ps(depthRow + x);
+			__m128 nearer = _mm_min_ps(old, depth);
+			_mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+		}
+#else
+		for (; x <= triangle.maxX; x++)
+		{
+			float px = x + 0.5f;
+			bool inside = true;
+			for (unsigned int e = 0; e < 3; e++)
+				inside = inside && triangle.edgeA[e] * px + triangle.edgeB[e] * py + triangle.edgeC[e] >= 0.0f;
+			if (!inside)
+				continue;
+			float depth = triangle.depthA * px + triangle.depthB * py + triangle.depthC;
+			depthRow[x] = std::min(depthRow[x], depth);
+		}
+#endif
+	}
+};
+
+#endif // !SOFTWAREOCCLUSION_H
@@ -0,0 +1,133 @@
+#ifndef STATICBATCH_H
+#define STATICBATCH_H
+
+// geometry that never moves, pre-transformed into world space and merged into one
+// vertex and index buffer, so all of it is drawn with a single call and no per
+// object uniforms. Add() the primitives with their world matrices, then Build()
+// uploads the merge. The batch has the same two vertex arrays as a Primitive
+// (full layout and positions only) and the world space bounds of everything in it.
+//
+// the sources are copied, moving one afterwards leaves the batch stale: only
+// objects that are static for good belong in here.
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "GLStateCache.h"
+#include "PrimitiveCache.h"
+
+#include <vector>
+
+class StaticBatch
+{
+public:
+	StaticBatch()
+		: m_vao(0),
+		m_shadowVAO(0),
+		m_indexCount(0),
+		m_sources(0),
+		m_boundsMin(0.0f),
+		m_boundsMax(0.0f)
+	{
+		m_buffers[0] = m_buffers[1] = m_buffers[2] = 0;
+	}
+
+	// appends a primitive transformed by world (normals by its inverse transpose)
+	void Add(const Primitive& primitive, const glm::mat4& world)
+	{
+		glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(world)));
+		unsigned int base = (unsigned int)(m_vertices.size() / PRIMITIVE_VERTEX_FLOATS);
+		unsigned int vertexCount = (unsigned int)(primitive.vertices.size() / PRIMITIVE_VERTEX_FLOATS);
+		for (unsigned int i = 0; i < vertexCount; i++)
+		{
+			const float* source = &primitive.vertices[i * PRIMITIVE_VERTEX_FLOATS];
+			glm::vec3 position(world * glm::vec4(source[0], source[1], source[2], 1.0f));
+			glm::vec3 normal = glm::normalize(normalMatrix * glm::vec3(source[3], source[4], source[5]));
+			if (m_vertices.empty())
+				m_boundsMin = m_boundsMax = position;
+			m_boundsMin = glm::min(m_boundsMin, position);
+			m_boundsMax = glm::max(m_boundsMax, position);
+			float vertex[PRIMITIVE_VERTEX_FLOATS] = { position.x, position.y, position.z, normal.x, normal.y, normal.z, source[6], source[7] };
+			m_vertices.insert(m_vertices.end(), vertex, vertex + PRIMITIVE_VERTEX_FLOATS);
+		}
+		for (unsigned int i = 0; i < primitive.indices.size(); i++)
+			m_indices.push_back(base + primitive.indices[i]);
+		m_sources++;
+	}
+
+	// uploads the merged geometry (again, after more Add()s), needs a current GL context
+	void Build()
+	{
+		if (m_vao == 0)
+		{
+			glGenVertexArrays(1, &m_vao);
+			glGenVertexArrays(1, &m_shadowVAO);
+			glGenBuffers(3, m_buffers);
+		}
+		unsigned int vertexCount = (unsigned int)(m_vertices.size() / PRIMITIVE_VERTEX_FLOATS);
+		std::vector<float> positions(vertexCount * 3);
+		for (unsigned int i = 0; i < vertexCount; i++)
+			for (unsigned int c = 0; c < 3; c++)
+				positions[i * 3 + c] = m_vertices[i * PRIMITIVE_VERTEX_FLOATS + c];
+
+		GLStateCache& state = GLStateCache::Get();
+		state.BindVertexArray(m_vao);
+		glBindBuffer(GL_ARRAY_BUFFER, m_buffers[0]);
+		glBufferData(GL_ARRAY_BUFFER, m_vertices.size() * sizeof(float), m_vertices.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_buffers[2]);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), m_indices.data(), GL_STATIC_DRAW);
+		GLsizei stride = PRIMITIVE_VERTEX_FLOATS * sizeof(float);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(6 * sizeof(float)));
+
+		state.BindVertexArray(m_shadowVAO);
+		glBindBuffer(GL_ARRAY_BUFFER, m_buffers[1]);
+		glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(float), positions.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_buffers[2]);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+		state.BindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		m_indexCount = (GLsizei)m_indices.size();
+	}
+
+	void Destroy()
+	{
+		if (m_vao != 0)
+		{
+			glDeleteVertexArrays(1, &m_vao);
+			glDeleteVertexArrays(1, &m_shadowVAO);
+			glDeleteBuffers(3, m_buffers);
+		}
+		m_vao = m_shadowVAO = 0;
+		m_buffers[0] = m_buffers[1] = m_buffers[2] = 0;
+		m_vertices.clear();
+		m_indices.clear();
+		m_indexCount = 0;
+		m_sources = 0;
+	}
+
+	bool Empty() const { return m_indexCount == 0; }
+	GLuint VAO() const { return m_vao; }
+	GLuint ShadowVAO() const { return m_shadowVAO; }
+	GLsizei IndexCount() const { return m_indexCount; }
+	// primitives merged into the batch
+	unsigned int SourceCount() const { return m_sources; }
+	const glm::vec3& BoundsMin() const { return m_boundsMin; }
+	const glm::vec3& BoundsMax() const { return m_boundsMax; }
+
+private:
+	GLuint m_vao;
+	GLuint m_shadowVAO;
+	GLuint m_buffers[3];
+	GLsizei m_indexCount;
+	unsigned int m_sources;
+	glm::vec3 m_boundsMin, m_boundsMax;
+	std::vector<float> m_vertices;
+	std::vector<unsigned int> m_indices;
+};
+
+#endif // !STATICBATCH_H
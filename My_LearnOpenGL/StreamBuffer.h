@@ -0,0 +1,249 @@
+#ifndef STREAMBUFFER_H
+#define STREAMBUFFER_H
+
+// ring buffer for data written by the CPU every frame (per draw constants). The
+// buffer is split into one region per frame in flight; a frame only writes its
+// own region, and before reusing a region BeginFrame() waits on the fence that
+// EndFrame() put behind the last frame that wrote it. Allocate() hands out
+// aligned pieces of the region, which are bound with glBindBufferRange().
+//
+// with GL 4.4 or ARB_buffer_storage the buffer is created with glBufferStorage
+// and stays mapped (persistent + coherent), so writes go straight to the buffer.
+// Otherwise (plain GL 3.3) the region is written to a CPU copy and Flush()
+// uploads what was written since the last flush with glBufferSubData().
+//
+// fence waits are timed, so a CPU stall on the GPU shows up in m_stats.
+//
+// a range may be bound longer than what was allocated for it (a uniform block
+// must be bound at its declared size even if only its first array elements are
+// written); Init()'s bindSize keeps such ranges inside the buffer.
+#include <glad/glad.h>
+
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+// frames the CPU may run ahead of the GPU
+const unsigned int STREAMBUFFER_FRAMES = 3;
+
+// glBufferStorage isn't part of the GL 3.3 loader, it is fetched by hand when the
+// driver has it
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void (APIENTRYP PFNSTREAMBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+class StreamBuffer
+{
+public:
+	// statistics of the last frame
+	struct Stats
+	{
+		double waitMs;				// BeginFrame() blocked on the region's fence
+		unsigned int waits;			// 1 if the fence wasn't signaled yet
+		unsigned int allocations;
+		unsigned int bytes;			// of the region, alignment padding included
+		unsigned int overflows;		// allocations that didn't fit
+	};
+	Stats m_stats;
+
+	StreamBuffer()
+		: m_buffer(0),
+		m_target(GL_UNIFORM_BUFFER),
+		m_regionSize(0),
+		m_frames(STREAMBUFFER_FRAMES),
+		m_alignment(16),
+		m_region(0),
+		m_head(0),
+		m_flushed(0),
+		m_mapped(NULL),
+		m_persistent(false)
+	{
+		ResetStats();
+	}
+
+	// creates the buffer, regionSize bytes per frame in flight. load fetches
+	// glBufferStorage (e.g. glfwGetProcAddress), without it the fallback is used.
+	// bindSize is the longest range that will be bound at an allocation.
+	void Init(GLenum target, GLsizeiptr regionSize, GLADloadproc load = NULL, unsigned int frames = STREAMBUFFER_FRAMES, GLsizeiptr bindSize = 0)
+	{
+		m_target = target;
+		m_frames = frames;
+		m_alignment = 16;
+		if (target == GL_UNIFORM_BUFFER)
+		{
+			GLint alignment = 0;
+			glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+			if (alignment > m_alignment)
+				m_alignment = alignment;
+		}
+		m_regionSize = (regionSize + m_alignment - 1) / m_alignment * m_alignment;
+		m_fences.assign(m_frames, (GLsync)0);
+
+		PFNSTREAMBUFFERSTORAGEPROC bufferStorage = NULL;
+		if (load && HasBufferStorage())
+			bufferStorage = (PFNSTREAMBUFFERSTORAGEPROC)load("glBufferStorage");
+
+		GLsizeiptr size = m_regionSize * m_frames + bindSize;
+		glGenBuffers(1, &m_buffer);
+		glBindBuffer(m_target, m_buffer);
+		if (bufferStorage)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			bufferStorage(m_target, size, NULL, flags);
+			m_mapped = static_cast<unsigned char*>(glMapBufferRange(m_target, 0, size, flags));
+		}
+		m_persistent = m_mapped != NULL;
+		if (!m_persistent)
+		{
+			if (bufferStorage)
+			{
+				std::cout << "ERROR::STREAMBUFFER::PERSISTENT_MAP_FAILED, falling back to glBufferSubData" << std::endl;
+				// immutable storage can't be reallocated, start over with a mutable buffer
+				glDeleteBuffers(1, &m_buffer);
+				glGenBuffers(1, &m_buffer);
+				glBindBuffer(m_target, m_buffer);
+			}
+			glBufferData(m_target, size, NULL, GL_STREAM_DRAW);
+			m_shadow.resize(size);
+			m_mapped = m_shadow.data();
+		}
+		glBindBuffer(m_target, 0);
+		m_region = m_frames - 1;
+		m_head = m_flushed = m_region * m_regionSize;
+	}
+
+	void Destroy()
+	{
+		for (unsigned int i = 0; i < m_fences.size(); i++)
+			if (m_fences[i])
+				glDeleteSync(m_fences[i]);
+		m_fences.clear();
+		if (m_persistent)
+		{
+			glBindBuffer(m_target, m_buffer);
+			glUnmapBuffer(m_target);
+			glBindBuffer(m_target, 0);
+		}
+		glDeleteBuffers(1, &m_buffer);
+		m_buffer = 0;
+		m_mapped = NULL;
+		m_shadow.clear();
+	}
+
+	GLuint Buffer() const { return m_buffer; }
+	GLint Alignment() const { return m_alignment; }
+	bool Persistent() const { return m_persistent; }
+
+	// moves on to the next region, waiting until the GPU is done with it
+	void BeginFrame()
+	{
+		ResetStats();
+		m_region = (m_region + 1) % m_frames;
+		GLsync& fence = m_fences[m_region];
+		if (fence)
+		{
+			GLenum result = glClientWaitSync(fence, 0, 0);
+			if (result == GL_TIMEOUT_EXPIRED)
+			{
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				m_stats.waits = 1;
+				// flush once so the fence can signal at all, then wait in 1 ms steps
+				GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+				do
+				{
+					result = glClientWaitSync(fence, flags, 1000000);
+					flags = 0;
+				} while (result == GL_TIMEOUT_EXPIRED);
+				m_stats.waitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			}
+			glDeleteSync(fence);
+			fence = 0;
+		}
+		m_head = m_flushed = m_region * m_regionSize;
+	}
+
+	// reserves size bytes of this frame's region, returns where to write them
+	// (offset receives their offset in the buffer), NULL if the region is full
+	void* Allocate(GLsizeiptr size, GLintptr& offset)
+	{
+		GLintptr start = (m_head + m_alignment - 1) / m_alignment * m_alignment;
+		if (start + size > (GLintptr)(m_region + 1) * m_regionSize)
+		{
+			m_stats.overflows++;
+			return NULL;
+		}
+		m_head = start + size;
+		m_stats.allocations++;
+		m_stats.bytes = (unsigned int)(m_head - m_region * m_regionSize);
+		offset = start;
+		return m_mapped + start;
+	}
+
+	// makes everything allocated so far visible to the GPU, before the draws using it
+	void Flush()
+	{
+		if (m_persistent || m_head == m_flushed)
+			return;
+		glBindBuffer(m_target, m_buffer);
+		glBufferSubData(m_target, m_flushed, m_head - m_flushed, m_mapped + m_flushed);
+		glBindBuffer(m_target, 0);
+		m_flushed = m_head;
+	}
+
+	// fences the region, after the last draw reading it was issued
+	void EndFrame()
+	{
+		Flush();
+		m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+private:
+	GLuint m_buffer;
+	GLenum m_target;
+	GLsizeiptr m_regionSize;
+	unsigned int m_frames;
+	GLint m_alignment;
+	unsigned int m_region;
+	// write position and upload position (fallback) in the buffer
+	GLintptr m_head;
+	GLintptr m_flushed;
+	unsigned char* m_mapped;
+	bool m_persistent;
+	std::vector<GLsync> m_fences;
+	// CPU copy of the buffer when it can't stay mapped
+	std::vector<unsigned char> m_shadow;
+
+	void ResetStats()
+	{
+		m_stats.waitMs = 0.0;
+		m_stats.waits = 0;
+		m_stats.allocations = 0;
+		m_stats.bytes = 0;
+		m_stats.overflows = 0;
+	}
+
+	static bool HasBufferStorage()
+	{
+		GLint major = 0, minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		if (major > 4 || (major == 4 && minor >= 4))
+			return true;
+		GLint count = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+		for (GLint i = 0; i < count; i++)
+		{
+			const char* name = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+			if (name && std::strcmp(name, "GL_ARB_buffer_storage") == 0)
+				return true;
+		}
+		return false;
+	}
+};
+
+#endif // !STREAMBUFFER_H
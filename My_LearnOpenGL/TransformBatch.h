@@ -0,0 +1,563 @@
+#ifndef TRANSFORMBATCH_H
+#define TRANSFORMBATCH_H
+
+// batch kernels for per-object matrices: many objects per call instead of one glm
+// expression per object.
+//
+//	ComposeTrs		translation/rotation/scale arrays -> world (affine) matrices
+//	Multiply		one matrix times an array, e.g. view-projection * world = MVP
+//	NormalMatrices	inverse-transpose of the upper 3x3 of world matrices
+//
+// every kernel has a scalar (glm) version and SSE, AVX2 (+FMA) and AVX-512 ones,
+// picked at run time for the CPU the program runs on (ActiveLevel(), which can be
+// lowered to compare them). ComposeTrs works across objects (lane i = object i),
+// the other two keep one matrix column (or one whole matrix) per 128-bit lane and
+// rely on in-lane shuffles only, so the wider levels just do more objects per step.
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <vector>
+#include <string>
+#include <chrono>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define TRANSFORMBATCH_USE_SIMD 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+// MSVC compiles any intrinsic without flags
+#define TRANSFORMBATCH_TARGET_AVX2
+#define TRANSFORMBATCH_TARGET_AVX512
+#else
+#define TRANSFORMBATCH_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TRANSFORMBATCH_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+#endif
+
+enum SimdLevel
+{
+	SIMD_SCALAR,
+	SIMD_SSE,
+	SIMD_AVX2,
+	SIMD_AVX512,
+	SIMD_LEVEL_COUNT
+};
+
+class TransformBatch
+{
+public:
+	static const char* LevelName(SimdLevel level)
+	{
+		static const char* names[SIMD_LEVEL_COUNT] = { "scalar", "sse", "avx2", "avx512" };
+		return names[level];
+	}
+
+	// the best level this CPU (and OS) supports
+	static SimdLevel DetectLevel()
+	{
+#ifdef TRANSFORMBATCH_USE_SIMD
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return SIMD_SSE;
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool fma = (info[2] & (1 << 12)) != 0;
+		if (!osxsave)
+			return SIMD_SSE;
+		unsigned long long xcr0 = _xgetbv(0);
+		__cpuidex(info, 7, 0);
+		bool avx2 = fma && (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+		bool avx512 = avx2 && (info[1] & (1 << 16)) != 0 && (xcr0 & 0xE6) == 0xE6;
+#else
+		__builtin_cpu_init();
+		bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+		bool avx512 = avx2 && __builtin_cpu_supports("avx512f");
+#endif
+		if (avx512)
+			return SIMD_AVX512;
+		if (avx2)
+			return SIMD_AVX2;
+		return SIMD_SSE;
+#else
+		return SIMD_SCALAR;
+#endif
+	}
+
+	// the level the kernels use, the detected one unless lowered
+	static SimdLevel& ActiveLevel()
+	{
+		static SimdLevel level = DetectLevel();
+		return level;
+	}
+
+	// world[i] = translate(position[i]) * mat4_cast(rotation[i]) * scale(scale[i]),
+	// rotations normalized
+	static void ComposeTrs(const glm::vec3* position, const glm::quat* rotation, const glm::vec3* scale, unsigned int count, glm::mat4* world)
+	{
+		unsigned int done = 0;
+#ifdef TRANSFORMBATCH_USE_SIMD
+		SimdLevel level = ActiveLevel();
+		if (level == SIMD_AVX512)
+			done = ComposeTrsAvx512(position, rotation, scale, count, world);
+		else if (level == SIMD_AVX2)
+			done = ComposeTrsAvx2(position, rotation, scale, count, world);
+		else if (level == SIMD_SSE)
+			done = ComposeTrsSse(position, rotation, scale, count, world);
+#endif
+		for (unsigned int i = done; i < count; i++)
+			world[i] = ComposeTrs(position[i], rotation[i], scale[i]);
+	}
+
+	// out[i] = a * b[i], out may be b
+	static void Multiply(const glm::mat4& a, const glm::mat4* b, unsigned int count, glm::mat4* out)
+	{
+		unsigned int done = 0;
+#ifdef TRANSFORMBATCH_USE_SIMD
+		SimdLevel level = ActiveLevel();
+		if (level == SIMD_AVX512)
+			done = MultiplyAvx512(a, b, count, out);
+		else if (level == SIMD_AVX2)
+			done = MultiplyAvx2(a, b, count, out);
+		else if (level == SIMD_SSE)
+			done = MultiplySse(a, b, count, out);
+#endif
+		for (unsigned int i = done; i < count; i++)
+			out[i] = a * b[i];
+	}
+
+	// normal[i] = transpose(inverse(mat3(world[i]))) in the upper 3x3 of a mat4 (rest
+	// identity), ready for mat3(normalMatrix) in a shader
+	static void NormalMatrices(const glm::mat4* world, unsigned int count, glm::mat4* normal)
+	{
+		unsigned int done = 0;
+#ifdef TRANSFORMBATCH_USE_SIMD
+		SimdLevel level = ActiveLevel();
+		if (level == SIMD_AVX512)
+			done = NormalMatricesAvx512(world, count, normal);
+		else if (level == SIMD_AVX2)
+			done = NormalMatricesAvx2(world, count, normal);
+		else if (level == SIMD_SSE)
+			done = NormalMatricesSse(world, count, normal);
+#endif
+		for (unsigned int i = done; i < count; i++)
+			normal[i] = glm::mat4(glm::transpose(glm::inverse(glm::mat3(world[i]))));
+	}
+
+	// times every kernel at every supported level against the plain glm expressions
+	// on count random objects, results are nanoseconds per object as (name, value)
+	static std::vector<std::pair<std::string, double> > MicroBenchmark(unsigned int count, unsigned int iterations)
+	{
+		std::vector<glm::vec3> position(count), scale(count);
+		std::vector<glm::quat> rotation(count);
+		std::vector<glm::mat4> world(count), result(count);
+		unsigned int seed = 1;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			position[i] = glm::vec3(Random(seed), Random(seed), Random(seed)) * 100.0f;
+			scale[i] = glm::vec3(0.5f) + glm::vec3(Random(seed), Random(seed), Random(seed));
+			rotation[i] = glm::angleAxis(Random(seed) * 6.28f, glm::normalize(glm::vec3(Random(seed), Random(seed), Random(seed)) + 0.1f));
+		}
+		glm::mat4 viewProjection = glm::perspective(1.0f, 1.5f, 0.1f, 100.0f) * glm::lookAt(glm::vec3(5.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+		std::vector<std::pair<std::string, double> > results;
+		SimdLevel detected = DetectLevel();
+		SimdLevel active = ActiveLevel();
+		double scaleNs = 1.0e6 / ((double)count * iterations);
+		// the glm expressions the kernels replace
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (unsigned int n = 0; n < iterations; n++)
+			for (unsigned int i = 0; i < count; i++)
+				world[i] = glm::scale(glm::translate(glm::mat4(1.0f), position[i]) * glm::mat4_cast(rotation[i]), scale[i]);
+		results.push_back(std::make_pair(std::string("transform_compose_glm_ns"), ElapsedMs(start) * scaleNs));
+		start = std::chrono::steady_clock::now();
+		for (unsigned int n = 0; n < iterations; n++)
+			for (unsigned int i = 0; i < count; i++)
+				result[i] = viewProjection * world[i];
+		results.push_back(std::make_pair(std::string("transform_multiply_glm_ns"), ElapsedMs(start) * scaleNs));
+		start = std::chrono::steady_clock::now();
+		for (unsigned int n = 0; n < iterations; n++)
+			for (unsigned int i = 0; i < count; i++)
+				result[i] = glm::mat4(glm::transpose(glm::inverse(glm::mat3(world[i]))));
+		results.push_back(std::make_pair(std::string("transform_normal_glm_ns"), ElapsedMs(start) * scaleNs));
+
+		for (int level = SIMD_SCALAR; level <= detected; level++)
+		{
+			ActiveLevel() = (SimdLevel)level;
+			std::string suffix = std::string("_") + LevelName((SimdLevel)level) + "_ns";
+			start = std::chrono::steady_clock::now();
+			for (unsigned int n = 0; n < iterations; n++)
+				ComposeTrs(position.data(), rotation.data(), scale.data(), count, world.data());
+			results.push_back(std::make_pair("transform_compose" + suffix, ElapsedMs(start) * scaleNs));
+			start = std::chrono::steady_clock::now();
+			for (unsigned int n = 0; n < iterations; n++)
+				Multiply(viewProjection, world.data(), count, result.data());
+			results.push_back(std::make_pair("transform_multiply" + suffix, ElapsedMs(start) * scaleNs));
+			start = std::chrono::steady_clock::now();
+			for (unsigned int n = 0; n < iterations; n++)
+				NormalMatrices(world.data(), count, result.data());
+			results.push_back(std::make_pair("transform_normal" + suffix, ElapsedMs(start) * scaleNs));
+		}
+		ActiveLevel() = active;
+		return results;
+	}
+
+private:
+	static glm::mat4 ComposeTrs(const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+	{
+		glm::mat3 basis = glm::mat3_cast(rotation);
+		glm::mat4 world(1.0f);
+		world[0] = glm::vec4(basis[0] * scale.x, 0.0f);
+		world[1] = glm::vec4(basis[1] * scale.y, 0.0f);
+		world[2] = glm::vec4(basis[2] * scale.z, 0.0f);
+		world[3] = glm::vec4(position, 1.0f);
+		return world;
+	}
+
+	static float Random(unsigned int& seed)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		return (float)(seed >> 8) / 16777216.0f;
+	}
+
+	static double ElapsedMs(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+#ifdef TRANSFORMBATCH_USE_SIMD
+	// float offsets of the quaternion's x, y, z, w (glm's order depends on its config)
+	static int QuatOffset(int component)
+	{
+		static const glm::quat q(1.0f, 0.0f, 0.0f, 0.0f);
+		const float* members[4] = { &q.x, &q.y, &q.z, &q.w };
+		return (int)(members[component] - &q[0]);
+	}
+
+	// writes four objects' affine matrices given as 12 lane vectors m[column * 3 + row]
+	static void StoreAffine4(glm::mat4* world, const __m128* m)
+	{
+		__m128 zero = _mm_setzero_ps();
+		__m128 one = _mm_set1_ps(1.0f);
+		for (int column = 0; column < 4; column++)
+		{
+			__m128 x = m[column * 3], y = m[column * 3 + 1], z = m[column * 3 + 2];
+			__m128 w = column == 3 ? one : zero;
+			_MM_TRANSPOSE4_PS(x, y, z, w);
+			_mm_storeu_ps(&world[0][column][0], x);
+			_mm_storeu_ps(&world[1][column][0], y);
+			_mm_storeu_ps(&world[2][column][0], z);
+			_mm_storeu_ps(&world[3][column][0], w);
+		}
+	}
+
+	// --- SSE ------------------------------------------------------------------
+
+	static unsigned int ComposeTrsSse(const glm::vec3* position, const glm::quat* rotation, const glm::vec3* scale, unsigned int count, glm::mat4* world)
+	{
+		int ox = QuatOffset(0), oy = QuatOffset(1), oz = QuatOffset(2), ow = QuatOffset(3);
+		unsigned int i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			const float* q = &rotation[i][0];
+			__m128 qx = _mm_setr_ps(q[ox], q[4 + ox], q[8 + ox], q[12 + ox]);
+			__m128 qy = _mm_setr_ps(q[oy], q[4 + oy], q[8 + oy], q[12 + oy]);
+			__m128 qz = _mm_setr_ps(q[oz], q[4 + oz], q[8 + oz], q[12 + oz]);
+			__m128 qw = _mm_setr_ps(q[ow], q[4 + ow], q[8 + ow], q[12 + ow]);
+			__m128 sx = _mm_setr_ps(scale[i].x, scale[i + 1].x, scale[i + 2].x, scale[i + 3].x);
+			__m128 sy = _mm_setr_ps(scale[i].y, scale[i + 1].y, scale[i + 2].y, scale[i + 3].y);
+			__m128 sz = _mm_setr_ps(scale[i].z, scale[i + 1].z, scale[i + 2].z, scale[i + 3].z);
+			__m128 one = _mm_set1_ps(1.0f);
+			__m128 x2 = _mm_add_ps(qx, qx), y2 = _mm_add_ps(qy, qy), z2 = _mm_add_ps(qz, qz);
+			__m128 xx = _mm_mul_ps(qx, x2), yy = _mm_mul_ps(qy, y2), zz = _mm_mul_ps(qz, z2);
+			__m128 xy = _mm_mul_ps(qx, y2), xz = _mm_mul_ps(qx, z2), yz = _mm_mul_ps(qy, z2);
+			__m128 wx = _mm_mul_ps(qw, x2), wy = _mm_mul_ps(qw, y2), wz = _mm_mul_ps(qw, z2);
+			__m128 m[12];
+			m[0] = _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(yy, zz)), sx);
+			m[1] = _mm_mul_ps(_mm_add_ps(xy, wz), sx);
+			m[2] = _mm_mul_ps(_mm_sub_ps(xz, wy), sx);
+			m[3] = _mm_mul_ps(_mm_sub_ps(xy, wz), sy);
+			m[4] = _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, zz)), sy);
+			m[5] = _mm_mul_ps(_mm_add_ps(yz, wx), sy);
+			m[6] = _mm_mul_ps(_mm_add_ps(xz, wy), sz);
+			m[7] = _mm_mul_ps(_mm_sub_ps(yz, wx), sz);
+			m[8] = _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, yy)), sz);
+			m[9] = _mm_setr_ps(position[i].x, position[i + 1].x, position[i + 2].x, position[i + 3].x);
+			m[10] = _mm_setr_ps(position[i].y, position[i + 1].y, position[i + 2].y, position[i + 3].y);
+			m[11] = _mm_setr_ps(position[i].z, position[i + 1].z, position[i + 2].z, position[i + 3].z);
+			StoreAffine4(world + i, m);
+		}
+		return i;
+	}
+
+	static unsigned int MultiplySse(const glm::mat4& a, const glm::mat4* b, unsigned int count, glm::mat4* out)
+	{
+		__m128 a0 = _mm_loadu_ps(&a[0][0]), a1 = _mm_loadu_ps(&a[1][0]), a2 = _mm_loadu_ps(&a[2][0]), a3 = _mm_loadu_ps(&a[3][0]);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			__m128 columns[4];
+			for (int c = 0; c < 4; c++)
+			{
+				__m128 bc = _mm_loadu_ps(&b[i][c][0]);
+				__m128 r = _mm_mul_ps(a0, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(0, 0, 0, 0)));
+				r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(1, 1, 1, 1))));
+				r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(2, 2, 2, 2))));
+				columns[c] = _mm_add_ps(r, _mm_mul_ps(a3, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(3, 3, 3, 3))));
+			}
+			for (int c = 0; c < 4; c++)
+				_mm_storeu_ps(&out[i][c][0], columns[c]);
+		}
+		return count;
+	}
+
+	static unsigned int NormalMatricesSse(const glm::mat4* world, unsigned int count, glm::mat4* normal)
+	{
+		__m128 last = _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			// w of the first three columns is 0, so are the crosses'
+			__m128 c0 = _mm_loadu_ps(&world[i][0][0]), c1 = _mm_loadu_ps(&world[i][1][0]), c2 = _mm_loadu_ps(&world[i][2][0]);
+			__m128 n0 = CrossSse(c1, c2), n1 = CrossSse(c2, c0), n2 = CrossSse(c0, c1);
+			__m128 p = _mm_mul_ps(c0, n0);
+			__m128 det = _mm_add_ps(_mm_add_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0)), _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1))),
+				_mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2)));
+			__m128 inverse = _mm_div_ps(_mm_set1_ps(1.0f), det);
+			_mm_storeu_ps(&normal[i][0][0], _mm_mul_ps(n0, inverse));
+			_mm_storeu_ps(&normal[i][1][0], _mm_mul_ps(n1, inverse));
+			_mm_storeu_ps(&normal[i][2][0], _mm_mul_ps(n2, inverse));
+			_mm_storeu_ps(&normal[i][3][0], last);
+		}
+		return count;
+	}
+
+	static __m128 CrossSse(__m128 a, __m128 b)
+	{
+		__m128 aYzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)), bZxy = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+		__m128 aZxy = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2)), bYzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+		return _mm_sub_ps(_mm_mul_ps(aYzx, bZxy), _mm_mul_ps(aZxy, bYzx));
+	}
+
+	// --- AVX2 + FMA -------------------------------------------------------------
+
+	TRANSFORMBATCH_TARGET_AVX2
+	static unsigned int ComposeTrsAvx2(const glm::vec3* position, const glm::quat* rotation, const glm::vec3* scale, unsigned int count, glm::mat4* world)
+	{
+		// lane i gathers object i: a stride of 3 floats for vec3s, 4 for quaternions
+		__m256i stride3 = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+		__m256i stride4 = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+		int ox = QuatOffset(0), oy = QuatOffset(1), oz = QuatOffset(2), ow = QuatOffset(3);
+		__m256 one = _mm256_set1_ps(1.0f);
+		unsigned int i = 0;
+		for (; i + 8 <= count; i += 8)
+		{
+			const float* q = &rotation[i][0];
+			const float* s = &scale[i].x;
+			const float* p = &position[i].x;
+			__m256 qx = _mm256_i32gather_ps(q + ox, stride4, 4), qy = _mm256_i32gather_ps(q + oy, stride4, 4);
+			__m256 qz = _mm256_i32gather_ps(q + oz, stride4, 4), qw = _mm256_i32gather_ps(q + ow, stride4, 4);
+			__m256 sx = _mm256_i32gather_ps(s, stride3, 4), sy = _mm256_i32gather_ps(s + 1, stride3, 4), sz = _mm256_i32gather_ps(s + 2, stride3, 4);
+			__m256 x2 = _mm256_add_ps(qx, qx), y2 = _mm256_add_ps(qy, qy), z2 = _mm256_add_ps(qz, qz);
+			__m256 xx = _mm256_mul_ps(qx, x2), yy = _mm256_mul_ps(qy, y2), zz = _mm256_mul_ps(qz, z2);
+			__m256 xy = _mm256_mul_ps(qx, y2), xz = _mm256_mul_ps(qx, z2), yz = _mm256_mul_ps(qy, z2);
+			__m256 wx = _mm256_mul_ps(qw, x2), wy = _mm256_mul_ps(qw, y2), wz = _mm256_mul_ps(qw, z2);
+			__m256 m[12];
+			m[0] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(yy, zz)), sx);
+			m[1] = _mm256_mul_ps(_mm256_add_ps(xy, wz), sx);
+			m[2] = _mm256_mul_ps(_mm256_sub_ps(xz, wy), sx);
+			m[3] = _mm256_mul_ps(_mm256_sub_ps(xy, wz), sy);
+			m[4] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(xx, zz)), sy);
+			m[5] = _mm256_mul_ps(_mm256_add_ps(yz, wx), sy);
+			m[6] = _mm256_mul_ps(_mm256_add_ps(xz, wy), sz);
+			m[7] = _mm256_mul_ps(_mm256_sub_ps(yz, wx), sz);
+			m[8] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(xx, yy)), sz);
+			m[9] = _mm256_i32gather_ps(p, stride3, 4);
+			m[10] = _mm256_i32gather_ps(p + 1, stride3, 4);
+			m[11] = _mm256_i32gather_ps(p + 2, stride3, 4);
+			__m128 low[12], high[12];
+			for (int k = 0; k < 12; k++)
+			{
+				low[k] = _mm256_castps256_ps128(m[k]);
+				high[k] = _mm256_extractf128_ps(m[k], 1);
+			}
+			StoreAffine4(world + i, low);
+			StoreAffine4(world + i + 4, high);
+		}
+		return i;
+	}
+
+	// two columns per register, in-lane broadcasts of b's elements
+	TRANSFORMBATCH_TARGET_AVX2
+	static unsigned int MultiplyAvx2(const glm::mat4& a, const glm::mat4* b, unsigned int count, glm::mat4* out)
+	{
+		__m256 a0 = _mm256_broadcast_ps((const __m128*)&a[0][0]), a1 = _mm256_broadcast_ps((const __m128*)&a[1][0]);
+		__m256 a2 = _mm256_broadcast_ps((const __m128*)&a[2][0]), a3 = _mm256_broadcast_ps((const __m128*)&a[3][0]);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			__m256 b01 = _mm256_loadu_ps(&b[i][0][0]), b23 = _mm256_loadu_ps(&b[i][2][0]);
+			__m256 r01 = _mm256_mul_ps(a0, _mm256_permute_ps(b01, _MM_SHUFFLE(0, 0, 0, 0)));
+			__m256 r23 = _mm256_mul_ps(a0, _mm256_permute_ps(b23, _MM_SHUFFLE(0, 0, 0, 0)));
+			r01 = _mm256_fmadd_ps(a1, _mm256_permute_ps(b01, _MM_SHUFFLE(1, 1, 1, 1)), r01);
+			r23 = _mm256_fmadd_ps(a1, _mm256_permute_ps(b23, _MM_SHUFFLE(1, 1, 1, 1)), r23);
+			r01 = _mm256_fmadd_ps(a2, _mm256_permute_ps(b01, _MM_SHUFFLE(2, 2, 2, 2)), r01);
+			r23 = _mm256_fmadd_ps(a2, _mm256_permute_ps(b23, _MM_SHUFFLE(2, 2, 2, 2)), r23);
+			r01 = _mm256_fmadd_ps(a3, _mm256_permute_ps(b01, _MM_SHUFFLE(3, 3, 3, 3)), r01);
+			r23 = _mm256_fmadd_ps(a3, _mm256_permute_ps(b23, _MM_SHUFFLE(3, 3, 3, 3)), r23);
+			_mm256_storeu_ps(&out[i][0][0], r01);
+			_mm256_storeu_ps(&out[i][2][0], r23);
+		}
+		return count;
+	}
+
+	// two objects per register, one in each 128-bit lane
+	TRANSFORMBATCH_TARGET_AVX2
+	static unsigned int NormalMatricesAvx2(const glm::mat4* world, unsigned int count, glm::mat4* normal)
+	{
+		__m128 last = _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f);
+		__m256 one = _mm256_set1_ps(1.0f);
+		unsigned int i = 0;
+		for (; i + 2 <= count; i += 2)
+		{
+			__m256 c[3];
+			for (int k = 0; k < 3; k++)
+				c[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&world[i][k][0])), _mm_loadu_ps(&world[i + 1][k][0]), 1);
+			__m256 n[3] = { CrossAvx2(c[1], c[2]), CrossAvx2(c[2], c[0]), CrossAvx2(c[0], c[1]) };
+			__m256 p = _mm256_mul_ps(c[0], n[0]);
+			__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_permute_ps(p, _MM_SHUFFLE(0, 0, 0, 0)), _mm256_permute_ps(p, _MM_SHUFFLE(1, 1, 1, 1))),
+				_mm256_permute_ps(p, _MM_SHUFFLE(2, 2, 2, 2)));
+			__m256 inverse = _mm256_div_ps(one, det);
+			for (int k = 0; k < 3; k++)
+			{
+				__m256 column = _mm256_mul_ps(n[k], inverse);
+				_mm_storeu_ps(&normal[i][k][0], _mm256_castps256_ps128(column));
+				_mm_storeu_ps(&normal[i + 1][k][0], _mm256_extractf128_ps(column, 1));
+			}
+			_mm_storeu_ps(&normal[i][3][0], last);
+			_mm_storeu_ps(&normal[i + 1][3][0], last);
+		}
+		return i;
+	}
+
+	TRANSFORMBATCH_TARGET_AVX2
+	static __m256 CrossAvx2(__m256 a, __m256 b)
+	{
+		__m256 aYzx = _mm256_permute_ps(a, _MM_SHUFFLE(3, 0, 2, 1)), bZxy = _mm256_permute_ps(b, _MM_SHUFFLE(3, 1, 0, 2));
+		__m256 aZxy = _mm256_permute_ps(a, _MM_SHUFFLE(3, 1, 0, 2)), bYzx = _mm256_permute_ps(b, _MM_SHUFFLE(3, 0, 2, 1));
+		return _mm256_fmsub_ps(aYzx, bZxy, _mm256_mul_ps(aZxy, bYzx));
+	}
+
+	// --- AVX-512 ------------------------------------------------------------------
+
+	TRANSFORMBATCH_TARGET_AVX512
+	static unsigned int ComposeTrsAvx512(const glm::vec3* position, const glm::quat* rotation, const glm::vec3* scale, unsigned int count, glm::mat4* world)
+	{
+		__m512i stride3 = _mm512_mullo_epi32(_mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0), _mm512_set1_epi32(3));
+		__m512i stride4 = _mm512_slli_epi32(_mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0), 2);
+		int ox = QuatOffset(0), oy = QuatOffset(1), oz = QuatOffset(2), ow = QuatOffset(3);
+		__m512 one = _mm512_set1_ps(1.0f);
+		unsigned int i = 0;
+		for (; i + 16 <= count; i += 16)
+		{
+			const float* q = &rotation[i][0];
+			const float* s = &scale[i].x;
+			const float* p = &position[i].x;
+			__m512 qx = _mm512_i32gather_ps(stride4, q + ox, 4), qy = _mm512_i32gather_ps(stride4, q + oy, 4);
+			__m512 qz = _mm512_i32gather_ps(stride4, q + oz, 4), qw = _mm512_i32gather_ps(stride4, q + ow, 4);
+			__m512 sx = _mm512_i32gather_ps(stride3, s, 4), sy = _mm512_i32gather_ps(stride3, s + 1, 4), sz = _mm512_i32gather_ps(stride3, s + 2, 4);
+			__m512 x2 = _mm512_add_ps(qx, qx), y2 = _mm512_add_ps(qy, qy), z2 = _mm512_add_ps(qz, qz);
+			__m512 xx = _mm512_mul_ps(qx, x2), yy = _mm512_mul_ps(qy, y2), zz = _mm512_mul_ps(qz, z2);
+			__m512 xy = _mm512_mul_ps(qx, y2), xz = _mm512_mul_ps(qx, z2), yz = _mm512_mul_ps(qy, z2);
+			__m512 wx = _mm512_mul_ps(qw, x2), wy = _mm512_mul_ps(qw, y2), wz = _mm512_mul_ps(qw, z2);
+			__m512 m[12];
+			m[0] = _mm512_mul_ps(_mm512_sub_ps(one, _mm512_add_ps(yy, zz)), sx);
+			m[1] = _mm512_mul_ps(_mm512_add_ps(xy, wz), sx);
+			m[2] = _mm512_mul_ps(_mm512_sub_ps(xz, wy), sx);
+			m[3] = _mm512_mul_ps(_mm512_sub_ps(xy, wz), sy);
+			m[4] = _mm512_mul_ps(_mm512_sub_ps(one, _mm512_add_ps(xx, zz)), sy);
+			m[5] = _mm512_mul_ps(_mm512_add_ps(yz, wx), sy);
+			m[6] = _mm512_mul_ps(_mm512_add_ps(xz, wy), sz);
+			m[7] = _mm512_mul_ps(_mm512_sub_ps(yz, wx), sz);
+			m[8] = _mm512_mul_ps(_mm512_sub_ps(one, _mm512_add_ps(xx, yy)), sz);
+			m[9] = _mm512_i32gather_ps(stride3, p, 4);
+			m[10] = _mm512_i32gather_ps(stride3, p + 1, 4);
+			m[11] = _mm512_i32gather_ps(stride3, p + 2, 4);
+			__m128 part[4][12];
+			for (int k = 0; k < 12; k++)
+			{
+				part[0][k] = _mm512_extractf32x4_ps(m[k], 0);
+				part[1][k] = _mm512_extractf32x4_ps(m[k], 1);
+				part[2][k] = _mm512_extractf32x4_ps(m[k], 2);
+				part[3][k] = _mm512_extractf32x4_ps(m[k], 3);
+			}
+			for (int g = 0; g < 4; g++)
+				StoreAffine4(world + i + g * 4, part[g]);
+		}
+		return i;
+	}
+
+	// one whole matrix per register, a column per 128-bit lane
+	TRANSFORMBATCH_TARGET_AVX512
+	static unsigned int MultiplyAvx512(const glm::mat4& a, const glm::mat4* b, unsigned int count, glm::mat4* out)
+	{
+		__m512 a0 = _mm512_broadcast_f32x4(_mm_loadu_ps(&a[0][0])), a1 = _mm512_broadcast_f32x4(_mm_loadu_ps(&a[1][0]));
+		__m512 a2 = _mm512_broadcast_f32x4(_mm_loadu_ps(&a[2][0])), a3 = _mm512_broadcast_f32x4(_mm_loadu_ps(&a[3][0]));
+		for (unsigned int i = 0; i < count; i++)
+		{
+			__m512 bi = _mm512_loadu_ps(&b[i][0][0]);
+			__m512 r = _mm512_mul_ps(a0, _mm512_permute_ps(bi, _MM_SHUFFLE(0, 0, 0, 0)));
+			r = _mm512_fmadd_ps(a1, _mm512_permute_ps(bi, _MM_SHUFFLE(1, 1, 1, 1)), r);
+			r = _mm512_fmadd_ps(a2, _mm512_permute_ps(bi, _MM_SHUFFLE(2, 2, 2, 2)), r);
+			r = _mm512_fmadd_ps(a3, _mm512_permute_ps(bi, _MM_SHUFFLE(3, 3, 3, 3)), r);
+			_mm512_storeu_ps(&out[i][0][0], r);
+		}
+		return count;
+	}
+
+	// four objects per register, one in each 128-bit lane
+	TRANSFORMBATCH_TARGET_AVX512
+	static unsigned int NormalMatricesAvx512(const glm::mat4* world, unsigned int count, glm::mat4* normal)
+	{
+		__m512 one = _mm512_set1_ps(1.0f);
+		__m128 last = _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f);
+		unsigned int i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			__m512 c[3];
+			for (int k = 0; k < 3; k++)
+			{
+				__m512 column = _mm512_broadcast_f32x4(_mm_loadu_ps(&world[i][k][0]));
+				column = _mm512_insertf32x4(column, _mm_loadu_ps(&world[i + 1][k][0]), 1);
+				column = _mm512_insertf32x4(column, _mm_loadu_ps(&world[i + 2][k][0]), 2);
+				c[k] = _mm512_insertf32x4(column, _mm_loadu_ps(&world[i + 3][k][0]), 3);
+			}
+			__m512 n[3] = { CrossAvx512(c[1], c[2]), CrossAvx512(c[2], c[0]), CrossAvx512(c[0], c[1]) };
+			__m512 p = _mm512_mul_ps(c[0], n[0]);
+			__m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_permute_ps(p, _MM_SHUFFLE(0, 0, 0, 0)), _mm512_permute_ps(p, _MM_SHUFFLE(1, 1, 1, 1))),
+				_mm512_permute_ps(p, _MM_SHUFFLE(2, 2, 2, 2)));
+			__m512 inverse = _mm512_div_ps(one, det);
+			for (int k = 0; k < 3; k++)
+			{
+				__m512 column = _mm512_mul_ps(n[k], inverse);
+				_mm_storeu_ps(&normal[i][k][0], _mm512_extractf32x4_ps(column, 0));
+				_mm_storeu_ps(&normal[i + 1][k][0], _mm512_extractf32x4_ps(column, 1));
+				_mm_storeu_ps(&normal[i + 2][k][0], _mm512_extractf32x4_ps(column, 2));
+				_mm_storeu_ps(&normal[i + 3][k][0], _mm512_extractf32x4_ps(column, 3));
+			}
+			for (int k = 0; k < 4; k++)
+				_mm_storeu_ps(&normal[i + k][3][0], last);
+		}
+		return i;
+	}
+
+	TRANSFORMBATCH_TARGET_AVX512
+	static __m512 CrossAvx512(__m512 a, __m512 b)
+	{
+		__m512 aYzx = _mm512_permute_ps(a, _MM_SHUFFLE(3, 0, 2, 1)), bZxy = _mm512_permute_ps(b, _MM_SHUFFLE(3, 1, 0, 2));
+		__m512 aZxy = _mm512_permute_ps(a, _MM_SHUFFLE(3, 1, 0, 2)), bYzx = _mm512_permute_ps(b, _MM_SHUFFLE(3, 0, 2, 1));
+		return _mm512_fmsub_ps(aYzx, bZxy, _mm512_mul_ps(aZxy, bYzx));
+	}
+#endif
+};
+
+#endif // !TRANSFORMBATCH_H
@@ -9,23 +9,68 @@
 #include "shader.h"
 #include "FpsCamera.h"
 #include "Model.h"
+#include "GLStateCache.h"
+#include "RenderQueue.h"
+#include "Profiler.h"
+#include "Benchmark.h"
+#include "CascadedShadowMap.h"
+#include "ShadowFilter.h"
+#include "PointShadowMaps.h"
+#include "ShadowAtlas.h"
+#include "ClusteredLights.h"
+#include "GBuffer.h"
+#include "SoftwareOcclusion.h"
+#include "OcclusionQueries.h"
+#include "SceneGraph.h"
+#include "DynamicBvh.h"
+#include "EntityStore.h"
+#include "TransformBatch.h"
+#include "StreamBuffer.h"
+#include "PrimitiveCache.h"
+#include "StaticBatch.h"
+#include "JobSystem.h"
 //#include "camera.h"
 
 #include <iostream>
+#include <chrono>
+#include <vector>
+#include <memory>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double posX, double posY);
 void scroll_callback(GLFWwindow* window, double posX, double posY);
 void processInput(GLFWwindow* window);
 unsigned int loadTexture(const char* path);
-void renderScene(const Shader& shader);
-void renderCube();
+void setupScene();
+void syncTransforms();
+void buildStaticBatches();
+void setupStressBodies(unsigned int count);
+void updateStressBodies(float dt);
+unsigned int renderScene(RenderQueue& queue, Shader& shader, const glm::mat4& view, const Frustum& frustum, float farPlane, SoftwareOcclusion* occlusion);
+template <typename CasterVolume>
+unsigned int renderShadowCasters(RenderQueue& queue, RenderPass pass, Shader& shader, const CasterVolume& casters, const glm::mat4& lightView, float farPlane);
+template <typename CasterVolume>
+unsigned int renderNanosuitCasters(RenderQueue& queue, RenderPass pass, Shader& shader, const CasterVolume& casters, const glm::mat4& lightView, float farPlane,
+	Model& nanosuit, unsigned int instances);
+glm::mat4 nanosuitTransform(unsigned int instance);
 void renderQuad();
 
 
 // settings
 const unsigned int SCR_WIDTH = 1024;
 const unsigned int SCR_HEIGHT = 768;
+// size of what we render to, the window or the offscreen target of the benchmark
+unsigned int renderWidth = SCR_WIDTH;
+unsigned int renderHeight = SCR_HEIGHT;
+
+// texture units of the lighting inputs, after the material units and the shadow
+// filter's, so no mesh texture bound by the render queue lands on them
+const unsigned int CSM_SHADOW_UNIT = SHADOW_MOMENTS_UNIT + 1;
+const unsigned int POINT_SHADOW_FIRST_UNIT = CSM_SHADOW_UNIT + 1;	// one cube map per light
+const unsigned int SPOT_ATLAS_UNIT = POINT_SHADOW_FIRST_UNIT + POINT_SHADOW_MAX_LIGHTS;
+const unsigned int CLUSTER_FIRST_UNIT = SPOT_ATLAS_UNIT + 1;	// three buffer textures
+const unsigned int GBUFFER_FIRST_UNIT = CLUSTER_FIRST_UNIT + 3;	// three G-buffer textures
+static_assert(GBUFFER_FIRST_UNIT + 3 <= STATECACHE_MAX_TEXTURE_UNITS, "lighting units past the state cache");
 
 // camera
 FpsCamera camera(glm::vec3(0.0f, 0.0f, 3.0f));
@@ -37,13 +82,157 @@ float firstMouse = true;
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
 
-// meshes
-unsigned int planeVAO;
+// meshes: the indexed primitives, and the static shadow casters merged into one batch
+PrimitiveCache primitives;
+unsigned int planePrimitive;
+StaticBatch staticCasters;
+unsigned int woodTexture;
 
-int main()
+// components of the scene's entities
+struct TransformComponent
+{
+	glm::mat4 world;			// copy of the node's world matrix
+	unsigned int node;			// its transform in the scene graph
+};
+struct BoundsComponent
+{
+	glm::vec3 localMin;			// local space bounds
+	glm::vec3 localMax;
+	glm::vec3 worldMin;			// world space bounds, refit when the transform changes
+	glm::vec3 worldMax;
+	int proxy;					// in the spatial index
+	unsigned int visibleFrame;	// last frame the camera frustum query found it
+};
+struct MeshComponent
+{
+	unsigned int primitive;		// in the primitive cache
+	unsigned int vao;			// full vertex layout, lit pass (the primitive's)
+	unsigned int shadowVAO;		// positions only, depth passes
+	int indexCount;
+};
+struct MaterialComponent
+{
+	unsigned int diffuse;
+};
+struct ShadowCasterComponent
 {
+	bool isStatic;				// static casters go to the cached shadow pass
+	bool batched;				// part of staticCasters, not drawn on its own while static batching is on
+};
+struct OccluderComponent
+{
+	bool solid;					// bounds are solid, rasterized by the software occlusion culling
+};
+enum LightKind
+{
+	LIGHT_POINT_SHADOWED,		// a cube map of PointShadowMaps
+	LIGHT_SPOT_SHADOWED			// a tile of the spot light ShadowAtlas
+};
+struct LightComponent
+{
+	LightKind kind;
+	glm::vec3 color;
+	glm::vec3 direction;		// spot lights
+	float innerAngle;			// spot lights, degrees
+	float outerAngle;
+	float range;
+};
+
+// the entities: renderables (transform, bounds, mesh, material, caster, maybe
+// occluder) and lights (transform, light)
+EntityStore scene;
+// transforms of the entities, world matrices are only recomputed when a node moved
+SceneGraph sceneGraph;
+// spatial index over the world bounds of the renderables (user value: the entity),
+// the stress bodies come after them
+DynamicBvh sceneBvh;
+
+// boxes that only move around in the spatial index, to measure it at scale (bench bvh=N)
+struct StressBody
+{
+	glm::vec3 position;
+	glm::vec3 velocity;
+	int proxy;
+};
+std::vector<StressBody> stressBodies;
+// visible renderables of one primitive and material, collected by renderScene() for one instanced draw
+struct InstanceGroup
+{
+	unsigned int vao;
+	int indexCount;
+	unsigned int diffuse;
+	float depth;				// of the nearest instance
+	std::vector<glm::mat4> models;
+	Entity first;				// drawn on its own (with its occlusion query) if it stays alone
+	glm::vec3 firstMin, firstMax;
+};
+
+// spatial index timings of the last frame
+double bvhMoveMs = 0.0;
+double bvhQueryMs = 0.0;
+// renderables in the camera frustum last frame
+unsigned int objectsVisible = 0;
+
+// draws of both passes are collected here every frame, then sorted and executed per pass
+RenderQueue renderQueue;
+// shadow filtering mode of the lit pass, keys 1-4 switch it
+ShadowFilter shadowFilter;
+// unshadowed point lights of the clustered forward path, keys -/= halve/double the count
+unsigned int clusteredLightCount = 64;
+bool clusteredLightsChanged = true;
+// forward or deferred shading of the opaque pass, key G toggles it
+RenderPath renderPath = RENDER_PATH_FORWARD;
+// CPU occlusion culling of the opaque draws, key O toggles it
+bool occlusionCulling = true;
+// GPU occlusion queries around the opaque draws, key H toggles them
+bool occlusionQueriesEnabled = true;
+// visible renderables sharing a primitive and material are drawn instanced, and the render
+// queue merges identical draws into instanced ones; key I toggles both
+bool instancing = true;
+unsigned int instancedDraws = 0;
+unsigned int instancedObjects = 0;
+// static shadow casters drawn as one merged batch, key B toggles it
+bool staticBatching = true;
+
+int main(int argc, char** argv)
+{
+	// command line: --bench runs the headless benchmark (see Benchmark.h)
+	// --------------------
+	BenchmarkOptions bench;
+	if (!bench.Parse(argc, argv))
+		return -1;
+	if (!ShadowFilter::ModeFromName(bench.shadowFilter, shadowFilter.m_mode))
+	{
+		std::cout << "ERROR::BENCHMARK::UNKNOWN_SHADOW_FILTER: " << bench.shadowFilter << std::endl;
+		return -1;
+	}
+	occlusionCulling = bench.occlusion;
+	occlusionQueriesEnabled = bench.queries;
+	instancing = bench.instancing;
+	staticBatching = bench.staticBatching;
+	if (bench.renderPath == "deferred")
+		renderPath = RENDER_PATH_DEFERRED;
+	else if (bench.renderPath != "forward")
+	{
+		std::cout << "ERROR::BENCHMARK::UNKNOWN_RENDER_PATH: " << bench.renderPath << std::endl;
+		return -1;
+	}
+	if (bench.matrices != "cpu" && bench.matrices != "vertex")
+	{
+		std::cout << "ERROR::BENCHMARK::UNKNOWN_MATRICES: " << bench.matrices << std::endl;
+		return -1;
+	}
+	if (bench.enabled)
+	{
+		renderWidth = bench.width;
+		renderHeight = bench.height;
+		clusteredLightCount = bench.LightCount(0);
+	}
+
 	// glfw: initialize and configure
 	// --------------------
+	if (bench.enabled && bench.api == BENCH_API_OSMESA)
+		glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);	// no display needed at all
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -53,9 +242,19 @@ int main()
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
 
+	if (bench.enabled)
+	{
+		// the benchmark renders offscreen, the window only carries the context
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		if (bench.api == BENCH_API_OSMESA)
+			glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+		else if (bench.api == BENCH_API_EGL)
+			glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+	}
+
 	// glfw: window creation
 	// --------------------
-	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
+	GLFWwindow* window = glfwCreateWindow(renderWidth, renderHeight, "LearnOpenGL", NULL, NULL);
 	if (window == NULL)
 	{
 		std::cout << "Failed to create GLFW window" << std::endl;
@@ -64,12 +263,17 @@ int main()
 	}
 
 	glfwMakeContextCurrent(window);
-	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-	glfwSetCursorPosCallback(window, mouse_callback);
-	glfwSetScrollCallback(window, scroll_callback);
+	if (!bench.enabled)
+	{
+		glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+		glfwSetCursorPosCallback(window, mouse_callback);
+		glfwSetScrollCallback(window, scroll_callback);
 
-	// tell GLFW to capture our mouse
-	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+		// tell GLFW to capture our mouse
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+	}
+	else
+		glfwSwapInterval(0);	// never wait for vsync while measuring
 
 	// glad: load all OpenGL function pointers
 	// --------------------
@@ -79,28 +283,65 @@ int main()
 		return -1;
 	}
 
+	// gpu timer queries need the context
+	Profiler::Get().InitGpu();
+
+	// worker threads shared by texture loading, light binning, occlusion rasterization
+	// and the scene graph; this thread is the job system's main (GL) thread
+	JobSystem& jobs = JobSystem::Get();
+	jobs.Init(bench.enabled ? bench.workers : 0);
+
 	// tell stb_image.h to flip loaded texture's on the y-axis (before loading model).
 	stbi_set_flip_vertically_on_load(true);
 
 	// configure global opengl state
 	// -----------------------------
-	glEnable(GL_DEPTH_TEST);
+	GLStateCache& glState = GLStateCache::Get();
+	glState.Enable(GL_DEPTH_TEST);
 
 
 	// build and compile our shader program
 	// --------------------
-	const char* vertexShaderPath1 = "..\\Shader\\VertexShader\\5.3.1.2.shadow_mapping_depth.vs";
-	const char* fragmentShaderPath1 = "..\\Shader\\FragmentShader\\5.3.1.2.shadow_mapping_depth.fs";
-	Shader simpleDepthShader(vertexShaderPath1, fragmentShaderPath1);
+	// cascaded shadow maps: all cascades are rendered in one layered pass
+	const char* vertexShaderPath1 = "..\\Shader\\VertexShader\\5.3.3.csm_depth.vs";
+	const char* fragmentShaderPath1 = "..\\Shader\\FragmentShader\\5.3.3.csm_depth.fs";
+	const char* geometryShaderPath1 = "..\\Shader\\GeometryShader\\5.3.3.csm_depth.gs";
+	Shader simpleDepthShader(vertexShaderPath1, fragmentShaderPath1, geometryShaderPath1);
+	// single shadow maps: the cached static casters per cascade, and the spot light atlas tiles
+	const char* vertexShaderPath4 = "..\\Shader\\VertexShader\\5.3.1.2.shadow_mapping_depth.vs";
+	const char* fragmentShaderPath4 = "..\\Shader\\FragmentShader\\5.3.1.2.shadow_mapping_depth.fs";
+	Shader staticDepthShader(vertexShaderPath4, fragmentShaderPath4);
 
-	const char* vertexShaderPath2 = "..\\Shader\\VertexShader\\5.3.1.2.shadow_mapping.vs";
-	const char* fragmentShaderPath2 = "..\\Shader\\FragmentShader\\5.3.1.2.shadow_mapping.fs";
-	Shader shadowMapShader(vertexShaderPath2, fragmentShaderPath2);
+	// lit pass, per object matrices from the render queue (or per vertex, bench matrices=vertex)
+	const char* vertexShaderPath2 = "..\\Shader\\VertexShader\\5.3.3.csm_shadow.vs";
+	const char* fragmentShaderPath2 = "..\\Shader\\FragmentShader\\5.3.3.csm_shadow.fs";
+	const char* matrixDefines = bench.matrices == "vertex" ? "#define PER_VERTEX_MATRICES\n" : nullptr;
+	Shader shadowMapShader(vertexShaderPath2, fragmentShaderPath2, nullptr, matrixDefines);
 
 	const char* vertexShaderPath3 = "..\\Shader\\VertexShader\\5.3.1.2.debug_quad.vs";
-	const char* fragmentShaderPath3 = "..\\Shader\\FragmentShader\\5.3.1.2.debug_quad.fs";
+	const char* fragmentShaderPath3 = "..\\Shader\\FragmentShader\\5.3.3.debug_cascade.fs";
 	Shader debugDepthQuadShader(vertexShaderPath3, fragmentShaderPath3);
 
+	// EVSM: depth to moments and separable blur, drawn as a fullscreen triangle
+	const char* vertexShaderPath5 = "..\\Shader\\VertexShader\\5.3.4.fullscreen.vs";
+	const char* fragmentShaderPath5 = "..\\Shader\\FragmentShader\\5.3.4.evsm_blur.fs";
+	Shader evsmBlurShader(vertexShaderPath5, fragmentShaderPath5);
+
+	// point light cube maps, all six faces in one layered pass
+	const char* vertexShaderPath6 = "..\\Shader\\VertexShader\\5.4.1.point_shadows_depth.vs";
+	const char* fragmentShaderPath6 = "..\\Shader\\FragmentShader\\5.4.1.point_shadows_depth.fs";
+	const char* geometryShaderPath6 = "..\\Shader\\GeometryShader\\5.4.1.point_shadows_depth.gs";
+	Shader pointDepthShader(vertexShaderPath6, fragmentShaderPath6, geometryShaderPath6);
+
+	// deferred path: the G-buffer pass, then the lit shader as a fullscreen lighting pass
+	const char* fragmentShaderPath7 = "..\\Shader\\FragmentShader\\5.3.5.gbuffer.fs";
+	Shader gBufferShader(vertexShaderPath2, fragmentShaderPath7, nullptr, matrixDefines);
+	Shader deferredLightingShader(vertexShaderPath5, fragmentShaderPath2, nullptr, "#define DEFERRED_LIGHTING\n");
+
+	// bounding boxes of the occlusion queries, depth only
+	const char* vertexShaderPath8 = "..\\Shader\\VertexShader\\5.3.6.occlusion_box.vs";
+	Shader occlusionBoxShader(vertexShaderPath8, fragmentShaderPath4);
+
 
 	// set up vertex data (and buffer(s)) and configure vertex attributes
    // ------------------------------------------------------------------
@@ -108,154 +349,453 @@ int main()
 		// positions            // normals         // texcoords
 		 25.0f, -0.5f,  25.0f,  0.0f, 1.0f, 0.0f,  25.0f,  0.0f,
 		-25.0f, -0.5f,  25.0f,  0.0f, 1.0f, 0.0f,   0.0f,  0.0f,
-		-25.0f, -0.5f, -25.0f,  0.0f, 1.0f, 0.0f,   0.0f, 25.0f,
-
-		 25.0f, -0.5f,  25.0f,  0.0f, 1.0f, 0.0f,  25.0f,  0.0f,
 		-25.0f, -0.5f, -25.0f,  0.0f, 1.0f, 0.0f,   0.0f, 25.0f,
 		 25.0f, -0.5f, -25.0f,  0.0f, 1.0f, 0.0f,  25.0f, 25.0f
 	};
-
-	// plane VAO
-	unsigned int planeVBO;
-	glGenVertexArrays(1, &planeVAO);
-	glGenBuffers(1, &planeVBO);
-	glBindVertexArray(planeVAO);
-	glBindBuffer(GL_ARRAY_BUFFER, planeVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(planeVertices), planeVertices, GL_STATIC_DRAW);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
-	glBindVertexArray(0);
+	unsigned int planeIndices[] = { 0, 1, 2, 0, 2, 3 };
+	planePrimitive = primitives.Add(planeVertices, 4, planeIndices, 6);
 
 	// load textures
 	// -------------
 	const char* texPath = "..\\resources\\textures\\wood.png";
-	unsigned int woodTexture = loadTexture(texPath);
+	woodTexture = loadTexture(texPath);
 
-	// configure depth map FBO
+	setupScene();
+	buildStaticBatches();
+	setupStressBodies(bench.bvhObjects);
+	// the vertex-bound load of the benchmark (bench nanosuit=N)
+	std::unique_ptr<Model> nanosuit;
+	if (bench.nanosuitInstances > 0)
+		nanosuit.reset(new Model("..\\resources\\objects\\nanosuit\\nanosuit.obj"));
+
+	// configure the cascaded shadow map (depth texture array + layered FBO)
 	// -----------------------
-	const unsigned int SHADOW_WIDTH = 1024, SHADOW_HEIGHT = 1024;
-	unsigned int depthMapFBO;
-	glGenFramebuffers(1, &depthMapFBO);
-	// create depth texture
-	unsigned int depthMap;
-	glGenTextures(1, &depthMap);
-	glBindTexture(GL_TEXTURE_2D, depthMap);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-	GLfloat borderColor[] = { 1.0, 1.0, 1.0, 1.0 };
-	glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
-	// attach depth texture as FBO's depth buffer
-	glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMap, 0);
-	glDrawBuffer(GL_NONE);
-	glReadBuffer(GL_NONE);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	CascadedShadowMap csm(CSM_MAX_CASCADES, 1024);
+	csm.Init();
+	shadowFilter.Init(csm.m_resolution, csm.m_cascadeCount);
+
+	// configure the shadowed point lights (one depth cube map each)
+	// -----------------------
+	PointShadowMaps pointShadows(512, 0.1f, 25.0f);
+	pointShadows.Init();
+
+	// configure the shadowed spot lights, all in one shadow atlas
+	// -----------------------
+	ShadowAtlas spotAtlas(2048, 64, 1024, 2);
+	spotAtlas.Init();
+
+	// hand the scene's light entities to their shadow systems
+	scene.ForEach<TransformComponent, LightComponent>([&](Entity, TransformComponent& transform, LightComponent& light)
+	{
+		glm::vec3 position(transform.world[3]);
+		if (light.kind == LIGHT_POINT_SHADOWED)
+			pointShadows.AddLight(position, light.color);
+		else
+			spotAtlas.AddLight(position, light.direction, light.color, light.innerAngle, light.outerAngle, light.range);
+	});
+
+	// configure the clustered point lights (light lists built on the CPU every frame)
+	// -----------------------
+	ClusteredLights clusteredLights;
+	clusteredLights.Init();
+
+	// the G-buffer is only allocated once the deferred path is selected
+	GBuffer gBuffer;
+
+	// configure the software occlusion culling (coarse CPU depth buffer, rasterized by the job system)
+	// -----------------------
+	SoftwareOcclusion occlusion(256, 144);
+
+	// configure the hardware occlusion queries (one query object per scene object)
+	// -----------------------
+	OcclusionQueries occlusionQueries;
+	occlusionQueries.Init();
+
+	// configure the per draw constants of the lit pass (a ring of uniform buffer regions, one per frame in flight)
+	// -----------------------
+	StreamBuffer perDrawStream;
+	perDrawStream.Init(GL_UNIFORM_BUFFER, 4 * 1024 * 1024, (GLADloadproc)glfwGetProcAddress, STREAMBUFFER_FRAMES, RENDERQUEUE_PER_DRAW_RANGE);
+	renderQueue.SetStreamBuffer(&perDrawStream);
+
+	// configure the offscreen target of the benchmark (the window's framebuffer otherwise)
+	// -----------------------
+	unsigned int sceneFBO = 0;
+	unsigned int sceneRBOs[2] = { 0, 0 };
+	if (bench.enabled)
+	{
+		glGenFramebuffers(1, &sceneFBO);
+		glGenRenderbuffers(2, sceneRBOs);
+		glBindRenderbuffer(GL_RENDERBUFFER, sceneRBOs[0]);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, renderWidth, renderHeight);
+		glBindRenderbuffer(GL_RENDERBUFFER, sceneRBOs[1]);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, renderWidth, renderHeight);
+		glState.BindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, sceneRBOs[0]);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, sceneRBOs[1]);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			std::cout << "ERROR::FRAMEBUFFER:: Benchmark framebuffer is not complete!" << std::endl;
+			glfwTerminate();
+			return -1;
+		}
+	}
 
 	// shader configuration
 	// --------------------
 	shadowMapShader.use();
 	shadowMapShader.setInt("diffuseTexture", 0);
-	shadowMapShader.setInt("shadowMap", 1);
+	shadowMapShader.setInt("shadowMap", (int)CSM_SHADOW_UNIT);
+	gBufferShader.use();
+	gBufferShader.setInt("diffuseTexture", 0);
+	deferredLightingShader.use();
+	deferredLightingShader.setInt("shadowMap", (int)CSM_SHADOW_UNIT);
 	debugDepthQuadShader.use();
 	debugDepthQuadShader.setInt("depthMap", 0);
+	debugDepthQuadShader.setInt("layer", 0);
 
 	// lighting info
 	// -------------
 	glm::vec3 lightPos(-2.0f, 4.0f, -1.0f);
 
+	// state cache statistics, shown in the window title once per second
+	float lastStatsTime = 0.0f;
+	// shadow casters that can't reach any cascade this frame
+	unsigned int shadowCastersCulled = 0;
+	// opaque draws hidden behind the occluders this frame
+	unsigned int objectsOccluded = 0;
+
+	// benchmark results
+	Benchmark benchmark;
+	// the matrix kernels against glm, ns per object at every SIMD level the CPU has
+	if (bench.enabled && bench.transformObjects > 0)
+	{
+		std::vector<std::pair<std::string, double> > timings = TransformBatch::MicroBenchmark(bench.transformObjects, 20);
+		for (unsigned int i = 0; i < timings.size(); i++)
+			benchmark.AddValue(timings[i].first, timings[i].second);
+		benchmark.AddValue("transform_simd_level", TransformBatch::ActiveLevel());
+	}
+	unsigned int benchFrame = 0;
+	// every segment (light count of a sweep) gets its own warmup and camera path
+	const unsigned int benchSegmentFrames = bench.frames + BENCHMARK_WARMUP_FRAMES;
+
 	// render loop
 	// --------------------
-	while (!glfwWindowShouldClose(window))
+	while (bench.enabled ? benchFrame < bench.SegmentCount() * benchSegmentFrames : !glfwWindowShouldClose(window))
 	{
+		std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+
 		// per-frame time logic
 		// --------------------
 		float currentFrame = glfwGetTime();
 		deltaTime = currentFrame - lastFrame;
 		lastFrame = currentFrame;
+		unsigned int segmentFrame = benchFrame % benchSegmentFrames;
+		if (bench.enabled)
+		{
+			deltaTime = Benchmark::DeltaTime();
+			if (segmentFrame == 0 && benchFrame > 0)
+			{
+				clusteredLightCount = bench.LightCount(benchFrame / benchSegmentFrames);
+				clusteredLightsChanged = true;
+			}
+			if (segmentFrame == BENCHMARK_WARMUP_FRAMES && bench.LightSweep())
+				benchmark.BeginSegment("lights_" + std::to_string(clusteredLightCount));
+		}
+		glState.NewFrame();
+		Profiler::Get().NewFrame();
+		PROFILE_SCOPE("Frame");
+		// GL work the jobs handed back, then the job statistics of the last frame
+		jobs.RunMainThreadJobs();
+		jobs.NewFrame();
+		{
+			PROFILE_SCOPE("StreamWait");
+			perDrawStream.BeginFrame();
+		}
+		if (!bench.enabled && currentFrame - lastStatsTime >= 1.0f)
+		{
+			const GLStateCache::FrameStats& stats = glState.LastFrame();
+			std::string title = "LearnOpenGL - GL calls issued: " + std::to_string(stats.issued) + " filtered: " + std::to_string(stats.filtered)
+				+ " | shadow draws: " + std::to_string(csm.m_cacheStats.drawsIssued + csm.m_cacheStats.dynamicDraws) + " cached: " + std::to_string(csm.m_cacheStats.drawsSkipped)
+				+ " culled: " + std::to_string(shadowCastersCulled)
+				+ " | point faces: " + std::to_string(pointShadows.m_stats.facesRendered) + " culled: " + std::to_string(pointShadows.m_stats.facesCulled)
+				+ " | atlas tiles: " + std::to_string(spotAtlas.m_stats.tilesAllocated) + " updated: " + std::to_string(spotAtlas.m_stats.tilesRendered)
+				+ " pending: " + std::to_string(spotAtlas.m_stats.tilesPending)
+				+ " | filter: " + ShadowFilter::ModeName(shadowFilter.m_mode)
+				+ " | occluded: " + (occlusionCulling ? std::to_string(objectsOccluded) + "/" + std::to_string(objectsVisible) : std::string("off"))
+				+ " | queries: " + (occlusionQueriesEnabled ? std::to_string(occlusionQueries.QueryCount()) + " avoided: " + std::to_string((int)(occlusionQueries.AvoidedFraction() * 100.0f)) + "%" : std::string("off"))
+				+ " | path: " + GBuffer::PathName(renderPath) + (renderPath == RENDER_PATH_DEFERRED ? " (" + std::to_string(GBuffer::BytesPerPixel()) + " B/px)" : std::string())
+				+ " | stream: " + (perDrawStream.Persistent() ? "persistent" : "subdata") + " " + std::to_string(perDrawStream.m_stats.bytes / 1024) + " KiB"
+				+ " wait: " + std::to_string(perDrawStream.m_stats.waitMs) + " ms"
+				+ " | instanced: " + (instancing ? std::to_string(instancedObjects) + " in " + std::to_string(instancedDraws) + " draws"
+					+ " merged: " + std::to_string(renderQueue.m_stats.submitted) + " -> " + std::to_string(renderQueue.m_stats.draws) : std::string("off"))
+				+ " | commands: " + std::to_string(renderQueue.m_stats.commands) + " in " + std::to_string(renderQueue.m_stats.commandBuffers) + " buffers"
+				+ " record: " + std::to_string(renderQueue.m_stats.recordMs) + " ms replay: " + std::to_string(renderQueue.m_stats.replayMs) + " ms"
+				+ " | static batch: " + (staticBatching ? std::to_string(staticCasters.SourceCount()) + " casters" : std::string("off"))
+				+ " | bvh: " + std::to_string(sceneBvh.ProxyCount()) + " height: " + std::to_string(sceneBvh.Height())
+				+ " query: " + std::to_string(bvhQueryMs) + " ms"
+				+ " | jobs: " + std::to_string(jobs.m_stats.jobs) + " steals: " + std::to_string(jobs.m_stats.steals)
+				+ " workers: " + std::to_string(jobs.WorkerCount()) + " busy: " + std::to_string((int)(jobs.m_stats.utilization * 100.0)) + "%"
+				+ " | clustered lights: " + std::to_string(clusteredLights.m_stats.lights) + " max/cluster: " + std::to_string(clusteredLights.m_stats.maxPerCluster)
+				+ " build: " + std::to_string(clusteredLights.m_stats.buildMs) + " ms"
+				+ " | gpu shadow: " + std::to_string(Profiler::Get().GpuZoneMs("ShadowPass")) + " ms lit: " + std::to_string(Profiler::Get().GpuZoneMs("LitPass")) + " ms";
+			glfwSetWindowTitle(window, title.c_str());
+			lastStatsTime = currentFrame;
+		}
 
 		// input
 		// --------------------
-		processInput(window);
+		{
+			PROFILE_SCOPE("processInput");
+			if (bench.enabled)
+				Benchmark::ScriptCamera(camera, segmentFrame < BENCHMARK_WARMUP_FRAMES ? 0 : segmentFrame - BENCHMARK_WARMUP_FRAMES, bench.frames);
+			else
+				processInput(window);
+		}
 
 		// render
 		// --------------------
+		glState.BindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
 		glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		// 1. render depth of scene to texture (from light's perspective)
+		// 0. collect the shadow casters and sort them
+		// --------------------------------------------------------------
+		// the light is directional, lightPos only gives its direction
+		glm::vec3 lightDir = glm::normalize(lightPos);
+		const float cameraNear = 0.1f, cameraFar = 100.0f;
+		float aspect = (float)renderWidth / (float)renderHeight;
+		glm::mat4 projection = glm::perspective(glm::radians(camera.m_zoom), aspect, cameraNear, cameraFar);
+		glm::mat4 view = camera.GetViewMatrix();
+		// bring the moved scene graph nodes up to date (nothing moves yet, so this is a scan)
+		if (sceneGraph.Update() > 0)
+			syncTransforms();
+		updateStressBodies(deltaTime);
+		// split the camera frustum and fit the cascades
+		csm.Update(view, glm::radians(camera.m_zoom), aspect, cameraNear, cameraFar, lightDir);
+		// size the spot lights' atlas tiles by their screen coverage
+		spotAtlas.Update(view, projection, camera.m_position);
+		// only used to sort the depth-only draws front-to-back from the light
+		float far_plane = 2.0f * csm.m_shadowDistance;
+		glm::mat4 lightView = glm::lookAt(lightDir * csm.m_shadowDistance, glm::vec3(0.0f), glm::vec3(0.0, 1.0, 0.0));
+		// assign the clustered lights to the camera's froxels
+		if (clusteredLightsChanged)
+		{
+			clusteredLights.GenerateLights(clusteredLightCount, glm::vec3(-10.0f, -0.4f, -10.0f), glm::vec3(10.0f, 4.0f, 10.0f));
+			clusteredLightsChanged = false;
+		}
+		clusteredLights.SetProjection(projection, cameraNear, cameraFar, renderWidth, renderHeight);
+		// start rasterizing the occluders, the workers run while the shadow passes are submitted
+		if (occlusionCulling)
+		{
+			occlusion.BeginFrame(projection * view);
+			scene.ForEach<TransformComponent, BoundsComponent, OccluderComponent>([&](Entity, TransformComponent& transform, BoundsComponent& bounds,
+				OccluderComponent&)
+			{
+				occlusion.AddBoxOccluder(transform.world, bounds.localMin, bounds.localMax);
+			});
+			occlusion.Kick();
+		}
+		clusteredLights.Build(view);
+
+		{
+			PROFILE_SCOPE("BuildRenderQueue");
+			renderQueue.Clear();
+			shadowCastersCulled = renderShadowCasters(renderQueue, PASS_SHADOW_STATIC, staticDepthShader, csm, lightView, far_plane)
+				+ renderShadowCasters(renderQueue, PASS_SHADOW, simpleDepthShader, csm, lightView, far_plane);
+			renderShadowCasters(renderQueue, PASS_SHADOW_POINT, pointDepthShader, pointShadows, lightView, far_plane);
+			renderShadowCasters(renderQueue, PASS_SHADOW_SPOT, staticDepthShader, spotAtlas, lightView, far_plane);
+			// the benchmark nanosuits never move, they cast into the cached cascades
+			if (nanosuit)
+			{
+				shadowCastersCulled += renderNanosuitCasters(renderQueue, PASS_SHADOW_STATIC, staticDepthShader, csm, lightView, far_plane, *nanosuit, bench.nanosuitInstances);
+				renderNanosuitCasters(renderQueue, PASS_SHADOW_POINT, pointDepthShader, pointShadows, lightView, far_plane, *nanosuit, bench.nanosuitInstances);
+				renderNanosuitCasters(renderQueue, PASS_SHADOW_SPOT, staticDepthShader, spotAtlas, lightView, far_plane, *nanosuit, bench.nanosuitInstances);
+			}
+			renderQueue.Sort();
+		}
+
+		// 1. render depth of scene into the cascades (from light's perspective): static
+		// casters only where the cache is stale, dynamic casters every frame
 		// --------------------------------------------------------------
-		glm::mat4 lightProjection, lightView;
-		glm::mat4 lightSpaceMatrix;
-		float near_plane = 1.0f, far_plane = 7.5f;
-		lightProjection = glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, near_plane, far_plane);
-		lightView = glm::lookAt(lightPos, glm::vec3(0.0f), glm::vec3(0.0, 1.0, 0.0));
-		lightSpaceMatrix = lightProjection * lightView;
-		// render scene from light's point of view
-		simpleDepthShader.use();
-		simpleDepthShader.setMat4("lightSpaceMatrix", lightSpaceMatrix);
-
-		glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-		glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-		glClear(GL_DEPTH_BUFFER_BIT);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, woodTexture);
-		renderScene(simpleDepthShader);
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		{
+			PROFILE_SCOPE("ShadowPass");
+			PROFILE_GPU_SCOPE("ShadowPass");
+			csm.RenderShadows(renderQueue, staticDepthShader, simpleDepthShader);
+			pointShadows.Render(renderQueue, pointDepthShader);
+			spotAtlas.Render(renderQueue, staticDepthShader);
+		}
+		{
+			PROFILE_SCOPE("ShadowFilter");
+			PROFILE_GPU_SCOPE("ShadowFilter");
+			shadowFilter.Prefilter(evsmBlurShader, csm.SampledArray());
+			glState.BindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+		}
 		
+		// collect the opaque draws that pass the occlusion test and sort them in
+		{
+			PROFILE_SCOPE("BuildOpaqueQueue");
+			if (occlusionCulling)
+				occlusion.Wait();
+			Shader& opaqueShader = renderPath == RENDER_PATH_DEFERRED ? gBufferShader : shadowMapShader;
+			objectsOccluded = renderScene(renderQueue, opaqueShader, view, Frustum(projection * view), cameraFar, occlusionCulling ? &occlusion : nullptr);
+			// rows of nanosuits behind the scene. Their meshes are occlusion tested with
+			// the query ids after the entities'
+			if (nanosuit)
+				for (unsigned int i = 0; i < bench.nanosuitInstances; i++)
+				{
+					unsigned int firstId = scene.IndexLimit() + i * (unsigned int)nanosuit->meshes.size();
+					nanosuit->Submit(renderQueue, PASS_OPAQUE, opaqueShader, nanosuitTransform(i), view, cameraFar, firstId);
+				}
+			renderQueue.Sort();
+		}
+
 		// reset viewport
-		glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
+		glState.Viewport(0, 0, renderWidth, renderHeight);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 		// 2. render scene as normal using the generated depth/shadow map  
 		// --------------------------------------------------------------
-		shadowMapShader.use();
-		glm::mat4 projection = glm::perspective(glm::radians(camera.m_zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-		glm::mat4 view = camera.GetViewMatrix();
-		shadowMapShader.setMat4("projection", projection);
-		shadowMapShader.setMat4("view", view);
-		// set light uniforms
-		shadowMapShader.setVec3("viewPos", camera.m_position);
-		shadowMapShader.setVec3("viewPos", camera.m_position);
-		shadowMapShader.setVec3("lightPos", lightPos);
-		shadowMapShader.setMat4("lightSpaceMatrix", lightSpaceMatrix);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, woodTexture);
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, depthMap);
-		renderScene(shadowMapShader);
+		// light uniforms and shadow maps, the same for the forward and the deferred lit shader
+		OcclusionQueries* queries = occlusionQueriesEnabled ? &occlusionQueries : NULL;
+		if (queries)
+			queries->BeginFrame(occlusionBoxShader, projection * view, camera.m_position);
+		renderQueue.SetViewProjection(projection * view);
+		renderQueue.SetAutoInstancing(instancing);
+		auto bindLighting = [&](Shader& shader)
+		{
+			shader.setMat4("view", view);
+			shader.setVec3("viewPos", camera.m_position);
+			shader.setVec3("lightDir", lightDir);
+			csm.BindForLighting(shader, CSM_SHADOW_UNIT);
+			shadowFilter.BindForLighting(shader, csm.SampledArray());
+			pointShadows.BindForLighting(shader, POINT_SHADOW_FIRST_UNIT);
+			spotAtlas.BindForLighting(shader, SPOT_ATLAS_UNIT);
+			clusteredLights.BindForLighting(shader, CLUSTER_FIRST_UNIT);
+		};
+		if (renderPath == RENDER_PATH_DEFERRED)
+		{
+			PROFILE_SCOPE("LitPass");
+			PROFILE_GPU_SCOPE("LitPass");
+			gBuffer.Resize(renderWidth, renderHeight);
+			{
+				PROFILE_SCOPE("GBufferPass");
+				PROFILE_GPU_SCOPE("GBufferPass");
+				gBuffer.BeginGeometryPass();
+				gBufferShader.use();
+				gBufferShader.setMat4("projection", projection);
+				gBufferShader.setMat4("view", view);
+				renderQueue.Execute(PASS_OPAQUE, queries);
+			}
+			glState.BindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+			deferredLightingShader.use();
+			deferredLightingShader.setMat4("inverseViewProjection", glm::inverse(projection * view));
+			bindLighting(deferredLightingShader);
+			gBuffer.BindForLighting(deferredLightingShader, GBUFFER_FIRST_UNIT);
+			gBuffer.DrawLightingPass();
+		}
+		else
+		{
+			PROFILE_SCOPE("LitPass");
+			PROFILE_GPU_SCOPE("LitPass");
+			shadowMapShader.use();
+			shadowMapShader.setMat4("projection", projection);
+			bindLighting(shadowMapShader);
+			renderQueue.Execute(PASS_OPAQUE, queries);
+		}
+		shadowFilter.EndLighting();
+		// the frame's per draw constants are all issued, fence their region
+		perDrawStream.EndFrame();
 
 		// render Depth map to quad for visual debugging
 		// ---------------------------------------------
 		/*
 		debugDepthQuadShader.use();
-		debugDepthQuadShader.setFloat("near_plane", near_plane);
-		debugDepthQuadShader.setFloat("far_plane", far_plane);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, depthMap);
+		debugDepthQuadShader.setInt("layer", 0);	// cascade to show
+		glState.BindTexture(0, GL_TEXTURE_2D_ARRAY, csm.SampledArray());
 		renderQuad();
 		*/
 		// glfw: swap buffers and poll IO event (key pressed/released, mouse move etc.)
 		// --------------------
-		glfwSwapBuffers(window);
+		if (bench.enabled)
+		{
+			// submit time is what the CPU spent issuing the frame, frame time includes
+			// waiting for the GPU (llvmpipe included) to finish it
+			std::chrono::steady_clock::time_point submitEnd = std::chrono::steady_clock::now();
+			glFinish();
+			std::chrono::steady_clock::time_point frameEnd = std::chrono::steady_clock::now();
+			if (segmentFrame >= BENCHMARK_WARMUP_FRAMES)
+			{
+				benchmark.AddFrame(std::chrono::duration<double, std::milli>(frameEnd - frameStart).count(),
+					std::chrono::duration<double, std::milli>(submitEnd - frameStart).count(),
+					glState.CurrentFrame().drawCalls);
+				benchmark.AddGpuZone("shadow", Profiler::Get().GpuZoneMs("ShadowPass"));
+				benchmark.AddGpuZone("shadow_filter", Profiler::Get().GpuZoneMs("ShadowFilter"));
+				benchmark.AddGpuZone("lit", Profiler::Get().GpuZoneMs("LitPass"));
+				if (renderPath == RENDER_PATH_DEFERRED)
+					benchmark.AddGpuZone("gbuffer", Profiler::Get().GpuZoneMs("GBufferPass"));
+				benchmark.AddCpuZone("cluster_build", clusteredLights.m_stats.buildMs);
+				benchmark.AddCpuZone("stream_wait", perDrawStream.m_stats.waitMs);
+				benchmark.AddValue("opaque_submitted", renderQueue.m_stats.submitted);
+				benchmark.AddValue("opaque_draws", renderQueue.m_stats.draws);
+				benchmark.AddValue("opaque_merge_ratio", renderQueue.MergeRatio());
+				benchmark.AddCpuZone("opaque_record", renderQueue.m_stats.recordMs);
+				benchmark.AddCpuZone("opaque_replay", renderQueue.m_stats.replayMs);
+				benchmark.AddValue("jobs", jobs.m_stats.jobs);
+				benchmark.AddValue("job_steals", jobs.m_stats.steals);
+				benchmark.AddValue("job_worker_utilization", jobs.m_stats.utilization);
+				if (occlusionCulling)
+					benchmark.AddCpuZone("occlusion_raster", occlusion.m_stats.rasterMs);
+				if (!stressBodies.empty())
+				{
+					benchmark.AddCpuZone("bvh_move", bvhMoveMs);
+					benchmark.AddCpuZone("bvh_query", bvhQueryMs);
+					benchmark.AddValue("bvh_reinsertions", sceneBvh.TakeReinsertions());
+					benchmark.AddValue("bvh_height", sceneBvh.Height());
+				}
+				if (occlusionQueriesEnabled)
+				{
+					benchmark.AddValue("occlusion_queries", occlusionQueries.QueryCount());
+					benchmark.AddValue("occlusion_avoided_fraction", occlusionQueries.AvoidedFraction());
+				}
+			}
+			// the last frame, to compare the filters' quality on the same view
+			if (benchFrame + 1 == bench.SegmentCount() * benchSegmentFrames && !bench.screenshotPath.empty())
+				Benchmark::WriteScreenshot(bench.screenshotPath, renderWidth, renderHeight);
+			benchFrame++;
+			continue;
+		}
+
+		{
+			PROFILE_SCOPE("glfwSwapBuffers");
+			glfwSwapBuffers(window);
+		}
 		glfwPollEvents();
 	}
 
 	// optional: de-allocate all resources once they've outlived their purpose:
 	// ------------------------------------------------------------------------
-	glDeleteVertexArrays(1, &planeVAO);
-	glDeleteBuffers(1, &planeVBO);
+	staticCasters.Destroy();
+	primitives.Destroy();
+	csm.Destroy();
+	shadowFilter.Destroy();
+	pointShadows.Destroy();
+	spotAtlas.Destroy();
+	clusteredLights.Destroy();
+	gBuffer.Destroy();
+	occlusionQueries.Destroy();
+	perDrawStream.Destroy();
+	jobs.Shutdown();
+
+	if (bench.enabled)
+	{
+		glDeleteFramebuffers(1, &sceneFBO);
+		glDeleteRenderbuffers(2, sceneRBOs);
+	}
 
 	// glfw: teminate, clearing all previously allocated GLFW resources
 	// --------------------
 	glfwTerminate();
-	return 0;
+	return bench.enabled ? benchmark.Finish(bench) : 0;
 }
 
 // glfw: whenever the window size changed (by OS or user) this callback function excetues
@@ -264,7 +804,7 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
 	// make sure the viewport matches the new window dimensions; note that width and 
 	// height will be sinificantly larger than specified on Retina displays
-	glViewport(0, 0, width, height);
+	GLStateCache::Get().Viewport(0, 0, width, height);
 
 }
 
@@ -315,6 +855,64 @@ void processInput(GLFWwindow* window)
 		camera.ProcessKeyboard(LEFT, deltaTime);
 	if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
 		camera.ProcessKeyboard(RIGHT, deltaTime);
+
+	// capture the next 120 frames to a Chrome trace (open in chrome://tracing)
+	if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS && !Profiler::Get().IsCapturing())
+		Profiler::Get().BeginCapture(120, "frame_trace.json");
+
+	// shadow filtering: 1 pcf, 2 hardware pcf, 3 poisson, 4 evsm
+	for (int i = 0; i < SHADOW_FILTER_COUNT; i++)
+		if (glfwGetKey(window, GLFW_KEY_1 + i) == GLFW_PRESS)
+			shadowFilter.m_mode = (ShadowFilterMode)i;
+
+	// clustered light count: - halves, = doubles (once per key press)
+	static bool lightKeyDown = false;
+	bool fewer = glfwGetKey(window, GLFW_KEY_MINUS) == GLFW_PRESS;
+	bool more = glfwGetKey(window, GLFW_KEY_EQUAL) == GLFW_PRESS;
+	if ((fewer || more) && !lightKeyDown)
+	{
+		if (fewer && clusteredLightCount > 1)
+			clusteredLightCount /= 2;
+		else if (more && clusteredLightCount < 4096)
+			clusteredLightCount = clusteredLightCount == 0 ? 1 : clusteredLightCount * 2;
+		clusteredLightsChanged = true;
+	}
+	lightKeyDown = fewer || more;
+
+	// render path: G toggles forward/deferred (once per key press)
+	static bool pathKeyDown = false;
+	bool toggle = glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS;
+	if (toggle && !pathKeyDown)
+		renderPath = renderPath == RENDER_PATH_DEFERRED ? RENDER_PATH_FORWARD : RENDER_PATH_DEFERRED;
+	pathKeyDown = toggle;
+
+	// occlusion culling: O toggles it (once per key press)
+	static bool occlusionKeyDown = false;
+	bool occlusionKey = glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS;
+	if (occlusionKey && !occlusionKeyDown)
+		occlusionCulling = !occlusionCulling;
+	occlusionKeyDown = occlusionKey;
+
+	// occlusion queries: H toggles them (once per key press)
+	static bool queriesKeyDown = false;
+	bool queriesKey = glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS;
+	if (queriesKey && !queriesKeyDown)
+		occlusionQueriesEnabled = !occlusionQueriesEnabled;
+	queriesKeyDown = queriesKey;
+
+	// instancing: I toggles it (once per key press)
+	static bool instancingKeyDown = false;
+	bool instancingKey = glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS;
+	if (instancingKey && !instancingKeyDown)
+		instancing = !instancing;
+	instancingKeyDown = instancingKey;
+
+	// static batching: B toggles it (once per key press)
+	static bool batchKeyDown = false;
+	bool batchKey = glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS;
+	if (batchKey && !batchKeyDown)
+		staticBatching = !staticBatching;
+	batchKeyDown = batchKey;
 }
 
 // utility function for loading a 2D texture from file
@@ -336,7 +934,7 @@ unsigned int loadTexture(const char* path)
 		else if (nrComponents == 4)
 			format = GL_RGBA;
 
-		glBindTexture(GL_TEXTURE_2D, textureID);
+		GLStateCache::Get().BindTexture(GL_TEXTURE_2D, textureID);
 		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, texData);
 		glGenerateMipmap(GL_TEXTURE_2D);
 
@@ -355,108 +953,290 @@ unsigned int loadTexture(const char* path)
 	return textureID;
 }
 
-// renders the 3D scene
+// places the floor, the cubes and the shadowed lights under one root node, none of
+// them ever move
 // --------------------
-void renderScene(const Shader& shader)
+void setupScene()
 {
-	// floor 
-	glm::mat4 model = glm::mat4(1.0f);
-	shader.setMat4("model", model);
-	glBindVertexArray(planeVAO);
-	glDrawArrays(GL_TRIANGLES, 0, 6);
-	// cubes
-	model = glm::mat4(1.0f);
-	model = glm::translate(model, glm::vec3(0.0f, 1.5f, 0.0));
-	model = glm::scale(model, glm::vec3(0.5f));
-	shader.setMat4("model", model);
-	renderCube();
-	model = glm::mat4(1.0f);
-	model = glm::translate(model, glm::vec3(2.0f, 0.0f, 1.0));
-	model = glm::scale(model, glm::vec3(0.5f));
-	shader.setMat4("model", model);
-	renderCube();
-	model = glm::mat4(1.0f);
-	model = glm::translate(model, glm::vec3(-1.0f, 0.0f, 2.0));
-	model = glm::rotate(model, glm::radians(60.0f), glm::normalize(glm::vec3(1.0, 0.0, 1.0)));
-	model = glm::scale(model, glm::vec3(0.25));
-	shader.setMat4("model", model);
-	renderCube();
+	unsigned int cube = primitives.Cube();
+
+	int root = sceneGraph.AddNode(SceneGraph::NO_PARENT);
+	glm::quat identity(1.0f, 0.0f, 0.0f, 0.0f);
+	auto addRenderable = [root](unsigned int primitive, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+	{
+		const Primitive& geometry = primitives.Get(primitive);
+		TransformComponent transform = { glm::mat4(1.0f), (unsigned int)sceneGraph.AddNode(root, position, rotation, scale) };
+		BoundsComponent bounds = { geometry.boundsMin, geometry.boundsMax, geometry.boundsMin, geometry.boundsMax, DYNAMICBVH_NULL, 0 };
+		MeshComponent mesh = { primitive, geometry.vao, geometry.shadowVAO, geometry.indexCount };
+		MaterialComponent material = { woodTexture };
+		ShadowCasterComponent caster = { true, false };
+		OccluderComponent occluder = { true };
+		scene.Create(transform, bounds, mesh, material, caster, occluder);
+	};
+	addRenderable(planePrimitive, glm::vec3(0.0f), identity, glm::vec3(1.0f));
+	addRenderable(cube, glm::vec3(0.0f, 1.5f, 0.0), identity, glm::vec3(0.5f));
+	addRenderable(cube, glm::vec3(2.0f, 0.0f, 1.0), identity, glm::vec3(0.5f));
+	addRenderable(cube, glm::vec3(-1.0f, 0.0f, 2.0), glm::angleAxis(glm::radians(60.0f), glm::normalize(glm::vec3(1.0, 0.0, 1.0))), glm::vec3(0.25));
+
+	// the point lights with a shadow cube map each
+	auto addLight = [root, identity](const glm::vec3& position, const LightComponent& light)
+	{
+		TransformComponent transform = { glm::mat4(1.0f), (unsigned int)sceneGraph.AddNode(root, position, identity) };
+		scene.Create(transform, light);
+	};
+	LightComponent point = { LIGHT_POINT_SHADOWED, glm::vec3(0.8f, 0.6f, 0.3f), glm::vec3(0.0f), 0.0f, 0.0f, 0.0f };
+	addLight(glm::vec3(1.5f, 2.5f, -1.5f), point);
+	point.color = glm::vec3(0.2f, 0.4f, 0.8f);
+	addLight(glm::vec3(-2.5f, 1.0f, 0.5f), point);
+	// a ring of spot lights around the scene, aimed at the middle, all in one shadow atlas
+	for (int i = 0; i < 8; i++)
+	{
+		float angle = glm::radians(45.0f * i);
+		glm::vec3 position(7.0f * cos(angle), 4.0f, 7.0f * sin(angle));
+		glm::vec3 color = i % 2 == 0 ? glm::vec3(0.6f, 0.5f, 0.4f) : glm::vec3(0.3f, 0.4f, 0.6f);
+		LightComponent spot = { LIGHT_SPOT_SHADOWED, color, glm::vec3(0.0f, 0.5f, 0.0f) - position, 15.0f, 25.0f, 15.0f };
+		addLight(position, spot);
+	}
+
+	sceneGraph.Update();
+	syncTransforms();
 }
 
-// renderCube() renders a 1x1 3D cube in NDC.
-// -------------------------------------------------
-unsigned int cubeVAO = 0;
-unsigned int cubeVBO = 0;
-void renderCube()
+// merges the static shadow casters into one batch (their transforms must be current)
+// --------------------
+void buildStaticBatches()
 {
-	// initialize (if necessary)
-	if (cubeVAO == 0)
-	{
-		float vertices[] = {
-			// back face
-			-1.0f, -1.0f, -1.0f,  0.0f,  0.0f, -1.0f, 0.0f, 0.0f, // bottom-left
-			 1.0f,  1.0f, -1.0f,  0.0f,  0.0f, -1.0f, 1.0f, 1.0f, // top-right
-			 1.0f, -1.0f, -1.0f,  0.0f,  0.0f, -1.0f, 1.0f, 0.0f, // bottom-right         
-			 1.0f,  1.0f, -1.0f,  0.0f,  0.0f, -1.0f, 1.0f, 1.0f, // top-right
-			-1.0f, -1.0f, -1.0f,  0.0f,  0.0f, -1.0f, 0.0f, 0.0f, // bottom-left
-			-1.0f,  1.0f, -1.0f,  0.0f,  0.0f, -1.0f, 0.0f, 1.0f, // top-left
-			// front face
-			-1.0f, -1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f, 0.0f, // bottom-left
-			 1.0f, -1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f, 0.0f, // bottom-right
-			 1.0f,  1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f, 1.0f, // top-right
-			 1.0f,  1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f, 1.0f, // top-right
-			-1.0f,  1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f, 1.0f, // top-left
-			-1.0f, -1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f, 0.0f, // bottom-left
-			// left face
-			-1.0f,  1.0f,  1.0f, -1.0f,  0.0f,  0.0f, 1.0f, 0.0f, // top-right
-			-1.0f,  1.0f, -1.0f, -1.0f,  0.0f,  0.0f, 1.0f, 1.0f, // top-left
-			-1.0f, -1.0f, -1.0f, -1.0f,  0.0f,  0.0f, 0.0f, 1.0f, // bottom-left
-			-1.0f, -1.0f, -1.0f, -1.0f,  0.0f,  0.0f, 0.0f, 1.0f, // bottom-left
-			-1.0f, -1.0f,  1.0f, -1.0f,  0.0f,  0.0f, 0.0f, 0.0f, // bottom-right
-			-1.0f,  1.0f,  1.0f, -1.0f,  0.0f,  0.0f, 1.0f, 0.0f, // top-right
-			// right face
-			 1.0f,  1.0f,  1.0f,  1.0f,  0.0f,  0.0f, 1.0f, 0.0f, // top-left
-			 1.0f, -1.0f, -1.0f,  1.0f,  0.0f,  0.0f, 0.0f, 1.0f, // bottom-right
-			 1.0f,  1.0f, -1.0f,  1.0f,  0.0f,  0.0f, 1.0f, 1.0f, // top-right         
-			 1.0f, -1.0f, -1.0f,  1.0f,  0.0f,  0.0f, 0.0f, 1.0f, // bottom-right
-			 1.0f,  1.0f,  1.0f,  1.0f,  0.0f,  0.0f, 1.0f, 0.0f, // top-left
-			 1.0f, -1.0f,  1.0f,  1.0f,  0.0f,  0.0f, 0.0f, 0.0f, // bottom-left     
-			 // bottom face
-			 -1.0f, -1.0f, -1.0f,  0.0f, -1.0f,  0.0f, 0.0f, 1.0f, // top-right
-			  1.0f, -1.0f, -1.0f,  0.0f, -1.0f,  0.0f, 1.0f, 1.0f, // top-left
-			  1.0f, -1.0f,  1.0f,  0.0f, -1.0f,  0.0f, 1.0f, 0.0f, // bottom-left
-			  1.0f, -1.0f,  1.0f,  0.0f, -1.0f,  0.0f, 1.0f, 0.0f, // bottom-left
-			 -1.0f, -1.0f,  1.0f,  0.0f, -1.0f,  0.0f, 0.0f, 0.0f, // bottom-right
-			 -1.0f, -1.0f, -1.0f,  0.0f, -1.0f,  0.0f, 0.0f, 1.0f, // top-right
-			 // top face
-			 -1.0f,  1.0f, -1.0f,  0.0f,  1.0f,  0.0f, 0.0f, 1.0f, // top-left
-			  1.0f,  1.0f , 1.0f,  0.0f,  1.0f,  0.0f, 1.0f, 0.0f, // bottom-right
-			  1.0f,  1.0f, -1.0f,  0.0f,  1.0f,  0.0f, 1.0f, 1.0f, // top-right     
-			  1.0f,  1.0f,  1.0f,  0.0f,  1.0f,  0.0f, 1.0f, 0.0f, // bottom-right
-			 -1.0f,  1.0f, -1.0f,  0.0f,  1.0f,  0.0f, 0.0f, 1.0f, // top-left
-			 -1.0f,  1.0f,  1.0f,  0.0f,  1.0f,  0.0f, 0.0f, 0.0f  // bottom-left        
-		};
+	scene.ForEach<TransformComponent, MeshComponent, ShadowCasterComponent>([](Entity, TransformComponent& transform, MeshComponent& mesh,
+		ShadowCasterComponent& caster)
+	{
+		if (!caster.isStatic)
+			return;
+		staticCasters.Add(primitives.Get(mesh.primitive), transform.world);
+		caster.batched = true;
+	});
+	staticCasters.Build();
+}
 
-		glGenVertexArrays(1, &cubeVAO);
-		glGenBuffers(1, &cubeVBO);
-		// fill buffer
-		glBindBuffer(GL_ARRAY_BUFFER, cubeVBO);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-		// link vertex attributes
-		glBindVertexArray(cubeVAO);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(void*)(6 * sizeof(float)));
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindVertexArray(0);
+// copies the world matrices of the scene graph into the entities, then refits their
+// world bounds and moves them in the spatial index (adding the new ones)
+// --------------------
+void syncTransforms()
+{
+	scene.ForEachChunk<TransformComponent>([](unsigned int count, const Entity*, TransformComponent* transforms)
+	{
+		for (unsigned int i = 0; i < count; i++)
+			transforms[i].world = sceneGraph.World(transforms[i].node);
+	});
+	scene.ForEachChunk<TransformComponent, BoundsComponent>([](unsigned int count, const Entity* entities, TransformComponent* transforms,
+		BoundsComponent* bounds)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			BoundsComponent& box = bounds[i];
+			glm::vec3 oldMin = box.worldMin;
+			Frustum::TransformAabb(transforms[i].world, box.localMin, box.localMax, box.worldMin, box.worldMax);
+			if (box.proxy == DYNAMICBVH_NULL)
+				box.proxy = sceneBvh.CreateProxy(box.worldMin, box.worldMax, entities[i]);
+			else
+				sceneBvh.MoveProxy(box.proxy, box.worldMin, box.worldMax, box.worldMin - oldMin);
+		}
+	});
+}
+
+// scatters count small boxes with random velocities over the scene (deterministic)
+// --------------------
+void setupStressBodies(unsigned int count)
+{
+	unsigned int seed = 1;
+	auto random = [&seed]()
+	{
+		seed = seed * 1664525u + 1013904223u;
+		return (float)(seed >> 8) / 16777216.0f;
+	};
+	for (unsigned int i = 0; i < count; i++)
+	{
+		StressBody body;
+		body.position = glm::vec3(random() * 100.0f - 50.0f, random() * 10.0f, random() * 100.0f - 50.0f);
+		body.velocity = (glm::vec3(random(), random(), random()) - 0.5f) * 4.0f;
+		body.proxy = sceneBvh.CreateProxy(body.position - glm::vec3(0.1f), body.position + glm::vec3(0.1f), ENTITY_NULL);
+		stressBodies.push_back(body);
 	}
-	// render Cube
-	glBindVertexArray(cubeVAO);
-	glDrawArrays(GL_TRIANGLES, 0, 36);
-	glBindVertexArray(0);
+}
+
+// moves the stress bodies, bouncing off the walls of their box, and updates the index
+// --------------------
+void updateStressBodies(float dt)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	const glm::vec3 boxMin(-50.0f, 0.0f, -50.0f), boxMax(50.0f, 10.0f, 50.0f);
+	for (unsigned int i = 0; i < stressBodies.size(); i++)
+	{
+		StressBody& body = stressBodies[i];
+		glm::vec3 displacement = body.velocity * dt;
+		body.position += displacement;
+		for (int axis = 0; axis < 3; axis++)
+			if (body.position[axis] < boxMin[axis] || body.position[axis] > boxMax[axis])
+				body.velocity[axis] = -body.velocity[axis];
+		sceneBvh.MoveProxy(body.proxy, body.position - glm::vec3(0.1f), body.position + glm::vec3(0.1f), displacement);
+	}
+	bvhMoveMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// submits the 3D scene to the render queue for the lit pass: the renderables the
+// spatial index finds in the camera frustum, minus what the occlusion buffer (if
+// any, already rasterized) hides. The rest can still be dropped by the occlusion
+// queries. Returns the number of renderables occluded.
+// --------------------
+unsigned int renderScene(RenderQueue& queue, Shader& shader, const glm::mat4& view, const Frustum& frustum, float farPlane, SoftwareOcclusion* occlusion)
+{
+	// the query only marks, the submission below streams over the chunks in order
+	static unsigned int frame = 0;
+	frame++;
+	objectsVisible = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	sceneBvh.QueryFrustum(frustum, [](int proxy)
+	{
+		BoundsComponent* bounds = scene.Get<BoundsComponent>(sceneBvh.UserData(proxy));
+		if (bounds)
+		{
+			bounds->visibleFrame = frame;
+			objectsVisible++;
+		}
+		return true;
+	});
+	bvhQueryMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	unsigned int occluded = 0;
+	// with instancing the visible renderables are grouped by primitive and material first
+	static std::vector<InstanceGroup> groups;
+	unsigned int groupCount = 0;
+	scene.ForEachChunk<TransformComponent, BoundsComponent, MeshComponent, MaterialComponent>([&](unsigned int count, const Entity* entities,
+		TransformComponent* transforms, BoundsComponent* bounds, MeshComponent* meshes, MaterialComponent* materials)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (bounds[i].visibleFrame != frame)
+				continue;
+			if (occlusion && !occlusion->IsVisible(bounds[i].worldMin, bounds[i].worldMax))
+			{
+				occluded++;
+				continue;
+			}
+			const glm::mat4& model = transforms[i].world;
+			float depth = RenderQueue::ViewDepth(view, glm::vec3(model[3]), farPlane);
+			if (!instancing)
+			{
+				RenderQueue::Key key = RenderQueue::MakeOpaqueKey(shader.ID, materials[i].diffuse, depth, meshes[i].vao);
+				queue.Submit(key, shader, meshes[i].vao, GL_TRIANGLES, meshes[i].indexCount, true, model, &materials[i].diffuse, 1);
+				// the entity's index doubles as its occlusion query id
+				queue.SetOcclusion(EntityStore::EntityIndex(entities[i]), bounds[i].worldMin, bounds[i].worldMax);
+				continue;
+			}
+			unsigned int g = 0;
+			while (g < groupCount && (groups[g].vao != meshes[i].vao || groups[g].diffuse != materials[i].diffuse))
+				g++;
+			if (g == groupCount)
+			{
+				if (groups.size() == groupCount)
+					groups.push_back(InstanceGroup());
+				InstanceGroup& group = groups[groupCount++];
+				group.vao = meshes[i].vao;
+				group.indexCount = meshes[i].indexCount;
+				group.diffuse = materials[i].diffuse;
+				group.depth = depth;
+				group.models.clear();
+				group.first = entities[i];
+				group.firstMin = bounds[i].worldMin;
+				group.firstMax = bounds[i].worldMax;
+			}
+			groups[g].models.push_back(model);
+			groups[g].depth = std::min(groups[g].depth, depth);
+		}
+	});
+
+	// one instanced draw per group, lone renderables keep their occlusion query
+	instancedDraws = 0;
+	instancedObjects = 0;
+	for (unsigned int g = 0; g < groupCount; g++)
+	{
+		InstanceGroup& group = groups[g];
+		RenderQueue::Key key = RenderQueue::MakeOpaqueKey(shader.ID, group.diffuse, group.depth, group.vao);
+		unsigned int instances = (unsigned int)group.models.size();
+		if (instances == 1)
+		{
+			queue.Submit(key, shader, group.vao, GL_TRIANGLES, group.indexCount, true, group.models[0], &group.diffuse, 1);
+			queue.SetOcclusion(EntityStore::EntityIndex(group.first), group.firstMin, group.firstMax);
+			continue;
+		}
+		queue.SubmitInstanced(key, shader, group.vao, GL_TRIANGLES, group.indexCount, true, group.models.data(), instances, &group.diffuse, 1);
+		instancedDraws += (instances + RENDERQUEUE_MAX_INSTANCES - 1) / RENDERQUEUE_MAX_INSTANCES;
+		instancedObjects += instances;
+	}
+	return occluded;
+}
+
+// submits the shadow casters of a depth-only pass: position-only vertex arrays, no
+// textures, and only the layers (cascades, cube faces) each caster can reach, as
+// returned by casters.CasterMask(). Static casters only go to the static (cached)
+// cascade pass, dynamic ones only to the dynamic one, the point and spot light
+// passes take both. Returns the number of casters culled.
+// --------------------
+template <typename CasterVolume>
+unsigned int renderShadowCasters(RenderQueue& queue, RenderPass pass, Shader& shader, const CasterVolume& casters, const glm::mat4& lightView, float farPlane)
+{
+	unsigned int culled = 0;
+	scene.ForEachChunk<TransformComponent, BoundsComponent, MeshComponent, ShadowCasterComponent>([&](unsigned int count, const Entity*,
+		TransformComponent* transforms, BoundsComponent* bounds, MeshComponent* meshes, ShadowCasterComponent* shadowCasters)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if ((pass == PASS_SHADOW_STATIC || pass == PASS_SHADOW) && shadowCasters[i].isStatic != (pass == PASS_SHADOW_STATIC))
+				continue;
+			if (staticBatching && shadowCasters[i].batched)
+				continue;
+			unsigned int mask = casters.CasterMask(bounds[i].worldMin, bounds[i].worldMax);
+			if (mask == 0)
+				culled++;
+			const glm::mat4& model = transforms[i].world;
+			float depth = RenderQueue::ViewDepth(lightView, glm::vec3(model[3]), farPlane);
+			RenderQueue::Key key = RenderQueue::MakeShadowKey(shader.ID, meshes[i].shadowVAO, depth, pass);
+			queue.SubmitDepth(key, shader, meshes[i].shadowVAO, meshes[i].indexCount, true, model, mask);
+		}
+	});
+	// the batched static casters, one draw culled by their combined bounds
+	if (staticBatching && pass != PASS_SHADOW && !staticCasters.Empty())
+	{
+		unsigned int mask = casters.CasterMask(staticCasters.BoundsMin(), staticCasters.BoundsMax());
+		if (mask == 0)
+			culled += staticCasters.SourceCount();
+		glm::vec3 center = (staticCasters.BoundsMin() + staticCasters.BoundsMax()) * 0.5f;
+		float depth = RenderQueue::ViewDepth(lightView, center, farPlane);
+		RenderQueue::Key key = RenderQueue::MakeShadowKey(shader.ID, staticCasters.ShadowVAO(), depth, pass);
+		queue.SubmitDepth(key, shader, staticCasters.ShadowVAO(), staticCasters.IndexCount(), true, glm::mat4(1.0f), mask);
+	}
+	return culled;
+}
+
+// submits the meshes of the benchmark nanosuits (placed by nanosuitTransform())
+// as depth-only casters of a shadow pass, culled per mesh like renderShadowCasters().
+// Returns the number of meshes culled.
+// --------------------
+template <typename CasterVolume>
+unsigned int renderNanosuitCasters(RenderQueue& queue, RenderPass pass, Shader& shader, const CasterVolume& casters, const glm::mat4& lightView, float farPlane,
+	Model& nanosuit, unsigned int instances)
+{
+	unsigned int culled = 0;
+	for (unsigned int i = 0; i < instances; i++)
+		culled += nanosuit.SubmitShadow(queue, pass, shader, nanosuitTransform(i), lightView, farPlane, casters);
+	return culled;
+}
+
+// placement of the benchmark's nanosuits, rows of eight behind the scene
+// --------------------
+glm::mat4 nanosuitTransform(unsigned int instance)
+{
+	glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(((instance % 8) - 3.5f) * 1.5f, -0.5f, -4.0f - (instance / 8) * 1.5f));
+	return glm::scale(model, glm::vec3(0.1f));
 }
 
 // renderQuad() renders a 1x1 XY quad in NDC
@@ -477,7 +1257,7 @@ void renderQuad()
 		// setup plane VAO
 		glGenVertexArrays(1, &quadVAO);
 		glGenBuffers(1, &quadVBO);
-		glBindVertexArray(quadVAO);
+		GLStateCache::Get().BindVertexArray(quadVAO);
 		glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
 		glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
 		glEnableVertexAttribArray(0);
@@ -485,9 +1265,8 @@ void renderQuad()
 		glEnableVertexAttribArray(1);
 		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
 	}
-	glBindVertexArray(quadVAO);
+	GLStateCache::Get().BindVertexArray(quadVAO);
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glBindVertexArray(0);
 }
 
 
@@ -7,6 +7,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "shader.h"
+#include "GLStateCache.h"
+#include "Material.h"
 
 #include <string>
 #include <vector>
@@ -43,60 +45,60 @@ public:
     vector<Vertex>       vertices;
     vector<unsigned int> indices;
     vector<Texture>      textures;
+    Material             material;
     unsigned int VAO;
+    // position-only vertex array (same index buffer) for the depth-only passes
+    unsigned int shadowVAO;
+    // local space bounds, for culling
+    glm::vec3 boundsMin, boundsMax;
 
-    // constructor
+    // constructor, resolves the material from the texture list
     Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
     {
         this->vertices = vertices;
         this->indices = indices;
         this->textures = textures;
+        for (unsigned int i = 0; i < textures.size(); i++)
+        {
+            TextureType type;
+            if (Material::TypeFromName(textures[i].type, type))
+                material.AddTexture(type, textures[i].id);
+        }
 
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
         setupMesh();
     }
 
+    // constructor with an already resolved (possibly shared) material
+    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, const Material& material)
+    {
+        this->vertices = vertices;
+        this->indices = indices;
+        this->textures = textures;
+        this->material = material;
+
+        setupMesh();
+    }
+
     // render the mesh
     void Draw(Shader& shader)
     {
-        // bind appropriate textures
-        unsigned int diffuseNr = 1;
-        unsigned int specularNr = 1;
-        unsigned int normalNr = 1;
-        unsigned int heightNr = 1;
-        for (unsigned int i = 0; i < textures.size(); i++)
-        {
-            glActiveTexture(GL_TEXTURE0 + i); // active proper texture unit before binding
-            // retrieve texture number (the N in diffuse_textureN)
-            string number;
-            string name = textures[i].type;
-            if (name == "texture_diffuse")
-                number = std::to_string(diffuseNr++);
-            else if (name == "texture_specular")
-                number = std::to_string(specularNr++); // transfer unsigned int to string
-            else if (name == "texture_normal")
-                number = std::to_string(normalNr++); // transfer unsigned int to string
-            else if (name == "texture_height")
-                number = std::to_string(heightNr++); // transfer unsigned int to string
-
-            // now set the sampler to the correct texture unit
-            glUniform1i(glGetUniformLocation(shader.ID, (name + number).c_str()), i);
-            // and finally bind the texture
-            glBindTexture(GL_TEXTURE_2D, textures[i].id);
-        }
-
-        // draw mesh
-        glBindVertexArray(VAO);
+        GLStateCache& state = GLStateCache::Get();
+        // the sampler names of the program are mapped to the material's fixed units
+        // once, after that drawing only binds texture ids (no string work per draw)
+        Material::PrepareProgram(shader);
+        material.Bind();
+
+        // draw mesh; no unbinding afterwards, the next draw binds what it needs
+        // and the state cache drops the bind if it's already current
+        state.BindVertexArray(VAO);
         glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-        // always good practice to set everything back to defaults once configured.
-        glActiveTexture(GL_TEXTURE0);
+        state.CountDrawCall();
     }
 
 private:
     // render data 
-    unsigned int VBO, EBO;
+    unsigned int VBO, EBO, positionVBO;
 
     // initializes all the buffer objects/arrays
     void setupMesh()
@@ -106,7 +108,7 @@ private:
         glGenBuffers(1, &VBO);
         glGenBuffers(1, &EBO);
 
-        glBindVertexArray(VAO);
+        GLStateCache::Get().BindVertexArray(VAO);
         // load data into vertex buffers
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         // A great thing about structs is that their memory layout is sequential for all its items.
@@ -140,7 +142,26 @@ private:
         // weights
         glEnableVertexAttribArray(6);
         glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, m_Weights));
-        glBindVertexArray(0);
+
+        // the depth passes only read positions: keep a tightly packed copy so they
+        // don't pull the whole interleaved vertex through the cache
+        vector<glm::vec3> positions(vertices.size());
+        boundsMin = boundsMax = vertices.empty() ? glm::vec3(0.0f) : vertices[0].Position;
+        for (unsigned int i = 0; i < vertices.size(); i++)
+        {
+            positions[i] = vertices[i].Position;
+            boundsMin = glm::min(boundsMin, positions[i]);
+            boundsMax = glm::max(boundsMax, positions[i]);
+        }
+        glGenVertexArrays(1, &shadowVAO);
+        glGenBuffers(1, &positionVBO);
+        GLStateCache::Get().BindVertexArray(shadowVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, positionVBO);
+        glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), &positions[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+        GLStateCache::Get().BindVertexArray(0);
     }
 };
 #endif
@@ -12,6 +12,11 @@
 
 #include "mesh.h"
 #include "shader.h"
+#include "GLStateCache.h"
+#include "RenderQueue.h"
+#include "Frustum.h"
+#include "SceneGraph.h"
+#include "JobSystem.h"
 
 #include <string>
 #include <fstream>
@@ -19,9 +24,11 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <cstring>
 using namespace std;
 
 unsigned int TextureFromFile(const char* path, const string& directory, bool gamma = false);
+void UploadTexture(unsigned int textureID, unsigned char* data, int width, int height, int nrComponents);
 
 class Model
 {
@@ -29,9 +36,23 @@ public:
     // model data 
     vector<Texture> textures_loaded;	// stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
     vector<Mesh>    meshes;
+    map<unsigned int, Material> materials_loaded;	// resolved materials by assimp material index, shared by all meshes using them
+    SceneGraph nodes;	// the assimp node hierarchy with its transforms, depth-first
+    vector<unsigned int> meshNodes;	// the node each mesh hangs off, meshes[i] is placed by nodes.World(meshNodes[i])
     string directory;
     bool gammaCorrection;
 
+    // a texture the model needs, decoded on the job system while loading
+    struct PendingTexture
+    {
+        string filename;
+        unsigned int id;
+        unsigned char* data;
+        int width, height, nrComponents;
+        JobCounter* counter;
+    };
+    vector<PendingTexture> pendingTextures;
+
     // constructor, expects a filepath to a 3D model.
     Model(string const& path, bool gamma = false) : gammaCorrection(gamma)
     {
@@ -45,6 +66,56 @@ public:
             meshes[i].Draw(shader);
     }
 
+    // queues the model's meshes into the render queue instead of drawing them right away.
+    // the depth bucket is taken from the model's origin in the given view. With a
+    // firstOcclusionId the lit draws are occlusion tested, mesh i as query object firstOcclusionId + i.
+    void Submit(RenderQueue& queue, RenderPass pass, Shader& shader, const glm::mat4& model, const glm::mat4& view, float farPlane,
+        unsigned int firstOcclusionId = RENDERQUEUE_NO_OCCLUSION)
+    {
+        float depth = RenderQueue::ViewDepth(view, glm::vec3(model[3]), farPlane);
+        for (unsigned int i = 0; i < meshes.size(); i++)
+        {
+            glm::mat4 meshModel = model * nodes.World(meshNodes[i]);
+            if (IsShadowPass(pass))
+            {
+                RenderQueue::Key key = RenderQueue::MakeShadowKey(shader.ID, meshes[i].shadowVAO, depth, pass);
+                queue.SubmitDepth(key, shader, meshes[i].shadowVAO, static_cast<GLsizei>(meshes[i].indices.size()), true, meshModel, ~0u);
+                continue;
+            }
+            RenderQueue::Key key = RenderQueue::MakeOpaqueKey(shader.ID, meshes[i].material.id, depth, meshes[i].VAO);
+            queue.Submit(key, shader, meshes[i], meshModel);
+            if (firstOcclusionId != RENDERQUEUE_NO_OCCLUSION)
+            {
+                glm::vec3 worldMin, worldMax;
+                Frustum::TransformAabb(meshModel, meshes[i].boundsMin, meshes[i].boundsMax, worldMin, worldMax);
+                queue.SetOcclusion(firstOcclusionId + i, worldMin, worldMax);
+            }
+        }
+    }
+
+    // queues the model's meshes as depth-only shadow casters, culled per mesh:
+    // casters.CasterMask(worldMin, worldMax) returns the shadow map layers a mesh
+    // reaches (e.g. CascadedShadowMap). Returns the number of meshes culled.
+    template <typename CasterVolume>
+    unsigned int SubmitShadow(RenderQueue& queue, RenderPass pass, Shader& shader, const glm::mat4& model, const glm::mat4& lightView, float farPlane,
+        const CasterVolume& casters)
+    {
+        float depth = RenderQueue::ViewDepth(lightView, glm::vec3(model[3]), farPlane);
+        unsigned int culled = 0;
+        for (unsigned int i = 0; i < meshes.size(); i++)
+        {
+            glm::mat4 meshModel = model * nodes.World(meshNodes[i]);
+            glm::vec3 worldMin, worldMax;
+            Frustum::TransformAabb(meshModel, meshes[i].boundsMin, meshes[i].boundsMax, worldMin, worldMax);
+            unsigned int mask = casters.CasterMask(worldMin, worldMax);
+            if (mask == 0)
+                culled++;
+            RenderQueue::Key key = RenderQueue::MakeShadowKey(shader.ID, meshes[i].shadowVAO, depth, pass);
+            queue.SubmitDepth(key, shader, meshes[i].shadowVAO, static_cast<GLsizei>(meshes[i].indices.size()), true, meshModel, mask);
+        }
+        return culled;
+    }
+
 private:
     // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
     void loadModel(string const& path)
@@ -62,12 +133,51 @@ private:
         directory = path.substr(0, path.find_last_of('\\'));
 
         // process ASSIMP's root node recursively
-        processNode(scene->mRootNode, scene);
+        processNode(scene->mRootNode, scene, SceneGraph::NO_PARENT);
+        // the node transforms are fixed from here on, one update bakes the mesh placements
+        nodes.Update();
+
+        // decode the textures in parallel, each is uploaded on this (the GL) thread as soon as it is decoded
+        JobCounter textureJobs;
+        for (unsigned int i = 0; i < pendingTextures.size(); i++)
+            pendingTextures[i].counter = &textureJobs;
+        JobSystem::Get().ParallelFor((unsigned int)pendingTextures.size(), 1, &Model::DecodeTextures, this, textureJobs, NULL, "DecodeTexture");
+        JobSystem::Get().Wait(textureJobs);
+        pendingTextures.clear();
+    }
+
+    static void DecodeTextures(void* data, unsigned int begin, unsigned int end)
+    {
+        Model& model = *static_cast<Model*>(data);
+        for (unsigned int i = begin; i < end; i++)
+        {
+            PendingTexture& texture = model.pendingTextures[i];
+            texture.data = stbi_load(texture.filename.c_str(), &texture.width, &texture.height, &texture.nrComponents, 0);
+            JobSystem::Get().RunOnMainThread(&Model::UploadTextures, data, i, i + 1, texture.counter, "UploadTexture");
+        }
+    }
+
+    static void UploadTextures(void* data, unsigned int begin, unsigned int end)
+    {
+        Model& model = *static_cast<Model*>(data);
+        for (unsigned int i = begin; i < end; i++)
+        {
+            PendingTexture& texture = model.pendingTextures[i];
+            if (!texture.data)
+                std::cout << "Texture failed to load at path: " << texture.filename << std::endl;
+            UploadTexture(texture.id, texture.data, texture.width, texture.height, texture.nrComponents);
+        }
     }
 
     // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-    void processNode(aiNode* node, const aiScene* scene)
+    void processNode(aiNode* node, const aiScene* scene, int parent)
     {
+        // keep the node's transform relative to its parent, split into translation, rotation and scale
+        aiVector3D scaling, position;
+        aiQuaternion rotation;
+        node->mTransformation.Decompose(scaling, rotation, position);
+        int index = nodes.AddNode(parent, glm::vec3(position.x, position.y, position.z), glm::quat(rotation.w, rotation.x, rotation.y, rotation.z),
+            glm::vec3(scaling.x, scaling.y, scaling.z));
         // process each mesh located at the current node
         for (unsigned int i = 0; i < node->mNumMeshes; i++)
         {
@@ -75,11 +185,12 @@ private:
             // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
             aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
             meshes.push_back(processMesh(mesh, scene));
+            meshNodes.push_back((unsigned int)index);
         }
         // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
         for (unsigned int i = 0; i < node->mNumChildren; i++)
         {
-            processNode(node->mChildren[i], scene);
+            processNode(node->mChildren[i], scene, index);
         }
 
     }
@@ -164,8 +275,22 @@ private:
         std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
         textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
 
+        // resolve the material once per assimp material, so meshes sharing it also share its id
+        map<unsigned int, Material>::iterator found = materials_loaded.find(mesh->mMaterialIndex);
+        if (found == materials_loaded.end())
+        {
+            Material resolved;
+            for (unsigned int i = 0; i < textures.size(); i++)
+            {
+                TextureType type;
+                if (Material::TypeFromName(textures[i].type, type))
+                    resolved.AddTexture(type, textures[i].id);
+            }
+            found = materials_loaded.insert(std::make_pair(mesh->mMaterialIndex, resolved)).first;
+        }
+
         // return a mesh object created from the extracted mesh data
-        return Mesh(vertices, indices, textures);
+        return Mesh(vertices, indices, textures, found->second);
     }
 
     // checks all material textures of a given type and loads the textures if they're not loaded yet.
@@ -190,8 +315,11 @@ private:
             }
             if (!skip)
             {   // if texture hasn't been loaded already, load it
+                // the id now, the image once loadModel() decoded it
                 Texture texture;
-                texture.id = TextureFromFile(str.C_Str(), this->directory);
+                glGenTextures(1, &texture.id);
+                PendingTexture pending = { directory + '\\' + str.C_Str(), texture.id, NULL, 0, 0, 0, NULL };
+                pendingTextures.push_back(pending);
                 texture.type = typeName;
                 texture.path = str.C_Str();
                 textures.push_back(texture);
@@ -213,6 +341,15 @@ unsigned int TextureFromFile(const char* path, const string& directory, bool gam
 
     int width, height, nrComponents;
     unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
+    if (!data)
+        std::cout << "Texture failed to load at path: " << path << std::endl;
+    UploadTexture(textureID, data, width, height, nrComponents);
+    return textureID;
+}
+
+// fills the texture with a decoded image and frees the image, NULL leaves it empty
+void UploadTexture(unsigned int textureID, unsigned char* data, int width, int height, int nrComponents)
+{
     if (data)
     {
         GLenum format;
@@ -223,7 +360,7 @@ unsigned int TextureFromFile(const char* path, const string& directory, bool gam
         else if (nrComponents == 4)
             format = GL_RGBA;
 
-        glBindTexture(GL_TEXTURE_2D, textureID);
+        GLStateCache::Get().BindTexture(GL_TEXTURE_2D, textureID);
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
         glGenerateMipmap(GL_TEXTURE_2D);
 
@@ -231,15 +368,7 @@ unsigned int TextureFromFile(const char* path, const string& directory, bool gam
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data);
     }
-    else
-    {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
-    }
-
-    return textureID;
+    stbi_image_free(data);
 }
 #endif
@@ -4,6 +4,8 @@
 #include <glad\glad.h>
 #include <glm/glm.hpp>
 
+#include "GLStateCache.h"
+
 #include <string>
 #include <fstream>
 #include <sstream>
@@ -13,18 +15,22 @@ class Shader
 {
 public:
 	unsigned int ID;
-	// constructor generates the shader on the fly
+	// constructor generates the shader on the fly, the geometry shader is optional.
+	// defines (e.g. "#define FOO\n") are inserted after the #version line of every stage
 	// ------------------------------------------------------------------------
-	Shader(const char* vertexPath, const char* fragmentPath)
+	Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr, const char* defines = nullptr)
 	{
 		// 1. retrieve the vertex/fragment source code from filePath
 		std::string vertexCode;
 		std::string fragmentCode;
+		std::string geometryCode;
 		std::ifstream vShaderFile;
 		std::ifstream fShaderFile;
+		std::ifstream gShaderFile;
 		// ensure ifstream objects can throw exceptions:
 		vShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		fShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		gShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		try
 		{
 			// open files
@@ -40,11 +46,26 @@ public:
 			// convert stream into string
 			vertexCode = vShaderStream.str();
 			fragmentCode = fShaderStream.str();
+			// if geometry shader path is present, also load a geometry shader
+			if (geometryPath != nullptr)
+			{
+				gShaderFile.open(geometryPath);
+				std::stringstream gShaderStream;
+				gShaderStream << gShaderFile.rdbuf();
+				gShaderFile.close();
+				geometryCode = gShaderStream.str();
+			}
 		}
 		catch (std::ifstream::failure& e)
 		{
 			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ: " << e.what() << std::endl;
 		}
+		if (defines != nullptr)
+		{
+			vertexCode = InsertDefines(vertexCode, defines);
+			fragmentCode = InsertDefines(fragmentCode, defines);
+			geometryCode = InsertDefines(geometryCode, defines);
+		}
 		const char* vShaderCode = vertexCode.c_str();
 		const char* fShaderCode = fragmentCode.c_str();
 		// 2. compile shaders
@@ -59,22 +80,36 @@ public:
 		glShaderSource(fragment, 1, &fShaderCode, NULL);
 		glCompileShader(fragment);
 		checkCompileErrors(fragment, "FRAGMENT");
+		// if geometry shader is given, compile geometry shader
+		unsigned int geometry = 0;
+		if (geometryPath != nullptr)
+		{
+			const char* gShaderCode = geometryCode.c_str();
+			geometry = glCreateShader(GL_GEOMETRY_SHADER);
+			glShaderSource(geometry, 1, &gShaderCode, NULL);
+			glCompileShader(geometry);
+			checkCompileErrors(geometry, "GEOMETRY");
+		}
 		// shader Program
 		ID = glCreateProgram();
 		glAttachShader(ID,vertex);
 		glAttachShader(ID, fragment);
+		if (geometryPath != nullptr)
+			glAttachShader(ID, geometry);
 		glLinkProgram(ID);
 		checkCompileErrors(ID, "PROGRAM");
 		// delete the shaders as they're linked into our program now and no longer necessary
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
+		if (geometryPath != nullptr)
+			glDeleteShader(geometry);
 	}
 
 	// activate the shader
 	// ------------------------------------------------------------------------
 	void use()
 	{
-		glUseProgram(ID);
+		GLStateCache::Get().UseProgram(ID);
 	}
 	// utility uniform functions
 	// ------------------------------------------------------------------------
@@ -83,7 +118,7 @@ public:
 		glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
 	}
 	// ------------------------------------------------------------------------
-	void setInt(const std::string& name, bool value) const
+	void setInt(const std::string& name, int value) const
 	{
 		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
 	}
@@ -162,6 +197,16 @@ private:
 			
 		}
 	}
+	// ------------------------------------------------------------------------
+	static std::string InsertDefines(const std::string& code, const char* defines)
+	{
+		if (code.empty())
+			return code;
+		size_t lineEnd = code.find('\n');
+		if (lineEnd == std::string::npos)
+			return code + "\n" + defines;
+		return code.substr(0, lineEnd + 1) + defines + code.substr(lineEnd + 1);
+	}
 };
 
 #endif
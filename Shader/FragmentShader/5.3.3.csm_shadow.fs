@@ -0,0 +1,368 @@
+#version 330 core
+
+#define MAX_CASCADES 4
+// must match POINT_SHADOW_MAX_LIGHTS in PointShadowMaps.h
+#define MAX_POINT_LIGHTS 4
+// must match SHADOW_ATLAS_MAX_LIGHTS in ShadowAtlas.h
+#define MAX_SPOT_LIGHTS 16
+// must match CLUSTER_X/Y/Z in ClusteredLights.h
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+
+// shadow filtering modes, must match ShadowFilterMode in ShadowFilter.h
+#define FILTER_PCF 0			// 3x3 manual depth compares
+#define FILTER_HARDWARE_PCF 1	// 2x2 bilinear compare taps through a comparison sampler
+#define FILTER_POISSON 2		// rotated Poisson disk, 4 taps first and 12 more only in the penumbra
+#define FILTER_EVSM 3			// exponential variance shadow map, blurred at shadow map resolution
+
+// compiled twice: the forward lit pass, and with DEFERRED_LIGHTING defined as the
+// fullscreen lighting pass of the deferred path, which rebuilds fs_in from the G-buffer
+#ifdef DEFERRED_LIGHTING
+in vec2 TexCoords;
+
+struct Surface
+{
+	vec3 FragPos;
+	vec3 Normal;
+	vec2 TexCoords;
+	float ViewDepth;
+};
+Surface fs_in;
+
+uniform sampler2D gAlbedoSpec;	// rgb albedo, a specular strength
+uniform sampler2D gNormal;		// octahedral world space normal
+uniform sampler2D gDepth;
+uniform mat4 inverseViewProjection;
+uniform mat4 view;
+#else
+in VS_OUT
+{
+	vec3 FragPos;
+	vec3 Normal;
+	vec2 TexCoords;
+	float ViewDepth;
+} fs_in;
+
+uniform sampler2D diffuseTexture;
+#endif
+uniform sampler2DArray shadowMap;
+// the same depth array through a GL_COMPARE_REF_TO_TEXTURE sampler
+uniform sampler2DArrayShadow shadowMapCompare;
+// blurred EVSM moments (FILTER_EVSM only)
+uniform sampler2DArray shadowMoments;
+uniform vec2 evsmExponents;
+uniform int shadowFilter;
+
+// shadowed point lights, their cube maps hold distance / pointFarPlane
+uniform int pointLightCount;
+uniform vec3 pointLightPositions[MAX_POINT_LIGHTS];
+uniform vec3 pointLightColors[MAX_POINT_LIGHTS];
+uniform float pointFarPlane;
+uniform samplerCube pointShadowMaps[MAX_POINT_LIGHTS];
+
+// shadowed spot lights, all sharing one shadow atlas
+uniform int spotLightCount;
+uniform vec3 spotLightPositions[MAX_SPOT_LIGHTS];
+uniform vec3 spotLightDirections[MAX_SPOT_LIGHTS];
+uniform vec3 spotLightColors[MAX_SPOT_LIGHTS];
+uniform vec3 spotLightParams[MAX_SPOT_LIGHTS];	// cos(inner), cos(outer), range
+uniform mat4 spotLightSpaceMatrices[MAX_SPOT_LIGHTS];
+uniform vec4 spotShadowRects[MAX_SPOT_LIGHTS];	// atlas tile (xy offset, zw size) in uv, zw = 0 without a shadow
+uniform sampler2D spotShadowAtlas;
+
+// unshadowed clustered point lights, see ClusteredLights.h
+uniform samplerBuffer clusterLightData;	// two texels per light: position + radius, color
+uniform usamplerBuffer clusterRanges;	// per cluster: offset into clusterIndices, light count
+uniform usamplerBuffer clusterIndices;
+uniform vec2 clusterSliceParams;	// depth slice = log(view depth) * x + y
+uniform vec2 clusterTileSize;		// pixels per cluster column/row
+
+uniform vec3 lightDir;	// towards the light
+uniform vec3 viewPos;
+
+uniform mat4 lightSpaceMatrices[MAX_CASCADES];
+uniform float cascadePlaneDistances[MAX_CASCADES];	// far distance of each cascade
+uniform int cascadeCount;
+
+out vec4 FragColor;
+
+// scales every light's specular term, no specular maps in the forward path
+float specularStrength = 1.0;
+
+const vec2 poissonDisk[16] = vec2[](
+	vec2(-0.94201624, -0.39906216), vec2(0.94558609, -0.76890725),
+	vec2(-0.09418410, -0.92938870), vec2(0.34495938, 0.29387760),
+	vec2(-0.91588581, 0.45771432), vec2(-0.81544232, -0.87912464),
+	vec2(-0.38277543, 0.27676845), vec2(0.97484398, 0.75648379),
+	vec2(0.44323325, -0.97511554), vec2(0.53742981, -0.47373420),
+	vec2(-0.26496911, -0.41893023), vec2(0.79197514, 0.19090188),
+	vec2(-0.24188840, 0.99706507), vec2(-0.81409955, 0.91437590),
+	vec2(0.19984126, 0.78641367), vec2(0.14383161, -0.14100790)
+);
+
+// every compare tap is a bilinear 2x2 PCF in hardware, four of them cover a 3x3 texel area
+float HardwarePCF(vec3 projCoords, int layer, float compareDepth, vec2 texelSize)
+{
+	float lit = 0.0;
+	for(int x = 0; x < 2; ++x)
+		for(int y = 0; y < 2; ++y)
+			lit += texture(shadowMapCompare, vec4(projCoords.xy + (vec2(x, y) - 0.5) * texelSize, layer, compareDepth));
+	return 1.0 - lit * 0.25;
+}
+
+// Poisson disk rotated per pixel (interleaved gradient noise) to trade banding for noise.
+// Fully lit or fully shadowed areas stop after the first 4 taps.
+float PoissonPCF(vec3 projCoords, int layer, float compareDepth, vec2 texelSize)
+{
+	float angle = 6.2831853 * fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+	mat2 rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+	vec2 radius = 2.5 * texelSize;
+
+	float lit = 0.0;
+	for(int i = 0; i < 4; ++i)
+		lit += texture(shadowMapCompare, vec4(projCoords.xy + rotation * poissonDisk[i] * radius, layer, compareDepth));
+	if(lit == 0.0 || lit == 4.0)
+		return 1.0 - lit * 0.25;
+	for(int i = 4; i < 16; ++i)
+		lit += texture(shadowMapCompare, vec4(projCoords.xy + rotation * poissonDisk[i] * radius, layer, compareDepth));
+	return 1.0 - lit / 16.0;
+}
+
+float Chebyshev(vec2 moments, float mean, float minVariance)
+{
+	if(mean <= moments.x)
+		return 1.0;
+	float variance = max(moments.y - moments.x * moments.x, minVariance);
+	float d = mean - moments.x;
+	float pMax = variance / (variance + d * d);
+	// cut the tail to reduce light bleeding
+	return clamp((pMax - 0.2) / 0.8, 0.0, 1.0);
+}
+
+// prefiltered: one linear fetch of the blurred moments, no depth bias needed
+float EVSM(vec3 projCoords, int layer)
+{
+	vec4 moments = texture(shadowMoments, vec3(projCoords.xy, layer));
+	float depth = projCoords.z * 2.0 - 1.0;
+	float positive = exp(evsmExponents.x * depth);
+	float negative = -exp(-evsmExponents.y * depth);
+	float positiveLit = Chebyshev(moments.xy, positive, 0.0001 * positive * positive);
+	float negativeLit = Chebyshev(moments.zw, negative, 0.0001 * negative * negative);
+	return 1.0 - min(positiveLit, negativeLit);
+}
+
+float ShadowCalculation(vec3 fragPosWorld, vec3 normal)
+{
+	// select the first cascade that still covers this fragment
+	int layer = -1;
+	for(int i = 0; i < cascadeCount; ++i)
+	{
+		if(fs_in.ViewDepth < cascadePlaneDistances[i])
+		{
+			layer = i;
+			break;
+		}
+	}
+	// beyond the last cascade, nothing is shadowed
+	if(layer == -1)
+		return 0.0;
+
+	vec4 fragPosLightSpace = lightSpaceMatrices[layer] * vec4(fragPosWorld, 1.0);
+	// perform perspective divide
+	vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
+	// transform to [0,1] range
+	projCoords = projCoords * 0.5 + 0.5;
+	float currentDepth = projCoords.z;
+	if(currentDepth > 1.0)
+		return 0.0;
+
+	// farther cascades cover more world space per texel, so shrink the bias with the split distance
+	float bias = max(0.05 * (1.0 - dot(normal, lightDir)), 0.005);
+	bias *= 1.0 / (cascadePlaneDistances[layer] * 0.5);
+
+	vec2 texelSize = 1.0 / vec2(textureSize(shadowMap, 0));
+	if(shadowFilter == FILTER_HARDWARE_PCF)
+		return HardwarePCF(projCoords, layer, currentDepth - bias, texelSize);
+	if(shadowFilter == FILTER_POISSON)
+		return PoissonPCF(projCoords, layer, currentDepth - bias, texelSize);
+	if(shadowFilter == FILTER_EVSM)
+		return EVSM(projCoords, layer);
+
+	// pcf
+	float shadow = 0.0;
+	for(int x = -1; x <= 1; ++x)
+	{
+		for(int y = -1; y <= 1; ++y)
+		{
+			float pcfDepth = texture(shadowMap, vec3(projCoords.xy + vec2(x, y) * texelSize, layer)).r;
+			shadow += currentDepth - bias > pcfDepth ? 1.0 : 0.0;
+		}
+	}
+	return shadow / 9.0;
+}
+
+const vec3 cubeSampleOffsets[8] = vec3[](
+	vec3( 1,  1,  1), vec3( 1, -1,  1), vec3(-1, -1,  1), vec3(-1,  1,  1),
+	vec3( 1,  1, -1), vec3( 1, -1, -1), vec3(-1, -1, -1), vec3(-1,  1, -1)
+);
+
+float PointShadowCalculation(samplerCube shadowCube, vec3 fragToLight)
+{
+	float currentDistance = length(fragToLight);
+	float bias = 0.05;
+	// wider kernel further away from the viewer
+	float diskRadius = (1.0 + length(viewPos - fs_in.FragPos) / pointFarPlane) / 50.0;
+	float shadow = 0.0;
+	for(int i = 0; i < 8; ++i)
+	{
+		float closestDistance = texture(shadowCube, fragToLight + cubeSampleOffsets[i] * diskRadius).r * pointFarPlane;
+		shadow += currentDistance - bias > closestDistance ? 1.0 : 0.0;
+	}
+	return shadow / 8.0;
+}
+
+vec3 PointLight(int index, samplerCube shadowCube, vec3 normal, vec3 viewDir)
+{
+	vec3 toLight = pointLightPositions[index] - fs_in.FragPos;
+	float distance = length(toLight);
+	if(distance >= pointFarPlane)
+		return vec3(0.0);
+	vec3 L = toLight / distance;
+	float diff = max(dot(L, normal), 0.0);
+	float spec = specularStrength * pow(max(dot(normal, normalize(L + viewDir)), 0.0), 64.0);
+	float attenuation = 1.0 / (1.0 + 0.09 * distance + 0.032 * distance * distance);
+	float shadow = PointShadowCalculation(shadowCube, -toLight);
+	return (1.0 - shadow) * attenuation * (diff + spec) * pointLightColors[index];
+}
+
+float SpotShadowCalculation(int index, vec3 normal, vec3 L)
+{
+	vec4 rect = spotShadowRects[index];
+	if(rect.z == 0.0)
+		return 0.0;
+	vec4 fragPosLightSpace = spotLightSpaceMatrices[index] * vec4(fs_in.FragPos, 1.0);
+	vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w * 0.5 + 0.5;
+	if(projCoords.z > 1.0)
+		return 0.0;
+	float bias = max(0.002 * (1.0 - dot(normal, L)), 0.0002);
+	// 2x2 pcf, the taps are clamped to the light's own tile
+	vec2 texelSize = 1.0 / vec2(textureSize(spotShadowAtlas, 0));
+	vec2 tileMin = rect.xy + 0.5 * texelSize;
+	vec2 tileMax = rect.xy + rect.zw - 0.5 * texelSize;
+	float shadow = 0.0;
+	for(int x = 0; x < 2; ++x)
+	{
+		for(int y = 0; y < 2; ++y)
+		{
+			vec2 uv = clamp(rect.xy + projCoords.xy * rect.zw + (vec2(x, y) - 0.5) * texelSize, tileMin, tileMax);
+			shadow += projCoords.z - bias > texture(spotShadowAtlas, uv).r ? 1.0 : 0.0;
+		}
+	}
+	return shadow * 0.25;
+}
+
+vec3 SpotLight(int index, vec3 normal, vec3 viewDir)
+{
+	vec3 toLight = spotLightPositions[index] - fs_in.FragPos;
+	float distance = length(toLight);
+	vec3 params = spotLightParams[index];
+	if(distance >= params.z)
+		return vec3(0.0);
+	vec3 L = toLight / distance;
+	float theta = dot(-L, spotLightDirections[index]);
+	float cone = clamp((theta - params.y) / (params.x - params.y), 0.0, 1.0);
+	if(cone <= 0.0)
+		return vec3(0.0);
+	float diff = max(dot(L, normal), 0.0);
+	float spec = specularStrength * pow(max(dot(normal, normalize(L + viewDir)), 0.0), 64.0);
+	float attenuation = 1.0 - distance / params.z;
+	float shadow = SpotShadowCalculation(index, normal, L);
+	return (1.0 - shadow) * cone * attenuation * attenuation * (diff + spec) * spotLightColors[index];
+}
+
+vec3 ClusteredLights(vec3 normal, vec3 viewDir)
+{
+	ivec2 tile = ivec2(gl_FragCoord.xy / clusterTileSize);
+	int slice = int(log(fs_in.ViewDepth) * clusterSliceParams.x + clusterSliceParams.y);
+	ivec3 cluster = clamp(ivec3(tile, slice), ivec3(0), ivec3(CLUSTER_X - 1, CLUSTER_Y - 1, CLUSTER_Z - 1));
+	uvec2 range = texelFetch(clusterRanges, cluster.x + CLUSTER_X * (cluster.y + CLUSTER_Y * cluster.z)).xy;
+	vec3 result = vec3(0.0);
+	for(uint i = 0u; i < range.y; ++i)
+	{
+		int light = int(texelFetch(clusterIndices, int(range.x + i)).r);
+		vec4 positionRadius = texelFetch(clusterLightData, light * 2);
+		vec3 toLight = positionRadius.xyz - fs_in.FragPos;
+		float distance = length(toLight);
+		if(distance >= positionRadius.w)
+			continue;
+		vec3 L = toLight / distance;
+		float diff = max(dot(L, normal), 0.0);
+		float spec = specularStrength * pow(max(dot(normal, normalize(L + viewDir)), 0.0), 64.0);
+		// windowed falloff, exactly zero at the radius the light was assigned with
+		float window = 1.0 - distance / positionRadius.w;
+		result += window * window * (diff + spec) * texelFetch(clusterLightData, light * 2 + 1).rgb;
+	}
+	return result;
+}
+
+#ifdef DEFERRED_LIGHTING
+vec3 OctahedronDecode(vec2 encoded)
+{
+	vec2 f = encoded * 2.0 - 1.0;
+	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+	float t = clamp(-n.z, 0.0, 1.0);
+	n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+	return normalize(n);
+}
+#endif
+
+void main()
+{
+#ifdef DEFERRED_LIGHTING
+	float depth = texture(gDepth, TexCoords).r;
+	// nothing was drawn here, keep the clear color
+	if(depth == 1.0)
+		discard;
+	vec4 worldPos = inverseViewProjection * vec4(vec3(TexCoords, depth) * 2.0 - 1.0, 1.0);
+	fs_in.FragPos = worldPos.xyz / worldPos.w;
+	fs_in.Normal = OctahedronDecode(texture(gNormal, TexCoords).rg);
+	fs_in.TexCoords = TexCoords;
+	fs_in.ViewDepth = -(view * vec4(fs_in.FragPos, 1.0)).z;
+	vec4 albedoSpec = texture(gAlbedoSpec, TexCoords);
+	vec3 color = albedoSpec.rgb;
+	specularStrength = albedoSpec.a;
+#else
+	vec3 color = texture(diffuseTexture, fs_in.TexCoords).rgb;
+#endif
+	vec3 normal = normalize(fs_in.Normal);
+	vec3 lightColor = vec3(0.3);
+	// ambient
+	vec3 ambient = 0.3 * lightColor;
+	// diffuse
+	float diff = max(dot(lightDir, normal), 0.0);
+	vec3 diffuse = diff * lightColor;
+	// specular
+	vec3 viewDir = normalize(viewPos - fs_in.FragPos);
+	vec3 halfwayDir = normalize(lightDir + viewDir);
+	float spec = specularStrength * pow(max(dot(normal, halfwayDir), 0.0), 64.0);
+	vec3 specular = spec * lightColor;
+	// calculate shadow
+	float shadow = ShadowCalculation(fs_in.FragPos, normal);
+	vec3 lighting = ambient + (1.0 - shadow) * (diffuse + specular);
+	// point lights, sampler arrays can only be indexed with constants in GLSL 3.30
+	if(pointLightCount > 0)
+		lighting += PointLight(0, pointShadowMaps[0], normal, viewDir);
+	if(pointLightCount > 1)
+		lighting += PointLight(1, pointShadowMaps[1], normal, viewDir);
+	if(pointLightCount > 2)
+		lighting += PointLight(2, pointShadowMaps[2], normal, viewDir);
+	if(pointLightCount > 3)
+		lighting += PointLight(3, pointShadowMaps[3], normal, viewDir);
+	for(int i = 0; i < spotLightCount; ++i)
+		lighting += SpotLight(i, normal, viewDir);
+	lighting += ClusteredLights(normal, viewDir);
+	lighting *= color;
+
+	FragColor = vec4(lighting, 1.0);
+}
@@ -0,0 +1,14 @@
+#version 330 core
+
+in vec2 TexCoords;
+
+uniform sampler2DArray depthMap;
+uniform int layer;
+
+out vec4 FragColor;
+
+void main()
+{
+	float depthValue = texture(depthMap, vec3(TexCoords, layer)).r;
+	FragColor = vec4(vec3(depthValue), 1.0); // orthographic
+}
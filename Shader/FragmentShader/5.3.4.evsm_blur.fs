@@ -0,0 +1,40 @@
+#version 330 core
+
+#define MAX_BLUR_RADIUS 8
+
+in vec2 TexCoords;
+
+// either the shadow depth array (toMoments) or the half blurred moments
+uniform sampler2DArray source;
+uniform int layer;
+uniform bool toMoments;
+uniform vec2 direction;		// one texel along x or y
+uniform int blurRadius;
+uniform vec2 exponents;		// positive/negative warp exponents
+
+out vec4 FragColor;
+
+vec4 Moments(vec2 uv)
+{
+	vec4 value = texture(source, vec3(uv, layer));
+	if(!toMoments)
+		return value;
+	// exponential warp of the [0,1] depth, the moments of both warps are blurred together
+	float depth = value.r * 2.0 - 1.0;
+	float positive = exp(exponents.x * depth);
+	float negative = -exp(-exponents.y * depth);
+	return vec4(positive, positive * positive, negative, negative * negative);
+}
+
+void main()
+{
+	// separable box blur, the moments are linear so filtering them is valid
+	vec4 sum = vec4(0.0);
+	for(int i = -MAX_BLUR_RADIUS; i <= MAX_BLUR_RADIUS; ++i)
+	{
+		if(abs(i) > blurRadius)
+			continue;
+		sum += Moments(TexCoords + float(i) * direction);
+	}
+	FragColor = sum / float(2 * blurRadius + 1);
+}
@@ -0,0 +1,32 @@
+#version 330 core
+
+// deferred path, geometry pass: 8 bytes of surface per pixel plus depth.
+// Positions are rebuilt from depth in the lighting pass.
+layout (location = 0) out vec4 gAlbedoSpec;	// RGBA8: albedo, specular strength
+layout (location = 1) out vec2 gNormal;		// RG16: octahedral world space normal
+
+in VS_OUT
+{
+	vec3 FragPos;
+	vec3 Normal;
+	vec2 TexCoords;
+	float ViewDepth;
+} fs_in;
+
+uniform sampler2D diffuseTexture;
+
+// unit vector to the [0, 1] square: project onto the octahedron and fold the lower half over
+vec2 OctahedronEncode(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 f = n.xy;
+	if(n.z < 0.0)
+		f = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return f * 0.5 + 0.5;
+}
+
+void main()
+{
+	gAlbedoSpec = vec4(texture(diffuseTexture, fs_in.TexCoords).rgb, 1.0);
+	gNormal = OctahedronEncode(normalize(fs_in.Normal));
+}
@@ -0,0 +1,12 @@
+#version 330 core
+
+in vec4 FragPos;
+
+uniform vec3 lightPos;
+uniform float farPlane;
+
+void main()
+{
+	// store the linear distance to the light in [0,1], the lit pass compares against it directly
+	gl_FragDepth = length(FragPos.xyz - lightPos) / farPlane;
+}
@@ -0,0 +1,28 @@
+#version 330 core
+
+#define MAX_CASCADES 4
+
+layout (triangles) in;
+layout (triangle_strip, max_vertices = 12) out;	// 3 * MAX_CASCADES
+
+uniform mat4 lightSpaceMatrices[MAX_CASCADES];
+uniform int cascadeCount;
+// cascades the current caster reaches (bit per layer), from the CPU side culling
+uniform int layerMask;
+
+void main()
+{
+	// one pass renders all cascades: emit the triangle once per layer of the depth array
+	for(int layer = 0; layer < cascadeCount; ++layer)
+	{
+		if((layerMask & (1 << layer)) == 0)
+			continue;
+		for(int i = 0; i < 3; ++i)
+		{
+			gl_Layer = layer;
+			gl_Position = lightSpaceMatrices[layer] * gl_in[i].gl_Position;
+			EmitVertex();
+		}
+		EndPrimitive();
+	}
+}
@@ -0,0 +1,28 @@
+#version 330 core
+
+layout (triangles) in;
+layout (triangle_strip, max_vertices = 18) out;	// 3 * 6 faces
+
+uniform mat4 shadowMatrices[6];
+// cube faces the current caster reaches (bit per face), from the CPU side culling
+uniform int layerMask;
+
+out vec4 FragPos;	// world space, for the distance in the fragment shader
+
+void main()
+{
+	// one pass renders the whole cube map: emit the triangle once per face it can touch
+	for(int face = 0; face < 6; ++face)
+	{
+		if((layerMask & (1 << face)) == 0)
+			continue;
+		for(int i = 0; i < 3; ++i)
+		{
+			gl_Layer = face;
+			FragPos = gl_in[i].gl_Position;
+			gl_Position = shadowMatrices[face] * FragPos;
+			EmitVertex();
+		}
+		EndPrimitive();
+	}
+}
@@ -7,5 +7,6 @@ uniform mat4 model;
 
 void main()
 {
-	gl_Position = lightSpaceMatrix * model * vec4(aPos, 1.0);
+	// two matrix-vector products, not a matrix-matrix product per vertex
+	gl_Position = lightSpaceMatrix * (model * vec4(aPos, 1.0));
 }
\ No newline at end of file
@@ -0,0 +1,53 @@
+#version 330 core
+
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTexCoords;
+
+out VS_OUT
+{
+	vec3 FragPos;
+	vec3 Normal;
+	vec2 TexCoords;
+	float ViewDepth;
+} vs_out;
+
+// per object matrices, precomputed on the CPU (RenderQueue) once per draw instead
+// of per vertex and streamed in as one block per draw, an array of them for
+// instanced draws; must match PerDrawBlock and RENDERQUEUE_MAX_INSTANCES in
+// RenderQueue.h. With PER_VERTEX_MATRICES defined the old path is compiled in,
+// for comparing the two in the benchmark (matrices=vertex).
+#define MAX_INSTANCES 64
+struct PerDrawData
+{
+	mat4 model;
+	mat4 modelViewProjection;
+	mat4 normalMatrix;
+};
+layout (std140) uniform PerDraw
+{
+	PerDrawData draws[MAX_INSTANCES];
+};
+uniform mat4 view;
+#ifdef PER_VERTEX_MATRICES
+uniform mat4 projection;
+#endif
+
+void main()
+{
+	mat4 model = draws[gl_InstanceID].model;
+	vec4 worldPos = model * vec4(aPos, 1.0);
+	vs_out.FragPos = vec3(worldPos);
+	vs_out.TexCoords = aTexCoords;
+#ifdef PER_VERTEX_MATRICES
+	vs_out.Normal = transpose(inverse(mat3(model))) * aNormal;
+	vec4 viewPos = view * worldPos;
+	vs_out.ViewDepth = -viewPos.z;
+	gl_Position = projection * viewPos;
+#else
+	vs_out.Normal = mat3(draws[gl_InstanceID].normalMatrix) * aNormal;
+	// distance along the view direction, selects the cascade (only one row of view is used)
+	vs_out.ViewDepth = -(view * worldPos).z;
+	gl_Position = draws[gl_InstanceID].modelViewProjection * vec4(aPos, 1.0);
+#endif
+}
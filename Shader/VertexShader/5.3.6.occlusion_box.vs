@@ -0,0 +1,12 @@
+#version 330 core
+
+layout (location = 0) in vec3 aPos;
+
+// model maps the unit box [-1, 1] onto the world space bounds being queried
+uniform mat4 viewProjection;
+uniform mat4 model;
+
+void main()
+{
+	gl_Position = viewProjection * model * vec4(aPos, 1.0);
+}
@@ -0,0 +1,11 @@
+#version 330 core
+
+layout (location = 0) in vec3 aPos;
+
+uniform mat4 model;
+
+void main()
+{
+	// world space, the geometry shader projects into every cube face
+	gl_Position = model * vec4(aPos, 1.0);
+}